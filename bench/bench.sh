@@ -0,0 +1,132 @@
+#!/usr/bin/env bash
+#
+# End-to-end multihome benchmark
+#
+# Generates a synthetic home directory, then times first login, steady-state
+# login and update (-u) by running the real multihome binary. When a slowfs
+# shim is given, filesystem calls under the synthetic home are delayed to
+# approximate an NFS mount.
+#
+# USAGE:
+#     bench.sh /path/to/multihome [/path/to/libslowfs.so]
+#
+# ENVIRONMENT:
+#     BENCH_SKEL_FILES        files placed in ~/.multihome/skel (default: 200)
+#     BENCH_TRANSFERS         "T" entries in ~/.multihome/transfer (default: 10)
+#     BENCH_TRANSFER_FILES    files per transfer entry (default: 100)
+#     BENCH_RULES             host_group rules (default: 100)
+#     BENCH_RUNS              iterations per scenario (default: 5)
+#     BENCH_ARGS              extra arguments passed to multihome (e.g. "-j 16")
+#     BENCH_BACKENDS          copy backends to compare (default: "native uring")
+#     SLOWFS_*                see bench/slowfs.c
+#
+# The shim intercepts libc calls, so io_uring operations are not delayed. Compare
+# the uring backend against native without it, or on a real network filesystem.
+#
+set -e
+
+multihome="$1"
+slowfs="$2"
+if [ -z "$multihome" ] || [ ! -x "$multihome" ]; then
+    echo "usage: $0 MULTIHOME [SLOWFS]" >&2
+    exit 1
+fi
+
+skel_files=${BENCH_SKEL_FILES:-200}
+transfers=${BENCH_TRANSFERS:-10}
+transfer_files=${BENCH_TRANSFER_FILES:-100}
+rules=${BENCH_RULES:-100}
+runs=${BENCH_RUNS:-5}
+backends=${BENCH_BACKENDS:-native uring}
+
+workdir=$(mktemp -d "${TMPDIR:-/tmp}/multihome-bench.XXXXXX")
+trap 'rm -rf "$workdir"' EXIT
+home="$workdir/home"
+
+# Populate a directory with small files spread across subdirectories
+populate() {
+    local dest="$1"
+    local count="$2"
+    for ((i = 0; i < count; i++)); do
+        local sub="$dest/d$((i % 8))"
+        mkdir -p "$sub"
+        printf 'file %d\n' "$i" > "$sub/f$i"
+    done
+}
+
+mkdir -p "$home/.multihome/skel"
+populate "$home/.multihome/skel" "$skel_files"
+
+: > "$home/.multihome/transfer"
+for ((t = 0; t < transfers; t++)); do
+    populate "$home/t$t" "$transfer_files"
+    echo "T t$t/" >> "$home/.multihome/transfer"
+done
+
+# None of the generated rules match, so every rule is evaluated
+: > "$home/.multihome/host_group"
+for ((r = 0; r < rules; r++)); do
+    if ((r % 2)); then
+        echo "nomatch$r = group$r" >> "$home/.multihome/host_group"
+    else
+        echo "nomatch[0-9]*x$r = group$r" >> "$home/.multihome/host_group"
+    fi
+done
+
+now() {
+    if [ -n "$EPOCHREALTIME" ]; then
+        echo "${EPOCHREALTIME/./}"
+    else
+        echo $(( $(date +%s%N) / 1000 ))
+    fi
+}
+
+# Run multihome under the shim and print elapsed microseconds
+run() {
+    local start
+    local end
+    start=$(now)
+    env HOME="$home" HOME_OLD="$home" \
+        ${slowfs:+LD_PRELOAD="$slowfs"} SLOWFS_PREFIX="${SLOWFS_PREFIX:-$workdir}" \
+        "$multihome" -b "$backend" $BENCH_ARGS "$@" >/dev/null 2>&1
+    end=$(now)
+    echo $((end - start))
+}
+
+report() {
+    local name="$1"
+    shift
+    printf '%-16s' "$name"
+    printf '%s\n' "$@" | sort -n | awk '
+        { v[NR] = $1; sum += $1 }
+        END {
+            printf "min %9.3f ms  median %9.3f ms  mean %9.3f ms  max %9.3f ms\n",
+                v[1] / 1000, v[int((NR + 1) / 2)] / 1000, sum / NR / 1000, v[NR] / 1000
+        }'
+}
+
+echo "skel files: $skel_files, transfers: $transfers x $transfer_files files, host_group rules: $rules, runs: $runs"
+echo "slowfs: ${slowfs:-disabled} (metadata latency: ${SLOWFS_LATENCY_US:-500}us)"
+
+for backend in $backends; do
+    echo "backend: $backend"
+
+    first=()
+    for ((n = 0; n < runs; n++)); do
+        rm -rf "$home/home_local" "$home/.multihome/resolve" "$home/.multihome/snapshot"
+        first+=("$(run)")
+    done
+    report "first login" "${first[@]}"
+
+    steady=()
+    for ((n = 0; n < runs; n++)); do
+        steady+=("$(run)")
+    done
+    report "steady state" "${steady[@]}"
+
+    update=()
+    for ((n = 0; n < runs; n++)); do
+        update+=("$(run -u)")
+    done
+    report "update (-u)" "${update[@]}"
+done
@@ -0,0 +1,309 @@
+/**
+ * slowfs: LD_PRELOAD shim that adds latency to filesystem syscalls
+ *
+ * Used by the benchmark target to approximate an NFS mounted home directory on a
+ * local disk. Every intercepted call sleeps before it is forwarded to libc.
+ *
+ * ENVIRONMENT:
+ *     SLOWFS_LATENCY_US     delay applied to metadata operations (default: 500)
+ *     SLOWFS_DATA_US        delay applied to read/write/copy_file_range (default: 0)
+ *     SLOWFS_<CALL>_US      override the delay of one call, e.g. SLOWFS_OPEN_US=2000
+ *     SLOWFS_PREFIX         only slow down paths beginning with this prefix
+ *                           (descriptors opened under the prefix inherit the delay)
+ */
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define SLOWFS_FD_MAX 65536
+
+enum {
+    SLOWFS_OPEN,
+    SLOWFS_CLOSE,
+    SLOWFS_STAT,
+    SLOWFS_ACCESS,
+    SLOWFS_MKDIR,
+    SLOWFS_RENAME,
+    SLOWFS_UNLINK,
+    SLOWFS_LINK,
+    SLOWFS_READLINK,
+    SLOWFS_SETATTR,
+    SLOWFS_OPENDIR,
+    SLOWFS_READDIR,
+    SLOWFS_DATA,
+    SLOWFS_CALLS
+};
+
+static const char *slowfs_names[SLOWFS_CALLS] = {
+    "OPEN", "CLOSE", "STAT", "ACCESS", "MKDIR", "RENAME", "UNLINK",
+    "LINK", "READLINK", "SETATTR", "OPENDIR", "READDIR", "DATA",
+};
+
+static long slowfs_delay[SLOWFS_CALLS];
+static const char *slowfs_prefix;
+static size_t slowfs_prefix_len;
+static unsigned char slowfs_fds[SLOWFS_FD_MAX];
+
+__attribute__((constructor))
+static void slowfs_init() {
+    char *value;
+    long latency;
+
+    value = getenv("SLOWFS_LATENCY_US");
+    latency = value ? strtol(value, NULL, 10) : 500;
+
+    for (int i = 0; i < SLOWFS_CALLS; i++) {
+        char name[64];
+        slowfs_delay[i] = i == SLOWFS_DATA ? 0 : latency;
+        snprintf(name, sizeof(name), "SLOWFS_%s_US", slowfs_names[i]);
+        if ((value = getenv(name)) != NULL) {
+            slowfs_delay[i] = strtol(value, NULL, 10);
+        }
+    }
+
+    slowfs_prefix = getenv("SLOWFS_PREFIX");
+    if (slowfs_prefix && *slowfs_prefix) {
+        slowfs_prefix_len = strlen(slowfs_prefix);
+    } else {
+        slowfs_prefix = NULL;
+    }
+}
+
+static int slowfs_match(const char *path) {
+    if (slowfs_prefix == NULL) {
+        return 1;
+    }
+    // Relative paths are resolved against the working directory, which is unknown here
+    if (path == NULL || *path != '/') {
+        return 1;
+    }
+    return strncmp(path, slowfs_prefix, slowfs_prefix_len) == 0;
+}
+
+static int slowfs_match_fd(int fd) {
+    if (slowfs_prefix == NULL) {
+        return 1;
+    }
+    return fd >= 0 && fd < SLOWFS_FD_MAX && slowfs_fds[fd];
+}
+
+static void slowfs_track(int fd, const char *path) {
+    if (fd >= 0 && fd < SLOWFS_FD_MAX) {
+        slowfs_fds[fd] = (unsigned char) slowfs_match(path);
+    }
+}
+
+static void slowfs_sleep(int call) {
+    struct timespec ts;
+    long usec;
+
+    usec = slowfs_delay[call];
+    if (usec <= 0) {
+        return;
+    }
+    ts.tv_sec = usec / 1000000;
+    ts.tv_nsec = (usec % 1000000) * 1000;
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR) {
+        continue;
+    }
+}
+
+#define SLOWFS_PATH(CALL, PATH) do { if (slowfs_match(PATH)) slowfs_sleep(CALL); } while (0)
+#define SLOWFS_FD(CALL, FD) do { if (slowfs_match_fd(FD)) slowfs_sleep(CALL); } while (0)
+#define SLOWFS_REAL(RET, NAME, ...) \
+    static RET (*real)(__VA_ARGS__); \
+    if (real == NULL) { \
+        real = (RET (*)(__VA_ARGS__)) dlsym(RTLD_NEXT, NAME); \
+    }
+
+int open(const char *path, int flags, ...) {
+    SLOWFS_REAL(int, "open", const char *, int, ...);
+    mode_t mode = 0;
+    int fd;
+    if (flags & (O_CREAT | O_TMPFILE)) {
+        va_list ap;
+        va_start(ap, flags);
+        mode = va_arg(ap, mode_t);
+        va_end(ap);
+    }
+    SLOWFS_PATH(SLOWFS_OPEN, path);
+    fd = real(path, flags, mode);
+    slowfs_track(fd, path);
+    return fd;
+}
+
+int open64(const char *path, int flags, ...) {
+    SLOWFS_REAL(int, "open64", const char *, int, ...);
+    mode_t mode = 0;
+    int fd;
+    if (flags & (O_CREAT | O_TMPFILE)) {
+        va_list ap;
+        va_start(ap, flags);
+        mode = va_arg(ap, mode_t);
+        va_end(ap);
+    }
+    SLOWFS_PATH(SLOWFS_OPEN, path);
+    fd = real(path, flags, mode);
+    slowfs_track(fd, path);
+    return fd;
+}
+
+int openat(int dirfd, const char *path, int flags, ...) {
+    SLOWFS_REAL(int, "openat", int, const char *, int, ...);
+    mode_t mode = 0;
+    int fd;
+    if (flags & (O_CREAT | O_TMPFILE)) {
+        va_list ap;
+        va_start(ap, flags);
+        mode = va_arg(ap, mode_t);
+        va_end(ap);
+    }
+    SLOWFS_PATH(SLOWFS_OPEN, path);
+    fd = real(dirfd, path, flags, mode);
+    slowfs_track(fd, path);
+    return fd;
+}
+
+int close(int fd) {
+    SLOWFS_REAL(int, "close", int);
+    SLOWFS_FD(SLOWFS_CLOSE, fd);
+    if (fd >= 0 && fd < SLOWFS_FD_MAX) {
+        slowfs_fds[fd] = 0;
+    }
+    return real(fd);
+}
+
+int stat(const char *path, struct stat *st) {
+    SLOWFS_REAL(int, "stat", const char *, struct stat *);
+    SLOWFS_PATH(SLOWFS_STAT, path);
+    return real(path, st);
+}
+
+int lstat(const char *path, struct stat *st) {
+    SLOWFS_REAL(int, "lstat", const char *, struct stat *);
+    SLOWFS_PATH(SLOWFS_STAT, path);
+    return real(path, st);
+}
+
+int fstat(int fd, struct stat *st) {
+    SLOWFS_REAL(int, "fstat", int, struct stat *);
+    SLOWFS_FD(SLOWFS_STAT, fd);
+    return real(fd, st);
+}
+
+int fstatat(int dirfd, const char *path, struct stat *st, int flags) {
+    SLOWFS_REAL(int, "fstatat", int, const char *, struct stat *, int);
+    SLOWFS_PATH(SLOWFS_STAT, path);
+    return real(dirfd, path, st, flags);
+}
+
+int access(const char *path, int mode) {
+    SLOWFS_REAL(int, "access", const char *, int);
+    SLOWFS_PATH(SLOWFS_ACCESS, path);
+    return real(path, mode);
+}
+
+int mkdir(const char *path, mode_t mode) {
+    SLOWFS_REAL(int, "mkdir", const char *, mode_t);
+    SLOWFS_PATH(SLOWFS_MKDIR, path);
+    return real(path, mode);
+}
+
+int rename(const char *oldpath, const char *newpath) {
+    SLOWFS_REAL(int, "rename", const char *, const char *);
+    SLOWFS_PATH(SLOWFS_RENAME, newpath);
+    return real(oldpath, newpath);
+}
+
+int unlink(const char *path) {
+    SLOWFS_REAL(int, "unlink", const char *);
+    SLOWFS_PATH(SLOWFS_UNLINK, path);
+    return real(path);
+}
+
+int symlink(const char *target, const char *path) {
+    SLOWFS_REAL(int, "symlink", const char *, const char *);
+    SLOWFS_PATH(SLOWFS_LINK, path);
+    return real(target, path);
+}
+
+int link(const char *oldpath, const char *newpath) {
+    SLOWFS_REAL(int, "link", const char *, const char *);
+    SLOWFS_PATH(SLOWFS_LINK, newpath);
+    return real(oldpath, newpath);
+}
+
+ssize_t readlink(const char *path, char *buf, size_t size) {
+    SLOWFS_REAL(ssize_t, "readlink", const char *, char *, size_t);
+    SLOWFS_PATH(SLOWFS_READLINK, path);
+    return real(path, buf, size);
+}
+
+int chmod(const char *path, mode_t mode) {
+    SLOWFS_REAL(int, "chmod", const char *, mode_t);
+    SLOWFS_PATH(SLOWFS_SETATTR, path);
+    return real(path, mode);
+}
+
+int lchown(const char *path, uid_t uid, gid_t gid) {
+    SLOWFS_REAL(int, "lchown", const char *, uid_t, gid_t);
+    SLOWFS_PATH(SLOWFS_SETATTR, path);
+    return real(path, uid, gid);
+}
+
+int utimensat(int dirfd, const char *path, const struct timespec times[2], int flags) {
+    SLOWFS_REAL(int, "utimensat", int, const char *, const struct timespec *, int);
+    SLOWFS_PATH(SLOWFS_SETATTR, path);
+    return real(dirfd, path, times, flags);
+}
+
+DIR *opendir(const char *path) {
+    SLOWFS_REAL(DIR *, "opendir", const char *);
+    DIR *d;
+    SLOWFS_PATH(SLOWFS_OPENDIR, path);
+    d = real(path);
+    if (d != NULL) {
+        slowfs_track(dirfd(d), path);
+    }
+    return d;
+}
+
+struct dirent *readdir(DIR *d) {
+    SLOWFS_REAL(struct dirent *, "readdir", DIR *);
+    // Model one READDIR round trip per batch of entries rather than per entry
+    static __thread unsigned long calls;
+    if ((calls++ % 32) == 0) {
+        SLOWFS_FD(SLOWFS_READDIR, dirfd(d));
+    }
+    return real(d);
+}
+
+ssize_t read(int fd, void *buf, size_t count) {
+    SLOWFS_REAL(ssize_t, "read", int, void *, size_t);
+    SLOWFS_FD(SLOWFS_DATA, fd);
+    return real(fd, buf, count);
+}
+
+ssize_t write(int fd, const void *buf, size_t count) {
+    SLOWFS_REAL(ssize_t, "write", int, const void *, size_t);
+    if (fd > STDERR_FILENO) {
+        SLOWFS_FD(SLOWFS_DATA, fd);
+    }
+    return real(fd, buf, count);
+}
+
+ssize_t copy_file_range(int fd_in, off_t *off_in, int fd_out, off_t *off_out, size_t len, unsigned int flags) {
+    SLOWFS_REAL(ssize_t, "copy_file_range", int, off_t *, int, off_t *, size_t, unsigned int);
+    SLOWFS_FD(SLOWFS_DATA, fd_out);
+    return real(fd_in, off_in, fd_out, off_out, len, flags);
+}
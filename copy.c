@@ -0,0 +1,3067 @@
+#define _GNU_SOURCE
+#include "multihome.h"
+#include <sys/time.h>
+#include <fnmatch.h>
+#ifdef HAVE_SENDFILE
+#include <sys/sendfile.h>
+#endif
+#ifdef HAVE_FICLONE
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+#ifdef HAVE_IOPRIO
+#include <sys/syscall.h>
+#define COPY_IOPRIO_WHO_PROCESS 1
+#define COPY_IOPRIO_IDLE (3 << 13)    // IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0)
+#endif
+#if defined(HAVE_IO_URING) && defined(HAVE_STATX)
+#define COPY_URING 1
+#include <sys/sysmacros.h>
+#endif
+
+/**
+ * Active copy backend (see copy_set_backend())
+ */
+static int copy_backend = COPY_BACKEND_NATIVE;
+
+/**
+ * io_uring operations in flight per thread (see copy_set_queue_depth())
+ */
+static unsigned copy_queue_depth = COPY_QUEUE_DEPTH_DEFAULT;
+
+/**
+ * File creation mask, read when the uring backend is selected
+ */
+static mode_t copy_umask = 022;
+
+/**
+ * Running totals for every copy performed by this process (see copy_get_stats())
+ */
+static struct CopyStats copy_stats;
+static __thread struct CopyStats *copy_stats_op;    // see copy_stats_track()
+
+#define COPY_STAT_ADD(FIELD, VALUE) do { \
+        uint64_t copy_stat_value = (VALUE); \
+        __atomic_add_fetch(&copy_stats.FIELD, copy_stat_value, __ATOMIC_RELAXED); \
+        if (copy_stats_op) { \
+            __atomic_add_fetch(&copy_stats_op->FIELD, copy_stat_value, __ATOMIC_RELAXED); \
+        } \
+    } while (0)
+
+/**
+ * Read the running copy totals
+ *
+ * Totals cover the native and uring backends. Callers measure a phase by taking the
+ * difference between two readings. A thread that tracks its own operation (see
+ * copy_stats_track()) reads the totals of that operation instead.
+ *
+ * @param stats output
+ */
+void copy_get_stats(struct CopyStats *stats) {
+    struct CopyStats *src = copy_stats_op ? copy_stats_op : &copy_stats;
+
+    stats->files = __atomic_load_n(&src->files, __ATOMIC_RELAXED);
+    stats->dirs = __atomic_load_n(&src->dirs, __ATOMIC_RELAXED);
+    stats->links = __atomic_load_n(&src->links, __ATOMIC_RELAXED);
+    stats->bytes = __atomic_load_n(&src->bytes, __ATOMIC_RELAXED);
+    stats->skipped = __atomic_load_n(&src->skipped, __ATOMIC_RELAXED);
+    stats->errors = __atomic_load_n(&src->errors, __ATOMIC_RELAXED);
+    stats->cloned = __atomic_load_n(&src->cloned, __ATOMIC_RELAXED);
+}
+
+/**
+ * Count the copies of the calling thread separately
+ *
+ * Operations running side by side (see plan_run()) share the process totals, so
+ * a difference of two readings would include the other operations. While stats
+ * is set, the copies made by the calling thread and the worker threads of its
+ * directory copies are added to it as well, and copy_get_stats() reads it.
+ *
+ * @param stats counters of the current operation (NULL stops tracking)
+ */
+void copy_stats_track(struct CopyStats *stats) {
+    copy_stats_op = stats;
+}
+
+/**
+ * Manifest consulted and updated by the native backend (see copy_set_manifest())
+ */
+static struct Manifest *copy_manifest;
+static int copy_checksum;
+static int copy_skip_dirs;
+
+/**
+ * Track copies in a manifest
+ *
+ * Entries whose source metadata matches the manifest are skipped without examining
+ * the destination.
+ *
+ * @param manifest manifest to use (NULL disables tracking)
+ * @param checksum non-zero to compare content hashes when metadata differs
+ * @param skip_dirs non-zero to skip whole directories whose source mtime is unchanged
+ */
+void copy_set_manifest(struct Manifest *manifest, int checksum, int skip_dirs) {
+    copy_manifest = manifest;
+    copy_checksum = checksum;
+    copy_skip_dirs = skip_dirs;
+}
+
+/**
+ * Content-addressed object store shared by every home directory (see copy_set_store())
+ */
+static char copy_store[PATH_MAX];
+
+/**
+ * Hardlink regular files from an object store instead of copying them
+ *
+ * Objects are keyed by content hash, size and mode, and keep the source's
+ * permissions. A file that diverges from its object through an in-place edit is
+ * detected on the next copy and turned into a private copy (see copy_leaf()).
+ *
+ * @param path store directory (NULL disables the store)
+ * @return 0=success, -1=path too long
+ */
+int copy_set_store(const char *path) {
+    if (path == NULL) {
+        copy_store[0] = '\0';
+        return 0;
+    }
+    if (strlen(path) >= sizeof(copy_store)) {
+        return -1;
+    }
+    strcpy(copy_store, path);
+    return 0;
+}
+
+/**
+ * Remove store objects no home directory links to anymore
+ *
+ * An object whose only link is its store entry is garbage once it has been in
+ * that state for COPY_STORE_GRACE seconds (unlinking it changed its ctime). A
+ * freshly written object is younger than that, so a concurrent copy about to
+ * link it is not affected.
+ *
+ * @param path store directory
+ * @param dry_run only count
+ * @param objects output: number of objects removed
+ * @param bytes output: bytes released
+ * @return 0=success, -1=one or more objects could not be removed
+ */
+int copy_store_prune(const char *path, int dry_run, uint64_t *objects, uint64_t *bytes) {
+    struct dirent *bucket;
+    time_t cutoff;
+    int status;
+    DIR *d;
+
+    *objects = 0;
+    *bytes = 0;
+    d = opendir(path);
+    if (d == NULL) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    cutoff = time(NULL) - COPY_STORE_GRACE;
+    status = 0;
+    while ((bucket = readdir(d)) != NULL) {
+        struct dirent *rec;
+        char dir[PATH_MAX];
+        DIR *b;
+
+        if (bucket->d_name[0] == '.') {
+            continue;
+        }
+        snprintf(dir, sizeof(dir), "%s/%s", path, bucket->d_name);
+        b = opendir(dir);
+        if (b == NULL) {
+            continue;
+        }
+        while ((rec = readdir(b)) != NULL) {
+            char record[NAME_MAX + sizeof(COPY_STORE_RECORD)];
+            struct stat st;
+
+            // Records go with their object (see copy_store_record())
+            size_t len = strlen(rec->d_name);
+            if (len > strlen(COPY_STORE_RECORD) && strcmp(rec->d_name + len - strlen(COPY_STORE_RECORD), COPY_STORE_RECORD) == 0) {
+                continue;
+            }
+            if (fstatat(dirfd(b), rec->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0
+                    || !S_ISREG(st.st_mode) || st.st_nlink != 1 || st.st_ctime > cutoff) {
+                continue;
+            }
+            if (!dry_run && unlinkat(dirfd(b), rec->d_name, 0) < 0) {
+                fprintf(stderr, "%s/%s: %s\n", dir, rec->d_name, strerror(errno));
+                status = -1;
+                continue;
+            }
+            snprintf(record, sizeof(record), "%s%s", rec->d_name, COPY_STORE_RECORD);
+            if (!dry_run) {
+                unlinkat(dirfd(b), record, 0);
+            }
+            (*objects)++;
+            *bytes += st.st_blocks * 512;
+        }
+        closedir(b);
+    }
+    closedir(d);
+    return status;
+}
+
+/**
+ * Patterns pruned from every walk below copy_exclude_root (see copy_set_exclude())
+ */
+struct CopyExclude {
+    char *pattern;              // without leading and trailing '/'
+    int anchored;               // matched against the path below the root, not just the name
+    int dir_only;               // pattern ended with '/'
+};
+static char copy_exclude_root[PATH_MAX];
+static struct CopyExclude *copy_excludes;
+static size_t copy_excludes_count;
+static __thread int copy_exclude_lifted;    // see copy_exclude_lift()
+
+/**
+ * Leave entries out of every copy below a directory
+ *
+ * Patterns use fnmatch(3) syntax. A pattern without a slash matches the name of
+ * an entry at any depth. A pattern containing a slash, or starting with one, is
+ * matched against the whole path relative to root. A trailing slash restricts a
+ * pattern to directories. Excluded directories are pruned while walking, so
+ * nothing below them is read.
+ *
+ * @param root directory patterns are relative to (NULL disables exclusion)
+ * @param patterns exclude patterns
+ * @param count number of patterns
+ * @return 0=success, -1=root too long
+ */
+int copy_set_exclude(const char *root, const char **patterns, size_t count) {
+    size_t len;
+
+    for (size_t i = 0; i < copy_excludes_count; i++) {
+        free(copy_excludes[i].pattern);
+    }
+    free(copy_excludes);
+    copy_excludes = NULL;
+    copy_excludes_count = 0;
+    copy_exclude_root[0] = '\0';
+    if (root == NULL || count == 0) {
+        return 0;
+    }
+    if (strlen(root) >= sizeof(copy_exclude_root)) {
+        return -1;
+    }
+    strcpy(copy_exclude_root, root);
+    len = strlen(copy_exclude_root);
+    while (len > 1 && copy_exclude_root[len - 1] == '/') {
+        copy_exclude_root[--len] = '\0';
+    }
+
+    copy_excludes = calloc(count, sizeof(*copy_excludes));
+    if (copy_excludes == NULL) {
+        perror("exclude");
+        exit(1);
+    }
+    for (size_t i = 0; i < count; i++) {
+        struct CopyExclude *ex = &copy_excludes[copy_excludes_count];
+        const char *pattern = patterns[i];
+
+        ex->anchored = *pattern == '/';
+        while (*pattern == '/') {
+            pattern++;
+        }
+        len = strlen(pattern);
+        ex->dir_only = len && pattern[len - 1] == '/';
+        while (len && pattern[len - 1] == '/') {
+            len--;
+        }
+        if (len == 0) {
+            continue;
+        }
+        ex->pattern = strndup(pattern, len);
+        if (ex->pattern == NULL) {
+            perror("exclude");
+            exit(1);
+        }
+        ex->anchored |= strchr(ex->pattern, '/') != NULL;
+        copy_excludes_count++;
+    }
+    return 0;
+}
+
+/**
+ * Ignore the exclude patterns in copies made by the calling thread
+ *
+ * Skeleton copies are never pruned, but may run next to transfers (see
+ * plan_run()). The worker threads of a directory copy inherit the setting of
+ * the thread that started it.
+ *
+ * @param lifted non-zero to copy everything
+ */
+void copy_exclude_lift(int lifted) {
+    copy_exclude_lifted = lifted;
+}
+
+/**
+ * Test one entry against the exclude patterns
+ *
+ * Only the entry itself is tested. Walks never descend into an excluded
+ * directory, so its parents are known to be included.
+ *
+ * @param path source path
+ * @param mode file type of the entry
+ * @return 1=excluded, 0=copied
+ */
+static int copy_exclude_entry(const char *path, mode_t mode) {
+    char rel[PATH_MAX];
+    const char *name;
+    size_t root_len;
+    size_t len;
+
+    if (copy_excludes_count == 0 || copy_exclude_lifted) {
+        return 0;
+    }
+    root_len = strlen(copy_exclude_root);
+    if (strncmp(path, copy_exclude_root, root_len) != 0 || path[root_len] != '/') {
+        return 0;
+    }
+
+    // Sources are joined with "/" and may carry doubled or trailing slashes
+    len = 0;
+    for (const char *p = path + root_len; *p && len < sizeof(rel) - 1; p++) {
+        if (*p == '/' && (len == 0 || rel[len - 1] == '/')) {
+            continue;
+        }
+        rel[len++] = *p;
+    }
+    while (len && rel[len - 1] == '/') {
+        len--;
+    }
+    rel[len] = '\0';
+    if (len == 0) {
+        return 0;
+    }
+    name = strrchr(rel, '/');
+    name = name ? name + 1 : rel;
+
+    for (size_t i = 0; i < copy_excludes_count; i++) {
+        struct CopyExclude *ex = &copy_excludes[i];
+        if (ex->dir_only && !S_ISDIR(mode)) {
+            continue;
+        }
+        if (fnmatch(ex->pattern, ex->anchored ? rel : name, ex->anchored ? FNM_PATHNAME : 0) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Check whether a path is left out by copy_set_exclude()
+ *
+ * Unlike the checks made while walking, the directories between the root and
+ * path are tested as well.
+ *
+ * @param path source path
+ * @param mode file type of path
+ * @return 1=excluded, 0=copied
+ */
+int copy_excluded(const char *path, mode_t mode) {
+    char parent[PATH_MAX];
+    size_t root_len;
+
+    if (copy_excludes_count == 0) {
+        return 0;
+    }
+    snprintf(parent, sizeof(parent), "%s", path);
+    root_len = strlen(copy_exclude_root);
+    for (char *sep = parent + root_len + 1; root_len < strlen(parent) && (sep = strchr(sep, '/')) != NULL; sep++) {
+        *sep = '\0';
+        if (copy_exclude_entry(parent, S_IFDIR)) {
+            return 1;
+        }
+        *sep = '/';
+    }
+    return copy_exclude_entry(path, mode);
+}
+
+/**
+ * Check that a destination still holds the copy its manifest record describes
+ *
+ * A manifest hit only says that the source did not change. The destination may
+ * have been removed or edited since, and deleting an entry changes the mtime of
+ * its directory.
+ *
+ * @param dest destination path
+ * @param st source metadata (matching the record)
+ * @return 1=intact, 0=missing or modified
+ */
+static int copy_dest_intact(const char *dest, struct stat *st) {
+    struct stat dest_st;
+
+    if (lstat(dest, &dest_st) < 0 || (dest_st.st_mode & S_IFMT) != (st->st_mode & S_IFMT)) {
+        return 0;
+    }
+    if (!S_ISDIR(st->st_mode) && dest_st.st_size != st->st_size) {
+        return 0;
+    }
+    return dest_st.st_mtim.tv_sec == st->st_mtim.tv_sec && dest_st.st_mtim.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+/**
+ * Check whether a directory can be skipped as a whole
+ *
+ * Only used when enabled with copy_set_manifest(). A directory's mtime changes when
+ * entries are added, removed or renamed, but not when a file inside it is edited
+ * in place, or when something changes further down the tree.
+ *
+ * @param dest destination directory
+ * @param st source metadata
+ * @return 1=skip, 0=scan
+ */
+static int copy_dir_unchanged(const char *dest, struct stat *st) {
+    if (copy_manifest == NULL || !copy_skip_dirs || !manifest_match(copy_manifest, dest, st, NULL)
+            || !copy_dest_intact(dest, st)) {
+        return 0;
+    }
+    manifest_keep(copy_manifest, dest);
+    COPY_STAT_ADD(skipped, 1);
+    return 1;
+}
+
+/**
+ * Token buckets limiting the copy rate of this process (see copy_set_throttle())
+ *
+ * A bucket refills at rate tokens per second and holds at most one second worth.
+ * Callers take tokens up front and may drive the bucket negative; the debt is
+ * paid by sleeping. Concurrent threads therefore queue behind each other instead
+ * of polling.
+ */
+struct CopyBucket {
+    double rate;                // tokens per second, 0 = unlimited
+    double tokens;
+    double last;                // monotonic time of the last refill
+};
+static struct CopyBucket copy_bucket_bytes;
+static struct CopyBucket copy_bucket_ops;
+static pthread_mutex_t copy_throttle_lock = PTHREAD_MUTEX_INITIALIZER;
+static int copy_throttled;
+
+/**
+ * Drop copies to the idle I/O scheduling class (see copy_set_idle())
+ */
+static int copy_idle;
+
+static double copy_clock() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Limit the data and metadata rate of every copy made by this process
+ *
+ * Bytes are read from the source as file data (and content hashes). Operations
+ * are destination entries examined or created: files, links and directories.
+ * Entries the manifest already accounts for cost nothing.
+ *
+ * @param bytes_per_sec data limit (0 = unlimited)
+ * @param ops_per_sec operation limit (0 = unlimited)
+ */
+void copy_set_throttle(uint64_t bytes_per_sec, uint64_t ops_per_sec) {
+    double now = copy_clock();
+
+    pthread_mutex_lock(&copy_throttle_lock);
+    copy_bucket_bytes.rate = (double) bytes_per_sec;
+    copy_bucket_bytes.tokens = copy_bucket_bytes.rate;
+    copy_bucket_bytes.last = now;
+    copy_bucket_ops.rate = (double) ops_per_sec;
+    copy_bucket_ops.tokens = copy_bucket_ops.rate;
+    copy_bucket_ops.last = now;
+    copy_throttled = bytes_per_sec || ops_per_sec;
+    pthread_mutex_unlock(&copy_throttle_lock);
+}
+
+/**
+ * Take tokens from a bucket
+ * @param b bucket
+ * @param amount tokens needed
+ * @param now current monotonic time
+ * @return seconds to wait before the tokens are available
+ */
+static double copy_bucket_take(struct CopyBucket *b, double amount, double now) {
+    if (b->rate <= 0 || amount <= 0) {
+        return 0;
+    }
+    b->tokens += (now - b->last) * b->rate;
+    b->last = now;
+    if (b->tokens > b->rate) {
+        b->tokens = b->rate;
+    }
+    b->tokens -= amount;
+    return b->tokens < 0 ? -b->tokens / b->rate : 0;
+}
+
+/**
+ * Wait until the copy rate allows more work
+ * @param bytes data about to be transferred
+ * @param ops operations about to be performed
+ */
+static void copy_throttle(uint64_t bytes, uint64_t ops) {
+    struct timespec ts;
+    double wait;
+    double wait_ops;
+    double now;
+
+    if (!copy_throttled) {
+        return;
+    }
+    now = copy_clock();
+    pthread_mutex_lock(&copy_throttle_lock);
+    wait = copy_bucket_take(&copy_bucket_bytes, (double) bytes, now);
+    wait_ops = copy_bucket_take(&copy_bucket_ops, (double) ops, now);
+    pthread_mutex_unlock(&copy_throttle_lock);
+
+    if (wait_ops > wait) {
+        wait = wait_ops;
+    }
+    if (wait <= 0) {
+        return;
+    }
+    ts.tv_sec = (time_t) wait;
+    ts.tv_nsec = (long) ((wait - (double) ts.tv_sec) * 1e9);
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR) {
+        continue;
+    }
+}
+
+/**
+ * Bytes a data transfer may move in one step
+ *
+ * Throttled transfers are split so the bucket is charged (and the caller paced)
+ * as the data moves, not once per file.
+ *
+ * @param remain bytes left to transfer
+ * @return step size
+ */
+static size_t copy_throttle_step(off_t remain) {
+    if (copy_throttled && remain > COPY_THROTTLE_CHUNK) {
+        return COPY_THROTTLE_CHUNK;
+    }
+    return (size_t) remain;
+}
+
+/**
+ * Run copies in the idle I/O scheduling class
+ *
+ * Only the calling thread is switched while a copy runs; worker threads it starts
+ * inherit the class. The block layer honours it for local disks (node-local homes,
+ * the object store). NFS traffic is not scheduled by it, use copy_set_throttle().
+ *
+ * @param enable non-zero to enable
+ */
+void copy_set_idle(int enable) {
+    copy_idle = enable;
+}
+
+/**
+ * Switch the calling thread to the idle I/O class
+ * @return previous priority to pass to copy_idle_end(), -1=unchanged
+ */
+static int copy_idle_begin() {
+#ifdef HAVE_IOPRIO
+    int prio;
+
+    if (!copy_idle) {
+        return -1;
+    }
+    prio = (int) syscall(SYS_ioprio_get, COPY_IOPRIO_WHO_PROCESS, 0);
+    if (prio < 0 || syscall(SYS_ioprio_set, COPY_IOPRIO_WHO_PROCESS, 0, COPY_IOPRIO_IDLE) < 0) {
+        return -1;
+    }
+    return prio;
+#else
+    return -1;
+#endif
+}
+
+/**
+ * Restore the I/O priority saved by copy_idle_begin()
+ * @param prio previous priority
+ */
+static void copy_idle_end(int prio) {
+#ifdef HAVE_IOPRIO
+    if (prio >= 0) {
+        syscall(SYS_ioprio_set, COPY_IOPRIO_WHO_PROCESS, 0, prio);
+    }
+#else
+    (void) prio;
+#endif
+}
+
+/**
+ * Select the backend used by copy()
+ *
+ * "uring" is the native backend with small regular files and directory listings
+ * batched through io_uring. It falls back to "native" when the kernel cannot
+ * provide it.
+ *
+ * @param name "native", "rsync" or "uring"
+ * @return 0=success, -1=unknown or unavailable backend
+ */
+int copy_set_backend(const char *name) {
+    if (strcmp(name, "native") == 0) {
+        copy_backend = COPY_BACKEND_NATIVE;
+        return 0;
+    }
+#ifdef MULTIHOME_RSYNC_BIN
+    if (strcmp(name, "rsync") == 0) {
+        copy_backend = COPY_BACKEND_RSYNC;
+        return 0;
+    }
+#endif
+    if (strcmp(name, "uring") == 0) {
+#ifdef COPY_URING
+        struct Uring *ring;
+
+        // Probe now, so an old or restricted kernel falls back before anything is copied
+        ring = uring_open(8);
+        if (ring != NULL) {
+            uring_close(ring);
+            copy_umask = umask(0);
+            umask(copy_umask);
+            copy_backend = COPY_BACKEND_URING;
+            return 0;
+        }
+        fprintf(stderr, "io_uring is unavailable (%s), using the native backend\n", strerror(errno));
+#else
+        fprintf(stderr, "io_uring support was not compiled in, using the native backend\n");
+#endif
+        copy_backend = COPY_BACKEND_NATIVE;
+        return 0;
+    }
+    return -1;
+}
+
+/**
+ * Return the active copy backend
+ * @return COPY_BACKEND_NATIVE, COPY_BACKEND_RSYNC or COPY_BACKEND_URING
+ */
+int copy_get_backend() {
+    return copy_backend;
+}
+
+#ifdef HAVE_FICLONE
+/**
+ * Reflink support by (source device, destination device)
+ *
+ * state: 0=unknown, 1=supported, -1=unsupported. Once a pair is known not to clone,
+ * its files go straight to copy_data().
+ */
+static struct {
+    dev_t src;
+    dev_t dest;
+    int state;
+} copy_clone_cache[COPY_CLONE_CACHE];
+static size_t copy_clone_count;
+static pthread_mutex_t copy_clone_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int copy_clone_state(dev_t src, dev_t dest, int state) {
+    int result;
+
+    result = 0;
+    pthread_mutex_lock(&copy_clone_lock);
+    for (size_t i = 0; i < copy_clone_count; i++) {
+        if (copy_clone_cache[i].src == src && copy_clone_cache[i].dest == dest) {
+            if (state) {
+                copy_clone_cache[i].state = state;
+            }
+            result = copy_clone_cache[i].state;
+            goto copy_clone_state_done;
+        }
+    }
+    if (state && copy_clone_count < COPY_CLONE_CACHE) {
+        copy_clone_cache[copy_clone_count].src = src;
+        copy_clone_cache[copy_clone_count].dest = dest;
+        copy_clone_cache[copy_clone_count].state = state;
+        copy_clone_count++;
+        result = state;
+    }
+copy_clone_state_done:
+    pthread_mutex_unlock(&copy_clone_lock);
+    return result;
+}
+#endif
+
+/**
+ * Share the source's data blocks with the destination (copy-on-write)
+ *
+ * Works on filesystems with reflink support (btrfs, XFS, NFSv4.2 clone) when both
+ * files live on the same one. Support is probed once per pair of filesystems.
+ *
+ * @param fd_in source descriptor
+ * @param fd_out destination descriptor (empty)
+ * @param st source metadata
+ * @return 0=cloned, -1=not cloned (fall back to copy_data())
+ */
+static int copy_clone(int fd_in, int fd_out, struct stat *st) {
+#ifdef HAVE_FICLONE
+    struct stat dest_st;
+    int state;
+
+    if (fstat(fd_out, &dest_st) < 0) {
+        return -1;
+    }
+    state = copy_clone_state(st->st_dev, dest_st.st_dev, 0);
+    if (state < 0) {
+        return -1;
+    }
+
+    if (ioctl(fd_out, FICLONE, fd_in) == 0) {
+        if (!state) {
+            copy_clone_state(st->st_dev, dest_st.st_dev, 1);
+        }
+        COPY_STAT_ADD(cloned, 1);
+        return 0;
+    }
+
+    // Anything else (ENOSPC, EIO, ...) may be specific to this file
+    if (errno == EOPNOTSUPP || errno == ENOTTY || errno == EXDEV || errno == EINVAL || errno == ENOSYS) {
+        copy_clone_state(st->st_dev, dest_st.st_dev, -1);
+    }
+#else
+    (void) fd_in;
+    (void) fd_out;
+    (void) st;
+#endif
+    return -1;
+}
+
+/**
+ * Stream file data from one descriptor to another
+ *
+ * Prefers copy_file_range(), then sendfile(), then a plain read/write loop.
+ *
+ * @param fd_in source descriptor
+ * @param fd_out destination descriptor
+ * @param size bytes to copy
+ * @return 0=success, -1=error (errno set)
+ */
+static int copy_data(int fd_in, int fd_out, off_t size) {
+    off_t remain;
+    ssize_t n;
+
+    remain = size;
+#ifdef HAVE_COPY_FILE_RANGE
+    while (remain > 0) {
+        size_t step = copy_throttle_step(remain);
+        copy_throttle(step, 0);
+        n = copy_file_range(fd_in, NULL, fd_out, NULL, step, 0);
+        if (n <= 0) {
+            break;
+        }
+        remain -= n;
+    }
+    if (remain == 0) {
+        return 0;
+    }
+#endif
+
+#ifdef HAVE_SENDFILE
+    while (remain > 0) {
+        size_t step = copy_throttle_step(remain);
+        copy_throttle(step, 0);
+        n = sendfile(fd_out, fd_in, NULL, step);
+        if (n <= 0) {
+            break;
+        }
+        remain -= n;
+    }
+    if (remain == 0) {
+        return 0;
+    }
+#endif
+
+    // Fall back to read/write. Also catches files that grew while being copied.
+    char buf[BUFSIZ * 8];
+    while ((n = read(fd_in, buf, sizeof(buf))) != 0) {
+        char *ptr;
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        copy_throttle(n, 0);
+        ptr = buf;
+        while (n > 0) {
+            ssize_t written;
+            written = write(fd_out, ptr, n);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return -1;
+            }
+            ptr += written;
+            n -= written;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Apply ownership, permissions and timestamps of st to path (rsync -a semantics)
+ *
+ * Ownership changes are best-effort. Only root may give files away.
+ *
+ * @param path destination
+ * @param st source metadata
+ * @return 0=success, -1=error (errno set)
+ */
+static int copy_attrs(const char *path, struct stat *st) {
+    struct timespec times[2];
+
+    if (lchown(path, geteuid() == 0 ? st->st_uid : (uid_t) -1, st->st_gid) < 0) {
+        // ignore: the user may not be a member of the source group
+    }
+
+    if (!S_ISLNK(st->st_mode) && chmod(path, st->st_mode & 07777) < 0) {
+        return -1;
+    }
+
+    times[0] = st->st_atim;
+    times[1] = st->st_mtim;
+    if (utimensat(AT_FDCWD, path, times, AT_SYMLINK_NOFOLLOW) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Decide whether an existing destination can be left alone
+ *
+ * Matches rsync's quick check (same size and mtime). In update mode a destination
+ * newer than its source is never replaced (rsync -u).
+ *
+ * @param src_st source metadata
+ * @param dest_st destination metadata
+ * @param mode COPY_NORMAL or COPY_UPDATE
+ * @return 1=skip, 0=copy
+ */
+static int copy_is_current(struct stat *src_st, struct stat *dest_st, int mode) {
+    if (src_st->st_size == dest_st->st_size
+            && src_st->st_mtim.tv_sec == dest_st->st_mtim.tv_sec
+            && src_st->st_mtim.tv_nsec == dest_st->st_mtim.tv_nsec) {
+        return 1;
+    }
+    if (mode == COPY_UPDATE && (dest_st->st_mtim.tv_sec > src_st->st_mtim.tv_sec
+            || (dest_st->st_mtim.tv_sec == src_st->st_mtim.tv_sec && dest_st->st_mtim.tv_nsec > src_st->st_mtim.tv_nsec))) {
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Generate a temporary path alongside dest
+ * @param dest destination path
+ * @param tmp output buffer (PATH_MAX)
+ */
+static void copy_tmpname(const char *dest, char *tmp) {
+    char *dest_copy;
+    char *dir;
+    char *name;
+
+    dest_copy = strdup(dest);
+    dir = dirname(dest_copy);
+    name = basename((char *) dest);
+    snprintf(tmp, PATH_MAX, "%s/.%s.XXXXXX", dir, name);
+    free(dest_copy);
+}
+
+/**
+ * Copy a regular file
+ *
+ * Data is written to a temporary file that replaces dest only after it is complete.
+ *
+ * @param source path to file
+ * @param dest path to file
+ * @param st source metadata
+ * @return 0=success, -1=error (errno set)
+ */
+static int copy_file(const char *source, const char *dest, struct stat *st) {
+    char tmp[PATH_MAX];
+    int fd_in;
+    int fd_out;
+    int err;
+
+    fd_in = open(source, O_RDONLY | O_NOFOLLOW);
+    if (fd_in < 0) {
+        return -1;
+    }
+
+    copy_tmpname(dest, tmp);
+    fd_out = mkstemp(tmp);
+    if (fd_out < 0) {
+        err = errno;
+        close(fd_in);
+        errno = err;
+        return -1;
+    }
+
+    if (copy_clone(fd_in, fd_out, st) < 0 && copy_data(fd_in, fd_out, st->st_size) < 0) {
+        goto copy_file_failed;
+    }
+    close(fd_in);
+    fd_in = -1;
+
+    if (close(fd_out) < 0) {
+        fd_out = -1;
+        goto copy_file_failed;
+    }
+    fd_out = -1;
+
+    if (copy_attrs(tmp, st) < 0 || rename(tmp, dest) < 0) {
+        goto copy_file_failed;
+    }
+    return 0;
+
+copy_file_failed:
+    err = errno;
+    if (fd_in >= 0) {
+        close(fd_in);
+    }
+    if (fd_out >= 0) {
+        close(fd_out);
+    }
+    unlink(tmp);
+    errno = err;
+    return -1;
+}
+
+/**
+ * Copy a symbolic link (the link itself, not its target)
+ * @param source path to link
+ * @param dest path to link
+ * @param st source metadata
+ * @param dest_exists non-zero when dest is already present
+ * @return 0=success, -1=error (errno set)
+ */
+static int copy_symlink(const char *source, const char *dest, struct stat *st, int dest_exists) {
+    char target[PATH_MAX];
+    char current[PATH_MAX];
+    char tmp[PATH_MAX];
+    ssize_t len;
+
+    len = readlink(source, target, sizeof(target) - 1);
+    if (len < 0) {
+        return -1;
+    }
+    target[len] = '\0';
+
+    // Nothing to do if the link already points to the same place
+    if (dest_exists) {
+        len = readlink(dest, current, sizeof(current) - 1);
+        if (len >= 0) {
+            current[len] = '\0';
+            if (strcmp(current, target) == 0) {
+                return 0;
+            }
+        }
+    }
+
+    // mkstemp() only reserves a name. Replace the placeholder with the link.
+    copy_tmpname(dest, tmp);
+    int fd;
+    fd = mkstemp(tmp);
+    if (fd < 0) {
+        return -1;
+    }
+    close(fd);
+    unlink(tmp);
+
+    if (symlink(target, tmp) < 0) {
+        return -1;
+    }
+    if (copy_attrs(tmp, st) < 0 || rename(tmp, dest) < 0) {
+        int err = errno;
+        unlink(tmp);
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Metadata of a store object when its content was last known to be intact
+ *
+ * Kept in OBJECT.meta. Linking the object into a home changes its link count and
+ * ctime, so the record is rewritten after every link. Anything else (an edit, a
+ * chmod) leaves a mismatch, and only then is the object read back.
+ */
+struct CopyStoreRecord {
+    uint64_t hash;
+    uint64_t ino;
+    uint64_t nlink;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    int64_t ctime_sec;
+    int64_t ctime_nsec;
+};
+
+static void copy_store_record_fill(struct CopyStoreRecord *rec, struct stat *object_st, uint64_t hash) {
+    memset(rec, 0, sizeof(*rec));
+    rec->hash = hash;
+    rec->ino = object_st->st_ino;
+    rec->nlink = object_st->st_nlink;
+    rec->mtime_sec = object_st->st_mtim.tv_sec;
+    rec->mtime_nsec = object_st->st_mtim.tv_nsec;
+    rec->ctime_sec = object_st->st_ctim.tv_sec;
+    rec->ctime_nsec = object_st->st_ctim.tv_nsec;
+}
+
+/**
+ * Record the current metadata of an intact store object
+ *
+ * Best effort: a missing or damaged record only costs one more hash.
+ *
+ * @param object path to object
+ * @param hash content hash of object
+ */
+static void copy_store_record(const char *object, uint64_t hash) {
+    struct CopyStoreRecord rec;
+    struct stat object_st;
+    char path[PATH_MAX];
+    int fd;
+
+    if (lstat(object, &object_st) < 0) {
+        return;
+    }
+    copy_store_record_fill(&rec, &object_st, hash);
+    snprintf(path, sizeof(path), "%s%s", object, COPY_STORE_RECORD);
+    fd = open(path, O_WRONLY | O_CREAT | O_NOFOLLOW, 0644);
+    if (fd < 0) {
+        return;
+    }
+    if (pwrite(fd, &rec, sizeof(rec), 0) != sizeof(rec)) {
+        // ignore: see above
+    }
+    close(fd);
+}
+
+/**
+ * Check that a store object still holds the content its name promises
+ *
+ * An object is linked into every home that uses it. Once someone edited it in
+ * place, the edit shows up in all of them and the object no longer matches its
+ * key. The object is only read back when its metadata differs from the record
+ * written the last time it was verified or linked (see copy_store_record()).
+ *
+ * @param object path to object
+ * @param object_st object metadata
+ * @param st source metadata
+ * @param hash content hash of source
+ * @return 1=intact, 0=must be replaced
+ */
+static int copy_store_valid(const char *object, struct stat *object_st, struct stat *st, uint64_t hash) {
+    struct CopyStoreRecord expect;
+    struct CopyStoreRecord rec;
+    char path[PATH_MAX];
+    uint64_t object_hash;
+    ssize_t len;
+    int fd;
+
+    if (!S_ISREG(object_st->st_mode) || (object_st->st_mode & 07777) != (st->st_mode & 07777)
+            || object_st->st_size != st->st_size) {
+        return 0;
+    }
+
+    snprintf(path, sizeof(path), "%s%s", object, COPY_STORE_RECORD);
+    fd = open(path, O_RDONLY | O_NOFOLLOW);
+    if (fd >= 0) {
+        len = read(fd, &rec, sizeof(rec));
+        close(fd);
+        copy_store_record_fill(&expect, object_st, hash);
+        if (len == sizeof(rec) && memcmp(&rec, &expect, sizeof(rec)) == 0) {
+            return 1;
+        }
+    }
+
+    copy_throttle(object_st->st_size, 0);
+    if (hash_file(object, &object_hash) < 0) {
+        return 0;
+    }
+    if (object_hash != hash) {
+        fprintf(stderr, "copy: %s: store object was modified, replacing it\n", object);
+        return 0;
+    }
+    copy_store_record(object, hash);
+    return 1;
+}
+
+/**
+ * Place a regular file by linking it to its object in the store
+ *
+ * The object is created from source on first use, and replaced when
+ * copy_store_valid() finds it was modified. When a link cannot be made
+ * (different filesystem, link limit reached) a private copy is written instead.
+ *
+ * @param source path to file
+ * @param dest path to file
+ * @param st source metadata
+ * @param hash content hash of source
+ * @param dest_st destination metadata (NULL when dest does not exist)
+ * @return 0=placed, 1=dest already is the object, -1=error (errno set)
+ */
+static int copy_store_link(const char *source, const char *dest, struct stat *st, uint64_t hash, struct stat *dest_st) {
+    char object[PATH_MAX];
+    char tmp[PATH_MAX];
+    struct stat object_st;
+    int exists;
+    int fd;
+
+    snprintf(object, sizeof(object), "%s/%02x/%016llx-%llx-%o", copy_store, (unsigned) (hash >> 56),
+             (unsigned long long) hash, (unsigned long long) st->st_size, (unsigned) (st->st_mode & 07777));
+
+    // A replaced object stays behind as the private copy of the homes that link it
+    exists = lstat(object, &object_st) == 0;
+    if (exists && !copy_store_valid(object, &object_st, st, hash)) {
+        exists = 0;
+    }
+    if (!exists) {
+        char *dir;
+
+        strcpy(tmp, object);
+        dir = dirname(tmp);
+        if (access(dir, F_OK) < 0 && mkdirs(dir) < 0) {
+            return -1;
+        }
+        if (copy_file(source, object, st) < 0 || lstat(object, &object_st) < 0) {
+            return -1;
+        }
+        copy_store_record(object, hash);
+    }
+
+    if (dest_st != NULL && dest_st->st_ino == object_st.st_ino && dest_st->st_dev == object_st.st_dev) {
+        return 1;
+    }
+
+    // mkstemp() only reserves a name. Replace the placeholder with the link.
+    copy_tmpname(dest, tmp);
+    fd = mkstemp(tmp);
+    if (fd < 0) {
+        return -1;
+    }
+    close(fd);
+    unlink(tmp);
+
+    if (link(object, tmp) < 0) {
+        if (errno == EXDEV || errno == EMLINK || errno == EPERM) {
+            return copy_file(source, dest, st);
+        }
+        return -1;
+    }
+    if (rename(tmp, dest) < 0) {
+        int err = errno;
+        unlink(tmp);
+        errno = err;
+        return -1;
+    }
+    copy_store_record(object, hash);
+    return 0;
+}
+
+/**
+ * Give a home its own copy of a shared file that diverged from its source
+ *
+ * An edit made in place through one home shows up in every home linking the same
+ * object. The edit is kept, but it is no longer shared: the link is replaced by a
+ * private, writable copy of its current content.
+ *
+ * @param dest path to file
+ * @param dest_st destination metadata
+ * @return 0=success, -1=error (errno set)
+ */
+static int copy_store_unshare(const char *dest, struct stat *dest_st) {
+    struct stat private_st;
+
+    private_st = *dest_st;
+    private_st.st_mode |= S_IWUSR;
+    return copy_file(dest, dest, &private_st);
+}
+
+static int copy_entry(const char *source, const char *dest, struct stat *st, int mode);
+#ifdef COPY_URING
+struct CopyPool;
+struct CopyTask;
+static int copy_scan_batch(DIR *d, const char *source, const char *dest, int created, int mode, struct CopyPool *pool, size_t id, struct CopyTask *task);
+#endif
+
+/**
+ * A directory waiting to be copied by the worker pool
+ *
+ * pending counts the unfinished subdirectories plus one for the task's own scan.
+ * The directory's attributes are applied when it drops to zero.
+ */
+struct CopyTask {
+    char *source;
+    char *dest;
+    struct stat st;
+    struct CopyTask *parent;
+    size_t pending;
+};
+
+/**
+ * Double-ended task queue owned by one worker
+ *
+ * The owner pushes and pops at the bottom (depth-first). Idle workers steal from
+ * the top, which tends to hand them the largest remaining subtrees.
+ */
+struct CopyDeque {
+    pthread_mutex_t lock;
+    struct CopyTask **tasks;
+    size_t top;
+    size_t bottom;
+    size_t size;
+};
+
+struct CopyPool {
+    struct CopyDeque *deques;
+    size_t workers;
+    int mode;
+    int exclude_lifted;         // copy_exclude_lift() of the starting thread
+    struct CopyStats *stats_op; // copy_stats_track() of the starting thread
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    long queued;
+    int done;
+    int status;
+    int err;
+};
+
+struct CopyWorker {
+    struct CopyPool *pool;
+    size_t id;
+};
+
+/**
+ * Number of worker threads used for directory copies (see copy_set_jobs())
+ */
+static size_t copy_jobs = COPY_JOBS_DEFAULT;
+
+/**
+ * Set the number of worker threads used to copy directory trees
+ * @param jobs thread count (1 disables the worker pool)
+ * @return 0=success, -1=invalid count
+ */
+int copy_set_jobs(long jobs) {
+    if (jobs < 1 || jobs > COPY_JOBS_MAX) {
+        return -1;
+    }
+    copy_jobs = (size_t) jobs;
+    return 0;
+}
+
+/**
+ * Return the number of worker threads used to copy directory trees
+ * @return thread count
+ */
+size_t copy_get_jobs() {
+    return copy_jobs;
+}
+
+/**
+ * Set the number of io_uring operations each thread keeps in flight
+ * @param depth queue depth
+ * @return 0=success, -1=invalid depth
+ */
+int copy_set_queue_depth(long depth) {
+    if (depth < 2 || depth > COPY_QUEUE_DEPTH_MAX) {
+        return -1;
+    }
+    copy_queue_depth = (unsigned) depth;
+    return 0;
+}
+
+static void copy_deque_push(struct CopyDeque *dq, struct CopyTask *task) {
+    pthread_mutex_lock(&dq->lock);
+    if (dq->bottom == dq->size) {
+        // Reclaim stolen slots before growing
+        if (dq->top > 0) {
+            memmove(dq->tasks, &dq->tasks[dq->top], (dq->bottom - dq->top) * sizeof(*dq->tasks));
+            dq->bottom -= dq->top;
+            dq->top = 0;
+        } else {
+            struct CopyTask **tmp;
+            size_t size = dq->size ? dq->size * 2 : 64;
+            tmp = realloc(dq->tasks, size * sizeof(*dq->tasks));
+            if (tmp == NULL) {
+                perror("copy task queue");
+                exit(1);
+            }
+            dq->tasks = tmp;
+            dq->size = size;
+        }
+    }
+    dq->tasks[dq->bottom++] = task;
+    pthread_mutex_unlock(&dq->lock);
+}
+
+static struct CopyTask *copy_deque_pop(struct CopyDeque *dq) {
+    struct CopyTask *task;
+
+    task = NULL;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->bottom > dq->top) {
+        task = dq->tasks[--dq->bottom];
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return task;
+}
+
+static struct CopyTask *copy_deque_steal(struct CopyDeque *dq) {
+    struct CopyTask *task;
+
+    task = NULL;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->bottom > dq->top) {
+        task = dq->tasks[dq->top++];
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return task;
+}
+
+/**
+ * Queue a subdirectory on the calling worker's deque
+ */
+static void copy_pool_push(struct CopyPool *pool, size_t id, struct CopyTask *task) {
+    copy_deque_push(&pool->deques[id], task);
+    pthread_mutex_lock(&pool->lock);
+    pool->queued++;
+    pthread_cond_signal(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * Record a failure without stopping the remaining work
+ */
+static void copy_pool_fail(struct CopyPool *pool, int err) {
+    pthread_mutex_lock(&pool->lock);
+    pool->status = -1;
+    pool->err = err;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * Drop one reference from task and finish every directory that has no work left
+ *
+ * Finishing a directory applies its attributes and releases its parent in turn.
+ * When the root finishes the pool is shut down.
+ */
+static void copy_task_release(struct CopyPool *pool, struct CopyTask *task) {
+    while (task != NULL) {
+        struct CopyTask *parent;
+
+        if (__atomic_sub_fetch(&task->pending, 1, __ATOMIC_ACQ_REL) != 0) {
+            return;
+        }
+
+        if (copy_attrs(task->dest, &task->st) < 0) {
+            fprintf(stderr, "copy: %s: %s\n", task->dest, strerror(errno));
+            copy_pool_fail(pool, errno);
+        } else if (copy_manifest) {
+            manifest_update(copy_manifest, task->dest, &task->st, 0);
+        }
+
+        parent = task->parent;
+        if (parent == NULL) {
+            pthread_mutex_lock(&pool->lock);
+            pool->done = 1;
+            pthread_cond_broadcast(&pool->wake);
+            pthread_mutex_unlock(&pool->lock);
+        }
+        free(task->source);
+        free(task->dest);
+        free(task);
+        task = parent;
+    }
+}
+
+/**
+ * Create dest as a directory, replacing a non-directory if necessary
+ * @param dest path to directory
+ * @return 0=already present, 1=created, -1=error (errno set)
+ */
+static int copy_mkdir(const char *dest) {
+    struct stat dest_st;
+
+    copy_throttle(0, 1);
+    if (lstat(dest, &dest_st) == 0) {
+        if (S_ISDIR(dest_st.st_mode)) {
+            // A read-only directory left by an earlier copy must be writable for the
+            // update. Its mode is restored with the other attributes afterwards.
+            if ((dest_st.st_mode & S_IRWXU) != S_IRWXU && chmod(dest, (dest_st.st_mode & 07777) | S_IRWXU) < 0) {
+                // ignore: writing below it reports the error
+            }
+            return 0;
+        }
+        if (unlink(dest) < 0) {
+            return -1;
+        }
+    }
+
+    // The directory must remain writable until its contents are in place
+    if (mkdir(dest, S_IRWXU) < 0) {
+        return -1;
+    }
+    return 1;
+}
+
+/**
+ * Copy one entry found while scanning a directory
+ *
+ * Subdirectories are queued on the pool when there is one, everything else is
+ * copied right away.
+ *
+ * @param src_path path to entry
+ * @param dest_path destination path
+ * @param st entry metadata
+ * @param mode COPY_NORMAL or COPY_UPDATE
+ * @param pool worker pool (may be NULL)
+ * @param id calling worker
+ * @param task directory being scanned (NULL without a pool)
+ * @return 0=success, -1=error (errno set)
+ */
+static int copy_child(const char *src_path, const char *dest_path, struct stat *st, int mode, struct CopyPool *pool, size_t id, struct CopyTask *task) {
+    if (S_ISDIR(st->st_mode) && copy_dir_unchanged(dest_path, st)) {
+        return 0;
+    }
+
+    if (pool != NULL && S_ISDIR(st->st_mode)) {
+        struct CopyTask *child;
+        child = calloc(1, sizeof(*child));
+        if (child == NULL || (child->source = strdup(src_path)) == NULL || (child->dest = strdup(dest_path)) == NULL) {
+            perror("copy task");
+            exit(1);
+        }
+        child->st = *st;
+        child->parent = task;
+        child->pending = 1;
+        __atomic_add_fetch(&task->pending, 1, __ATOMIC_ACQ_REL);
+        copy_pool_push(pool, id, child);
+        return 0;
+    }
+
+    return copy_entry(src_path, dest_path, st, mode);
+}
+
+/**
+ * Copy the entries of one directory
+ *
+ * Without a pool subdirectories are copied recursively. With a pool they are queued
+ * as new tasks and the caller is responsible for applying the directory's attributes.
+ *
+ * @param source path to directory
+ * @param dest path to directory (created if missing)
+ * @param mode COPY_NORMAL or COPY_UPDATE
+ * @param pool worker pool (may be NULL)
+ * @param id calling worker
+ * @param task directory being scanned (NULL without a pool)
+ * @return 0=success, -1=one or more errors occurred (errno set)
+ */
+static int copy_scan(const char *source, const char *dest, int mode, struct CopyPool *pool, size_t id, struct CopyTask *task) {
+    DIR *d;
+    struct dirent *rec;
+    int created;
+    int status;
+    int err;
+
+    status = 0;
+    err = 0;
+
+    created = copy_mkdir(dest);
+    if (created < 0) {
+        fprintf(stderr, "copy: %s: %s\n", dest, strerror(errno));
+        COPY_STAT_ADD(errors, 1);
+        return -1;
+    }
+    COPY_STAT_ADD(dirs, 1);
+
+    d = opendir(source);
+    if (!d) {
+        fprintf(stderr, "copy: %s: %s\n", source, strerror(errno));
+        return -1;
+    }
+
+#ifdef COPY_URING
+    if (copy_backend == COPY_BACKEND_URING) {
+        status = copy_scan_batch(d, source, dest, created, mode, pool, id, task);
+        closedir(d);
+        return status;
+    }
+#endif
+
+    while ((rec = readdir(d)) != NULL) {
+        char src_path[PATH_MAX];
+        char dest_path[PATH_MAX];
+        struct stat child_st;
+
+        if (strcmp(rec->d_name, ".") == 0 || strcmp(rec->d_name, "..") == 0) {
+            continue;
+        }
+
+        snprintf(src_path, sizeof(src_path), "%s/%s", source, rec->d_name);
+        snprintf(dest_path, sizeof(dest_path), "%s/%s", dest, rec->d_name);
+
+        if (lstat(src_path, &child_st) < 0) {
+            fprintf(stderr, "copy: %s: %s\n", src_path, strerror(errno));
+            err = errno;
+            status = -1;
+            continue;
+        }
+        if (copy_exclude_entry(src_path, child_st.st_mode)) {
+            continue;
+        }
+
+        if (copy_child(src_path, dest_path, &child_st, mode, pool, id, task) < 0) {
+            err = errno;
+            status = -1;
+        }
+    }
+    closedir(d);
+
+    errno = err;
+    return status;
+}
+
+/**
+ * Recursively copy a directory's contents
+ * @param source path to directory
+ * @param dest path to directory (created if missing)
+ * @param st source metadata
+ * @param mode COPY_NORMAL or COPY_UPDATE
+ * @return 0=success, -1=one or more errors occurred (errno set)
+ */
+static int copy_tree(const char *source, const char *dest, struct stat *st, int mode) {
+    int status;
+    int err;
+
+    status = copy_scan(source, dest, mode, NULL, 0, NULL);
+    err = errno;
+
+    // Directory attributes are applied last so the mtime survives the writes above
+    if (copy_attrs(dest, st) < 0) {
+        fprintf(stderr, "copy: %s: %s\n", dest, strerror(errno));
+        err = errno;
+        status = -1;
+    } else if (copy_manifest) {
+        manifest_update(copy_manifest, dest, st, 0);
+    }
+
+    errno = err;
+    return status;
+}
+
+static void *copy_worker(void *arg) {
+    struct CopyWorker *worker = arg;
+    struct CopyPool *pool = worker->pool;
+
+    copy_exclude_lifted = pool->exclude_lifted;
+    copy_stats_op = pool->stats_op;
+    while (1) {
+        struct CopyTask *task;
+
+        task = copy_deque_pop(&pool->deques[worker->id]);
+        for (size_t i = 1; task == NULL && i < pool->workers; i++) {
+            task = copy_deque_steal(&pool->deques[(worker->id + i) % pool->workers]);
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        if (task != NULL) {
+            pool->queued--;
+            pthread_mutex_unlock(&pool->lock);
+        } else {
+            // Sleep until new work is queued or the copy is finished
+            if (!pool->done && pool->queued == 0) {
+                pthread_cond_wait(&pool->wake, &pool->lock);
+            }
+            if (pool->done) {
+                pthread_mutex_unlock(&pool->lock);
+                break;
+            }
+            pthread_mutex_unlock(&pool->lock);
+            continue;
+        }
+
+        if (copy_scan(task->source, task->dest, pool->mode, pool, worker->id, task) < 0) {
+            copy_pool_fail(pool, errno);
+        }
+        copy_task_release(pool, task);
+    }
+    return NULL;
+}
+
+/**
+ * Recursively copy a directory using a pool of worker threads
+ *
+ * Each worker owns a deque of directories. Workers scan their own directories
+ * depth-first and steal from other workers when they run dry, so many metadata
+ * round trips are in flight at once.
+ *
+ * @param source path to directory
+ * @param dest path to directory (created if missing)
+ * @param st source metadata
+ * @param mode COPY_NORMAL or COPY_UPDATE
+ * @return 0=success, -1=one or more errors occurred (errno set)
+ */
+static int copy_tree_parallel(const char *source, const char *dest, struct stat *st, int mode) {
+    struct CopyPool pool;
+    struct CopyWorker *workers;
+    struct CopyTask *root;
+    pthread_t *threads;
+    size_t started;
+
+    memset(&pool, 0, sizeof(pool));
+    pool.workers = copy_jobs;
+    pool.mode = mode;
+    pool.exclude_lifted = copy_exclude_lifted;
+    pool.stats_op = copy_stats_op;
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.wake, NULL);
+
+    pool.deques = calloc(pool.workers, sizeof(*pool.deques));
+    workers = calloc(pool.workers, sizeof(*workers));
+    threads = calloc(pool.workers, sizeof(*threads));
+    root = calloc(1, sizeof(*root));
+    if (pool.deques == NULL || workers == NULL || threads == NULL || root == NULL) {
+        perror("copy pool");
+        exit(1);
+    }
+
+    root->source = strdup(source);
+    root->dest = strdup(dest);
+    root->st = *st;
+    root->pending = 1;
+
+    for (size_t i = 0; i < pool.workers; i++) {
+        pthread_mutex_init(&pool.deques[i].lock, NULL);
+        workers[i].pool = &pool;
+        workers[i].id = i;
+    }
+    copy_pool_push(&pool, 0, root);
+
+    started = 0;
+    for (size_t i = 0; i < pool.workers; i++) {
+        if (pthread_create(&threads[i], NULL, copy_worker, &workers[i]) != 0) {
+            break;
+        }
+        started++;
+    }
+
+    if (started == 0) {
+        // Could not start any threads. Do the work here.
+        copy_worker(&workers[0]);
+    }
+
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (size_t i = 0; i < pool.workers; i++) {
+        pthread_mutex_destroy(&pool.deques[i].lock);
+        free(pool.deques[i].tasks);
+    }
+    pthread_mutex_destroy(&pool.lock);
+    pthread_cond_destroy(&pool.wake);
+    free(pool.deques);
+    free(workers);
+    free(threads);
+
+    errno = pool.err;
+    return pool.status;
+}
+
+/**
+ * Copy a single non-directory object to dest
+ * @param source path
+ * @param dest path
+ * @param st source metadata
+ * @param mode COPY_NORMAL or COPY_UPDATE
+ * @param manifest manifest of the destination home (may be NULL)
+ * @return 0=copied, 1=already up to date, -1=error (errno set)
+ */
+static int copy_leaf(const char *source, const char *dest, struct stat *st, int mode, struct Manifest *manifest) {
+    struct stat dest_st;
+    int dest_exists;
+    int status;
+    int store;
+    uint64_t hash;
+    uint64_t hash_recorded;
+
+    hash = 0;
+    hash_recorded = 0;
+    if (manifest) {
+        if (manifest_match(manifest, dest, st, &hash_recorded) && copy_dest_intact(dest, st)) {
+            COPY_STAT_ADD(skipped, 1);
+            return 1;
+        }
+        if (copy_checksum && S_ISREG(st->st_mode)) {
+            copy_throttle(st->st_size, 0);
+            if (hash_file(source, &hash) < 0) {
+                hash = 0;
+            }
+        }
+    }
+    store = copy_store[0] && S_ISREG(st->st_mode);
+
+    copy_throttle(0, 1);
+    dest_exists = lstat(dest, &dest_st) == 0;
+    if (dest_exists) {
+        if (S_ISDIR(dest_st.st_mode)) {
+            fprintf(stderr, "copy: %s: refusing to replace directory\n", dest);
+            errno = EISDIR;
+            return -1;
+        }
+        // An identical private copy is traded for a link into the store
+        int relink = store && S_ISREG(dest_st.st_mode) && dest_st.st_nlink == 1
+                && dest_st.st_size == st->st_size
+                && dest_st.st_mtim.tv_sec == st->st_mtim.tv_sec
+                && dest_st.st_mtim.tv_nsec == st->st_mtim.tv_nsec;
+        if (((!S_ISLNK(st->st_mode) && copy_is_current(st, &dest_st, mode))
+                || (S_ISLNK(st->st_mode) && mode == COPY_UPDATE && dest_st.st_mtim.tv_sec > st->st_mtim.tv_sec))
+                && !relink) {
+            // Kept because it is newer: a store object edited in place through a home
+            if (store && S_ISREG(dest_st.st_mode) && dest_st.st_nlink > 1 && !copy_is_current(st, &dest_st, COPY_NORMAL)
+                    && copy_store_unshare(dest, &dest_st) < 0) {
+                fprintf(stderr, "copy: %s: %s\n", dest, strerror(errno));
+            }
+            COPY_STAT_ADD(skipped, 1);
+            if (manifest) {
+                manifest_update(manifest, dest, st, hash);
+            }
+            return 1;
+        }
+
+        // Same content as the last copy, and the destination still holds it. Only
+        // the metadata changed. (Store objects are shared, so their attributes are
+        // never modified.)
+        uint64_t hash_dest;
+        if (!store && hash && hash == hash_recorded && S_ISREG(dest_st.st_mode) && dest_st.st_size == st->st_size
+                && hash_file(dest, &hash_dest) == 0 && hash_dest == hash) {
+            COPY_STAT_ADD(skipped, 1);
+            if (copy_attrs(dest, st) == 0) {
+                manifest_update(manifest, dest, st, hash);
+            }
+            return 1;
+        }
+    }
+
+    if (store) {
+        if (!hash) {
+            copy_throttle(st->st_size, 0);
+        }
+        if (!hash && hash_file(source, &hash) < 0) {
+            status = -1;
+        } else {
+            status = copy_store_link(source, dest, st, hash, dest_exists ? &dest_st : NULL);
+        }
+        if (status > 0) {
+            COPY_STAT_ADD(skipped, 1);
+            if (manifest) {
+                manifest_update(manifest, dest, st, hash);
+            }
+            return 1;
+        }
+    } else if (S_ISREG(st->st_mode)) {
+        status = copy_file(source, dest, st);
+    } else if (S_ISLNK(st->st_mode)) {
+        status = copy_symlink(source, dest, st, dest_exists);
+    } else {
+        // Devices, FIFOs and sockets
+        if (dest_exists) {
+            unlink(dest);
+        }
+        status = mknod(dest, st->st_mode, st->st_rdev);
+        if (status == 0) {
+            status = copy_attrs(dest, st);
+        }
+    }
+
+    if (status < 0) {
+        int err = errno;
+        COPY_STAT_ADD(errors, 1);
+        fprintf(stderr, "copy: %s: %s\n", source, strerror(err));
+        errno = err;
+    } else {
+        if (S_ISLNK(st->st_mode)) {
+            COPY_STAT_ADD(links, 1);
+        } else {
+            COPY_STAT_ADD(files, 1);
+            COPY_STAT_ADD(bytes, S_ISREG(st->st_mode) ? (uint64_t) st->st_size : 0);
+        }
+        if (manifest) {
+            manifest_update(manifest, dest, st, hash);
+        }
+    }
+    return status;
+}
+
+/**
+ * Copy a single filesystem object of any type to dest
+ * @param source path
+ * @param dest path
+ * @param st source metadata
+ * @param mode COPY_NORMAL or COPY_UPDATE
+ * @return 0=success, -1=error (errno set)
+ */
+static int copy_entry(const char *source, const char *dest, struct stat *st, int mode) {
+    if (S_ISDIR(st->st_mode)) {
+        return copy_tree(source, dest, st, mode);
+    }
+    return copy_leaf(source, dest, st, mode, copy_manifest) < 0 ? -1 : 0;
+}
+
+#ifdef COPY_URING
+/**
+ * Batched copies through io_uring
+ *
+ * Each thread owns a ring. A directory's entries are stat'ed in one batch, then
+ * its small regular files move through a per-file state machine:
+ *
+ *     statx(dest) -> open(source) + open(tmp) -> read/write ... -> close + close -> rename
+ *
+ * Up to half the ring's entries worth of files are in flight at once (a file
+ * never has more than two operations queued). io_uring has no setattr operation,
+ * so ownership, permissions and timestamps are applied with one synchronous
+ * fchown/fchmod/futimens each before the descriptors are closed.
+ */
+#define COPY_URING_STAT_DEST 1
+#define COPY_URING_OPEN_IN 2
+#define COPY_URING_OPEN_OUT 3
+#define COPY_URING_READ 4
+#define COPY_URING_WRITE 5
+#define COPY_URING_CLOSE_IN 6
+#define COPY_URING_CLOSE_OUT 7
+#define COPY_URING_RENAME 8
+#define COPY_URING_DATA(SLOT, OP) ((uint64_t) (SLOT) | ((uint64_t) (OP) << 32))
+#define COPY_URING_RETRIES 100
+
+/**
+ * A small regular file waiting for copy_uring_files()
+ */
+struct CopyUringFile {
+    char *source;
+    char *dest;
+    struct stat st;
+    int fresh;              // dest is known not to exist
+};
+
+/**
+ * A file in flight
+ */
+struct CopyUringSlot {
+    struct CopyUringFile *file;
+    struct statx stx;
+    char tmp[PATH_MAX];
+    char *buf;
+    int fd_in;
+    int fd_out;
+    off_t offset;
+    unsigned len;           // bytes in buf
+    unsigned written;       // bytes of buf written so far
+    int pending;            // operations in flight
+    int attempts;           // temporary names tried
+    int created;            // tmp exists
+    int quiet;              // error already reported
+    int err;
+};
+
+struct CopyUring {
+    struct Uring *ring;
+    struct CopyUringSlot *slots;
+    struct CopyUringFile *files;
+    size_t count;
+    size_t next;
+    size_t active;
+    int mode;
+    struct Manifest *manifest;
+    struct CopyStats *stats;
+    int status;
+    int err;
+};
+
+static pthread_key_t copy_ring_key;
+static pthread_once_t copy_ring_once = PTHREAD_ONCE_INIT;
+
+static void copy_ring_release(void *ring) {
+    uring_close(ring);
+}
+
+static void copy_ring_init(void) {
+    if (pthread_key_create(&copy_ring_key, copy_ring_release) != 0) {
+        perror("copy ring");
+        exit(1);
+    }
+}
+
+/**
+ * Return the calling thread's ring, creating it on first use
+ * @return ring, NULL=unavailable (use the synchronous path)
+ */
+static struct Uring *copy_ring() {
+    struct Uring *ring;
+
+    pthread_once(&copy_ring_once, copy_ring_init);
+    ring = pthread_getspecific(copy_ring_key);
+    if (ring == NULL) {
+        ring = uring_open(copy_queue_depth);
+        if (ring == NULL) {
+            return NULL;
+        }
+        pthread_setspecific(copy_ring_key, ring);
+    }
+    return ring;
+}
+
+/**
+ * Abort on a ring failure
+ *
+ * Operations still in flight may write into our buffers, so there is no safe way
+ * to hand the error back to the caller.
+ *
+ * @param result return value of a uring_*() call
+ */
+static void copy_uring_check(int result) {
+    if (result < 0) {
+        perror("io_uring");
+        exit(1);
+    }
+}
+
+/**
+ * Convert statx() output to a struct stat
+ * @param stx statx() result
+ * @param st output
+ */
+static void copy_statx_stat(const struct statx *stx, struct stat *st) {
+    memset(st, 0, sizeof(*st));
+    st->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+    st->st_ino = stx->stx_ino;
+    st->st_mode = stx->stx_mode;
+    st->st_nlink = stx->stx_nlink;
+    st->st_uid = stx->stx_uid;
+    st->st_gid = stx->stx_gid;
+    st->st_rdev = makedev(stx->stx_rdev_major, stx->stx_rdev_minor);
+    st->st_size = (off_t) stx->stx_size;
+    st->st_blksize = stx->stx_blksize;
+    st->st_blocks = (blkcnt_t) stx->stx_blocks;
+    st->st_atim.tv_sec = stx->stx_atime.tv_sec;
+    st->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+    st->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+    st->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+    st->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+    st->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+}
+
+/**
+ * lstat() the entries of a directory in one batch
+ * @param dir_fd directory descriptor
+ * @param names entry names
+ * @param count number of names
+ * @param st output: metadata of each entry
+ * @param err output: 0 or the errno of each entry
+ * @return 0=success, -1=no ring (use lstat())
+ */
+static int copy_uring_stat(int dir_fd, char **names, size_t count, struct stat *st, int *err) {
+    struct statx *stx;
+    struct Uring *ring;
+    size_t next;
+    size_t done;
+
+    ring = copy_ring();
+    if (ring == NULL) {
+        return -1;
+    }
+    stx = calloc(count + 1, sizeof(*stx));
+    if (stx == NULL) {
+        perror("copy stat");
+        exit(1);
+    }
+
+    next = 0;
+    done = 0;
+    while (done < count) {
+        uint64_t data;
+        int res;
+
+        while (next < count && uring_prep_statx(ring, dir_fd, names[next], AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT,
+                                                STATX_BASIC_STATS, &stx[next], next) == 0) {
+            next++;
+        }
+        copy_uring_check(uring_wait(ring, &data, &res));
+        if (res < 0) {
+            err[data] = -res;
+        } else {
+            err[data] = 0;
+            copy_statx_stat(&stx[data], &st[data]);
+        }
+        done++;
+    }
+    free(stx);
+    return 0;
+}
+
+/**
+ * Pick a temporary name alongside dest
+ *
+ * Unlike mkstemp() the name is only chosen here. The O_EXCL open that claims it
+ * is queued on the ring, and a collision picks another name.
+ *
+ * @param dest destination path
+ * @param tmp output buffer (PATH_MAX)
+ * @return 0=success, -1=path too long
+ */
+static int copy_uring_tmpname(const char *dest, char *tmp) {
+    static const char digits[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+    static uint64_t counter;
+    struct timespec now;
+    uint64_t n;
+    size_t len;
+
+    copy_tmpname(dest, tmp);
+    len = strlen(tmp);
+    if (len < 6 || strcmp(tmp + len - 6, "XXXXXX") != 0) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    clock_gettime(CLOCK_REALTIME, &now);
+    n = (((uint64_t) getpid() << 32) ^ (uint64_t) now.tv_nsec ^ __atomic_add_fetch(&counter, 1, __ATOMIC_RELAXED))
+        * 0x9e3779b97f4a7c15ULL;
+    for (size_t i = len - 6; i < len; i++) {
+        tmp[i] = digits[n % (sizeof(digits) - 1)];
+        n /= sizeof(digits) - 1;
+    }
+    return 0;
+}
+
+static void copy_uring_assign(struct CopyUring *ctx, size_t i);
+
+/**
+ * Record the outcome of one file and move its slot to the next one
+ * @param ctx batch
+ * @param i slot
+ * @param result 0=copied, 1=already up to date, -1=error
+ */
+static void copy_uring_done(struct CopyUring *ctx, size_t i, int result) {
+    struct CopyUringSlot *slot = &ctx->slots[i];
+    struct CopyUringFile *file = slot->file;
+
+    if (result < 0) {
+        COPY_STAT_ADD(errors, 1);
+        if (ctx->stats) {
+            ctx->stats->errors++;
+        }
+        ctx->status = -1;
+        ctx->err = slot->err;
+    } else if (result > 0) {
+        COPY_STAT_ADD(skipped, 1);
+        if (ctx->stats) {
+            ctx->stats->skipped++;
+        }
+    } else {
+        COPY_STAT_ADD(files, 1);
+        COPY_STAT_ADD(bytes, (uint64_t) file->st.st_size);
+        if (ctx->stats) {
+            ctx->stats->files++;
+            ctx->stats->bytes += (uint64_t) file->st.st_size;
+        }
+    }
+    if (result >= 0 && ctx->manifest) {
+        manifest_update(ctx->manifest, file->dest, &file->st, 0);
+    }
+
+    slot->file = NULL;
+    ctx->active--;
+    copy_uring_assign(ctx, i);
+}
+
+/**
+ * Give up on a file once nothing is in flight for it
+ * @param ctx batch
+ * @param i slot
+ */
+static void copy_uring_fail(struct CopyUring *ctx, size_t i) {
+    struct CopyUringSlot *slot = &ctx->slots[i];
+
+    if (slot->fd_in >= 0) {
+        close(slot->fd_in);
+        slot->fd_in = -1;
+    }
+    if (slot->fd_out >= 0) {
+        close(slot->fd_out);
+        slot->fd_out = -1;
+    }
+    if (slot->created) {
+        unlink(slot->tmp);
+    }
+    if (!slot->quiet) {
+        fprintf(stderr, "copy: %s: %s\n", slot->file->source, strerror(slot->err));
+    }
+    copy_uring_done(ctx, i, -1);
+}
+
+static void copy_uring_read(struct CopyUring *ctx, size_t i) {
+    struct CopyUringSlot *slot = &ctx->slots[i];
+    off_t left = slot->file->st.st_size - slot->offset;
+
+    copy_throttle(left > 0 && left < COPY_URING_CHUNK ? (uint64_t) left : COPY_URING_CHUNK, 0);
+    copy_uring_check(uring_prep_read(ctx->ring, slot->fd_in, slot->buf, COPY_URING_CHUNK, (uint64_t) slot->offset,
+                                     COPY_URING_DATA(i, COPY_URING_READ)));
+    slot->pending++;
+}
+
+static void copy_uring_write(struct CopyUring *ctx, size_t i) {
+    struct CopyUringSlot *slot = &ctx->slots[i];
+
+    copy_uring_check(uring_prep_write(ctx->ring, slot->fd_out, slot->buf + slot->written, slot->len - slot->written,
+                                      (uint64_t) (slot->offset + slot->written), COPY_URING_DATA(i, COPY_URING_WRITE)));
+    slot->pending++;
+}
+
+/**
+ * Open the source and claim a temporary destination
+ * @param ctx batch
+ * @param i slot
+ */
+static void copy_uring_open(struct CopyUring *ctx, size_t i) {
+    struct CopyUringSlot *slot = &ctx->slots[i];
+    struct CopyUringFile *file = slot->file;
+
+    if (copy_uring_tmpname(file->dest, slot->tmp) < 0) {
+        slot->err = errno;
+        copy_uring_fail(ctx, i);
+        return;
+    }
+    copy_uring_check(uring_prep_openat(ctx->ring, AT_FDCWD, file->source, O_RDONLY | O_NOFOLLOW | O_CLOEXEC, 0,
+                                       COPY_URING_DATA(i, COPY_URING_OPEN_IN)));
+    copy_uring_check(uring_prep_openat(ctx->ring, AT_FDCWD, slot->tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+                                       file->st.st_mode & 0777, COPY_URING_DATA(i, COPY_URING_OPEN_OUT)));
+    slot->pending += 2;
+}
+
+/**
+ * Apply the source's attributes and close both descriptors
+ *
+ * The file was created with the source's permission bits, so fchmod() is only
+ * needed when the umask removed some of them or special bits are set.
+ *
+ * @param ctx batch
+ * @param i slot
+ */
+static void copy_uring_finish(struct CopyUring *ctx, size_t i) {
+    struct CopyUringSlot *slot = &ctx->slots[i];
+    struct stat *st = &slot->file->st;
+    struct timespec times[2];
+
+    if (fchown(slot->fd_out, geteuid() == 0 ? st->st_uid : (uid_t) -1, st->st_gid) < 0) {
+        // ignore: the user may not be a member of the source group
+    }
+    if (((st->st_mode & 07000) || (st->st_mode & 0777 & copy_umask)) && fchmod(slot->fd_out, st->st_mode & 07777) < 0) {
+        slot->err = errno;
+    }
+    times[0] = st->st_atim;
+    times[1] = st->st_mtim;
+    if (!slot->err && futimens(slot->fd_out, times) < 0) {
+        slot->err = errno;
+    }
+
+    copy_uring_check(uring_prep_close(ctx->ring, slot->fd_in, COPY_URING_DATA(i, COPY_URING_CLOSE_IN)));
+    copy_uring_check(uring_prep_close(ctx->ring, slot->fd_out, COPY_URING_DATA(i, COPY_URING_CLOSE_OUT)));
+    slot->fd_in = -1;
+    slot->fd_out = -1;
+    slot->pending += 2;
+}
+
+/**
+ * Start the next file on an idle slot
+ *
+ * Files the manifest already accounts for are skipped after a quick look at the
+ * destination, like copy_leaf() does.
+ *
+ * @param ctx batch
+ * @param i slot
+ */
+static void copy_uring_assign(struct CopyUring *ctx, size_t i) {
+    struct CopyUringSlot *slot = &ctx->slots[i];
+
+    while (ctx->next < ctx->count) {
+        struct CopyUringFile *file = &ctx->files[ctx->next++];
+
+        if (ctx->manifest && manifest_match(ctx->manifest, file->dest, &file->st, NULL)
+                && copy_dest_intact(file->dest, &file->st)) {
+            COPY_STAT_ADD(skipped, 1);
+            if (ctx->stats) {
+                ctx->stats->skipped++;
+            }
+            continue;
+        }
+
+        copy_throttle(0, 1);
+        slot->file = file;
+        slot->fd_in = -1;
+        slot->fd_out = -1;
+        slot->offset = 0;
+        slot->len = 0;
+        slot->written = 0;
+        slot->attempts = 0;
+        slot->created = 0;
+        slot->quiet = 0;
+        slot->err = 0;
+        slot->pending = 0;
+        ctx->active++;
+        if (file->fresh) {
+            copy_uring_open(ctx, i);
+            return;
+        }
+        copy_uring_check(uring_prep_statx(ctx->ring, AT_FDCWD, file->dest, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT,
+                                          STATX_BASIC_STATS, &slot->stx, COPY_URING_DATA(i, COPY_URING_STAT_DEST)));
+        slot->pending = 1;
+        return;
+    }
+}
+
+/**
+ * Advance a file's state machine with one completion
+ * @param ctx batch
+ * @param i slot
+ * @param op completed operation
+ * @param res result of the operation (negative errno on failure)
+ */
+static void copy_uring_complete(struct CopyUring *ctx, size_t i, int op, int res) {
+    struct CopyUringSlot *slot = &ctx->slots[i];
+    struct CopyUringFile *file = slot->file;
+    struct stat dest_st;
+
+    slot->pending--;
+    if (res < 0 && !slot->err && !(op == COPY_URING_STAT_DEST && res == -ENOENT)
+            && !(op == COPY_URING_OPEN_OUT && res == -EEXIST && slot->attempts < COPY_URING_RETRIES)) {
+        slot->err = -res;
+    }
+
+    switch (op) {
+        case COPY_URING_STAT_DEST:
+            if (res == -ENOENT) {
+                copy_uring_open(ctx, i);
+                return;
+            }
+            if (res < 0) {
+                break;
+            }
+            copy_statx_stat(&slot->stx, &dest_st);
+            if (S_ISDIR(dest_st.st_mode)) {
+                fprintf(stderr, "copy: %s: refusing to replace directory\n", file->dest);
+                slot->err = EISDIR;
+                slot->quiet = 1;
+                break;
+            }
+            if (copy_is_current(&file->st, &dest_st, ctx->mode)) {
+                copy_uring_done(ctx, i, 1);
+                return;
+            }
+            copy_uring_open(ctx, i);
+            return;
+
+        case COPY_URING_OPEN_IN:
+            if (res >= 0) {
+                slot->fd_in = res;
+            }
+            break;
+
+        case COPY_URING_OPEN_OUT:
+            if (res == -EEXIST && !slot->err && slot->attempts++ < COPY_URING_RETRIES) {
+                if (copy_uring_tmpname(file->dest, slot->tmp) < 0) {
+                    slot->err = errno;
+                    break;
+                }
+                copy_uring_check(uring_prep_openat(ctx->ring, AT_FDCWD, slot->tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+                                                   file->st.st_mode & 0777, COPY_URING_DATA(i, COPY_URING_OPEN_OUT)));
+                slot->pending++;
+                return;
+            }
+            if (res >= 0) {
+                slot->fd_out = res;
+                slot->created = 1;
+            }
+            break;
+
+        case COPY_URING_READ:
+            if (res < 0) {
+                break;
+            }
+            slot->len = (unsigned) res;
+            slot->written = 0;
+            if (res == 0) {
+                copy_uring_finish(ctx, i);
+            } else {
+                copy_uring_write(ctx, i);
+            }
+            return;
+
+        case COPY_URING_WRITE:
+            if (res < 0) {
+                break;
+            }
+            if (res == 0) {
+                slot->err = EIO;
+                break;
+            }
+            slot->written += (unsigned) res;
+            if (slot->written < slot->len) {
+                copy_uring_write(ctx, i);
+                return;
+            }
+            slot->offset += slot->len;
+            // A short read means the end of the file was reached
+            if (slot->len < COPY_URING_CHUNK) {
+                copy_uring_finish(ctx, i);
+            } else {
+                copy_uring_read(ctx, i);
+            }
+            return;
+
+        case COPY_URING_CLOSE_IN:
+        case COPY_URING_CLOSE_OUT:
+            break;
+
+        case COPY_URING_RENAME:
+            if (res == 0) {
+                copy_uring_done(ctx, i, 0);
+                return;
+            }
+            break;
+    }
+
+    // Opens and closes come in pairs. Wait for the other half.
+    if (slot->pending > 0) {
+        return;
+    }
+    if (slot->err) {
+        copy_uring_fail(ctx, i);
+        return;
+    }
+    if (op == COPY_URING_OPEN_IN || op == COPY_URING_OPEN_OUT) {
+        if (file->st.st_size == 0) {
+            copy_uring_finish(ctx, i);
+        } else {
+            copy_uring_read(ctx, i);
+        }
+    } else if (op == COPY_URING_CLOSE_IN || op == COPY_URING_CLOSE_OUT) {
+        copy_uring_check(uring_prep_renameat(ctx->ring, AT_FDCWD, slot->tmp, AT_FDCWD, file->dest,
+                                             COPY_URING_DATA(i, COPY_URING_RENAME)));
+        slot->pending++;
+    }
+}
+
+/**
+ * Decide whether a file can go through copy_uring_files()
+ *
+ * Larger files keep the synchronous path, where reflinks and copy_file_range()
+ * avoid moving the data through user space. Store links and checksums need
+ * the whole file hashed first.
+ *
+ * @param st source metadata
+ * @return non-zero when eligible
+ */
+static int copy_uring_eligible(struct stat *st) {
+    return S_ISREG(st->st_mode) && st->st_size <= COPY_URING_SMALL && !copy_store[0] && !copy_checksum;
+}
+
+/**
+ * Copy a batch of small regular files
+ * @param files files to copy
+ * @param count number of files
+ * @param mode COPY_NORMAL or COPY_UPDATE
+ * @param manifest manifest of the destination home (may be NULL)
+ * @param stats totals, added to (may be NULL)
+ * @return 0=success, -1=one or more errors occurred (errno set)
+ */
+static int copy_uring_files(struct CopyUringFile *files, size_t count, int mode, struct Manifest *manifest, struct CopyStats *stats) {
+    struct CopyUring ctx;
+    size_t slots;
+
+    memset(&ctx, 0, sizeof(ctx));
+    if (count == 0) {
+        return 0;
+    }
+
+    ctx.ring = copy_ring();
+    if (ctx.ring == NULL) {
+        for (size_t i = 0; i < count; i++) {
+            int result = copy_leaf(files[i].source, files[i].dest, &files[i].st, mode, manifest);
+            if (result < 0) {
+                ctx.err = errno;
+                ctx.status = -1;
+            }
+            if (stats == NULL) {
+                continue;
+            }
+            if (result < 0) {
+                stats->errors++;
+            } else if (result > 0) {
+                stats->skipped++;
+            } else {
+                stats->files++;
+                stats->bytes += (uint64_t) files[i].st.st_size;
+            }
+        }
+        errno = ctx.err;
+        return ctx.status;
+    }
+
+    slots = uring_entries(ctx.ring) / 2;
+    if (slots == 0) {
+        slots = 1;
+    }
+    if (slots > count) {
+        slots = count;
+    }
+    ctx.slots = calloc(slots, sizeof(*ctx.slots));
+    if (ctx.slots == NULL) {
+        perror("copy");
+        exit(1);
+    }
+    for (size_t i = 0; i < slots; i++) {
+        ctx.slots[i].buf = malloc(COPY_URING_CHUNK);
+        if (ctx.slots[i].buf == NULL) {
+            perror("copy");
+            exit(1);
+        }
+    }
+    ctx.files = files;
+    ctx.count = count;
+    ctx.mode = mode;
+    ctx.manifest = manifest;
+    ctx.stats = stats;
+
+    for (size_t i = 0; i < slots; i++) {
+        copy_uring_assign(&ctx, i);
+    }
+    while (ctx.active) {
+        uint64_t data;
+        int res;
+
+        copy_uring_check(uring_wait(ctx.ring, &data, &res));
+        copy_uring_complete(&ctx, (size_t) (data & 0xffffffff), (int) (data >> 32), res);
+    }
+
+    for (size_t i = 0; i < slots; i++) {
+        free(ctx.slots[i].buf);
+    }
+    free(ctx.slots);
+    errno = ctx.err;
+    return ctx.status;
+}
+
+/**
+ * Copy the entries of one directory with the uring backend
+ *
+ * Entries are stat'ed in one batch. Small regular files are copied together
+ * through copy_uring_files(), everything else takes the usual path.
+ *
+ * @param d open source directory
+ * @param source path to directory
+ * @param dest path to directory (already created)
+ * @param created non-zero when dest was created by this copy (it is empty)
+ * @param mode COPY_NORMAL or COPY_UPDATE
+ * @param pool worker pool (may be NULL)
+ * @param id calling worker
+ * @param task directory being scanned (NULL without a pool)
+ * @return 0=success, -1=one or more errors occurred (errno set)
+ */
+static int copy_scan_batch(DIR *d, const char *source, const char *dest, int created, int mode, struct CopyPool *pool, size_t id, struct CopyTask *task) {
+    struct CopyUringFile *files;
+    struct dirent *rec;
+    struct stat *st;
+    char **names;
+    size_t count;
+    size_t alloc;
+    size_t nfiles;
+    int *errs;
+    int status;
+    int err;
+
+    names = NULL;
+    count = 0;
+    alloc = 0;
+    while ((rec = readdir(d)) != NULL) {
+        if (strcmp(rec->d_name, ".") == 0 || strcmp(rec->d_name, "..") == 0) {
+            continue;
+        }
+        if (count == alloc) {
+            char **tmp;
+            alloc = alloc ? alloc * 2 : 64;
+            tmp = realloc(names, alloc * sizeof(*tmp));
+            if (tmp == NULL) {
+                perror("copy");
+                exit(1);
+            }
+            names = tmp;
+        }
+        names[count] = strdup(rec->d_name);
+        if (names[count] == NULL) {
+            perror("copy");
+            exit(1);
+        }
+        count++;
+    }
+
+    st = calloc(count + 1, sizeof(*st));
+    errs = calloc(count + 1, sizeof(*errs));
+    files = calloc(count + 1, sizeof(*files));
+    if (st == NULL || errs == NULL || files == NULL) {
+        perror("copy");
+        exit(1);
+    }
+    if (copy_uring_stat(dirfd(d), names, count, st, errs) < 0) {
+        for (size_t i = 0; i < count; i++) {
+            errs[i] = fstatat(dirfd(d), names[i], &st[i], AT_SYMLINK_NOFOLLOW) < 0 ? errno : 0;
+        }
+    }
+
+    status = 0;
+    err = 0;
+    nfiles = 0;
+    for (size_t i = 0; i < count; i++) {
+        char src_path[PATH_MAX];
+        char dest_path[PATH_MAX];
+
+        snprintf(src_path, sizeof(src_path), "%s/%s", source, names[i]);
+        snprintf(dest_path, sizeof(dest_path), "%s/%s", dest, names[i]);
+
+        if (errs[i]) {
+            fprintf(stderr, "copy: %s: %s\n", src_path, strerror(errs[i]));
+            err = errs[i];
+            status = -1;
+            continue;
+        }
+        if (copy_exclude_entry(src_path, st[i].st_mode)) {
+            continue;
+        }
+
+        if (copy_uring_eligible(&st[i])) {
+            files[nfiles].source = strdup(src_path);
+            files[nfiles].dest = strdup(dest_path);
+            if (files[nfiles].source == NULL || files[nfiles].dest == NULL) {
+                perror("copy");
+                exit(1);
+            }
+            files[nfiles].st = st[i];
+            files[nfiles].fresh = created;
+            nfiles++;
+            continue;
+        }
+
+        if (copy_child(src_path, dest_path, &st[i], mode, pool, id, task) < 0) {
+            err = errno;
+            status = -1;
+        }
+    }
+
+    if (copy_uring_files(files, nfiles, mode, copy_manifest, NULL) < 0) {
+        err = errno;
+        status = -1;
+    }
+
+    for (size_t i = 0; i < nfiles; i++) {
+        free(files[i].source);
+        free(files[i].dest);
+    }
+    for (size_t i = 0; i < count; i++) {
+        free(names[i]);
+    }
+    free(files);
+    free(names);
+    free(errs);
+    free(st);
+
+    errno = err;
+    return status;
+}
+#endif
+
+/**
+ * Copy files natively (rsync -a[u] semantics)
+ *
+ * A trailing slash on a directory source copies its contents into dest. Without the
+ * trailing slash the directory itself is created inside dest.
+ *
+ * @param source file or directory
+ * @param dest file or directory
+ * @param mode COPY_NORMAL or COPY_UPDATE
+ * @return 0=success, -1=error (errno set)
+ */
+static int copy_native(char *source, char *dest, int mode) {
+    struct stat st;
+    struct stat dest_st;
+    char target[PATH_MAX];
+    char *tmp;
+    size_t len;
+
+    if (lstat(source, &st) < 0) {
+        fprintf(stderr, "copy: %s: %s\n", source, strerror(errno));
+        return -1;
+    }
+
+    len = strlen(source);
+    strcpy(target, dest);
+    if (S_ISDIR(st.st_mode)) {
+        if (len > 0 && source[len - 1] != '/') {
+            if (mkdirs(dest) < 0) {
+                return -1;
+            }
+            tmp = strdup(source);
+            snprintf(target, sizeof(target), "%s/%s", dest, basename(tmp));
+            free(tmp);
+        }
+    } else if ((*dest && dest[strlen(dest) - 1] == '/')
+               || (stat(dest, &dest_st) == 0 && S_ISDIR(dest_st.st_mode))) {
+        tmp = strdup(source);
+        snprintf(target, sizeof(target), "%s/%s", dest, basename(tmp));
+        free(tmp);
+    }
+
+    if (S_ISDIR(st.st_mode) && copy_dir_unchanged(target, &st)) {
+        return 0;
+    }
+    if (S_ISDIR(st.st_mode) && copy_jobs > 1) {
+        return copy_tree_parallel(source, target, &st, mode);
+    }
+    return copy_entry(source, target, &st, mode);
+}
+
+/**
+ * Append one entry to a source listing
+ */
+static void copy_list_push(struct CopyList *list, const char *path, struct stat *st) {
+    if (list->count == list->alloc) {
+        struct CopyListEntry *tmp;
+        size_t alloc = list->alloc ? list->alloc * 2 : 64;
+        tmp = realloc(list->entries, alloc * sizeof(*tmp));
+        if (tmp == NULL) {
+            perror("copy list");
+            exit(1);
+        }
+        list->entries = tmp;
+        list->alloc = alloc;
+    }
+    list->entries[list->count].path = strdup(path);
+    if (list->entries[list->count].path == NULL) {
+        perror("copy list");
+        exit(1);
+    }
+    list->entries[list->count].st = *st;
+    list->count++;
+}
+
+/**
+ * Record the contents of a directory (parents are listed before their children)
+ */
+static int copy_list_walk(struct CopyList *list, const char *rel) {
+    char path[PATH_MAX];
+    struct dirent *rec;
+    DIR *d;
+    int status;
+
+    snprintf(path, sizeof(path), "%s%s%s", list->source, *rel ? "/" : "", rel);
+    d = opendir(path);
+    if (d == NULL) {
+        fprintf(stderr, "copy: %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    status = 0;
+    while ((rec = readdir(d)) != NULL) {
+        char child[PATH_MAX];
+        char child_path[PATH_MAX];
+        struct stat st;
+
+        if (strcmp(rec->d_name, ".") == 0 || strcmp(rec->d_name, "..") == 0) {
+            continue;
+        }
+        snprintf(child, sizeof(child), "%s%s%s", rel, *rel ? "/" : "", rec->d_name);
+        snprintf(child_path, sizeof(child_path), "%s/%s", list->source, child);
+        if (lstat(child_path, &st) < 0) {
+            fprintf(stderr, "copy: %s: %s\n", child_path, strerror(errno));
+            status = -1;
+            continue;
+        }
+        if (copy_exclude_entry(child_path, st.st_mode)) {
+            continue;
+        }
+        copy_list_push(list, child, &st);
+        if (S_ISDIR(st.st_mode) && copy_list_walk(list, child) < 0) {
+            status = -1;
+        }
+    }
+    closedir(d);
+    return status;
+}
+
+/**
+ * Read a source tree once so it can be copied to many destinations
+ *
+ * The source follows the same rules as copy(): a directory with a trailing slash
+ * contributes only its contents.
+ *
+ * @param list output (release with copy_list_free())
+ * @param source file or directory
+ * @return 0=success, -1=error (entries that could not be read are left out)
+ */
+int copy_list_scan(struct CopyList *list, const char *source) {
+    struct stat st;
+    size_t len;
+
+    memset(list, 0, sizeof(*list));
+    list->source = strdup(source);
+    if (list->source == NULL) {
+        perror("copy list");
+        exit(1);
+    }
+    len = strlen(list->source);
+    while (len > 1 && list->source[len - 1] == '/') {
+        list->source[--len] = '\0';
+        list->contents = 1;
+    }
+
+    if (lstat(list->source, &st) < 0) {
+        fprintf(stderr, "copy: %s: %s\n", source, strerror(errno));
+        return -1;
+    }
+    copy_list_push(list, "", &st);
+    if (S_ISDIR(st.st_mode)) {
+        return copy_list_walk(list, "");
+    }
+    return 0;
+}
+
+/**
+ * Copy a scanned source tree to dest (see copy_list_apply())
+ */
+static int copy_list_apply_run(struct CopyList *list, const char *dest, int mode, struct Manifest *manifest, struct CopyStats *stats) {
+#ifdef COPY_URING
+    struct CopyUringFile *files;
+    size_t nfiles;
+    int fresh;
+#endif
+    struct CopyStats local;
+    int created;
+    struct stat dest_st;
+    char target[PATH_MAX];
+    char *tmp;
+    int status;
+    int err;
+
+    if (list->count == 0) {
+        errno = ENOENT;
+        return -1;
+    }
+    memset(&local, 0, sizeof(local));
+
+    // Same placement rules as copy_native()
+    snprintf(target, sizeof(target), "%s", dest);
+    if (S_ISDIR(list->entries[0].st.st_mode)) {
+        if (!list->contents) {
+            if (mkdirs((char *) dest) < 0) {
+                return -1;
+            }
+            tmp = strdup(list->source);
+            snprintf(target, sizeof(target), "%s/%s", dest, basename(tmp));
+            free(tmp);
+        }
+    } else if ((*dest && dest[strlen(dest) - 1] == '/')
+               || (stat(dest, &dest_st) == 0 && S_ISDIR(dest_st.st_mode))) {
+        tmp = strdup(list->source);
+        snprintf(target, sizeof(target), "%s/%s", dest, basename(tmp));
+        free(tmp);
+    }
+
+#ifdef COPY_URING
+    // Small files are collected and copied in one batch once the directories exist.
+    // Nothing can be in the way below a target directory this call created.
+    files = NULL;
+    nfiles = 0;
+    fresh = 0;
+    if (copy_backend == COPY_BACKEND_URING) {
+        files = calloc(list->count, sizeof(*files));
+        if (files == NULL) {
+            perror("copy");
+            exit(1);
+        }
+    }
+#endif
+
+    status = 0;
+    err = 0;
+    for (size_t i = 0; i < list->count; i++) {
+        struct CopyListEntry *entry = &list->entries[i];
+        char src_path[PATH_MAX];
+        char dest_path[PATH_MAX];
+        int result;
+
+        snprintf(src_path, sizeof(src_path), "%s%s%s", list->source, *entry->path ? "/" : "", entry->path);
+        snprintf(dest_path, sizeof(dest_path), "%s%s%s", target, *entry->path ? "/" : "", entry->path);
+
+        if (S_ISDIR(entry->st.st_mode)) {
+            created = copy_mkdir(dest_path);
+            if (created < 0) {
+                fprintf(stderr, "copy: %s: %s\n", dest_path, strerror(errno));
+                COPY_STAT_ADD(errors, 1);
+                local.errors++;
+                err = errno;
+                status = -1;
+                continue;
+            }
+#ifdef COPY_URING
+            if (i == 0) {
+                fresh = created;
+            }
+#endif
+            COPY_STAT_ADD(dirs, 1);
+            local.dirs++;
+            continue;
+        }
+
+#ifdef COPY_URING
+        if (files != NULL && copy_uring_eligible(&entry->st)) {
+            files[nfiles].source = strdup(src_path);
+            files[nfiles].dest = strdup(dest_path);
+            if (files[nfiles].source == NULL || files[nfiles].dest == NULL) {
+                perror("copy");
+                exit(1);
+            }
+            files[nfiles].st = entry->st;
+            files[nfiles].fresh = fresh;
+            nfiles++;
+            continue;
+        }
+#endif
+
+        result = copy_leaf(src_path, dest_path, &entry->st, mode, manifest);
+        if (result < 0) {
+            local.errors++;
+            err = errno;
+            status = -1;
+        } else if (result > 0) {
+            local.skipped++;
+        } else if (S_ISLNK(entry->st.st_mode)) {
+            local.links++;
+        } else {
+            local.files++;
+            local.bytes += S_ISREG(entry->st.st_mode) ? (uint64_t) entry->st.st_size : 0;
+        }
+    }
+
+#ifdef COPY_URING
+    // Every destination directory exists by now
+    if (files != NULL) {
+        if (copy_uring_files(files, nfiles, mode, manifest, &local) < 0) {
+            err = errno;
+            status = -1;
+        }
+        for (size_t i = 0; i < nfiles; i++) {
+            free(files[i].source);
+            free(files[i].dest);
+        }
+        free(files);
+    }
+#endif
+
+    // Directory attributes are applied last, deepest first, so the mtimes survive
+    for (size_t i = list->count; i > 0; i--) {
+        struct CopyListEntry *entry = &list->entries[i - 1];
+        char dest_path[PATH_MAX];
+
+        if (!S_ISDIR(entry->st.st_mode)) {
+            continue;
+        }
+        snprintf(dest_path, sizeof(dest_path), "%s%s%s", target, *entry->path ? "/" : "", entry->path);
+        if (copy_attrs(dest_path, &entry->st) < 0) {
+            if (errno != ENOENT) {
+                fprintf(stderr, "copy: %s: %s\n", dest_path, strerror(errno));
+                err = errno;
+                status = -1;
+            }
+        } else if (manifest) {
+            manifest_update(manifest, dest_path, &entry->st, 0);
+        }
+    }
+
+    if (stats) {
+        stats->files += local.files;
+        stats->dirs += local.dirs;
+        stats->links += local.links;
+        stats->bytes += local.bytes;
+        stats->skipped += local.skipped;
+        stats->errors += local.errors;
+    }
+    errno = err;
+    return status;
+}
+
+/**
+ * Copy a scanned source tree to dest
+ *
+ * Only the destination is examined. The listing is never modified, so several
+ * threads may apply the same listing to different destinations at once.
+ *
+ * @param list listing from copy_list_scan()
+ * @param dest file or directory
+ * @param mode COPY_NORMAL or COPY_UPDATE
+ * @param manifest manifest of the destination home (may be NULL)
+ * @param stats per-destination totals, added to (may be NULL)
+ * @return 0=success, -1=one or more errors occurred (errno set)
+ */
+int copy_list_apply(struct CopyList *list, const char *dest, int mode, struct Manifest *manifest, struct CopyStats *stats) {
+    int status;
+    int prio;
+
+    prio = copy_idle_begin();
+    status = copy_list_apply_run(list, dest, mode, manifest, stats);
+    copy_idle_end(prio);
+    return status;
+}
+
+/**
+ * Release a source listing
+ * @param list listing from copy_list_scan()
+ */
+void copy_list_free(struct CopyList *list) {
+    for (size_t i = 0; i < list->count; i++) {
+        free(list->entries[i].path);
+    }
+    free(list->entries);
+    free(list->source);
+    memset(list, 0, sizeof(*list));
+}
+
+#ifdef MULTIHOME_RSYNC_BIN
+/**
+ * Copy files using rsync
+ * @param source file or directory
+ * @param dest file or directory
+ * @param mode 0=direct copy, 1=update only
+ * @return rsync exit code
+ */
+static int copy_rsync(char *source, char *dest, int mode) {
+    char args[255];
+    char top[PATH_MAX];
+    char **argv;
+    char *rel;
+    size_t argc;
+    size_t len;
+    int status;
+
+    memset(args, '\0', sizeof(args));
+    strcat(args, RSYNC_ARGS);
+    if (mode == COPY_UPDATE) {
+        strcat(args, "u");
+    }
+
+    argv = calloc(copy_excludes_count + 6, sizeof(*argv));
+    if (argv == NULL) {
+        perror("rsync");
+        exit(1);
+    }
+    argc = 0;
+    argv[argc++] = MULTIHOME_RSYNC_BIN;
+    argv[argc++] = args;
+
+    // rsync paces its own data (in KiB per second). Operations are not limited.
+    if (copy_bucket_bytes.rate > 0) {
+        argv[argc] = malloc(32);
+        if (argv[argc] == NULL) {
+            perror("rsync");
+            exit(1);
+        }
+        snprintf(argv[argc++], 32, "--bwlimit=%llu", (unsigned long long) (copy_bucket_bytes.rate / 1024 > 1 ? copy_bucket_bytes.rate / 1024 : 1));
+    }
+
+    // rsync anchors patterns at the top of the transfer: the source itself with a
+    // trailing slash, otherwise its parent. Anchored patterns are rewritten relative
+    // to it, and dropped when they point somewhere else.
+    snprintf(top, sizeof(top), "%s", source);
+    len = strlen(top);
+    if (len > 1 && top[len - 1] == '/') {
+        while (len > 1 && top[len - 1] == '/') {
+            top[--len] = '\0';
+        }
+    } else if ((rel = strrchr(top, '/')) != NULL) {
+        *rel = '\0';
+    }
+    len = strlen(copy_exclude_root);
+    rel = NULL;
+    if (len && strncmp(top, copy_exclude_root, len) == 0 && (top[len] == '\0' || top[len] == '/')) {
+        rel = top + len + (top[len] == '/');
+    }
+
+    for (size_t i = 0; i < copy_excludes_count; i++) {
+        struct CopyExclude *ex = &copy_excludes[i];
+        const char *pattern = ex->pattern;
+        size_t size;
+
+        if (ex->anchored) {
+            size_t rel_len;
+            if (rel == NULL) {
+                continue;
+            }
+            rel_len = strlen(rel);
+            if (rel_len && (strncmp(pattern, rel, rel_len) != 0 || pattern[rel_len] != '/')) {
+                continue;
+            }
+            pattern += rel_len + (rel_len != 0);
+        }
+        size = strlen(pattern) + 16;
+        argv[argc] = malloc(size);
+        if (argv[argc] == NULL) {
+            perror("rsync");
+            exit(1);
+        }
+        snprintf(argv[argc++], size, "--exclude=%s%s%s", ex->anchored ? "/" : "", pattern, ex->dir_only ? "/" : "");
+    }
+    argv[argc++] = source;
+    argv[argc++] = dest;
+
+    status = shell(argv);
+    for (size_t i = 2; i < argc - 2; i++) {
+        free(argv[i]);
+    }
+    free(argv);
+    return status;
+}
+#endif
+
+/**
+ * Copy files using the active backend
+ * @param source file or directory
+ * @param dest file or directory
+ * @param mode 0=direct copy, 1=update only
+ * @return 0=success, non-zero=error
+ */
+int copy(char *source, char *dest, int mode) {
+    int status;
+    int prio;
+
+    if (source == NULL || dest == NULL) {
+        fprintf(stderr, "copy failed. source and destination may not be NULL\n");
+        exit(1);
+    }
+
+    prio = copy_idle_begin();
+#ifdef MULTIHOME_RSYNC_BIN
+    if (copy_backend == COPY_BACKEND_RSYNC) {
+        status = copy_rsync(source, dest, mode);
+        copy_idle_end(prio);
+        return status;
+    }
+#endif
+    status = copy_native(source, dest, mode);
+    copy_idle_end(prio);
+    return status;
+}
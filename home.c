@@ -0,0 +1,1415 @@
+#include "multihome.h"
+#include <glob.h>
+#include <poll.h>
+
+/**
+ * Home directory resolution and initialization
+ *
+ * Everything here works on an explicit struct Multihome, so one process may hold
+ * contexts for several accounts (see pam/pam_multihome.c). The copy engine settings
+ * (backend, jobs, manifest, store) are still per process.
+ */
+
+/**
+ * Set up a context for an account
+ * @param mh context
+ * @param path_old original home directory of the account
+ * @return 0=success, -1=path too long (errno set)
+ */
+int multihome_init(struct Multihome *mh, const char *path_old) {
+    memset(mh, 0, sizeof(*mh));
+    if (strlen(path_old) + strlen(MULTIHOME_CFGDIR) + NAME_MAX + 3 >= PATH_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(mh->path_old, path_old);
+    strcpy(mh->path_root, MULTIHOME_ROOT);
+    strcpy(mh->scripts_dir, MULTIHOME_SCRIPTS_DIR);
+    sprintf(mh->config_dir, "%s/%s", mh->path_old, MULTIHOME_CFGDIR);
+    sprintf(mh->config_transfer, "%s/%s", mh->config_dir, MULTIHOME_CFG_TRANSFER);
+    sprintf(mh->config_skeleton, "%s/%s", mh->config_dir, MULTIHOME_CFG_SKEL);
+    sprintf(mh->config_host_group, "%s/%s", mh->config_dir, MULTIHOME_CFG_HOST_GROUP);
+    sprintf(mh->config_snapshot, "%s/%s", mh->config_dir, MULTIHOME_CFG_SNAPSHOT);
+    sprintf(mh->config_objects, "%s/%s", mh->config_dir, MULTIHOME_CFG_OBJECTS);
+    sprintf(mh->config_storage, "%s/%s", mh->config_dir, MULTIHOME_CFG_STORAGE);
+    return 0;
+}
+
+/**
+ * Create the configuration directory and blank configuration files
+ * @param mh context
+ * @return 0=success, -1=error (errno set)
+ */
+int multihome_config(struct Multihome *mh) {
+    // Generate configuration directory
+    if (access(mh->config_dir, F_OK) < 0) {
+        fprintf(stderr, "Creating configuration directory: %s\n", mh->config_dir);
+        if (mkdirs(mh->config_dir) < 0) {
+            perror(mh->config_dir);
+            return -1;
+        }
+    }
+
+    // Generate a blank host group configuration
+    if (access(mh->config_host_group, F_OK) < 0) {
+        fprintf(stderr, "Creating host group configuration: %s\n", mh->config_host_group);
+        if (touch(mh->config_host_group) < 0) {
+            perror(mh->config_host_group);
+            return -1;
+        }
+    }
+
+    // Generate directory for user-defined account defaults
+    // Files placed here will be copied to the new home directory.
+    if (access(mh->config_skeleton, F_OK) < 0) {
+        fprintf(stderr, "Creating user skel directory: %s\n", mh->config_skeleton);
+        if (mkdirs(mh->config_skeleton) < 0) {
+            perror(mh->config_skeleton);
+            return -1;
+        }
+    }
+
+    // Generate a blank transfer configuration
+    if (access(mh->config_transfer, F_OK) < 0) {
+        fprintf(stderr, "Creating transfer configuration: %s\n", mh->config_transfer);
+        if (touch(mh->config_transfer) < 0) {
+            perror(mh->config_transfer);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Parse host_group, transfer and storage configuration (or reuse the compiled snapshot)
+ * @param mh context
+ * @return 0=success, -1=error
+ */
+int multihome_load(struct Multihome *mh) {
+    if (snapshot_load(&mh->snapshot, mh->config_snapshot, mh->config_host_group, mh->config_transfer) < 0) {
+        return -1;
+    }
+    // Without its rules every home simply stays in home_local
+    if (storage_load(&mh->storage, mh->config_storage) < 0) {
+        fprintf(stderr, "Unable to read %s: %s\n", mh->config_storage, strerror(errno));
+    }
+    if (trace_enabled()) {
+        char rules[32];
+        snprintf(rules, sizeof(rules), "%u", mh->snapshot.header->rule_count);
+        trace_note("host_group_rules", rules);
+    }
+    return 0;
+}
+
+/**
+ * Point a context at a home directory
+ * @param mh context
+ * @param home home directory
+ */
+static void multihome_set_home(struct Multihome *mh, const char *home) {
+    snprintf(mh->path_new, sizeof(mh->path_new), "%s", home);
+    snprintf(mh->path_topdir, sizeof(mh->path_topdir), "%s/%s", mh->path_new, MULTIHOME_TOPDIR);
+    snprintf(mh->marker, sizeof(mh->marker), "%s/%s", mh->path_new, MULTIHOME_MARKER);
+    snprintf(mh->manifest, sizeof(mh->manifest), "%s/%s", mh->path_new, MULTIHOME_MANIFEST);
+}
+
+/**
+ * Determine the home directory of a host
+ *
+ * Homes named in the storage configuration resolve to node-local storage. Call
+ * multihome_storage() before using such a home on this node.
+ *
+ * @param mh context (loaded, see multihome_load())
+ * @param nodename short hostname
+ * @return 1=mapped by a host_group rule, 0=home named after the host
+ */
+int multihome_resolve(struct Multihome *mh, const char *nodename) {
+    const char *name;
+    const char *root;
+
+    name = multihome_map(mh, nodename);
+    snprintf(mh->path_durable, sizeof(mh->path_durable), "%s/%s/%s", mh->path_old, mh->path_root, name);
+    root = storage_match(&mh->storage, name);
+    if (root != NULL) {
+        char pwbuf[STORAGE_PWBUF];
+        char home[PATH_MAX];
+        struct passwd pw;
+        struct passwd *result;
+
+        // Shared storage is divided by account
+        if (getpwuid_r(geteuid(), &pw, pwbuf, sizeof(pwbuf), &result) == 0 && result != NULL) {
+            snprintf(home, sizeof(home), "%s/%s/%s", root, pw.pw_name, name);
+        } else {
+            snprintf(home, sizeof(home), "%s/%u/%s", root, (unsigned) geteuid(), name);
+        }
+        multihome_set_home(mh, home);
+    } else {
+        multihome_set_home(mh, mh->path_durable);
+    }
+    return name != nodename;
+}
+
+/**
+ * Make sure a node-local home directory can be used on this node
+ *
+ * When the storage directory is missing (e.g. not mounted here) or the user's
+ * directory in it is unsafe (see storage_prepare()), the context falls back to
+ * the durable copy in home_local.
+ *
+ * @param mh context (resolved, see multihome_resolve())
+ * @return 1=node-local home, 0=home in home_local, -1=node-local storage is
+ *     unavailable and the context fell back to home_local
+ */
+int multihome_storage(struct Multihome *mh) {
+    char scratch[PATH_MAX];
+    char dir[PATH_MAX];
+
+    if (strcmp(mh->path_new, mh->path_durable) == 0) {
+        return 0;
+    }
+    strcpy(scratch, mh->path_new);
+    strcpy(dir, dirname(scratch));
+    if (storage_prepare(dir) < 0) {
+        fprintf(stderr, "Node-local storage is unavailable: %s: %s (using %s)\n", dir, strerror(errno), mh->path_durable);
+        multihome_set_home(mh, mh->path_durable);
+        return -1;
+    }
+    return 1;
+}
+
+/**
+ * Release resources held by a context
+ * @param mh context
+ */
+void multihome_free(struct Multihome *mh) {
+    snapshot_free(&mh->snapshot);
+    storage_free(&mh->storage);
+}
+
+/**
+ * Map a hostname through the host_group configuration
+ *
+ * FORMAT:
+ *     # Comment
+ *     HOST_PATTERN = COMMON_HOME
+ *     HOST_PATTERN=COMMON_HOME  # Inline comment
+ *
+ * EXAMPLE:
+ * # To map all hosts starting with "example" to one home directory
+ *     example.* = example
+ * # To map only hosts example1 and example2 to home directory "special_boxes"
+ *     example[1-2]+ = special_boxes
+ * # Then map the remaining hosts to the "example" home directory
+ *     example.* = example
+ *
+ * @param mh context
+ * @param hostname short hostname
+ * @return name of the home directory (hostname itself when no rule matches)
+ */
+const char *multihome_map(struct Multihome *mh, const char *hostname) {
+    ssize_t rule;
+
+    rule = snapshot_match(&mh->snapshot, hostname);
+    if (rule < 0) {
+        return hostname;
+    }
+    return snapshot_string(&mh->snapshot, mh->snapshot.rules[rule].home);
+}
+
+/**
+ * Expand the WHERE field of a transfer record into source paths
+ *
+ * WHERE is taken literally unless it contains a glob(3) wildcard, in which case
+ * every match below the original home directory is a source (none is not an
+ * error). As in the shell, wildcards do not match a leading '.', and a trailing
+ * slash is kept on directory matches. Sources left out by an X entry are dropped.
+ *
+ * @param mh context
+ * @param record L, H or T record
+ * @param count output: number of sources
+ * @return NULL terminated array of paths (release with free_array())
+ */
+char **user_transfer_sources(struct Multihome *mh, struct SnapshotTransfer *record, size_t *count) {
+    const char *field_where;
+    char pattern[PATH_MAX * 2];
+    char **result;
+    glob_t g;
+    size_t len;
+
+    field_where = snapshot_string(&mh->snapshot, record->where);
+    *count = 0;
+    if (strpbrk(field_where, "*?[") == NULL) {
+        struct stat st;
+        result = calloc(2, sizeof(*result));
+        if (result == NULL || (result[0] = malloc(PATH_MAX)) == NULL) {
+            perror("transfer");
+            exit(1);
+        }
+        snprintf(result[0], PATH_MAX, "%s/%s", mh->path_old, field_where);
+        if (lstat(result[0], &st) == 0 && copy_excluded(result[0], st.st_mode)) {
+            free(result[0]);
+            result[0] = NULL;
+            return result;
+        }
+        *count = 1;
+        return result;
+    }
+
+    // The home directory is not part of the pattern
+    len = 0;
+    for (const char *p = mh->path_old; *p && len < sizeof(pattern) - 3; p++) {
+        if (strchr("*?[\\", *p) != NULL) {
+            pattern[len++] = '\\';
+        }
+        pattern[len++] = *p;
+    }
+    snprintf(pattern + len, sizeof(pattern) - len, "/%s", field_where);
+
+    memset(&g, 0, sizeof(g));
+    if (glob(pattern, 0, NULL, &g) != 0) {
+        g.gl_pathc = 0;
+    }
+    result = calloc(g.gl_pathc + 1, sizeof(*result));
+    if (result == NULL) {
+        perror("transfer");
+        exit(1);
+    }
+    for (size_t i = 0; i < g.gl_pathc; i++) {
+        struct stat st;
+        if (lstat(g.gl_pathv[i], &st) == 0 && copy_excluded(g.gl_pathv[i], st.st_mode)) {
+            continue;
+        }
+        result[*count] = strdup(g.gl_pathv[i]);
+        if (result[*count] == NULL) {
+            perror("transfer");
+            exit(1);
+        }
+        (*count)++;
+    }
+    globfree(&g);
+    return result;
+}
+
+/**
+ * Apply the X entries of the transfer configuration to the copy engine
+ *
+ * Patterns are relative to the original home directory. The skeletons are copied
+ * with exclusion lifted, so only the sources of T entries are pruned.
+ *
+ * @param mh context
+ * @param enable 0=lift the patterns again
+ */
+void user_transfer_exclude(struct Multihome *mh, int enable) {
+    const char **patterns;
+    size_t count;
+
+    if (!enable || mh->snapshot.header == NULL) {
+        copy_set_exclude(NULL, NULL, 0);
+        return;
+    }
+    patterns = calloc(mh->snapshot.header->transfer_count + 1, sizeof(*patterns));
+    if (patterns == NULL) {
+        perror("transfer");
+        exit(1);
+    }
+    count = 0;
+    for (size_t i = 0; i < mh->snapshot.header->transfer_count; i++) {
+        if (mh->snapshot.transfers[i].type == 'X') {
+            patterns[count++] = snapshot_string(&mh->snapshot, mh->snapshot.transfers[i].where);
+        }
+    }
+    copy_set_exclude(mh->path_old, patterns, count);
+    free(patterns);
+}
+
+/**
+ * Check whether a transfer record may finish after the login (see home_set_deadline())
+ * @param record transfer record
+ * @return 1=plain T entry, 0=needed before the login returns
+ */
+static int user_transfer_deferrable(const struct SnapshotTransfer *record) {
+    return record->type == 'T' && !(record->flags & SNAPSHOT_TRANSFER_REQUIRED);
+}
+
+/**
+ * Add one operation per source of each transfer record to a plan
+ * @param mh context
+ * @param plan plan of the destination home directory
+ * @param select TRANSFER_ALL, TRANSFER_LOGIN or TRANSFER_DEFERRED
+ */
+static void user_transfer_plan(struct Multihome *mh, struct Plan *plan, int select) {
+    for (size_t i = 0; i < mh->snapshot.header->transfer_count; i++) {
+        struct SnapshotTransfer *record;
+        char **sources;
+        size_t count;
+
+        record = &mh->snapshot.transfers[i];
+        if (record->type == 'X') {
+            continue;
+        }
+        if (select != TRANSFER_ALL && (select == TRANSFER_DEFERRED) != user_transfer_deferrable(record)) {
+            continue;
+        }
+
+        sources = user_transfer_sources(mh, record, &count);
+        for (size_t j = 0; j < count; j++) {
+            char dest[PATH_MAX];
+            char *tmp;
+
+            // construct data destination path
+            tmp = strdup(sources[j]);
+            snprintf(dest, sizeof(dest), "%s/%s", plan->home, basename(tmp));
+            free(tmp);
+            plan_add(plan, record->type, sources[j], dest, snapshot_string(&mh->snapshot, record->where));
+        }
+        free_array((void **) sources, 0);
+    }
+}
+
+/**
+ * Link or copy files from /home/username to /home/username/home_local/nodename
+ *
+ * FORMAT:
+ *     TYPE WHERE
+ *
+ * TYPE:
+ *     L = SYMBOLIC LINK
+ *     H = HARD LINK
+ *     T = TRANSFER (file, directory, etc)
+ *     T! = REQUIRED TRANSFER (copied before the login returns)
+ *     X = EXCLUDE (never transferred)
+ *
+ * WHERE may contain glob(3) wildcards (see user_transfer_sources()). X entries
+ * hold fnmatch(3) patterns: without a '/' they match a name at any depth, with
+ * one they match the path relative to the home directory. A trailing '/' matches
+ * directories only. Excluded directories are never read.
+ *
+ * With a login deadline, TRANSFER_LOGIN leaves plain T entries to the background
+ * worker of home_resume(), which copies them with TRANSFER_DEFERRED.
+ *
+ * Entries run concurrently unless they write the same name (see plan_run()). An
+ * L or H entry replaces a file of the same name, but never a directory.
+ *
+ * EXAMPLE:
+ *     L .Xauthority
+ *     L .ssh
+ *     H token.asc
+ *     T special_dotfiles/
+ *     T! .config/
+ *     T data/
+ *     X .config/google-chrome/
+ *     X Cache/
+ *
+ * @param mh context
+ * @param home destination home directory
+ * @param copy_mode COPY_NORMAL or COPY_UPDATE
+ * @param select TRANSFER_ALL, TRANSFER_LOGIN or TRANSFER_DEFERRED
+ */
+void user_transfer(struct Multihome *mh, const char *home, int copy_mode, int select) {
+    struct Plan plan;
+
+    plan_init(&plan, home);
+    user_transfer_exclude(mh, 1);
+    user_transfer_plan(mh, &plan, select);
+    plan_run(&plan, copy_mode);
+    user_transfer_exclude(mh, 0);
+    plan_free(&plan);
+}
+
+/**
+ * Plan the population of a home directory: both skeletons, then the transfers
+ *
+ * X entries must be in effect (see user_transfer_exclude()).
+ *
+ * @param mh context
+ * @param plan plan of the destination home directory (see plan_init())
+ * @param select transfer records to apply (see user_transfer())
+ */
+void home_plan(struct Multihome *mh, struct Plan *plan, int select) {
+    plan_add(plan, '\0', OS_SKEL_DIR, plan->home, "skel_system");
+    plan_add(plan, '\0', mh->config_skeleton, plan->home, "skel_user");
+    user_transfer_plan(mh, plan, select);
+}
+
+/**
+ * Create a home directory and its link back to the original home directory
+ * @param mh context
+ * @param home path to home directory
+ * @return 0=success, -1=error (errno set)
+ */
+int home_prepare(struct Multihome *mh, const char *home) {
+    char topdir[PATH_MAX];
+    struct stat st;
+
+    if (strcmp(home, mh->path_old) != 0 && access(home, F_OK) < 0) {
+        fprintf(stderr, "Creating home directory: %s\n", home);
+        if (mkdirs((char *) home) < 0) {
+            perror(home);
+            return -1;
+        }
+    }
+
+    // Generate symbolic link within the new home directory pointing back to the real account home directory
+    snprintf(topdir, sizeof(topdir), "%s/%s", home, MULTIHOME_TOPDIR);
+    if (lstat(topdir, &st) != 0) {
+        fprintf(stderr, "Creating symlink to original home directory: %s\n", topdir);
+        if (symlink(mh->path_old, topdir) < 0) {
+            perror(topdir);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Copy account defaults and transfers into a home directory
+ *
+ * @param mh context
+ * @param home destination (may be a staging directory)
+ * @param home_final where home will live once published (manifest paths refer to it)
+ * @param copy_mode COPY_NORMAL or COPY_UPDATE
+ * @param checksum compare contents when source metadata changed
+ * @param skip_dirs skip directories whose mtime is unchanged
+ * @param select transfer records to apply (see user_transfer())
+ */
+void home_populate(struct Multihome *mh, const char *home, const char *home_final, int copy_mode, int checksum, int skip_dirs, int select) {
+    struct Manifest manifest;
+    struct Plan plan;
+    char path_manifest[PATH_MAX];
+    size_t phase;
+
+    // Entries recorded in the manifest are only re-examined when their source changes
+    snprintf(path_manifest, sizeof(path_manifest), "%s/%s", home, MULTIHOME_MANIFEST);
+    manifest_load(&manifest, path_manifest);
+    copy_set_manifest(&manifest, checksum, skip_dirs);
+
+    // Copy system and user-defined account defaults, transfer or link user-defined files
+    fprintf(stderr, "Pulling account skeleton: %s\n", OS_SKEL_DIR);
+    fprintf(stderr, "Pulling user-defined account skeleton: %s\n", mh->config_skeleton);
+    plan_init(&plan, home);
+    user_transfer_exclude(mh, 1);
+    home_plan(mh, &plan, select);
+    phase = trace_begin("plan");
+    trace_end(phase, plan_run(&plan, copy_mode) < 0 ? 1 : 0);
+    user_transfer_exclude(mh, 0);
+    plan_free(&plan);
+
+    copy_set_manifest(NULL, 0, 0);
+    if (strcmp(home, home_final) != 0) {
+        manifest_rebase(&manifest, home, home_final);
+    }
+    if (copy_get_backend() != COPY_BACKEND_RSYNC && manifest_save(&manifest, path_manifest) < 0) {
+        fprintf(stderr, "Unable to write manifest: %s: %s\n", path_manifest, strerror(errno));
+    }
+    manifest_free(&manifest);
+}
+
+/**
+ * Split a home directory path into its parent directory and name
+ *
+ * dirname() and basename() may modify their argument and return a pointer into
+ * it, so they work on a copy.
+ *
+ * @param home home directory
+ * @param root output parent directory (PATH_MAX)
+ * @param name output last path component (PATH_MAX)
+ */
+static void home_split(const char *home, char *root, char *name) {
+    char scratch[PATH_MAX];
+
+    snprintf(scratch, sizeof(scratch), "%s", home);
+    snprintf(root, PATH_MAX, "%s", dirname(scratch));
+    snprintf(scratch, sizeof(scratch), "%s", home);
+    snprintf(name, PATH_MAX, "%s", basename(scratch));
+}
+
+/**
+ * Take the initialization lock of a home directory
+ * @param path lock file
+ * @param home home directory being initialized
+ * @param timeout give up after this many seconds
+ * @param locked set to 0 when the filesystem cannot lock and the descriptor holds no lock (may be NULL)
+ * @return descriptor holding the lock, -1=error (errno set, ETIMEDOUT on timeout)
+ */
+static int home_lock(const char *path, const char *home, long timeout, int *locked) {
+    struct timespec ts;
+    time_t deadline;
+    int waiting;
+    int fd;
+
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (locked) {
+        *locked = 1;
+    }
+    deadline = time(NULL) + timeout;
+    waiting = 0;
+    while (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+        if (errno == ENOLCK) {
+            // The filesystem cannot lock (e.g. NFS mounted with nolock). Carry on unprotected.
+            fprintf(stderr, "Unable to lock %s: %s\n", path, strerror(errno));
+            if (locked) {
+                *locked = 0;
+            }
+            return fd;
+        }
+        if (errno != EWOULDBLOCK && errno != EINTR) {
+            int err = errno;
+            close(fd);
+            errno = err;
+            return -1;
+        }
+        if (time(NULL) >= deadline) {
+            close(fd);
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        if (!waiting) {
+            fprintf(stderr, "Waiting for another process to initialize %s\n", home);
+            waiting = 1;
+        }
+        ts.tv_sec = 0;
+        ts.tv_nsec = INIT_LOCK_POLL_MS * 1000000L;
+        nanosleep(&ts, NULL);
+    }
+    return fd;
+}
+
+/**
+ * Remove staging directories left behind by interrupted initializations
+ * @param root directory holding the home directories
+ * @param prefix staging name prefix
+ */
+static void home_clean_staging(const char *root, const char *prefix) {
+    struct dirent *rec;
+    DIR *d;
+
+    d = opendir(root);
+    if (d == NULL) {
+        return;
+    }
+    while ((rec = readdir(d)) != NULL) {
+        char path[PATH_MAX];
+        if (strncmp(rec->d_name, prefix, strlen(prefix)) != 0) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", root, rec->d_name);
+        fprintf(stderr, "Removing abandoned staging directory: %s\n", path);
+        shell((char *[]){"/bin/rm", "-rf", path, NULL});
+    }
+    closedir(d);
+}
+
+/**
+ * Build a home directory exactly once
+ *
+ * Concurrent callers serialize on a lock next to the home directory. The first one
+ * builds the home in a staging directory and renames it into place together with
+ * its marker, the others wait and reuse the result.
+ *
+ * @param home home directory
+ * @param timeout seconds to wait for another process
+ * @param populate fills a directory (arguments: directory, final home directory, arg)
+ * @param arg passed to populate
+ * @return 0=built, 1=already initialized, -1=error
+ */
+int home_build(const char *home, long timeout, int (*populate)(const char *, const char *, void *), void *arg) {
+    char root[PATH_MAX];
+    char name[PATH_MAX];
+    char path_lock[PATH_MAX];
+    char staging[PATH_MAX];
+    char prefix[PATH_MAX];
+    char marker[PATH_MAX];
+    int locked;
+    int fd;
+
+    home_split(home, root, name);
+    if (access(root, F_OK) < 0 && mkdirs(root) < 0) {
+        perror(root);
+        return -1;
+    }
+
+    snprintf(path_lock, sizeof(path_lock), "%s/.%s.lock", root, name);
+    fd = home_lock(path_lock, home, timeout, &locked);
+    if (fd < 0) {
+        fprintf(stderr, "Unable to lock %s: %s\n", path_lock, strerror(errno));
+        return -1;
+    }
+
+    // Someone else finished while we were waiting
+    snprintf(marker, sizeof(marker), "%s/%s", home, MULTIHOME_MARKER);
+    if (access(marker, F_OK) == 0) {
+        close(fd);
+        return 1;
+    }
+
+    // Without the lock a staging directory may belong to a build still in progress
+    snprintf(prefix, sizeof(prefix), ".%s.staging.", name);
+    if (locked) {
+        home_clean_staging(root, prefix);
+    }
+
+    if (access(home, F_OK) == 0) {
+        // A partial home from an older version or an interrupted run. Finish it in place.
+        if (populate(home, home, arg) < 0) {
+            close(fd);
+            return -1;
+        }
+        fprintf(stderr, "Creating marker file: %s\n", marker);
+        touch(marker);
+        close(fd);
+        return 0;
+    }
+
+    snprintf(staging, sizeof(staging), "%s/%sXXXXXX", root, prefix);
+    if (mkdtemp(staging) == NULL) {
+        perror(staging);
+        close(fd);
+        return -1;
+    }
+    chmod(staging, 0755);
+
+    if (populate(staging, home, arg) < 0) {
+        shell((char *[]){"/bin/rm", "-rf", staging, NULL});
+        close(fd);
+        return -1;
+    }
+
+    // Publish the finished home and its marker in one step
+    snprintf(marker, sizeof(marker), "%s/%s", staging, MULTIHOME_MARKER);
+    touch(marker);
+    fprintf(stderr, "Publishing home directory: %s\n", home);
+    if (rename(staging, home) < 0) {
+        perror(home);
+        shell((char *[]){"/bin/rm", "-rf", staging, NULL});
+        close(fd);
+        return -1;
+    }
+
+    close(fd);
+    return 0;
+}
+
+struct HomeInit {
+    struct Multihome *mh;
+    int checksum;
+    int skip_dirs;
+    int select;
+    int deferred;               // T entries were left to home_resume()
+};
+
+static long home_deadline;      // login budget in seconds, 0=copy everything first
+
+/**
+ * Set the time budget of a first login
+ *
+ * With a deadline, home_initialize() only copies the skeletons and the L, H and
+ * T! entries before publishing the home directory. The remaining T entries are
+ * finished by a background worker (see home_resume()), which the login waits
+ * for until the deadline has passed.
+ *
+ * @param seconds login budget, 0=wait for every transfer
+ */
+void home_set_deadline(long seconds) {
+    home_deadline = seconds > 0 ? seconds : 0;
+}
+
+/**
+ * Check for deferred transfers nobody is working on
+ *
+ * The worker holds a lock on MULTIHOME_PENDING until it is done. A marker without
+ * a lock holder was left by a worker that did not finish (host reboot, OOM kill).
+ *
+ * @param home home directory
+ * @return 1=abandoned, 0=none or still running
+ */
+int home_abandoned(const char *home) {
+    char path[PATH_MAX];
+    int abandoned;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/%s", home, MULTIHOME_PENDING);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 0;
+    }
+    abandoned = flock(fd, LOCK_SH | LOCK_NB) == 0;
+    close(fd);
+    return abandoned;
+}
+
+/**
+ * Close every descriptor except two
+ * @param keep1 descriptor to keep
+ * @param keep2 descriptor to keep
+ */
+static void home_close_fds(int keep1, int keep2) {
+    struct dirent *rec;
+    DIR *d;
+
+    d = opendir("/proc/self/fd");
+    if (d == NULL) {
+        return;
+    }
+    while ((rec = readdir(d)) != NULL) {
+        int fd;
+        if (!isdigit((unsigned char) rec->d_name[0])) {
+            continue;
+        }
+        fd = (int) strtol(rec->d_name, NULL, 10);
+        if (fd > STDERR_FILENO && fd != keep1 && fd != keep2 && fd != dirfd(d)) {
+            close(fd);
+        }
+    }
+    closedir(d);
+}
+
+/**
+ * Copy the deferred transfers of a home directory and exit
+ *
+ * Runs in its own session. Descriptors inherited from the login (the service's
+ * sockets, the pipe of a command substitution) are closed so nothing waits for
+ * the worker. Output goes to MULTIHOME_DEFER_LOG in the home directory.
+ *
+ * @param mh context
+ * @param fd_lock locked MULTIHOME_PENDING
+ * @param fd_done closed on exit, tells the login the worker is done
+ */
+static void home_resume_worker(struct Multihome *mh, int fd_lock, int fd_done) {
+    struct Manifest manifest;
+    char path[PATH_MAX];
+    int fd;
+
+    setsid();
+    home_close_fds(fd_lock, fd_done);
+    fd = open("/dev/null", O_RDONLY);
+    if (fd >= 0) {
+        dup2(fd, STDIN_FILENO);
+        if (fd > STDERR_FILENO) {
+            close(fd);
+        }
+    }
+    snprintf(path, sizeof(path), "%s/%s", mh->path_new, MULTIHOME_DEFER_LOG);
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0) {
+        dup2(fd, STDOUT_FILENO);
+        dup2(fd, STDERR_FILENO);
+        if (fd > STDERR_FILENO) {
+            close(fd);
+        }
+    }
+    if (ftruncate(fd_lock, 0) == 0) {
+        dprintf(fd_lock, "%d\n", (int) getpid());
+    }
+    fprintf(stderr, "Deferred transfers started: %s\n", mh->path_new);
+
+    // Only the deferred records are touched, keep the ones of the login
+    snprintf(path, sizeof(path), "%s/%s", mh->path_new, MULTIHOME_MANIFEST);
+    manifest_load(&manifest, path);
+    manifest_keep(&manifest, mh->path_new);
+    copy_set_manifest(&manifest, 0, 0);
+    user_transfer(mh, mh->path_new, COPY_NORMAL, TRANSFER_DEFERRED);
+    copy_set_manifest(NULL, 0, 0);
+    if (copy_get_backend() != COPY_BACKEND_RSYNC && manifest_save(&manifest, path) < 0) {
+        fprintf(stderr, "Unable to write manifest: %s: %s\n", path, strerror(errno));
+    }
+    manifest_free(&manifest);
+
+    snprintf(path, sizeof(path), "%s/%s", mh->path_new, MULTIHOME_PENDING);
+    unlink(path);
+    fprintf(stderr, "Deferred transfers finished: %s\n", mh->path_new);
+    _exit(0);
+}
+
+/**
+ * Start the worker of a home directory's deferred transfers and wait for it
+ * @param mh context
+ * @param wait_ms give up waiting after this many milliseconds (-1 = wait until done)
+ * @return 0=finished or continuing in the background, -1=error
+ */
+static int home_resume_start(struct Multihome *mh, int wait_ms) {
+    char path[PATH_MAX];
+    char byte;
+    pid_t pid;
+    int fds[2];
+    int fd;
+    int status;
+
+    snprintf(path, sizeof(path), "%s/%s", mh->path_new, MULTIHOME_PENDING);
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+    if (flock(fd, LOCK_EX | LOCK_NB) < 0 && errno != ENOLCK) {
+        // Another login started the worker first
+        close(fd);
+        return 0;
+    }
+    if (pipe(fds) < 0) {
+        perror("pipe");
+        close(fd);
+        return -1;
+    }
+
+    // Fork twice so the worker is not our child and outlives the login
+    pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        if (fork() == 0) {
+            home_resume_worker(mh, fd, fds[1]);
+        }
+        _exit(0);
+    }
+    close(fds[1]);
+    close(fd);
+    if (pid < 0) {
+        perror("fork");
+        close(fds[0]);
+        return -1;
+    }
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+        continue;
+    }
+
+    snprintf(path, sizeof(path), "%s/%s", mh->path_new, MULTIHOME_DEFER_LOG);
+    while (1) {
+        struct pollfd pfd = {.fd = fds[0], .events = POLLIN};
+        status = poll(&pfd, 1, wait_ms);
+        if (status < 0 && errno == EINTR) {
+            continue;
+        }
+        break;
+    }
+    if (status > 0 && read(fds[0], &byte, 1) == 0) {
+        if (home_abandoned(mh->path_new)) {
+            fprintf(stderr, "Deferred transfers did not finish, see %s\n", path);
+        }
+    } else {
+        fprintf(stderr, "Continuing transfers in the background (log: %s)\n", path);
+    }
+    close(fds[0]);
+    return 0;
+}
+
+/**
+ * Milliseconds left of the login deadline
+ * @param start beginning of the login (CLOCK_MONOTONIC)
+ * @return remaining time, 0=passed, -1=no deadline
+ */
+static int home_deadline_left(const struct timespec *start) {
+    struct timespec now;
+    long elapsed;
+
+    if (home_deadline == 0) {
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (now.tv_sec - start->tv_sec) * 1000L + (now.tv_nsec - start->tv_nsec) / 1000000L;
+    return elapsed >= home_deadline * 1000L ? 0 : (int) (home_deadline * 1000L - elapsed);
+}
+
+/**
+ * Finish deferred transfers whose worker is gone
+ *
+ * Files the worker already copied are recognized through the manifest, so a
+ * restarted worker picks up where the last one stopped. The caller waits like a
+ * first login (see home_set_deadline()).
+ *
+ * @param mh context (resolved, see multihome_resolve())
+ * @return 0=nothing to do, finished or continuing in the background, -1=error
+ */
+int home_resume(struct Multihome *mh) {
+    struct timespec start;
+
+    if (!home_abandoned(mh->path_new)) {
+        return 0;
+    }
+    fprintf(stderr, "Resuming deferred transfers: %s\n", mh->path_new);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    return home_resume_start(mh, home_deadline_left(&start));
+}
+
+/**
+ * Test whether an entry of a home directory belongs to that copy alone
+ *
+ * A node-local home and its durable copy in home_local each keep their own sync
+ * manifest and deferred transfer state. A pending marker copied to the other side
+ * would be held by no worker there, and look abandoned (see home_abandoned()).
+ *
+ * @param name entry at the top of the home directory
+ * @return 1=never copied between the two, 0=copied
+ */
+static int home_entry_local(const char *name) {
+    return strcmp(name, ".") == 0 || strcmp(name, "..") == 0
+           || strcmp(name, MULTIHOME_SYNC_MANIFEST) == 0
+           || strcmp(name, MULTIHOME_PENDING) == 0
+           || strcmp(name, MULTIHOME_DEFER_LOG) == 0;
+}
+
+/**
+ * Fill a node-local home directory from its durable copy in home_local
+ *
+ * Copy errors are reported but do not stop the login, like in home_populate().
+ *
+ * @param mh context
+ * @param home destination (may be a staging directory)
+ * @param home_final where home will live once published
+ * @return 0=seeded, 1=there is no durable copy yet
+ */
+static int home_seed(struct Multihome *mh, const char *home, const char *home_final) {
+    struct Manifest manifest;
+    struct dirent *rec;
+    char marker[PATH_MAX];
+    char path_manifest[PATH_MAX];
+    size_t phase;
+    int status;
+    DIR *d;
+
+    snprintf(marker, sizeof(marker), "%s/%s", mh->path_durable, MULTIHOME_MARKER);
+    if (access(marker, F_OK) < 0) {
+        return 1;
+    }
+
+    fprintf(stderr, "Seeding node-local home directory from: %s\n", mh->path_durable);
+    d = opendir(mh->path_durable);
+    if (d == NULL) {
+        perror(mh->path_durable);
+        return 1;
+    }
+    phase = trace_begin("seed");
+    status = 0;
+    while ((rec = readdir(d)) != NULL) {
+        char source[PATH_MAX];
+
+        if (home_entry_local(rec->d_name)) {
+            continue;
+        }
+        snprintf(source, sizeof(source), "%s/%s", mh->path_durable, rec->d_name);
+        if (copy(source, (char *) home, COPY_NORMAL) < 0) {
+            status = -1;
+        }
+    }
+    closedir(d);
+    trace_end(phase, status);
+
+    // The copied manifest describes the durable copy
+    snprintf(path_manifest, sizeof(path_manifest), "%s/%s", home, MULTIHOME_MANIFEST);
+    if (manifest_load(&manifest, path_manifest) > 0) {
+        manifest_rebase(&manifest, mh->path_durable, home_final);
+        if (manifest_save(&manifest, path_manifest) < 0) {
+            fprintf(stderr, "Unable to write manifest: %s: %s\n", path_manifest, strerror(errno));
+        }
+    }
+    manifest_free(&manifest);
+    return 0;
+}
+
+static int home_initialize_populate(const char *home, const char *home_final, void *arg) {
+    struct HomeInit *init = arg;
+
+    if (strcmp(home_final, init->mh->path_durable) != 0 && home_seed(init->mh, home, home_final) == 0) {
+        return 0;
+    }
+    if (home_prepare(init->mh, home) < 0) {
+        return -1;
+    }
+    home_populate(init->mh, home, home_final, COPY_NORMAL, init->checksum, init->skip_dirs, init->select);
+
+    // The marker is published with the home, a crash before the worker starts is resumed later
+    if (init->select == TRANSFER_LOGIN) {
+        for (size_t i = 0; i < init->mh->snapshot.header->transfer_count; i++) {
+            if (user_transfer_deferrable(&init->mh->snapshot.transfers[i])) {
+                char marker[PATH_MAX];
+                snprintf(marker, sizeof(marker), "%s/%s", home, MULTIHOME_PENDING);
+                touch(marker);
+                init->deferred = 1;
+                break;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * Initialize this host's home directory exactly once
+ *
+ * Concurrent logins on a fresh host serialize on a lock next to the home directory
+ * (see home_build()). A node-local home is seeded from its durable copy when
+ * there is one. With a login deadline, plain T entries are finished in the
+ * background (see home_set_deadline()).
+ *
+ * @param mh context (resolved, see multihome_resolve())
+ * @param timeout seconds to wait for another process
+ * @param checksum compare contents when source metadata changed
+ * @param skip_dirs skip directories whose mtime is unchanged
+ * @return 0=success, -1=error
+ */
+int home_initialize(struct Multihome *mh, long timeout, int checksum, int skip_dirs) {
+    struct HomeInit init;
+    struct timespec start;
+    size_t phase;
+    int status;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    init.mh = mh;
+    init.checksum = checksum;
+    init.skip_dirs = skip_dirs;
+    init.select = home_deadline ? TRANSFER_LOGIN : TRANSFER_ALL;
+    init.deferred = 0;
+
+    // The original home directory is never staged or replaced
+    if (strcmp(mh->path_new, mh->path_old) == 0) {
+        if (home_initialize_populate(mh->path_new, mh->path_new, &init) < 0) {
+            return -1;
+        }
+        touch(mh->marker);
+    } else {
+        phase = trace_begin("initialize");
+        status = home_build(mh->path_new, timeout, home_initialize_populate, &init);
+        trace_end(phase, status < 0 ? 1 : 0);
+        if (status == 1) {
+            fprintf(stderr, "Home directory initialized by another process: %s\n", mh->path_new);
+        }
+        if (status < 0) {
+            return -1;
+        }
+    }
+
+    if (init.deferred) {
+        phase = trace_begin("defer");
+        trace_end(phase, home_resume_start(mh, home_deadline_left(&start)) < 0 ? 1 : 0);
+    }
+    return 0;
+}
+
+/**
+ * Resolve the home directory of a host, initializing it on first use
+ *
+ * This is the whole login path of the program in one call: the resolution cache is
+ * tried first, otherwise the configuration is loaded, the host is mapped through
+ * host_group, the home is initialized if needed and the result is cached.
+ *
+ * @param path_old original home directory of the account
+ * @param nodename short hostname
+ * @param timeout seconds to wait for another process initializing the same home
+ * @param path_new output buffer (PATH_MAX)
+ * @return 0=success, -1=error
+ */
+int multihome_login(const char *path_old, const char *nodename, long timeout, char *path_new) {
+    struct Multihome mh;
+    char already_inside[PATH_MAX];
+    int fallback;
+    int status;
+
+    if (resolve_cache_lookup(path_old, nodename, path_new) == 0 && !home_abandoned(path_new)) {
+        trace_note("path", "fast");
+        home_mark_used(path_new);
+        return 0;
+    }
+    trace_note("path", "full");
+
+    if (multihome_init(&mh, path_old) < 0) {
+        return -1;
+    }
+
+    // Refuse to operate within a controlled home directory
+    snprintf(already_inside, sizeof(already_inside), "%s/%s", mh.path_old, MULTIHOME_MARKER);
+    if (access(already_inside, F_OK) == 0) {
+        fprintf(stderr, "error: multihome cannot be nested.\n");
+        return -1;
+    }
+
+    if (multihome_config(&mh) < 0 || multihome_load(&mh) < 0) {
+        return -1;
+    }
+    multihome_resolve(&mh, nodename);
+    fallback = multihome_storage(&mh) < 0;
+
+    status = 0;
+    if (access(mh.marker, F_OK) < 0) {
+        status = home_initialize(&mh, timeout, 0, 0);
+    }
+    if (status == 0) {
+        home_resume(&mh);
+        home_mark_used(mh.path_new);
+        // A fallback is not cached. The next login tries node-local storage again.
+        if (!fallback && resolve_cache_write(mh.path_old, nodename, mh.path_new) < 0) {
+            fprintf(stderr, "Unable to write resolution cache: %s\n", strerror(errno));
+        }
+        strcpy(path_new, mh.path_new);
+    }
+    multihome_free(&mh);
+    return status;
+}
+
+/**
+ * Record that a home directory is in use (see --gc)
+ *
+ * The time of use is the mtime of a stamp file in the home directory. It is
+ * rewritten at most once per HOME_USED_INTERVAL, so a login usually costs one
+ * attribute lookup.
+ *
+ * @param home home directory
+ * @return 0=success, -1=error (errno set)
+ */
+int home_mark_used(const char *home) {
+    char path[PATH_MAX];
+    struct stat st;
+    int fd;
+
+    if (snprintf(path, sizeof(path), "%s/%s", home, MULTIHOME_USED) >= PATH_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if (stat(path, &st) == 0) {
+        if (time(NULL) - st.st_mtime < HOME_USED_INTERVAL) {
+            return 0;
+        }
+        return utimensat(AT_FDCWD, path, NULL, 0);
+    }
+    fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+/**
+ * Determine when a home directory was last used
+ *
+ * This is the most recent of the stamp written by home_mark_used() (or by the
+ * init scripts), the marker, and the home directory itself, so homes initialized
+ * before stamps existed are judged by their latest top level change.
+ *
+ * @param home home directory
+ * @return seconds since the epoch, 0 if nothing could be examined
+ */
+time_t home_last_used(const char *home) {
+    const char *names[] = {MULTIHOME_USED, MULTIHOME_MARKER, ""};
+    time_t result;
+
+    result = 0;
+    for (size_t i = 0; i < sizeof(names) / sizeof(*names); i++) {
+        char path[PATH_MAX];
+        struct stat st;
+
+        snprintf(path, sizeof(path), "%s/%s", home, names[i]);
+        if (stat(path, &st) == 0 && st.st_mtime > result) {
+            result = st.st_mtime;
+        }
+    }
+    return result;
+}
+
+/**
+ * Remove (or archive, then remove) a home directory that has not been used since a cutoff
+ *
+ * The home is taken under its initialization lock and renamed out of the way in one
+ * step, so a login either still finds the whole home or builds a new one. When the
+ * archive cannot be written the home is put back.
+ *
+ * @param home home directory
+ * @param cutoff keep the home when it was used at or after this time
+ * @param archive write DIR/NAME-YYYYMMDD.tar.gz first (NULL = remove only)
+ * @param timeout seconds to wait for a login initializing the same home
+ * @return 0=removed, 1=in use again, -1=error
+ */
+int home_retire(const char *home, time_t cutoff, const char *archive, long timeout) {
+    char root[PATH_MAX];
+    char name[PATH_MAX];
+    char path_lock[PATH_MAX];
+    char trash[PATH_MAX];
+    int status;
+    int fd;
+
+    home_split(home, root, name);
+
+    snprintf(path_lock, sizeof(path_lock), "%s/.%s.lock", root, name);
+    fd = home_lock(path_lock, home, timeout, NULL);
+    if (fd < 0) {
+        fprintf(stderr, "Unable to lock %s: %s\n", path_lock, strerror(errno));
+        return -1;
+    }
+
+    // A login may have happened since the caller looked
+    if (home_last_used(home) >= cutoff) {
+        close(fd);
+        return 1;
+    }
+
+    // rename() replaces an empty directory, so the home disappears in one step
+    snprintf(trash, sizeof(trash), "%s/.%s.gc.XXXXXX", root, name);
+    if (mkdtemp(trash) == NULL || rename(home, trash) < 0) {
+        perror(home);
+        rmdir(trash);
+        close(fd);
+        return -1;
+    }
+
+    status = 0;
+    if (archive != NULL) {
+        char dest[PATH_MAX];
+        char date[16];
+        struct tm tm;
+        time_t now;
+
+        time(&now);
+        localtime_r(&now, &tm);
+        strftime(date, sizeof(date), "%Y%m%d", &tm);
+        snprintf(dest, sizeof(dest), "%s/%s-%s.tar.gz", archive, name, date);
+        fprintf(stderr, "Archiving home directory: %s -> %s\n", home, dest);
+        if ((access(archive, F_OK) < 0 && mkdirs((char *) archive) < 0)
+                || shell((char *[]){"/bin/tar", "-C", trash, "-czf", dest, ".", NULL}) != 0) {
+            fprintf(stderr, "Unable to archive %s, keeping it\n", home);
+            unlink(dest);
+            if (rename(trash, home) < 0) {
+                fprintf(stderr, "Unable to restore %s (kept as %s): %s\n", home, trash, strerror(errno));
+            }
+            status = -1;
+        }
+    }
+
+    if (status == 0) {
+        fprintf(stderr, "Removing home directory: %s\n", home);
+        if (shell((char *[]){"/bin/rm", "-rf", trash, NULL}) != 0) {
+            status = -1;
+        }
+    }
+    close(fd);
+    return status;
+}
+
+/**
+ * Write a node-local home directory back to its durable copy in home_local
+ *
+ * Only entries whose metadata changed since the previous sync are copied. Their
+ * records live in the durable copy (MULTIHOME_SYNC_MANIFEST), apart from the
+ * manifest of the skeletons and transfers. Every file is written under a
+ * temporary name and renamed into place, so an interrupted sync leaves each file
+ * either old or new. Entries an earlier sync wrote that are gone from the local
+ * home are removed. Node-local homes of one host group share a durable copy, so
+ * syncs serialize on its initialization lock.
+ *
+ * @param mh context (resolved to a node-local home, see multihome_storage())
+ * @param timeout seconds to wait for the lock
+ * @param skip_dirs skip directories whose mtime is unchanged
+ * @param stats output: totals of this sync
+ * @param removed output: entries removed from the durable copy
+ * @return 0=success, -1=one or more errors
+ */
+int home_sync_back(struct Multihome *mh, long timeout, int skip_dirs, struct CopyStats *stats, uint64_t *removed) {
+    struct Manifest manifest;
+    struct CopyStats before;
+    struct dirent *rec;
+    char root[PATH_MAX];
+    char name[PATH_MAX];
+    char path_lock[PATH_MAX];
+    char path_manifest[PATH_MAX];
+    char marker[PATH_MAX];
+    char **stale;
+    size_t count;
+    size_t len;
+    int status;
+    int fd;
+    DIR *d;
+
+    memset(stats, 0, sizeof(*stats));
+    *removed = 0;
+    home_split(mh->path_durable, root, name);
+    if (access(root, F_OK) < 0 && mkdirs(root) < 0) {
+        perror(root);
+        return -1;
+    }
+
+    snprintf(path_lock, sizeof(path_lock), "%s/.%s.lock", root, name);
+    fd = home_lock(path_lock, mh->path_durable, timeout, NULL);
+    if (fd < 0) {
+        fprintf(stderr, "Unable to lock %s: %s\n", path_lock, strerror(errno));
+        return -1;
+    }
+    if (access(mh->path_durable, F_OK) < 0 && mkdirs(mh->path_durable) < 0) {
+        perror(mh->path_durable);
+        close(fd);
+        return -1;
+    }
+
+    d = opendir(mh->path_new);
+    if (d == NULL) {
+        perror(mh->path_new);
+        close(fd);
+        return -1;
+    }
+
+    snprintf(path_manifest, sizeof(path_manifest), "%s/%s", mh->path_durable, MULTIHOME_SYNC_MANIFEST);
+    manifest_load(&manifest, path_manifest);
+    copy_set_manifest(&manifest, 0, skip_dirs);
+    copy_get_stats(&before);
+
+    // Entry by entry, so the bookkeeping files of each copy stay its own
+    status = 0;
+    while ((rec = readdir(d)) != NULL) {
+        char source[PATH_MAX];
+
+        if (home_entry_local(rec->d_name)
+                || strcmp(rec->d_name, MULTIHOME_MANIFEST) == 0 || strcmp(rec->d_name, MULTIHOME_MARKER) == 0) {
+            continue;
+        }
+        snprintf(source, sizeof(source), "%s/%s", mh->path_new, rec->d_name);
+        if (copy(source, mh->path_durable, COPY_NORMAL) < 0) {
+            status = -1;
+        }
+    }
+    closedir(d);
+    copy_set_manifest(NULL, 0, 0);
+
+    copy_get_stats(stats);
+    stats->files -= before.files;
+    stats->dirs -= before.dirs;
+    stats->links -= before.links;
+    stats->bytes -= before.bytes;
+    stats->skipped -= before.skipped;
+    stats->errors -= before.errors;
+    stats->cloned -= before.cloned;
+
+    // Deleted locally since the last sync. Entries that failed to copy are still present.
+    len = strlen(mh->path_durable);
+    stale = manifest_stale(&manifest, &count);
+    for (size_t i = 0; i < count; i++) {
+        char local[PATH_MAX];
+        struct stat st;
+
+        if (strncmp(stale[i], mh->path_durable, len) != 0 || stale[i][len] != '/') {
+            continue;
+        }
+        snprintf(local, sizeof(local), "%s%s", mh->path_new, stale[i] + len);
+        if (lstat(local, &st) == 0 || lstat(stale[i], &st) < 0) {
+            continue;
+        }
+        if (S_ISDIR(st.st_mode) ? rmdir(stale[i]) == 0 : unlink(stale[i]) == 0) {
+            (*removed)++;
+        } else if (errno != ENOTEMPTY && errno != EEXIST) {
+            fprintf(stderr, "Unable to remove %s: %s\n", stale[i], strerror(errno));
+            status = -1;
+        }
+    }
+    free_array((void **) stale, count);
+
+    if (manifest_save(&manifest, path_manifest) < 0) {
+        fprintf(stderr, "Unable to write manifest: %s: %s\n", path_manifest, strerror(errno));
+        status = -1;
+    }
+    manifest_free(&manifest);
+
+    // A complete durable copy can seed other nodes
+    snprintf(marker, sizeof(marker), "%s/%s", mh->path_durable, MULTIHOME_MARKER);
+    if (status == 0 && access(marker, F_OK) < 0) {
+        touch(marker);
+    }
+    close(fd);
+    return status;
+}
@@ -0,0 +1,203 @@
+#include "multihome.h"
+
+/**
+ * Host lists
+ *
+ * Hosts are given one per word (whitespace or comma separated) and may use the
+ * Slurm range syntax, where each bracket group expands to every listed number:
+ *
+ *     node[001-004,010]     node001 node002 node003 node004 node010
+ *     rack[1-2]-gpu[1-2]    rack1-gpu1 rack1-gpu2 rack2-gpu1 rack2-gpu2
+ *
+ * The width of a range's lower bound is kept (zero padded) like Slurm does.
+ */
+
+/**
+ * Append a host name
+ * @param list host list
+ * @param host name
+ */
+static void hostlist_push(struct HostList *list, const char *host) {
+    if (list->count == list->alloc) {
+        char **tmp;
+        size_t alloc = list->alloc ? list->alloc * 2 : 64;
+        tmp = realloc(list->hosts, alloc * sizeof(*tmp));
+        if (tmp == NULL) {
+            perror("hostlist");
+            exit(1);
+        }
+        list->hosts = tmp;
+        list->alloc = alloc;
+    }
+    list->hosts[list->count] = strdup(host);
+    if (list->hosts[list->count] == NULL) {
+        perror("hostlist");
+        exit(1);
+    }
+    list->count++;
+}
+
+/**
+ * Expand the first bracket group of a word and recurse on the remainder
+ * @param list host list
+ * @param done already expanded prefix
+ * @param word remainder of the word
+ * @return 0=success, -1=syntax error or too many hosts
+ */
+static int hostlist_expand(struct HostList *list, const char *done, const char *word) {
+    char buf[HOSTLIST_NAME_MAX];
+    const char *open;
+    const char *close;
+    const char *range;
+    size_t prefix_len;
+
+    open = strchr(word, '[');
+    if (open == NULL) {
+        if (strchr(word, ']') != NULL) {
+            return -1;
+        }
+        if (snprintf(buf, sizeof(buf), "%s%s", done, word) >= (int) sizeof(buf)) {
+            return -1;
+        }
+        if (list->count >= HOSTLIST_MAX) {
+            return -1;
+        }
+        hostlist_push(list, buf);
+        return 0;
+    }
+
+    close = strchr(open, ']');
+    if (close == NULL || close == open + 1) {
+        return -1;
+    }
+    prefix_len = strlen(done) + (open - word);
+    if (prefix_len >= sizeof(buf)) {
+        return -1;
+    }
+
+    // Each comma separated element is a number or a lo-hi range
+    range = open + 1;
+    while (range < close) {
+        unsigned long lo;
+        unsigned long hi;
+        char *end;
+        int width;
+
+        if (!isdigit((unsigned char) *range)) {
+            return -1;
+        }
+        lo = strtoul(range, &end, 10);
+        width = (int) (end - range);
+        hi = lo;
+        if (*end == '-') {
+            range = end + 1;
+            if (!isdigit((unsigned char) *range)) {
+                return -1;
+            }
+            hi = strtoul(range, &end, 10);
+        }
+        if (end > close || (*end != ',' && end != close) || hi < lo || hi - lo >= HOSTLIST_MAX) {
+            return -1;
+        }
+
+        for (unsigned long n = lo; n <= hi; n++) {
+            snprintf(buf, sizeof(buf), "%s%.*s%0*lu", done, (int) (open - word), word, width, n);
+            if (hostlist_expand(list, buf, close + 1) < 0) {
+                return -1;
+            }
+        }
+        range = *end == ',' ? end + 1 : end;
+    }
+    return 0;
+}
+
+/**
+ * Add every host named by an expression
+ * @param list host list
+ * @param expr whitespace or comma separated words, with optional bracket ranges
+ * @return 0=success, -1=syntax error (errno set to EINVAL)
+ */
+int hostlist_add(struct HostList *list, const char *expr) {
+    char word[HOSTLIST_NAME_MAX];
+    size_t len;
+    int depth;
+
+    len = 0;
+    depth = 0;
+    for (const char *ch = expr; ; ch++) {
+        // Commas inside brackets separate range elements, not hosts
+        if (*ch == '\0' || isspace((unsigned char) *ch) || (*ch == ',' && depth == 0)) {
+            if (depth != 0) {
+                errno = EINVAL;
+                return -1;
+            }
+            if (len) {
+                word[len] = '\0';
+                if (hostlist_expand(list, "", word) < 0) {
+                    errno = EINVAL;
+                    return -1;
+                }
+                len = 0;
+            }
+            if (*ch == '\0') {
+                break;
+            }
+            continue;
+        }
+        if (*ch == '[') {
+            depth++;
+        } else if (*ch == ']') {
+            depth--;
+        }
+        if (depth < 0 || depth > 1 || len == sizeof(word) - 1) {
+            errno = EINVAL;
+            return -1;
+        }
+        word[len++] = *ch;
+    }
+    return 0;
+}
+
+/**
+ * Add every host named in a file
+ *
+ * Each line holds one or more host expressions. Text after '#' is ignored.
+ *
+ * @param list host list
+ * @param fp stream
+ * @return 0=success, -1=syntax error or read error (errno set)
+ */
+int hostlist_read(struct HostList *list, FILE *fp) {
+    char *line;
+    size_t size;
+    int status;
+
+    line = NULL;
+    size = 0;
+    status = 0;
+    while (getline(&line, &size, fp) >= 0) {
+        line[strcspn(line, "#\n")] = '\0';
+        if (hostlist_add(list, line) < 0) {
+            fprintf(stderr, "Invalid host list: %s\n", line);
+            status = -1;
+            break;
+        }
+    }
+    if (status == 0 && ferror(fp)) {
+        status = -1;
+    }
+    free(line);
+    return status;
+}
+
+/**
+ * Release a host list
+ * @param list host list
+ */
+void hostlist_free(struct HostList *list) {
+    for (size_t i = 0; i < list->count; i++) {
+        free(list->hosts[i]);
+    }
+    free(list->hosts);
+    memset(list, 0, sizeof(*list));
+}
@@ -1,12 +1,37 @@
 # Set location of multihome to avoid PATH lookups
 MULTIHOME="%s"
-if [ -x "$MULTIHOME" ]; then
+MULTIHOME_HOME=""
+# Resolve hosts known at generation time without running multihome
+if [ -r /proc/sys/kernel/hostname ]; then
+    read -r MULTIHOME_HOST < /proc/sys/kernel/hostname
+    case "$MULTIHOME_HOST" in
+%@        "%1"|"%1".*)
+%@            MULTIHOME_HOME="%2"
+%@            ;;
+    esac
+fi
+# Ask multihome when host_group or storage changed since generation or the home is gone
+if [ -n "$MULTIHOME_HOME" ]; then
+    if [ "%c" -nt "%o" ] || [ "%t" -nt "%o" ] || [ ! -f "$MULTIHOME_HOME/%m" ]; then
+        MULTIHOME_HOME=""
+    else
+        # Record the use for --gc at most once an hour (multihome does this itself when it runs)
+        if [ ! -e "$MULTIHOME_HOME/%u" ] || [ -n "$(find "$MULTIHOME_HOME/%u" -mmin +60 2>/dev/null)" ]; then
+            true 2>/dev/null > "$MULTIHOME_HOME/%u"
+        fi
+    fi
+fi
+if [ -z "$MULTIHOME_HOME" ] && [ -x "$MULTIHOME" ]; then
+    MULTIHOME_HOME="$($MULTIHOME)"
+fi
+if [ -n "$MULTIHOME_HOME" ]; then
     # Save HOME
     HOME_OLD="$HOME"
     # Redeclare HOME
-    HOME="$($MULTIHOME)"
+    HOME="$MULTIHOME_HOME"
     # Switch to new HOME
     if [ "$HOME" != "$HOME_OLD" ]; then
         cd "$HOME"
     fi
 fi
+unset MULTIHOME_HOST MULTIHOME_HOME
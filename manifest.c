@@ -0,0 +1,541 @@
+#include "multihome.h"
+
+/**
+ * Copy manifest
+ *
+ * Every file, link and directory that multihome places in a home directory is
+ * recorded together with the metadata of its source. During an update a source
+ * whose metadata still matches its record is skipped as long as the destination
+ * is still in place with the size and mtime of that copy (one lstat, no reads).
+ *
+ * LAYOUT:
+ *     struct ManifestHeader
+ *     struct ManifestEntry[count]
+ *     char strings[strings_size]   (NUL terminated paths, referenced by offset)
+ */
+
+struct ManifestHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+    uint64_t strings_size;
+};
+
+struct ManifestEntry {
+    int64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t ino;
+    uint64_t hash;
+    uint32_t path;              // string table offset
+    uint32_t mode;
+};
+
+/**
+ * FNV-1a 64-bit hash
+ * @param hash initial value (MANIFEST_HASH_INIT) or the result of a previous call
+ * @param data input
+ * @param len length of input
+ * @return updated hash
+ */
+uint64_t hash_fnv1a(uint64_t hash, const void *data, size_t len) {
+    const unsigned char *ptr = data;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= ptr[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/**
+ * Hash the contents of a file
+ * @param path path to file
+ * @param hash output
+ * @return 0=success, -1=error (errno set)
+ */
+int hash_file(const char *path, uint64_t *hash) {
+    char buf[BUFSIZ * 8];
+    ssize_t n;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_NOFOLLOW);
+    if (fd < 0) {
+        return -1;
+    }
+
+    *hash = MANIFEST_HASH_INIT;
+    while ((n = read(fd, buf, sizeof(buf))) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            int err = errno;
+            close(fd);
+            errno = err;
+            return -1;
+        }
+        *hash = hash_fnv1a(*hash, buf, n);
+    }
+    close(fd);
+
+    // Zero is reserved for "not hashed"
+    if (*hash == 0) {
+        *hash = 1;
+    }
+    return 0;
+}
+
+/**
+ * Locate the slot for path (either its record or the empty slot where it belongs)
+ */
+static struct ManifestRecord *manifest_slot(struct Manifest *m, const char *path) {
+    size_t i;
+
+    i = hash_fnv1a(MANIFEST_HASH_INIT, path, strlen(path)) & (m->alloc - 1);
+    while (m->table[i].path != NULL && strcmp(m->table[i].path, path) != 0) {
+        i = (i + 1) & (m->alloc - 1);
+    }
+    return &m->table[i];
+}
+
+/**
+ * Grow the table when it is more than half full
+ */
+static void manifest_reserve(struct Manifest *m) {
+    struct ManifestRecord *old;
+    size_t old_alloc;
+
+    if (m->alloc && (m->count + 1) * 2 <= m->alloc) {
+        return;
+    }
+
+    old = m->table;
+    old_alloc = m->alloc;
+    m->alloc = old_alloc ? old_alloc * 2 : 1024;
+    m->table = calloc(m->alloc, sizeof(*m->table));
+    if (m->table == NULL) {
+        perror("manifest");
+        exit(1);
+    }
+
+    for (size_t i = 0; i < old_alloc; i++) {
+        if (old[i].path != NULL) {
+            *manifest_slot(m, old[i].path) = old[i];
+        }
+    }
+    free(old);
+}
+
+/**
+ * Insert or replace a record (caller holds the lock)
+ */
+static struct ManifestRecord *manifest_put(struct Manifest *m, const char *path) {
+    struct ManifestRecord *rec;
+
+    manifest_reserve(m);
+    rec = manifest_slot(m, path);
+    if (rec->path == NULL) {
+        rec->path = strdup(path);
+        if (rec->path == NULL) {
+            perror("manifest");
+            exit(1);
+        }
+        m->count++;
+    }
+    return rec;
+}
+
+/**
+ * Initialize an empty manifest
+ * @param m manifest
+ */
+void manifest_init(struct Manifest *m) {
+    memset(m, 0, sizeof(*m));
+    pthread_mutex_init(&m->lock, NULL);
+    m->generation = 1;
+}
+
+/**
+ * Load a manifest from disk
+ *
+ * A missing or unreadable manifest is not an error. The result is simply empty
+ * and every entry will be compared against its destination as usual.
+ *
+ * @param m manifest (initialized by this function)
+ * @param filename path to manifest
+ * @return number of records loaded
+ */
+size_t manifest_load(struct Manifest *m, const char *filename) {
+    struct ManifestHeader header;
+    struct ManifestEntry *entries;
+    char *strings;
+    FILE *fp;
+
+    manifest_init(m);
+    fp = fopen(filename, "rb");
+    if (fp == NULL) {
+        return 0;
+    }
+
+    entries = NULL;
+    strings = NULL;
+    if (fread(&header, sizeof(header), 1, fp) != 1
+            || memcmp(header.magic, MANIFEST_MAGIC, sizeof(header.magic)) != 0
+            || header.version != MANIFEST_VERSION) {
+        goto manifest_load_done;
+    }
+
+    entries = calloc(header.count + 1, sizeof(*entries));
+    strings = malloc(header.strings_size + 1);
+    if (entries == NULL || strings == NULL) {
+        goto manifest_load_done;
+    }
+    if (fread(entries, sizeof(*entries), header.count, fp) != header.count
+            || fread(strings, 1, header.strings_size, fp) != header.strings_size) {
+        goto manifest_load_done;
+    }
+    strings[header.strings_size] = '\0';
+
+    // Records loaded from disk belong to the previous generation until they are seen
+    m->generation = 2;
+    for (size_t i = 0; i < header.count; i++) {
+        struct ManifestRecord *rec;
+        if (entries[i].path >= header.strings_size) {
+            continue;
+        }
+        rec = manifest_put(m, &strings[entries[i].path]);
+        rec->mode = entries[i].mode;
+        rec->size = entries[i].size;
+        rec->mtime_sec = entries[i].mtime_sec;
+        rec->mtime_nsec = entries[i].mtime_nsec;
+        rec->ino = entries[i].ino;
+        rec->hash = entries[i].hash;
+        rec->generation = 1;
+    }
+
+manifest_load_done:
+    free(entries);
+    free(strings);
+    fclose(fp);
+    return m->count;
+}
+
+/**
+ * Write the records seen during this run to disk atomically
+ * @param m manifest
+ * @param filename path to manifest
+ * @return 0=success, -1=error (errno set)
+ */
+int manifest_save(struct Manifest *m, const char *filename) {
+    struct ManifestHeader header;
+    char tmp[PATH_MAX];
+    uint32_t offset;
+    FILE *fp;
+    int fd;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MANIFEST_MAGIC, sizeof(header.magic));
+    header.version = MANIFEST_VERSION;
+    for (size_t i = 0; i < m->alloc; i++) {
+        struct ManifestRecord *rec = &m->table[i];
+        if (rec->path != NULL && rec->generation == m->generation) {
+            header.count++;
+            header.strings_size += strlen(rec->path) + 1;
+        }
+    }
+
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", filename);
+    fd = mkstemp(tmp);
+    if (fd < 0) {
+        return -1;
+    }
+    fp = fdopen(fd, "wb");
+    if (fp == NULL) {
+        int err = errno;
+        close(fd);
+        unlink(tmp);
+        errno = err;
+        return -1;
+    }
+
+    fwrite(&header, sizeof(header), 1, fp);
+    offset = 0;
+    for (size_t i = 0; i < m->alloc; i++) {
+        struct ManifestRecord *rec = &m->table[i];
+        struct ManifestEntry entry;
+        if (rec->path == NULL || rec->generation != m->generation) {
+            continue;
+        }
+        memset(&entry, 0, sizeof(entry));
+        entry.size = rec->size;
+        entry.mtime_sec = rec->mtime_sec;
+        entry.mtime_nsec = rec->mtime_nsec;
+        entry.ino = rec->ino;
+        entry.hash = rec->hash;
+        entry.mode = rec->mode;
+        entry.path = offset;
+        offset += strlen(rec->path) + 1;
+        fwrite(&entry, sizeof(entry), 1, fp);
+    }
+    for (size_t i = 0; i < m->alloc; i++) {
+        struct ManifestRecord *rec = &m->table[i];
+        if (rec->path != NULL && rec->generation == m->generation) {
+            fwrite(rec->path, 1, strlen(rec->path) + 1, fp);
+        }
+    }
+
+    if (ferror(fp)) {
+        fclose(fp);
+        unlink(tmp);
+        errno = EIO;
+        return -1;
+    }
+    if (fclose(fp) != 0 || rename(tmp, filename) < 0) {
+        int err = errno;
+        unlink(tmp);
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Release resources held by a manifest
+ * @param m manifest
+ */
+void manifest_free(struct Manifest *m) {
+    for (size_t i = 0; i < m->alloc; i++) {
+        free(m->table[i].path);
+    }
+    free(m->table);
+    free(m->index);
+    pthread_mutex_destroy(&m->lock);
+    memset(m, 0, sizeof(*m));
+}
+
+/**
+ * Check whether dest was produced from a source with identical metadata
+ *
+ * A match also marks the record as seen, so it is kept when the manifest is saved.
+ *
+ * @param m manifest
+ * @param dest destination path
+ * @param st source metadata
+ * @param hash output: content hash from the record, or 0 (may be NULL)
+ * @return 1=unchanged, 0=changed or unknown
+ */
+int manifest_match(struct Manifest *m, const char *dest, struct stat *st, uint64_t *hash) {
+    struct ManifestRecord *rec;
+    int result;
+
+    result = 0;
+    if (hash) {
+        *hash = 0;
+    }
+
+    pthread_mutex_lock(&m->lock);
+    if (m->alloc) {
+        rec = manifest_slot(m, dest);
+        if (rec->path != NULL) {
+            if (hash) {
+                *hash = rec->hash;
+            }
+            if (rec->mode == st->st_mode
+                    && rec->size == st->st_size
+                    && rec->mtime_sec == st->st_mtim.tv_sec
+                    && rec->mtime_nsec == st->st_mtim.tv_nsec
+                    && rec->ino == st->st_ino) {
+                rec->generation = m->generation;
+                result = 1;
+            }
+        }
+    }
+    pthread_mutex_unlock(&m->lock);
+    return result;
+}
+
+/**
+ * Record that dest now holds a copy of a source
+ * @param m manifest
+ * @param dest destination path
+ * @param st source metadata
+ * @param hash content hash (0 if not computed)
+ */
+void manifest_update(struct Manifest *m, const char *dest, struct stat *st, uint64_t hash) {
+    struct ManifestRecord *rec;
+
+    pthread_mutex_lock(&m->lock);
+    rec = manifest_put(m, dest);
+    rec->mode = st->st_mode;
+    rec->size = st->st_size;
+    rec->mtime_sec = st->st_mtim.tv_sec;
+    rec->mtime_nsec = st->st_mtim.tv_nsec;
+    rec->ino = st->st_ino;
+    rec->hash = hash;
+    rec->generation = m->generation;
+    pthread_mutex_unlock(&m->lock);
+}
+
+static int manifest_path_cmp(const void *a, const void *b) {
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+/**
+ * Sort the paths of the records not seen yet, once (caller holds the lock)
+ *
+ * Only these records can be kept by manifest_keep(). Records added later belong to
+ * the current generation already, so the index never has to be rebuilt.
+ */
+static void manifest_index(struct Manifest *m) {
+    if (m->index != NULL) {
+        return;
+    }
+    m->index = calloc(m->count + 1, sizeof(*m->index));
+    if (m->index == NULL) {
+        perror("manifest");
+        exit(1);
+    }
+    m->index_count = 0;
+    for (size_t i = 0; i < m->alloc; i++) {
+        if (m->table[i].path != NULL && m->table[i].generation != m->generation) {
+            m->index[m->index_count++] = m->table[i].path;
+        }
+    }
+    qsort(m->index, m->index_count, sizeof(*m->index), manifest_path_cmp);
+}
+
+/**
+ * Keep every record below a directory that was skipped as a whole
+ * @param m manifest
+ * @param dest destination directory
+ */
+void manifest_keep(struct Manifest *m, const char *dest) {
+    char prefix[PATH_MAX];
+    size_t len;
+    size_t lo;
+    size_t hi;
+
+    len = (size_t) snprintf(prefix, sizeof(prefix), "%s/", dest);
+    pthread_mutex_lock(&m->lock);
+    manifest_index(m);
+
+    // First indexed path not sorting before the prefix. Every path below dest follows it.
+    lo = 0;
+    hi = m->index_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strcmp(m->index[mid], prefix) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    for (size_t i = lo; i < m->index_count && strncmp(m->index[i], prefix, len) == 0; i++) {
+        manifest_slot(m, m->index[i])->generation = m->generation;
+    }
+    pthread_mutex_unlock(&m->lock);
+}
+
+static int manifest_path_cmp_reverse(const void *a, const void *b) {
+    return strcmp(*(char *const *) b, *(char *const *) a);
+}
+
+/**
+ * List the destinations whose record was not seen during this run
+ *
+ * After a complete pass these are the entries whose source disappeared. Paths
+ * are sorted in reverse, so the contents of a directory come before it.
+ *
+ * @param m manifest
+ * @param count output: number of paths
+ * @return NULL terminated array of paths (release with free_array())
+ */
+char **manifest_stale(struct Manifest *m, size_t *count) {
+    char **result;
+
+    *count = 0;
+    pthread_mutex_lock(&m->lock);
+    result = calloc(m->count + 1, sizeof(*result));
+    if (result == NULL) {
+        perror("manifest");
+        exit(1);
+    }
+    for (size_t i = 0; i < m->alloc; i++) {
+        struct ManifestRecord *rec = &m->table[i];
+        if (rec->path == NULL || rec->generation == m->generation) {
+            continue;
+        }
+        result[*count] = strdup(rec->path);
+        if (result[*count] == NULL) {
+            perror("manifest");
+            exit(1);
+        }
+        (*count)++;
+    }
+    pthread_mutex_unlock(&m->lock);
+    qsort(result, *count, sizeof(*result), manifest_path_cmp_reverse);
+    return result;
+}
+
+/**
+ * Move every record below one directory to another
+ *
+ * Used when a home directory is built in a staging directory and renamed into
+ * place afterwards.
+ *
+ * @param m manifest
+ * @param from old directory prefix
+ * @param to new directory prefix
+ */
+void manifest_rebase(struct Manifest *m, const char *from, const char *to) {
+    struct ManifestRecord *old;
+    size_t old_alloc;
+    size_t len;
+
+    len = strlen(from);
+    pthread_mutex_lock(&m->lock);
+    // The index points at the paths replaced below
+    free(m->index);
+    m->index = NULL;
+    m->index_count = 0;
+    old = m->table;
+    old_alloc = m->alloc;
+    if (old_alloc == 0) {
+        pthread_mutex_unlock(&m->lock);
+        return;
+    }
+    m->table = calloc(old_alloc, sizeof(*m->table));
+    if (m->table == NULL) {
+        perror("manifest");
+        exit(1);
+    }
+    m->alloc = old_alloc;
+    m->count = 0;
+
+    for (size_t i = 0; i < old_alloc; i++) {
+        struct ManifestRecord *rec;
+        char path[PATH_MAX];
+
+        if (old[i].path == NULL) {
+            continue;
+        }
+        if (strncmp(old[i].path, from, len) == 0 && (old[i].path[len] == '/' || old[i].path[len] == '\0')) {
+            snprintf(path, sizeof(path), "%s%s", to, old[i].path + len);
+        } else {
+            snprintf(path, sizeof(path), "%s", old[i].path);
+        }
+        free(old[i].path);
+        old[i].path = NULL;
+
+        rec = manifest_put(m, path);
+        rec->mode = old[i].mode;
+        rec->size = old[i].size;
+        rec->mtime_sec = old[i].mtime_sec;
+        rec->mtime_nsec = old[i].mtime_nsec;
+        rec->ino = old[i].ino;
+        rec->hash = old[i].hash;
+        rec->generation = old[i].generation;
+    }
+    free(old);
+    pthread_mutex_unlock(&m->lock);
+}
@@ -0,0 +1,303 @@
+#include "multihome.h"
+
+/**
+ * Combined host_group matcher
+ *
+ * Every rule contributes one needle: the pattern itself for literal rules, or a
+ * substring any match of a regular expression must contain. The needles are
+ * compiled into a single Aho-Corasick automaton, so one pass over a hostname
+ * yields the set of rules that can possibly match it. The caller then confirms
+ * candidates in rule order, which keeps first-match-wins semantics while running
+ * the regex engine only for rules whose needle occurs in the hostname.
+ */
+
+#define MATCHER_ROOT 0
+
+/**
+ * Prepare a matcher
+ * @param m matcher
+ * @param rules number of rules
+ */
+void matcher_init(struct Matcher *m, size_t rules) {
+    memset(m, 0, sizeof(*m));
+    m->rules = rules;
+    m->words = (rules + 63) / 64;
+    m->needles = calloc(rules + 1, sizeof(*m->needles));
+    m->always = calloc(m->words + 1, sizeof(*m->always));
+    m->candidates = calloc(m->words + 1, sizeof(*m->candidates));
+    if (m->needles == NULL || m->always == NULL || m->candidates == NULL) {
+        perror("matcher");
+        exit(1);
+    }
+}
+
+/**
+ * Register the needle of a rule
+ * @param m matcher
+ * @param rule rule index
+ * @param needle substring present in every hostname the rule matches ("" = any hostname)
+ */
+void matcher_add(struct Matcher *m, size_t rule, const char *needle) {
+    if (*needle == '\0') {
+        m->always[rule / 64] |= 1ULL << (rule % 64);
+        return;
+    }
+    m->needles[rule] = strdup(needle);
+    if (m->needles[rule] == NULL) {
+        perror("matcher");
+        exit(1);
+    }
+}
+
+/**
+ * Compile the registered needles into a deterministic automaton
+ *
+ * Bytes that occur in no needle share one input class, which keeps the
+ * transition table small. Missing transitions are filled in from the failure
+ * links, so scanning a hostname costs one table lookup per character.
+ *
+ * @param m matcher
+ */
+void matcher_build(struct Matcher *m) {
+    int32_t *fail;
+    int32_t *queue;
+    size_t states_max;
+    size_t head;
+    size_t tail;
+
+    // Input classes
+    states_max = 1;
+    m->classes_count = 1;
+    for (size_t i = 0; i < m->rules; i++) {
+        if (m->needles[i] == NULL) {
+            continue;
+        }
+        for (const unsigned char *ch = (const unsigned char *) m->needles[i]; *ch; ch++) {
+            if (m->classes[*ch] == 0) {
+                m->classes[*ch] = (unsigned char) m->classes_count++;
+            }
+            states_max++;
+        }
+    }
+
+    m->next = malloc(states_max * m->classes_count * sizeof(*m->next));
+    m->dict = calloc(states_max, sizeof(*m->dict));
+    m->out_head = calloc(states_max, sizeof(*m->out_head));
+    m->out_rule = calloc(m->rules + 1, sizeof(*m->out_rule));
+    m->out_link = calloc(m->rules + 1, sizeof(*m->out_link));
+    fail = calloc(states_max, sizeof(*fail));
+    queue = calloc(states_max, sizeof(*queue));
+    if (m->next == NULL || m->dict == NULL || m->out_head == NULL || m->out_rule == NULL
+            || m->out_link == NULL || fail == NULL || queue == NULL) {
+        perror("matcher");
+        exit(1);
+    }
+    for (size_t i = 0; i < states_max * m->classes_count; i++) {
+        m->next[i] = -1;
+    }
+    for (size_t i = 0; i < states_max; i++) {
+        m->out_head[i] = -1;
+        m->dict[i] = -1;
+    }
+
+    // Trie of needles. Rules sharing a needle share its final state.
+    m->states_count = 1;
+    for (size_t i = 0; i < m->rules; i++) {
+        int32_t state;
+        size_t out;
+
+        if (m->needles[i] == NULL) {
+            continue;
+        }
+        state = MATCHER_ROOT;
+        for (const unsigned char *ch = (const unsigned char *) m->needles[i]; *ch; ch++) {
+            int32_t *next = &m->next[state * m->classes_count + m->classes[*ch]];
+            if (*next < 0) {
+                *next = (int32_t) m->states_count++;
+            }
+            state = *next;
+        }
+        out = m->out_count++;
+        m->out_rule[out] = (int32_t) i;
+        m->out_link[out] = m->out_head[state];
+        m->out_head[state] = (int32_t) out;
+    }
+
+    // Breadth first, so a state's failure target is complete before the state itself
+    head = tail = 0;
+    for (size_t c = 0; c < m->classes_count; c++) {
+        int32_t *next = &m->next[MATCHER_ROOT * m->classes_count + c];
+        if (*next < 0) {
+            *next = MATCHER_ROOT;
+        } else {
+            fail[*next] = MATCHER_ROOT;
+            queue[tail++] = *next;
+        }
+    }
+    while (head < tail) {
+        int32_t state = queue[head++];
+
+        // Nearest proper suffix that completes a needle
+        m->dict[state] = m->out_head[fail[state]] >= 0 ? fail[state] : m->dict[fail[state]];
+
+        for (size_t c = 0; c < m->classes_count; c++) {
+            int32_t *next = &m->next[state * m->classes_count + c];
+            int32_t target = m->next[fail[state] * m->classes_count + c];
+            if (*next < 0) {
+                *next = target;
+            } else {
+                fail[*next] = target;
+                queue[tail++] = *next;
+            }
+        }
+    }
+    free(queue);
+    free(fail);
+}
+
+/**
+ * Find the rules that may match a hostname
+ * @param m matcher
+ * @param text hostname
+ * @return bit set of candidate rules (valid until the next call)
+ */
+const uint64_t *matcher_scan(struct Matcher *m, const char *text) {
+    int32_t state;
+
+    memcpy(m->candidates, m->always, m->words * sizeof(*m->candidates));
+    state = MATCHER_ROOT;
+    for (const unsigned char *ch = (const unsigned char *) text; *ch; ch++) {
+        state = m->next[state * m->classes_count + m->classes[*ch]];
+        for (int32_t s = m->out_head[state] >= 0 ? state : m->dict[state]; s > MATCHER_ROOT; s = m->dict[s]) {
+            for (int32_t o = m->out_head[s]; o >= 0; o = m->out_link[o]) {
+                m->candidates[m->out_rule[o] / 64] |= 1ULL << (m->out_rule[o] % 64);
+            }
+        }
+    }
+    return m->candidates;
+}
+
+/**
+ * Extract a substring every match of a basic regular expression must contain
+ *
+ * The answer is conservative: the longest run of plain characters outside of
+ * groups that is not made optional by a following repetition operator. Patterns
+ * with alternatives at the top level yield an empty needle (any hostname is a
+ * candidate).
+ *
+ * @param pattern basic regular expression
+ * @param buf output buffer
+ * @param size size of buf
+ */
+void matcher_needle(const char *pattern, char *buf, size_t size) {
+    char run[PATH_MAX];
+    size_t run_len;
+    size_t best_len;
+    int depth;
+
+    buf[0] = '\0';
+    run_len = best_len = 0;
+    depth = 0;
+#define MATCHER_END_RUN() do { \
+        if (run_len > best_len && run_len < size) { \
+            memcpy(buf, run, run_len); \
+            buf[run_len] = '\0'; \
+            best_len = run_len; \
+        } \
+        run_len = 0; \
+    } while (0)
+
+    for (const char *p = pattern; *p; p++) {
+        if (*p == '\\' && p[1] != '\0') {
+            p++;
+            if (strchr(".[]*^$\\", *p) != NULL && depth == 0) {
+                if (p[1] != '*' && strncmp(p + 1, "\\{", 2) != 0 && strncmp(p + 1, "\\?", 2) != 0
+                        && strncmp(p + 1, "\\+", 2) != 0 && run_len < sizeof(run)) {
+                    run[run_len++] = *p;
+                    continue;
+                }
+            } else if (*p == '|' && depth == 0) {
+                // Alternatives at the top level have nothing in common
+                buf[0] = '\0';
+                return;
+            } else if (*p == '(') {
+                depth++;
+            } else if (*p == ')') {
+                depth--;
+            } else if (*p == '{') {
+                // Skip the interval
+                while (*p && !(p[0] == '\\' && p[1] == '}')) {
+                    p++;
+                }
+                if (*p) {
+                    p++;
+                }
+            }
+            MATCHER_END_RUN();
+            continue;
+        }
+        if (*p == '[') {
+            // Skip the bracket expression, including [:class:], [.coll.] and [=equiv=]
+            p++;
+            if (*p == '^') {
+                p++;
+            }
+            if (*p == ']') {
+                p++;
+            }
+            while (*p && *p != ']') {
+                if (*p == '[' && (p[1] == ':' || p[1] == '.' || p[1] == '=')) {
+                    char close = p[1];
+                    p += 2;
+                    while (*p && !(p[0] == close && p[1] == ']')) {
+                        p++;
+                    }
+                    if (*p) {
+                        p++;
+                    }
+                }
+                if (*p) {
+                    p++;
+                }
+            }
+            if (*p == '\0') {
+                p--;
+            }
+            MATCHER_END_RUN();
+            continue;
+        }
+        if (strchr(".*^$", *p) != NULL || depth > 0) {
+            MATCHER_END_RUN();
+            continue;
+        }
+        // A plain character is only required when no repetition operator follows it
+        if (p[1] == '*' || strncmp(p + 1, "\\{", 2) == 0 || strncmp(p + 1, "\\?", 2) == 0 || strncmp(p + 1, "\\+", 2) == 0) {
+            MATCHER_END_RUN();
+            continue;
+        }
+        if (run_len < sizeof(run)) {
+            run[run_len++] = *p;
+        }
+    }
+    MATCHER_END_RUN();
+#undef MATCHER_END_RUN
+}
+
+/**
+ * Release a matcher
+ * @param m matcher
+ */
+void matcher_free(struct Matcher *m) {
+    for (size_t i = 0; m->needles && i < m->rules; i++) {
+        free(m->needles[i]);
+    }
+    free(m->needles);
+    free(m->next);
+    free(m->dict);
+    free(m->out_head);
+    free(m->out_rule);
+    free(m->out_link);
+    free(m->always);
+    free(m->candidates);
+    memset(m, 0, sizeof(*m));
+}
@@ -6,696 +6,1526 @@
 
 
 /**
- * Globals
+ * State of this invocation
  */
-struct {
-    char path_new[PATH_MAX];
-    char path_old[PATH_MAX];
-    char path_topdir[PATH_MAX];
-    char path_root[PATH_MAX];
-    char marker[PATH_MAX];
-    char entry_point[PATH_MAX];
-    char config_dir[PATH_MAX];
-    char config_host_group[PATH_MAX];
-    char config_transfer[PATH_MAX];
-    char config_skeleton[PATH_MAX];
-    char scripts_dir[PATH_MAX];
-} multihome;
+static struct Multihome multihome;
 
 /**
- * Generic function to free an array of pointers
- * @param arr an array
- * @param nelem if nelem is 0 free until NULL. >0 free until nelem
+ * Write one template line, expanding its directives
+ *
+ * DIRECTIVES:
+ *     %s  path to the multihome program
+ *     %o  path to the script being generated
+ *     %c  path to the host_group configuration
+ *     %t  path to the storage configuration
+ *     %m  name of the home directory marker file
+ *     %u  name of the last-used stamp file (see --gc)
+ *     %1  host name (host table lines only)
+ *     %2  home directory of that host (host table lines only)
+ *     %%  a literal percent sign
+ *
+ * Anything else following a percent sign is written unchanged.
+ *
+ * @param fp output stream
+ * @param line template line
+ * @param path_output path to the script being generated
+ * @param host host table entry (may be NULL)
  */
-void free_array(void **arr, size_t nelem) {
-    if (nelem) {
-        for (size_t i = 0; i < nelem; i++) {
-            free(arr[i]);
+static void render_line(FILE *fp, const char *line, const char *path_output, struct ResolveHost *host) {
+    for (const char *ch = line; *ch; ch++) {
+        const char *value;
+
+        if (*ch != '%' || !ch[1]) {
+            fputc(*ch, fp);
+            continue;
         }
-    } else {
-        for (size_t i = 0; arr[i] != NULL; i++) {
-            free(arr[i]);
+
+        switch (ch[1]) {
+            case 's':
+                value = multihome.entry_point;
+                break;
+            case 'o':
+                value = path_output;
+                break;
+            case 'c':
+                value = multihome.config_host_group;
+                break;
+            case 't':
+                value = multihome.config_storage;
+                break;
+            case 'm':
+                value = MULTIHOME_MARKER;
+                break;
+            case 'u':
+                value = MULTIHOME_USED;
+                break;
+            case '1':
+                value = host ? host->nodename : NULL;
+                break;
+            case '2':
+                value = host ? host->path_new : NULL;
+                break;
+            case '%':
+                value = "%";
+                break;
+            default:
+                value = NULL;
+                break;
+        }
+
+        if (value == NULL) {
+            fputc(*ch, fp);
+            continue;
         }
+        fputs(value, fp);
+        ch++;
     }
-    free(arr);
 }
 
 /**
- * Return the count of a substring in a string
- * @param s Input string
- * @param sub Input substring
- * @return count
+ * Render an initialization script template
+ *
+ * Templates are streamed one line at a time, so their size is not limited. A run
+ * of lines beginning with "%@" is the host table: the run is written once for
+ * every host with a valid resolution record, with the prefix removed.
+ *
+ * @param fp_input template
+ * @param fp_output generated script
+ * @param path_output path to the generated script
+ * @param hosts known hosts
+ * @param hosts_count number of known hosts
+ * @return 0=success, -1=error (errno set)
  */
-ssize_t count_substrings(const char *s, char *sub) {
-    char *str;
-    char *str_orig;
-    size_t str_length;
-    size_t sub_length;
-    ssize_t result;
-
-    str = strdup(s);
-    if (str == NULL) {
-        return -1;
-    }
-
-    str_orig = str;
-    str_length = strlen(str);
-    sub_length = strlen(sub);
-    result = 0;
-
-    for (size_t i = 0; i < str_length; i++) {
-        char *ptr;
-        ptr = strstr(str, sub);
+int render_template(FILE *fp_input, FILE *fp_output, const char *path_output, struct ResolveHost *hosts, size_t hosts_count) {
+    char *line;
+    size_t line_alloc;
+    char **block;
+    size_t block_count;
+    size_t block_alloc;
+    int done;
+
+    line = NULL;
+    line_alloc = 0;
+    block = NULL;
+    block_count = 0;
+    block_alloc = 0;
+    done = 0;
+
+    while (!done) {
+        int is_table;
+
+        done = getline(&line, &line_alloc, fp_input) < 0;
+        is_table = !done && strncmp(line, "%@", 2) == 0;
+
+        // Emit the host table once the run of "%@" lines ends
+        if (!is_table && block_count) {
+            for (size_t i = 0; i < hosts_count; i++) {
+                for (size_t j = 0; j < block_count; j++) {
+                    render_line(fp_output, block[j], path_output, &hosts[i]);
+                }
+            }
+            for (size_t j = 0; j < block_count; j++) {
+                free(block[j]);
+            }
+            block_count = 0;
+        }
 
-        if (ptr) {
-            result++;
-        } else {
+        if (done) {
             break;
         }
-
-        if (i < str_length - sub_length) {
-            str = ptr + sub_length;
+        if (is_table) {
+            if (block_count == block_alloc) {
+                char **tmp;
+                block_alloc = block_alloc ? block_alloc * 2 : 8;
+                tmp = realloc(block, block_alloc * sizeof(*tmp));
+                if (tmp == NULL) {
+                    perror("template");
+                    exit(1);
+                }
+                block = tmp;
+            }
+            block[block_count] = strdup(line + 2);
+            if (block[block_count] == NULL) {
+                perror("template");
+                exit(1);
+            }
+            block_count++;
+            continue;
         }
+        render_line(fp_output, line, path_output, NULL);
     }
 
-    free(str_orig);
-    return result;
+    free(block);
+    free(line);
+    return ferror(fp_input) || ferror(fp_output) ? -1 : 0;
 }
 
 /**
- * Split a string using a substring
- * @param sptr Input string
- * @param delim Substring to split on
- * @param num_alloc Address to store count of allocated records
- * @return NULL terminated array of strings
+ * Generate multihome initialization scripts
+ *
+ * Every host that has been resolved before is written into the scripts, so a shell
+ * on one of them can set HOME without running multihome at all. A script that
+ * cannot be generated is left as it was.
+ *
+ * @return 0=success, -1=one or more scripts could not be generated
  */
-char **split(const char *sptr, char *delim, size_t *num_alloc) {
-    char *s;
-    char *s_orig;
-    char **result;
-    char *token;
-
-    token = NULL;
-    result = NULL;
-    s = strdup(sptr);
-    s_orig = s;
-    if (s == NULL) {
-        return NULL;
-    }
+int write_init_script() {
+    struct ResolveHost *hosts;
+    size_t hosts_count;
+    DIR *d;
+    struct dirent *rec;
+    char date[100];
+    int status;
 
-    *num_alloc = count_substrings(s, delim);
-    if (*num_alloc < 0) {
-        goto split_die_2;
+    d = opendir(multihome.scripts_dir);
+    if (!d) {
+        perror(multihome.scripts_dir);
+        return -1;
     }
 
-    *num_alloc += 2;
-    result = calloc(*num_alloc, sizeof(char *));
+    status = 0;
 
-    if (result == NULL) {
-        goto split_die_1;
-    }
+    hosts = resolve_cache_list(multihome.path_old, &hosts_count);
+    while ((rec = readdir(d)) != NULL) {
+        if (rec->d_type == DT_REG && strstr(rec->d_name, "init.")) {
+            FILE *fp_input;
+            FILE *fp_output;
+            char *script_name;
+            char path_input[PATH_MAX];
+            char path_output[PATH_MAX];
+            char path_temp[PATH_MAX];
+            int fd;
 
-    for (size_t i = 0; (token = strsep(&s, delim)) != NULL; i++) {
-        result[i] = strdup(token);
-        if (result[i] == NULL) {
-            break;
+            script_name = basename(rec->d_name);
+            sprintf(path_input, "%s/%s", multihome.scripts_dir, script_name);
+            fp_input = fopen(path_input, "r");
+            if (!fp_input) {
+                perror(rec->d_name);
+                status = -1;
+                continue;
+            }
+
+            // Shells starting elsewhere may be reading the current script. Replace it atomically.
+            sprintf(path_output, "%s/%s", multihome.config_dir, script_name);
+            sprintf(path_temp, "%s.XXXXXX", path_output);
+            fd = mkstemp(path_temp);
+            if (fd < 0 || (fp_output = fdopen(fd, "w")) == NULL) {
+                perror(path_output);
+                if (fd >= 0) {
+                    close(fd);
+                    unlink(path_temp);
+                }
+                fclose(fp_input);
+                status = -1;
+                continue;
+            }
+            fchmod(fd, 0644);
+
+            get_timestamp(date, sizeof(date));
+            fprintf(fp_output, "# Version: %s\n", VERSION);
+            fprintf(fp_output, "# Generated: %s\n\n", date);
+            if (render_template(fp_input, fp_output, path_output, hosts, hosts_count) < 0) {
+                perror(path_input);
+                fclose(fp_input);
+                fclose(fp_output);
+                unlink(path_temp);
+                status = -1;
+                continue;
+            }
+            fclose(fp_input);
+            if (fclose(fp_output) != 0 || rename(path_temp, path_output) < 0) {
+                perror(path_output);
+                unlink(path_temp);
+                status = -1;
+            }
         }
     }
-
-split_die_1:
-    free(s_orig);
-split_die_2:
-    return result;
+    resolve_cache_list_free(hosts, hosts_count);
+    closedir(d);
+    return status;
 }
 
 /**
- * Using $PATH, return the location of _name
+ * Regenerate initialization scripts that were generated before
  *
- * If _name starts with "./" return the absolute path to the file
+ * Called after a host was resolved the slow way, so the host (or a host_group
+ * change) is reflected in the scripts and the next shell needs no exec. This runs
+ * on the login path before the home directory is printed, so a failure (full
+ * quota, missing template) only costs the next shell an exec.
  *
- * This function returns local storage
- *
- * @param _name program name
- * @return path, or NULL if not found
+ * @param argv0 program name used to locate multihome
  */
-char *find_program(const char *_name) {
-    static char buf[PATH_MAX];
-    char *pathvar;
-    char **parts;
-    size_t parts_count;
+void refresh_init_script(const char *argv0) {
+    char path[PATH_MAX];
+    struct dirent *rec;
     int found;
+    DIR *d;
 
-    pathvar = getenv("PATH");
-    if (pathvar == NULL) {
-        return NULL;
+    d = opendir(multihome.config_dir);
+    if (!d) {
+        return;
+    }
+    found = 0;
+    while (!found && (rec = readdir(d)) != NULL) {
+        if (strncmp(rec->d_name, "init.", 5) == 0 && strchr(rec->d_name + 5, '.') == NULL) {
+            snprintf(path, sizeof(path), "%s/%s", multihome.scripts_dir, rec->d_name);
+            found = access(path, F_OK) == 0;
+        }
+    }
+    closedir(d);
+    if (!found) {
+        return;
     }
 
-    parts = split(pathvar, ":", &parts_count);
-    if (parts == NULL) {
-        return NULL;
+    if (find_program(argv0, multihome.entry_point) == NULL) {
+        return;
+    }
+    if (write_init_script() < 0) {
+        fprintf(stderr, "Unable to refresh initialization scripts in %s\n", multihome.config_dir);
     }
+}
 
-    memset(buf, '\0', sizeof(buf));
-    found = 0;
+/**
+ * Set by SIGINT/SIGTERM/SIGHUP to leave the watch loop
+ */
+static volatile sig_atomic_t user_watch_stop;
+
+static void user_watch_signal(int sig) {
+    (void) sig;
+    user_watch_stop = 1;
+}
 
-    // Return the absolute path of _name when:
-    // 1) Path starts with "./" (absolute)
-    // 2) Path starts with "/" (absolute)
-    // 3) Path contains "/" (relative)
-    //
-    // Obviously strstr will do this job all by itself, however it's like watching slow scan TV.
-    if (strncmp(_name, "./", 2) == 0 || strncmp(_name, "/", 1) == 0 || strstr(_name, "/") != NULL) {
-        if (access(_name, F_OK) == 0) {
-            found = 1;
-            realpath(_name, buf);
+/**
+ * Watch the sources of every T entry in the transfer configuration
+ *
+ * Wildcards are expanded once. Directories left out by X entries are not watched
+ * (the caller enables them with user_transfer_exclude()).
+ *
+ * @param w watch set
+ */
+static void user_watch_transfer(struct Watch *w) {
+    for (size_t i = 0; i < multihome.snapshot.header->transfer_count; i++) {
+        struct SnapshotTransfer *record;
+        char **sources;
+        size_t count;
+
+        record = &multihome.snapshot.transfers[i];
+        if (record->type != 'T') {
+            continue;
         }
-    } else {
-        for (int i = 0; parts[i] != NULL; i++) {
-            char tmp[PATH_MAX];
-            memset(tmp, '\0', sizeof(tmp));
-            strcat(tmp, parts[i]);
-            strcat(tmp, "/");
-            strcat(tmp, _name);
-            if (access(tmp, F_OK) == 0) {
-                found = 1;
-                realpath(tmp, buf);
-                break;
+
+        sources = user_transfer_sources(&multihome, record, &count);
+        for (size_t j = 0; j < count; j++) {
+            char *source = sources[j];
+            char dest[PATH_MAX];
+            char parent[PATH_MAX];
+            char name[PATH_MAX];
+            struct stat st;
+            int status;
+
+            // Same destination as user_transfer()
+            strcpy(name, source);
+            sprintf(dest, "%s/%s", multihome.path_new, basename(name));
+
+            if (lstat(source, &st) == 0 && S_ISDIR(st.st_mode)) {
+                char contents[PATH_MAX];
+                // Without a trailing slash the directory itself lands inside dest
+                if (source[strlen(source) - 1] == '/') {
+                    strcpy(contents, dest);
+                } else {
+                    snprintf(contents, sizeof(contents), "%s/%s", dest, basename(name));
+                }
+                strcpy(parent, source);
+                if (parent[strlen(parent) - 1] == '/') {
+                    parent[strlen(parent) - 1] = '\0';
+                }
+                status = watch_add(w, WATCH_KIND_TRANSFER, parent, NULL, NULL, contents);
+            } else {
+                // Files (and sources that do not exist yet) are watched through their parent
+                strcpy(parent, source);
+                status = watch_add(w, WATCH_KIND_TRANSFER, dirname(parent), basename(name), source, dest);
+            }
+            if (status < 0) {
+                fprintf(stderr, "watch: %s: %s\n", source, strerror(errno));
             }
         }
+        free_array((void **) sources, 0);
     }
+}
 
-    free_array((void**)parts, parts_count);
-    return found ? buf : NULL;
+/**
+ * Watch the user skeleton
+ * @param w watch set
+ */
+static void user_watch_skel(struct Watch *w) {
+    char skel[PATH_MAX];
+    size_t len;
+
+    strcpy(skel, multihome.config_skeleton);
+    len = strlen(skel);
+    if (len > 1 && skel[len - 1] == '/') {
+        skel[len - 1] = '\0';
+    }
+    if (watch_add(w, WATCH_KIND_SKEL, skel, NULL, NULL, multihome.path_new) < 0) {
+        fprintf(stderr, "watch: %s: %s\n", skel, strerror(errno));
+    }
 }
 
 /**
- * Create directories if they do not exist
- * @param path Filesystem path
- * @return int (0=success, -1=error (errno set))
+ * Apply one changed path
+ * @param change change reported by watch_wait()
+ * @param rewatch set when a transfer source turned into a directory
+ * @return 0=success, non-zero=error
  */
-int mkdirs(char *path) {
-    char **parts;
-    char tmp[PATH_MAX];
-    size_t parts_length;
-    memset(tmp, '\0', sizeof(tmp));
+static int user_watch_apply(struct WatchChange *change, int *rewatch) {
+    char source[PATH_MAX];
+    struct stat st;
+    int status;
 
-    parts = split(path, "/", &parts_length);
+    // The path may already be gone again. Removals are never propagated.
+    if (lstat(change->source, &st) < 0) {
+        return 0;
+    }
 
-    for (size_t i = 0; parts[i] != NULL; i++) {
-        if (i == 0 && strlen(parts[i]) == 0) {
-            strcat(tmp, "/");
-            continue;
+    // X entries only apply to transfers
+    if (change->kind == WATCH_KIND_TRANSFER && copy_excluded(change->source, st.st_mode)) {
+        return 0;
+    }
+    if (change->kind != WATCH_KIND_TRANSFER) {
+        user_transfer_exclude(&multihome, 0);
+    }
+
+    fprintf(stderr, "Updating: %s\n", change->dest);
+    if (change->exact) {
+        if (S_ISDIR(st.st_mode)) {
+            *rewatch = 1;
         }
+        status = copy(change->source, change->dest, COPY_UPDATE);
+    } else {
+        // Copy directory contents onto the matching destination directory
+        snprintf(source, sizeof(source), "%s%s", change->source, S_ISDIR(st.st_mode) ? "/" : "");
+        status = copy(source, change->dest, COPY_UPDATE);
+    }
+    user_transfer_exclude(&multihome, 1);
+    return status;
+}
+
+/**
+ * Propagate changes to the user skeleton, the transfer configuration and T
+ * sources into the new home directory as they happen
+ *
+ * @param debounce_ms quiet period before a batch of changes is applied
+ * @param checksum compare contents when source metadata changed
+ * @return 0=success, 1=error
+ */
+int user_watch(long debounce_ms, int checksum) {
+    struct Manifest manifest;
+    struct Watch watch;
+    struct sigaction sa;
+    int status;
+
+    if (watch_init(&watch) < 0) {
+        perror("inotify");
+        return 1;
+    }
 
-        strcat(tmp, parts[i]);
+    // Each batch only touches a few records. Keep the rest when the manifest is saved.
+    manifest_load(&manifest, multihome.manifest);
+    manifest_keep(&manifest, multihome.path_new);
+    copy_set_manifest(&manifest, checksum, 0);
 
-        if (tmp[strlen(tmp) - 1] != '/') {
-            strcat(tmp, "/");
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = user_watch_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGHUP, &sa, NULL);
+
+    if (watch_add(&watch, WATCH_KIND_CONFIG, multihome.config_dir, MULTIHOME_CFG_TRANSFER, multihome.config_transfer, NULL) < 0) {
+        fprintf(stderr, "watch: %s: %s\n", multihome.config_transfer, strerror(errno));
+    }
+    user_watch_skel(&watch);
+    user_transfer_exclude(&multihome, 1);
+    user_watch_transfer(&watch);
+    fprintf(stderr, "Watching for changes: %s\n", multihome.config_dir);
+
+    status = 0;
+    while (!user_watch_stop) {
+        struct WatchChange *changes;
+        ssize_t count;
+        int reload;
+        int rewatch;
+
+        count = watch_wait(&watch, debounce_ms, &changes);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("watch");
+            status = 1;
+            break;
         }
 
-        if (access(tmp, F_OK) == 0) {
-            continue;
+        reload = 0;
+        rewatch = 0;
+        for (ssize_t i = 0; i < count; i++) {
+            if (changes[i].kind == WATCH_KIND_CONFIG) {
+                reload = 1;
+                continue;
+            }
+            if (user_watch_apply(&changes[i], &rewatch) != 0) {
+                fprintf(stderr, "transfer: %s: %s -> %s\n", strerror(errno), changes[i].source, changes[i].dest);
+            }
+        }
+        watch_changes_free(changes, count);
+
+        if (reload) {
+            struct Snapshot next;
+            fprintf(stderr, "Reloading transfer configuration: %s\n", multihome.config_transfer);
+            if (snapshot_load(&next, multihome.config_snapshot, multihome.config_host_group, multihome.config_transfer) == 0) {
+                snapshot_free(&multihome.snapshot);
+                multihome.snapshot = next;
+                user_transfer(&multihome, multihome.path_new, COPY_UPDATE, TRANSFER_ALL);
+                user_transfer_exclude(&multihome, 1);
+                rewatch = 1;
+            }
+        }
+
+        // Events were dropped by the kernel. Fall back to a full update.
+        if (watch.overflow) {
+            fprintf(stderr, "Change notifications were lost, synchronizing everything\n");
+            user_transfer_exclude(&multihome, 0);
+            copy(multihome.config_skeleton, multihome.path_new, COPY_UPDATE);
+            user_transfer(&multihome, multihome.path_new, COPY_UPDATE, TRANSFER_ALL);
+            user_transfer_exclude(&multihome, 1);
+            watch_remove(&watch, WATCH_KIND_SKEL);
+            user_watch_skel(&watch);
+            rewatch = 1;
+        }
+
+        if (rewatch) {
+            watch_remove(&watch, WATCH_KIND_TRANSFER);
+            user_watch_transfer(&watch);
         }
 
-        if (mkdir(tmp, (mode_t) 0755) < 0) {
-            perror("mkdir");
-            return -1;
+        if (copy_get_backend() != COPY_BACKEND_RSYNC && manifest_save(&manifest, multihome.manifest) < 0) {
+            fprintf(stderr, "Unable to write manifest: %s: %s\n", multihome.manifest, strerror(errno));
         }
     }
 
-    free_array((void **)parts, parts_length);
-    return 0;
+    user_transfer_exclude(&multihome, 0);
+    copy_set_manifest(NULL, 0, 0);
+    manifest_free(&manifest);
+    watch_free(&watch);
+    return status;
 }
 
 /**
- * Execute a shell program
- * @param args (char *[]){"/path/to/program", "arg1", "arg2, ..., NULL};
- * @return exit code of program
+ * Shared state of an --update-all or --provision run
+ *
+ * lists holds the system skeleton, the user skeleton and one listing per source
+ * of a T record, each read once and applied to every home.
+ */
+struct UpdateAll {
+    char **homes;
+    size_t count;
+    size_t next;
+    size_t finished;
+    struct CopyList *lists;
+    size_t lists_count;
+    char ***sources;            // per transfer record, see user_transfer_sources()
+    size_t *sources_count;
+    size_t *lists_first;        // per T record: listing of its first source
+    int failed;
+    int provision;              // build missing homes instead of updating existing ones
+    long timeout;               // provision: seconds to wait for a concurrent login
+    size_t existing;            // provision: homes that were already initialized
+    pthread_mutex_t lock;
+};
+
+/**
+ * Bring one home directory up to date from the shared listings
+ * @param u run state
+ * @param home path to home directory (may be a staging directory)
+ * @param home_final where home will live once published (manifest paths refer to it)
+ * @param stats per-home totals
+ * @return 0=success, -1=one or more errors occurred
  */
-int shell(char *args[]) {
-    pid_t pid;
-    pid_t status;
+static int user_update_home(struct UpdateAll *u, const char *home, const char *home_final, struct CopyStats *stats) {
+    struct Manifest manifest;
+    char path_manifest[PATH_MAX];
+    int status;
 
     status = 0;
-    errno = 0;
+    snprintf(path_manifest, sizeof(path_manifest), "%s/%s", home, MULTIHOME_MANIFEST);
+    manifest_load(&manifest, path_manifest);
 
-    pid = fork();
-    if (pid == -1) {
-        fprintf(stderr, "fork failed\n");
-        exit(1);
-    } else if (pid == 0) {
-        int retval;
-        retval = execv(args[0], &args[0]);
-        exit(retval);
-    } else {
-        if (waitpid(pid, &status, WUNTRACED) > 0) {
-            if (WIFEXITED(status) && WEXITSTATUS(status)) {
-                if (WEXITSTATUS(status) == 127) {
-                    fprintf(stderr, "execvp failed\n");
-                    exit(1);
-                }
-            } else if (WIFSIGNALED(status))  {
-                fprintf(stderr, "signal received: %d\n", WIFSIGNALED(status));
-            }
-        } else {
-            fprintf(stderr, "waitpid() failed\n");
+    for (size_t i = 0; i < 2; i++) {
+        if (u->lists[i].count && copy_list_apply(&u->lists[i], home, COPY_UPDATE, &manifest, stats) < 0) {
+            status = -1;
         }
     }
-    return WEXITSTATUS(status);
-}
 
-/**
- * Copy files using rsync
- * @param source file or directory
- * @param dest file or directory
- * @param mode 0=direct copy, 1=update only
- * @return rsync exit code
- */
-int copy(char *source, char *dest, int mode) {
-    if (source == NULL || dest == NULL) {
-        fprintf(stderr, "copy failed. source and destination may not be NULL\n");
-        exit(1);
+    for (size_t i = 0; i < multihome.snapshot.header->transfer_count; i++) {
+        struct SnapshotTransfer *record;
+
+        record = &multihome.snapshot.transfers[i];
+        for (size_t j = 0; j < u->sources_count[i]; j++) {
+            struct CopyList *list;
+            const char *source;
+            char dest[PATH_MAX];
+            char name[PATH_MAX];
+
+            source = u->sources[i][j];
+            strcpy(name, source);
+            snprintf(dest, sizeof(dest), "%s/%s", home, basename(name));
+
+            switch (record->type) {
+                case 'L':
+                    // Replaces the skeleton's file like a login does (see plan_link())
+                    if (plan_link('L', source, dest) < 0) {
+                        fprintf(stderr, "symlink: %s: %s -> %s\n", strerror(errno), source, dest);
+                        status = -1;
+                    }
+                    break;
+                case 'H':
+                    if (plan_link('H', source, dest) < 0) {
+                        fprintf(stderr, "hardlink: %s: %s -> %s\n", strerror(errno), source, dest);
+                        status = -1;
+                    }
+                    break;
+                case 'T':
+                    list = &u->lists[u->lists_first[i] + j];
+                    if (!list->count || copy_list_apply(list, dest, COPY_UPDATE, &manifest, stats) < 0) {
+                        fprintf(stderr, "transfer: %s: %s -> %s\n", strerror(errno), source, dest);
+                        status = -1;
+                    }
+                    break;
+                default:
+                    break;
+            }
+        }
     }
 
-    char args[255];
-    memset(args, '\0', sizeof(args));
-    strcat(args, RSYNC_ARGS);
-    if (mode == COPY_UPDATE) {
-        strcat(args, "u");
+    if (strcmp(home, home_final) != 0) {
+        manifest_rebase(&manifest, home, home_final);
     }
-
-    return shell((char *[]){MULTIHOME_RSYNC_BIN, args, source, dest, NULL});
+    if (manifest_save(&manifest, path_manifest) < 0) {
+        fprintf(stderr, "Unable to write manifest: %s: %s\n", path_manifest, strerror(errno));
+    }
+    manifest_free(&manifest);
+    return status;
 }
 
-/**
- * Create or update the modified time on a file
- * @param filename path to file
- * @return 0=success, -1=error (errno set)
- */
-int touch(char *filename) {
-    FILE *fp;
-    fp = fopen(filename, "w");
-    fflush(fp);
-    if (fp == NULL) {
+struct UpdateAllHome {
+    struct UpdateAll *u;
+    struct CopyStats *stats;
+};
+
+static int user_provision_populate(const char *home, const char *home_final, void *arg) {
+    struct UpdateAllHome *h = arg;
+
+    if (home_prepare(&multihome, home) < 0) {
         return -1;
     }
-    fclose(fp);
-    return 0;
+    return user_update_home(h->u, home, home_final, h->stats);
+}
+
+static void *user_update_all_worker(void *arg) {
+    struct UpdateAll *u = arg;
+
+    while (1) {
+        struct UpdateAllHome h;
+        struct CopyStats stats;
+        const char *result;
+        size_t i;
+        int status;
+
+        i = __atomic_fetch_add(&u->next, 1, __ATOMIC_RELAXED);
+        if (i >= u->count) {
+            break;
+        }
+
+        memset(&stats, 0, sizeof(stats));
+        if (u->provision) {
+            h.u = u;
+            h.stats = &stats;
+            status = home_build(u->homes[i], u->timeout, user_provision_populate, &h);
+            result = status < 0 ? "failed" : status ? "already initialized" : "provisioned";
+        } else {
+            status = user_update_home(u, u->homes[i], u->homes[i], &stats);
+            result = status < 0 ? "failed" : "updated";
+        }
+
+        pthread_mutex_lock(&u->lock);
+        u->finished++;
+        if (status < 0) {
+            u->failed++;
+        } else if (status > 0) {
+            u->existing++;
+        }
+        fprintf(stderr, "[%zu/%zu] %s: %s (files: %llu, links: %llu, bytes: %llu, unchanged: %llu, errors: %llu)\n",
+                u->finished, u->count, u->homes[i], result,
+                (unsigned long long) stats.files, (unsigned long long) stats.links,
+                (unsigned long long) stats.bytes, (unsigned long long) stats.skipped,
+                (unsigned long long) stats.errors);
+        pthread_mutex_unlock(&u->lock);
+    }
+    return NULL;
 }
 
 /**
- * Get date and time as a string
+ * Apply the skeletons and transfers to every home directory of a run
  *
- * @return pointer to buffer containing date and time (do not free())
+ * The skeletons and T sources are scanned once. A bounded pool of threads (see
+ * --jobs) then applies them to each home directory with that home's manifest.
+ *
+ * @param u run state (homes filled in)
+ * @param checksum compare contents when source metadata changed
  */
-char *get_timestamp() {
-    static char result[100];
-    struct tm *tm;
-    time_t now;
-
-    // Get current time
-    time(&now);
-
-    // Convert current time to tm struct
-    tm = localtime(&now);
+static void user_update_all_run(struct UpdateAll *u, int checksum) {
+    pthread_t *threads;
+    size_t transfer_count;
+    size_t workers;
+    size_t started;
+    size_t phase;
+
+    // Read every source once
+    phase = trace_begin(u->provision ? "provision_scan" : "update_all_scan");
+    transfer_count = multihome.snapshot.header->transfer_count;
+    u->sources = calloc(transfer_count + 1, sizeof(*u->sources));
+    u->sources_count = calloc(transfer_count + 1, sizeof(*u->sources_count));
+    u->lists_first = calloc(transfer_count + 1, sizeof(*u->lists_first));
+    if (u->sources == NULL || u->sources_count == NULL || u->lists_first == NULL) {
+        perror("update-all");
+        exit(1);
+    }
+    user_transfer_exclude(&multihome, 1);
+    u->lists_count = 2;
+    for (size_t i = 0; i < transfer_count; i++) {
+        if (multihome.snapshot.transfers[i].type == 'X') {
+            continue;
+        }
+        u->sources[i] = user_transfer_sources(&multihome, &multihome.snapshot.transfers[i], &u->sources_count[i]);
+        if (multihome.snapshot.transfers[i].type == 'T') {
+            u->lists_first[i] = u->lists_count;
+            u->lists_count += u->sources_count[i];
+        }
+    }
+    u->lists = calloc(u->lists_count, sizeof(*u->lists));
+    if (u->lists == NULL) {
+        perror("update-all");
+        exit(1);
+    }
+    // X entries prune transfers only, as in a login (see plan_execute())
+    copy_exclude_lift(1);
+    fprintf(stderr, "Scanning account skeleton: %s\n", OS_SKEL_DIR);
+    copy_list_scan(&u->lists[0], OS_SKEL_DIR);
+    fprintf(stderr, "Scanning user-defined account skeleton: %s\n", multihome.config_skeleton);
+    copy_list_scan(&u->lists[1], multihome.config_skeleton);
+    copy_exclude_lift(0);
+    for (size_t i = 0; i < transfer_count; i++) {
+        if (multihome.snapshot.transfers[i].type != 'T') {
+            continue;
+        }
+        for (size_t j = 0; j < u->sources_count[i]; j++) {
+            copy_list_scan(&u->lists[u->lists_first[i] + j], u->sources[i][j]);
+        }
+    }
+    user_transfer_exclude(&multihome, 0);
+    trace_end(phase, 0);
+
+    // Fan out
+    phase = trace_begin(u->provision ? "provision" : "update_all");
+    copy_set_manifest(NULL, checksum, 0);
+    workers = copy_get_jobs() < u->count ? copy_get_jobs() : u->count;
+    threads = calloc(workers, sizeof(*threads));
+    if (threads == NULL) {
+        perror("update-all");
+        exit(1);
+    }
+    started = 0;
+    for (size_t i = 0; i < workers; i++) {
+        if (pthread_create(&threads[i], NULL, user_update_all_worker, u) != 0) {
+            break;
+        }
+        started++;
+    }
+    if (started == 0) {
+        user_update_all_worker(u);
+    }
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    trace_end(phase, u->failed ? 1 : 0);
 
-    // Write result to buffer
-    memset(result, '\0', sizeof(result));
-    sprintf(result, "%02d-%02d-%d @ %02d:%02d:%02d",
-            tm->tm_mon + 1, tm->tm_mday, tm->tm_year + 1900,
-            tm->tm_hour, tm->tm_min, tm->tm_sec);
+    for (size_t i = 0; i < u->lists_count; i++) {
+        copy_list_free(&u->lists[i]);
+    }
+    for (size_t i = 0; i < transfer_count; i++) {
+        if (u->sources[i] != NULL) {
+            free_array((void **) u->sources[i], 0);
+        }
+    }
+    free(u->lists);
+    free(u->sources);
+    free(u->sources_count);
+    free(u->lists_first);
+    free(threads);
+}
 
-    return result;
+static int user_home_cmp(const void *a, const void *b) {
+    return strcmp(*(char * const *) a, *(char * const *) b);
 }
 
 /**
- * Generate multihome initialization scripts
+ * List the home directories below home_local
+ * @param all include directories without a marker (partial homes, leftovers)
+ * @param count output: number of home directories
+ * @return array of paths sorted by name (release with free_array()), or NULL when home_local is unreadable
  */
-void write_init_script() {
-    char buf[BUFSIZ];
-    DIR *d;
+static char **user_list_homes(int all, size_t *count) {
+    char root[PATH_MAX];
     struct dirent *rec;
-    char *date;
-
-    memset(buf, '\0', sizeof(buf));
+    char **homes;
+    size_t alloc;
+    DIR *d;
 
-    d = opendir(multihome.scripts_dir);
-    if (!d) {
-        perror(multihome.scripts_dir);
-        exit(1);
+    *count = 0;
+    snprintf(root, sizeof(root), "%s/%s", multihome.path_old, multihome.path_root);
+    d = opendir(root);
+    if (d == NULL) {
+        perror(root);
+        return NULL;
     }
+    homes = NULL;
+    alloc = 0;
     while ((rec = readdir(d)) != NULL) {
-        if (rec->d_type == DT_REG && strstr(rec->d_name, "init.")) {
-            FILE *fp_input;
-            FILE *fp_output;
-            char *script_name;
-            char path_input[PATH_MAX];
-            char path_output[PATH_MAX];
-
-            script_name = basename(rec->d_name);
-            sprintf(path_input, "%s/%s", multihome.scripts_dir, script_name);
-            fp_input = fopen(path_input, "r");
-            if (!fp_input) {
-                perror(rec->d_name);
-                exit(1);
-            }
-            memset(buf, '\0', sizeof(buf));
-            fread(buf, sizeof(char), sizeof(buf) - 1, fp_input);
-            fclose(fp_input);
+        char home[PATH_MAX];
+        char marker[PATH_MAX];
+        struct stat st;
 
-            sprintf(path_output, "%s/%s", multihome.config_dir, script_name);
-            fp_output = fopen(path_output, "w+");
-            if (!fp_output) {
-                perror(path_output);
+        if (strcmp(rec->d_name, ".") == 0 || strcmp(rec->d_name, "..") == 0) {
+            continue;
+        }
+        if (!all && rec->d_name[0] == '.') {
+            continue;
+        }
+        snprintf(home, sizeof(home), "%s/%s", root, rec->d_name);
+        snprintf(marker, sizeof(marker), "%s/%s", home, MULTIHOME_MARKER);
+        if (all ? lstat(home, &st) < 0 || !S_ISDIR(st.st_mode) : access(marker, F_OK) < 0) {
+            continue;
+        }
+        if (*count == alloc) {
+            char **tmp;
+            alloc = alloc ? alloc * 2 : 16;
+            tmp = realloc(homes, (alloc + 1) * sizeof(*tmp));
+            if (tmp == NULL) {
+                perror("home_local");
                 exit(1);
             }
-            date = get_timestamp();
-            fprintf(fp_output, "# Version: %s\n", VERSION);
-            fprintf(fp_output, "# Generated: %s\n\n", date);
-            fprintf(fp_output, buf, multihome.entry_point);
-            fclose(fp_output);
+            homes = tmp;
+        }
+        homes[*count] = strdup(home);
+        if (homes[*count] == NULL) {
+            perror("home_local");
+            exit(1);
         }
+        (*count)++;
     }
     closedir(d);
+
+    if (homes == NULL) {
+        homes = calloc(1, sizeof(*homes));
+        if (homes == NULL) {
+            perror("home_local");
+            exit(1);
+        }
+    }
+    homes[*count] = NULL;
+    qsort(homes, *count, sizeof(*homes), user_home_cmp);
+    return homes;
 }
 
 /**
- * End string on first occurrence of LF or whitespace
- * @param str
- * @return non-zero if LF not found
+ * Update every initialized home directory below home_local
+ * @param checksum compare contents when source metadata changed
+ * @return 0=success, 1=one or more home directories failed
  */
-static int strip(char **str) {
-    char *orig;
-    char *tmp;
-    char *result;
-
-    orig = (*str);
-    tmp = NULL;
-    result = strchr((*str), '\n');
-    if (result) {
-        *result = '\0';
-    }
-
-    tmp = (*str);
-    while(tmp) {
-        if (isblank(*tmp)) {
-            tmp++;
-            continue;
-        }
-        break;
-    }
-    size_t size;
-    size_t len;
-    size = tmp - (*str);
-    len = strlen(tmp);
+int user_update_all(int checksum) {
+    struct UpdateAll u;
 
-    memmove(orig, tmp, len);
-    len = strlen(orig) - size;
-    *((*str) + len) = '\0';
+    memset(&u, 0, sizeof(u));
+    pthread_mutex_init(&u.lock, NULL);
 
-    result = strrchr((*str), ' ');
-    if (result) {
-        *result = '\0';
+    // Collect the home directories multihome has initialized
+    u.homes = user_list_homes(0, &u.count);
+    if (u.homes == NULL) {
+        return 1;
     }
 
-    return 0;
+    if (u.count == 0) {
+        fprintf(stderr, "No home directories to update in %s/%s\n", multihome.path_old, multihome.path_root);
+        free(u.homes);
+        return 0;
+    }
+
+    user_update_all_run(&u, checksum);
+    fprintf(stderr, "Updated %zu of %zu home directories\n", u.count - u.failed, u.count);
+
+    free_array((void **) u.homes, u.count);
+    pthread_mutex_destroy(&u.lock);
+    return u.failed ? 1 : 0;
+}
+
+struct ProvisionHost {
+    char *host;
+    char *home;                 // durable home in home_local
+    int local;                  // home lives on node-local storage (see multihome_resolve())
+};
+
+static int provision_host_cmp(const void *a, const void *b) {
+    const struct ProvisionHost *x = a;
+    const struct ProvisionHost *y = b;
+    int result;
+
+    result = strcmp(x->home, y->home);
+    if (result == 0) {
+        result = strcmp(x->host, y->host);
+    }
+    return result;
 }
 
 /**
- * Read and apply transformations defined by the host_group configuration file
- *
- * FORMAT:
- *     # Comment
- *     HOST_PATTERN = COMMON_HOME
- *     HOST_PATTERN=COMMON_HOME  # Inline comment
+ * Initialize the home directories of many hosts ahead of their first login
  *
- * EXAMPLE:
- * # To map all hosts starting with "example" to one home directory
- *     example.* = example
- * # To map only hosts example1 and example2 to home directory "special_boxes"
- *     example[1-2]+ = special_boxes
- * # Then map the remaining hosts to the "example" home directory
- *     example.* = example
+ * Each host is mapped through host_group and the distinct home directories are
+ * built in parallel like --update-all, using the same lock and staging directory as
+ * a login so both can run at once. Every host is then given a resolution record,
+ * so its first login takes the fast path.
  *
- * @param hostname
- * @return 0=not found, 1=found
+ * @param hostlist "-" (stdin), a file, or a host list expression (e.g. node[001-064])
+ * @param timeout seconds to wait for a login initializing the same home
+ * @return 0=success, 1=error
  */
-int user_host_group(char **hostname) {
-    int found;
-    FILE *fp;
-    char *recptr;
-    char rec[PATH_MAX];
-    char home_tmp[PATH_MAX];
+int user_provision(const char *hostlist, long timeout) {
+    struct UpdateAll u;
+    struct HostList list;
+    struct ProvisionHost *hosts;
+    size_t count;
+    size_t written;
+    size_t seeded;
     int status;
 
-    fp = fopen(multihome.config_host_group, "r");
-    if (!fp) {
-        perror(multihome.config_host_group);
+    memset(&list, 0, sizeof(list));
+    if (strcmp(hostlist, "-") == 0) {
+        status = hostlist_read(&list, stdin);
+    } else if (access(hostlist, F_OK) == 0) {
+        FILE *fp = fopen(hostlist, "r");
+        if (fp == NULL) {
+            perror(hostlist);
+            return 1;
+        }
+        status = hostlist_read(&list, fp);
+        fclose(fp);
+    } else {
+        status = hostlist_add(&list, hostlist);
+        if (status < 0) {
+            fprintf(stderr, "Invalid host list: %s\n", hostlist);
+        }
+    }
+    if (status < 0) {
+        hostlist_free(&list);
+        return 1;
+    }
+    if (list.count == 0) {
+        fprintf(stderr, "No hosts to provision\n");
+        hostlist_free(&list);
+        return 0;
+    }
+
+    // Map each host to its home directory
+    hosts = calloc(list.count, sizeof(*hosts));
+    if (hosts == NULL) {
+        perror("provision");
         exit(1);
     }
+    for (size_t i = 0; i < list.count; i++) {
+        hosts[i].host = strip_domainname(list.hosts[i]);
+        multihome_resolve(&multihome, hosts[i].host);
+        // Node-local disks are out of reach from here. The durable copy their homes are seeded from is not.
+        hosts[i].local = strcmp(multihome.path_new, multihome.path_durable) != 0;
+        hosts[i].home = strdup(multihome.path_durable);
+        if (hosts[i].home == NULL) {
+            perror("provision");
+            exit(1);
+        }
+    }
 
-    // Preserve hostname
-    strcpy(home_tmp, (*hostname));
+    // Many hosts may share one host group home. Build each home once.
+    qsort(hosts, list.count, sizeof(*hosts), provision_host_cmp);
+    memset(&u, 0, sizeof(u));
+    pthread_mutex_init(&u.lock, NULL);
+    u.provision = 1;
+    u.timeout = timeout;
+    u.homes = calloc(list.count, sizeof(*u.homes));
+    if (u.homes == NULL) {
+        perror("provision");
+        exit(1);
+    }
+    count = 0;
+    for (size_t i = 0; i < list.count; i++) {
+        if (i == 0 || strcmp(hosts[i].home, hosts[i - 1].home) != 0) {
+            u.homes[u.count++] = hosts[i].home;
+        }
+        if (i == 0 || provision_host_cmp(&hosts[i], &hosts[i - 1]) != 0) {
+            count++;
+        }
+    }
+    fprintf(stderr, "Provisioning %zu home directories for %zu hosts\n", u.count, count);
 
-    found = 0;
-    for (size_t i = 0; (fgets(rec, PATH_MAX - 1, fp) != NULL) && !found; i++) {
-        size_t alloc;
-        regex_t compiled;
-        regmatch_t match[100];
-        int num_matches;
-        char **data;
-        char *comment;
-
-        recptr = rec;
-
-        // Ignore empty lines
-        if (strlen(recptr) == 0 || *recptr == '\n') {
+    user_update_all_run(&u, 0);
+
+    // Let every host whose home exists now skip straight to it on login. A host on
+    // node-local storage is seeded at its first login, which records its local home.
+    written = 0;
+    seeded = 0;
+    for (size_t i = 0; i < list.count; i++) {
+        char marker[PATH_MAX];
+        if (i > 0 && provision_host_cmp(&hosts[i], &hosts[i - 1]) == 0) {
             continue;
         }
-
-        // Ignore comments and inline comments
-        if (*recptr == '#') {
+        if (hosts[i].local) {
+            seeded++;
             continue;
-        } else if ((comment = strstr(recptr, "#")) != NULL) {
-            comment--;
-            for (; comment != NULL && isblank(*comment) && comment > recptr; comment--) {
-                *comment = '\0';
-            }
         }
-
-        // Report and skip invalid records
-        if (strchr(recptr, '=') == NULL) {
-            fprintf(stderr, "%s:%zu:syntax error, missing '=' operator\n", multihome.config_host_group, i);
+        snprintf(marker, sizeof(marker), "%s/%s", hosts[i].home, MULTIHOME_MARKER);
+        if (access(marker, F_OK) < 0) {
             continue;
         }
-
-        data = split(recptr, "=", &alloc);
-        if (data == NULL) {
+        if (resolve_cache_write(multihome.path_old, hosts[i].host, hosts[i].home) < 0) {
+            fprintf(stderr, "Unable to record resolution of %s: %s\n", hosts[i].host, strerror(errno));
             continue;
         }
+        written++;
+    }
 
-        // Strip blank characters from data
-        for (size_t item = 0; alloc > 1 && item < alloc - 1; item++) {
-            strip(&data[item]);
-        }
+    fprintf(stderr, "Provisioned %zu of %zu home directories (%zu already initialized), %zu of %zu hosts ready\n",
+            u.count - u.failed - u.existing, u.count, u.existing, written, count);
+    if (seeded) {
+        fprintf(stderr, "%zu hosts on node-local storage are seeded from home_local at their first login\n", seeded);
+    }
+
+    status = u.failed ? 1 : 0;
+    for (size_t i = 0; i < list.count; i++) {
+        free(hosts[i].home);
+    }
+    free(hosts);
+    free(u.homes);
+    hostlist_free(&list);
+    pthread_mutex_destroy(&u.lock);
+    return status;
+}
 
-        // Initialize regex patttern
-        if (regcomp(&compiled, data[0], 0) != 0) {
-            // handle compilation failure
-            fprintf(stderr, "%s:%zu:unable to compile regex pattern '%s'\n", multihome.config_host_group, i, data[0]);
-            free_array((void **) data, alloc);
+/**
+ * Print the home directory of every hostname read from a stream
+ *
+ * FORMAT (one line per input line):
+ *     HOSTNAME<TAB>HOME
+ *
+ * The host_group rules are compiled into the combined matcher once, so large
+ * clusters can be audited in one run.
+ *
+ * @param in hostnames, one per line
+ * @param out results
+ * @return 0=success, 1=error
+ */
+int user_map(FILE *in, FILE *out) {
+    char prefix[PATH_MAX];
+    char host[HOSTLIST_NAME_MAX];
+    char *line;
+    size_t size;
+    ssize_t len;
+
+    snapshot_matcher(&multihome.snapshot);
+    snprintf(prefix, sizeof(prefix), "%s/%s", multihome.path_old, multihome.path_root);
+
+    line = NULL;
+    size = 0;
+    while ((len = getline(&line, &size, in)) >= 0) {
+        const char *name;
+        char *start;
+
+        while (len > 0 && isspace((unsigned char) line[len - 1])) {
+            line[--len] = '\0';
+        }
+        for (start = line; isspace((unsigned char) *start); start++) {
             continue;
         }
-
-        // Check whether the regex pattern matches
-        num_matches = sizeof(match) / sizeof(regmatch_t);
-        status = regexec(&compiled, (*hostname), num_matches, match, REG_EXTENDED);
-        if (status == REG_NOMATCH) {
-            // Ignore unmatched records
-        } else if (status > 0) {
-            // handle fatal error
-            char errbuf[BUFSIZ];
-            regerror(status, &compiled, errbuf, BUFSIZ);
-            fprintf(stderr, "%s:%zu:regex %s\n", multihome.config_host_group, i, errbuf);
-        } else {
-            // Replace preserved hostname with the requested name, and stop
-            strcpy(home_tmp, data[1]);
-            found = 1;
+        if (*start == '\0') {
+            continue;
         }
 
-        regfree(&compiled);
-        free_array((void **)data, alloc);
+        snprintf(host, sizeof(host), "%s", start);
+        strip_domainname(host);
+        name = multihome_map(&multihome, host);
+        fprintf(out, "%s\t%s/%s\n", start, prefix, name);
     }
-    fclose(fp);
+    free(line);
 
-    // Replace the hostname
-    strcpy((*hostname), home_tmp);
-    return found;
+    if (ferror(in) || fflush(out) != 0) {
+        perror("map");
+        return 1;
+    }
+    return 0;
+}
+
+
+struct ReportHome {
+    char *home;
+    time_t used;                // 0 = not an initialized home
+    struct UsageStats stats;
+};
+
+static int report_home_cmp(const void *a, const void *b) {
+    const struct ReportHome *x = a;
+    const struct ReportHome *y = b;
+
+    if (x->stats.bytes != y->stats.bytes) {
+        return x->stats.bytes < y->stats.bytes ? 1 : -1;
+    }
+    return strcmp(x->home, y->home);
 }
 
 /**
- * Link or copy files from /home/username to /home/username/home_local/nodename
+ * Print the disk usage and last use of every directory below home_local
+ *
+ * FORMAT (largest first):
+ *     LAST_USED IDLE SIZE FILES HOME
+ *
+ * Directories without a marker (interrupted initializations, staging and
+ * collected homes still being removed) are listed with a last use of "-".
+ *
+ * @return 0=success, 1=error
  */
-void user_transfer(int copy_mode) {
-    FILE *fp;
-    char rec[PATH_MAX];
-    size_t lineno;
-
-    memset(rec, '\0', PATH_MAX);
+int user_report() {
+    struct ReportHome *report;
+    struct UsageStats *stats;
+    struct UsageStats total;
+    char **homes;
+    size_t count;
+    time_t now;
+    int status;
 
-    fp = fopen(multihome.config_transfer, "r");
-    if (fp == NULL) {
-        // doesn't exist or isn't readable. non-fatal.
-        return;
+    homes = user_list_homes(1, &count);
+    if (homes == NULL) {
+        return 1;
+    }
+    stats = calloc(count + 1, sizeof(*stats));
+    report = calloc(count + 1, sizeof(*report));
+    if (stats == NULL || report == NULL) {
+        perror("report");
+        exit(1);
     }
 
-    // FORMAT:
-    // TYPE WHERE
-    //
-    // TYPE:
-    // L = SYMBOLIC LINK
-    // H = HARD LINK
-    // T = TRANSFER (file, directory, etc)
-    //
-    // EXAMPLE:
-    // L .Xauthority
-    // L .ssh
-    // H token.asc
-    // T special_dotfiles/
-
-    lineno = 0;
-    while (fgets(rec, PATH_MAX - 1, fp) != NULL) {
-        char *recptr;
-        char *field_type;
-        char *field_where;
-        char source[PATH_MAX];
-        char dest[PATH_MAX];
-
-        // Set pointer to string
-        recptr = rec;
-
-        // Set pointer to TYPE field (beginning of string)
-        field_type = recptr;
-
-        // Ignore empty lines
-        if (strlen(recptr) == 0 || *recptr == '\n') {
-            continue;
+    status = usage_scan(homes, count, stats, copy_get_jobs()) < 0 ? 1 : 0;
+
+    memset(&total, 0, sizeof(total));
+    for (size_t i = 0; i < count; i++) {
+        char marker[PATH_MAX];
+
+        report[i].home = homes[i];
+        report[i].stats = stats[i];
+        snprintf(marker, sizeof(marker), "%s/%s", homes[i], MULTIHOME_MARKER);
+        if (access(marker, F_OK) == 0) {
+            report[i].used = home_last_used(homes[i]);
+        }
+        total.bytes += stats[i].bytes;
+        total.files += stats[i].files;
+    }
+    qsort(report, count, sizeof(*report), report_home_cmp);
+
+    now = time(NULL);
+    printf("%-16s %6s %8s %10s  %s\n", "LAST_USED", "IDLE", "SIZE", "FILES", "HOME");
+    for (size_t i = 0; i < count; i++) {
+        char used[32];
+        char idle[16];
+        char size[16];
+
+        if (report[i].used) {
+            struct tm tm;
+            localtime_r(&report[i].used, &tm);
+            strftime(used, sizeof(used), "%Y-%m-%d %H:%M", &tm);
+            snprintf(idle, sizeof(idle), "%ldd", (long) ((now - report[i].used) / 86400));
+        } else {
+            strcpy(used, "-");
+            strcpy(idle, "-");
         }
+        printf("%-16s %6s %8s %10llu  %s\n", used, idle, human_size(report[i].stats.bytes, size, sizeof(size)),
+               (unsigned long long) report[i].stats.files, report[i].home);
+    }
+    {
+        char size[16];
+        printf("%-16s %6s %8s %10llu  total (%zu directories)\n", "", "", human_size(total.bytes, size, sizeof(size)),
+               (unsigned long long) total.files, count);
+    }
+
+    if (fflush(stdout) != 0) {
+        perror("report");
+        status = 1;
+    }
+    free(report);
+    free(stats);
+    free_array((void **) homes, count);
+    return status;
+}
 
-        // Ignore: comments and inline comments
-        char *comment;
-        if (*recptr == '#') {
+/**
+ * Remove home directories that have not been used for a number of days
+ *
+ * The home directory of the current session ($HOME) is always kept. Store objects
+ * left without links are removed afterwards.
+ *
+ * @param days idle time after which a home is removed
+ * @param archive write each home to DIR/NAME-YYYYMMDD.tar.gz first (NULL = remove only)
+ * @param dry_run only list what would be removed
+ * @param timeout seconds to wait for a login initializing the same home
+ * @return 0=success, 1=one or more home directories could not be removed
+ */
+int user_gc(long days, const char *archive, int dry_run, long timeout) {
+    const char *current;
+    char **homes;
+    size_t count;
+    size_t removed;
+    size_t failed;
+    uint64_t objects;
+    uint64_t bytes;
+    time_t cutoff;
+
+    homes = user_list_homes(0, &count);
+    if (homes == NULL) {
+        return 1;
+    }
+    current = getenv("HOME");
+    cutoff = time(NULL) - days * 86400;
+    removed = 0;
+    failed = 0;
+    for (size_t i = 0; i < count; i++) {
+        time_t used;
+        int status;
+
+        used = home_last_used(homes[i]);
+        if (used >= cutoff || (current != NULL && strcmp(current, homes[i]) == 0)) {
             continue;
-        } else if ((comment = strstr(recptr, "#")) != NULL) {
-            comment--;
-            for (; comment != NULL && isblank(*comment) && comment > recptr; comment--) {
-                *comment = '\0';
-            }
         }
-
-        // Ignore: bad lines without enough information
-        if (strlen(rec) < 3) {
-            fprintf(stderr, "%s:%zu: Invalid format: %s\n", multihome.config_transfer, lineno, rec);
+        if (dry_run) {
+            printf("Would remove %s (unused for %ld days)\n", homes[i], (long) ((time(NULL) - used) / 86400));
+            removed++;
             continue;
         }
-
-        // Error checking is done
-        // Set pointer to WHERE field
-        field_where = &rec[2];
-
-        if (*field_where == '/') {
-            fprintf(stderr, "%s:%zu: Removing leading '/' from: %s\n", multihome.config_transfer, lineno, field_where);
-            memmove(field_where, field_where + 1, strlen(field_where) + 1);
+        status = home_retire(homes[i], cutoff, archive, timeout);
+        if (status < 0) {
+            failed++;
+        } else if (status == 0) {
+            removed++;
+        } else {
+            fprintf(stderr, "Home directory in use again, keeping it: %s\n", homes[i]);
         }
+    }
 
-        if (field_where[strlen(field_where) - 1] == '\n') {
-            field_where[strlen(field_where) - 1] = '\0';
-        }
+    objects = bytes = 0;
+    if (copy_store_prune(multihome.config_objects, dry_run, &objects, &bytes) < 0) {
+        failed++;
+    }
+    if (objects) {
+        char size[16];
+        fprintf(stderr, "%s %llu unreferenced store objects (%s)\n", dry_run ? "Would remove" : "Removed",
+                (unsigned long long) objects, human_size(bytes, size, sizeof(size)));
+    }
+    fprintf(stderr, "%s %zu of %zu home directories unused for %ld days\n", dry_run ? "Would remove" : "Removed",
+            removed, count, days);
 
-        // construct data source path
-        sprintf(source, "%s/%s", multihome.path_old, field_where);
+    free_array((void **) homes, count);
+    return failed ? 1 : 0;
+}
 
-        // construct data destination path
-        char *tmp;
-        tmp = strdup(source);
-        sprintf(dest, "%s/%s", multihome.path_new, basename(tmp));
-        free(tmp);
+/**
+ * Set by SIGINT/SIGTERM/SIGHUP to end periodic write-back after one last pass
+ */
+static volatile sig_atomic_t user_sync_stop;
 
-        // Perform task based on TYPE field
-        switch (*field_type) {
-            case 'L':
-                if (symlink(source, dest) < 0) {
-                    fprintf(stderr, "symlink: %s: %s -> %s\n", strerror(errno), source, dest);
-                }
-                break;
-            case 'H':
-                if (link(source, dest) < 0) {
-                    fprintf(stderr, "hardlink: %s: %s -> %s\n", strerror(errno), source, dest);
-                }
-                break;
-            case 'T':
-                if (copy(source, dest, copy_mode) != 0) {
-                    fprintf(stderr, "transfer: %s: %s -> %s\n", strerror(errno), source, dest);
-                }
-                break;
-            default:
-                fprintf(stderr, "%s:%zu: Invalid type: '%c'\n", multihome.config_transfer, lineno, *field_type);
-                break;
-        }
-    }
-    fclose(fp);
+static void user_sync_signal(int sig) {
+    (void) sig;
+    user_sync_stop = 1;
 }
 
 /**
- * Retrieve hostname from FQDN
- * @param hostname
- * @return short hostname
+ * Write this host's node-local home directory back to home_local
+ *
+ * With an interval the write-back repeats until a signal arrives (e.g. SIGHUP
+ * at logout), then runs once more so nothing written before it is lost.
+ *
+ * @param interval seconds between passes (0 = once)
+ * @param timeout seconds to wait for another process holding the durable copy
+ * @param skip_dirs skip directories whose mtime is unchanged
+ * @return 0=success, 1=error
  */
-char *strip_domainname(char *hostname) {
-    char *ptr;
+int user_sync_back(long interval, long timeout, int skip_dirs) {
+    struct sigaction sa;
+    int failed;
 
-    ptr = strchr(hostname, '.');
-    if (ptr != NULL) {
-        *ptr = '\0';
+    if (strcmp(multihome.path_new, multihome.path_durable) == 0) {
+        fprintf(stderr, "Home directory is not node-local, nothing to write back: %s\n", multihome.path_new);
+        return 0;
+    }
+    if (access(multihome.marker, F_OK) < 0) {
+        fprintf(stderr, "Node-local home directory is not initialized: %s\n", multihome.path_new);
+        return 1;
     }
 
-    return hostname;
-}
+    if (interval) {
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = user_sync_signal;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGINT, &sa, NULL);
+        sigaction(SIGTERM, &sa, NULL);
+        sigaction(SIGHUP, &sa, NULL);
+    }
 
+    failed = 0;
+    while (1) {
+        struct CopyStats stats;
+        uint64_t removed;
+        char size[16];
+        size_t phase;
+        int status;
+
+        phase = trace_begin("sync_back");
+        status = home_sync_back(&multihome, timeout, skip_dirs, &stats, &removed);
+        trace_end(phase, status < 0 ? 1 : 0);
+        failed = status < 0;
+        fprintf(stderr, "Wrote back %s -> %s: %llu files (%s), %llu unchanged, %llu removed, %llu errors\n",
+                multihome.path_new, multihome.path_durable, (unsigned long long) (stats.files + stats.links),
+                human_size(stats.bytes, size, sizeof(size)), (unsigned long long) stats.skipped,
+                (unsigned long long) removed, (unsigned long long) stats.errors);
+
+        if (interval == 0 || user_sync_stop) {
+            break;
+        }
+        // A signal cuts the wait short
+        sleep((unsigned) interval);
+    }
+    return failed ? 1 : 0;
+}
 
 // begin argp setup
+#define OPT_TRACE 0x100
+#define OPT_CHECKSUM 0x101
+#define OPT_SKIP_UNCHANGED_DIRS 0x102
+#define OPT_DEBOUNCE 0x103
+#define OPT_UPDATE_ALL 0x104
+#define OPT_STORE 0x105
+#define OPT_LOCK_TIMEOUT 0x106
+#define OPT_PROVISION 0x107
+#define OPT_MAP 0x108
+#define OPT_GC 0x109
+#define OPT_ARCHIVE 0x10a
+#define OPT_DRY_RUN 0x10b
+#define OPT_REPORT 0x10c
+#define OPT_QUEUE_DEPTH 0x10d
+#define OPT_SYNC_BACK 0x10e
+#define OPT_SYNC_INTERVAL 0x10f
+#define OPT_BWLIMIT 0x110
+#define OPT_IO_IDLE 0x111
+#define OPT_IOPS 0x112
+#define OPT_DEADLINE 0x113
+#define OPT_METRICS 0x114
+#define OPT_PLAN 0x115
 static char doc[] = "Partition a home directory per-host when using a centrally mounted /home";
 static char args_doc[] = "";
 static struct argp_option options[] = {
+    {"archive", OPT_ARCHIVE, "DIR", 0, "With --gc, write each removed home directory to DIR/NAME-YYYYMMDD.tar.gz first"},
+    {"backend", 'b', "NAME", 0, "Copy backend: native (default), rsync, uring"},
+    {"bwlimit", OPT_BWLIMIT, "RATE", 0, "Copy at most RATE bytes per second (K, M, G suffixes; default: $MULTIHOME_BWLIMIT or unlimited)"},
+    {"checksum", OPT_CHECKSUM, 0, 0, "Compare file contents when source metadata differs from the manifest"},
+    {"deadline", OPT_DEADLINE, "SEC", 0, "Return from a first login after SEC seconds and finish T entries in the background (default: $MULTIHOME_DEADLINE or wait)"},
+    {"debounce", OPT_DEBOUNCE, "MS", 0, "Wait for MS milliseconds without changes before applying them (default: 200)"},
+    {"dry-run", OPT_DRY_RUN, 0, 0, "With --gc, only list the home directories that would be removed"},
+    {"gc", OPT_GC, "DAYS", 0, "Remove home directories in home_local that have not been used for DAYS days"},
+    {"io-idle", OPT_IO_IDLE, 0, 0, "Copy in the idle I/O scheduling class (default: on when $MULTIHOME_IO_IDLE is set)"},
+    {"iops", OPT_IOPS, "N", 0, "Create or examine at most N entries per second while copying (default: $MULTIHOME_IOPS or unlimited)"},
+    {"jobs", 'j', "N", 0, "Number of threads used to copy directories (default: 8)"},
+    {"lock-timeout", OPT_LOCK_TIMEOUT, "SEC", 0, "Wait up to SEC seconds for another process initializing the same home (default: 120)"},
+    {"map", OPT_MAP, 0, 0, "Read hostnames from stdin and print each one's home directory (HOSTNAME<TAB>HOME)"},
+    {"metrics", OPT_METRICS, "DIR", 0, "Add the metrics of this run to DIR/multihome_UID.prom for the node_exporter textfile collector (default: $MULTIHOME_METRICS_DIR)"},
+    {"plan", OPT_PLAN, 0, 0, "Print the operations that populate this host's home directory, with estimated sizes, and exit"},
+    {"provision", OPT_PROVISION, "HOSTLIST", 0, "Initialize the home directories of every host in HOSTLIST (a file, - for stdin, or a range such as node[001-064])"},
+    {"queue-depth", OPT_QUEUE_DEPTH, "N", 0, "io_uring operations in flight per thread with --backend=uring (default: 64)"},
+    {"report", OPT_REPORT, 0, 0, "Print the disk usage and last use of every home directory in home_local"},
     {"script", 's', 0, 0, "Generate runtime script"},
+    {"skip-unchanged-dirs", OPT_SKIP_UNCHANGED_DIRS, 0, 0, "Skip directories whose mtime matches the manifest (faster, misses in-place edits)"},
+    {"store", OPT_STORE, 0, 0, "Hardlink identical files from a shared object store in ~/.multihome/objects"},
+    {"sync-back", OPT_SYNC_BACK, 0, 0, "Write this host's node-local home directory back to home_local"},
+    {"sync-interval", OPT_SYNC_INTERVAL, "SEC", 0, "With --sync-back, repeat every SEC seconds until interrupted"},
+    {"trace", OPT_TRACE, "FILE", OPTION_ARG_OPTIONAL, "Write a JSON timing report to FILE (default: stderr)"},
 #ifdef ENABLE_TESTING
     {"tests", 't', 0, 0, "Run unit tests"},
 #endif
     {"update", 'u', 0, 0, "Synchronize user skeleton and transfer configuration"},
+    {"update-all", OPT_UPDATE_ALL, 0, 0, "Synchronize every home directory in home_local"},
     {"version", 'V', 0, 0, "Show version and exit"},
+    {"watch", 'w', 0, 0, "Update, then keep propagating skeleton and transfer changes as they happen"},
     {0},
 };
 
 struct arguments {
+    char *archive;
+    uint64_t bwlimit;
+    int checksum;
+    long deadline;
+    long debounce;
+    int dry_run;
+    long gc;
+    int io_idle;
+    uint64_t iops;
+    long lock_timeout;
+    int map;
+    int plan;
+    char *provision;
+    int report;
+    int skip_unchanged_dirs;
     int script;
+    int store;
+    int sync_back;
+    long sync_interval;
 #ifdef ENABLE_TESTING
     int testing;
 #endif
     int update;
+    int update_all;
     int version;
+    int watch;
 };
 
 static error_t parse_opt (int key, char *arg, struct argp_state *state) {
     struct arguments *arguments = state->input;
-    (void) arg; // arg is not used
 
     switch (key) {
         case 'V':
             arguments->version = 1;
             break;
+        case 'b':
+            if (copy_set_backend(arg) < 0) {
+                argp_error(state, "unknown or unavailable copy backend: %s", arg);
+            }
+            break;
+        case 'j':
+            if (copy_set_jobs(strtol(arg, NULL, 10)) < 0) {
+                argp_error(state, "invalid number of jobs: %s", arg);
+            }
+            break;
         case 's':
             arguments->script = 1;
             break;
+        case OPT_ARCHIVE:
+            arguments->archive = arg;
+            break;
+        case OPT_BWLIMIT:
+            if (parse_size(arg, &arguments->bwlimit) < 0) {
+                argp_error(state, "invalid bandwidth limit: %s", arg);
+            }
+            break;
+        case OPT_CHECKSUM:
+            arguments->checksum = 1;
+            break;
+        case OPT_DEADLINE:
+            arguments->deadline = strtol(arg, NULL, 10);
+            if (arguments->deadline < 0) {
+                argp_error(state, "invalid login deadline: %s", arg);
+            }
+            break;
+        case OPT_DEBOUNCE:
+            arguments->debounce = strtol(arg, NULL, 10);
+            if (arguments->debounce < 0) {
+                argp_error(state, "invalid debounce interval: %s", arg);
+            }
+            break;
+        case OPT_DRY_RUN:
+            arguments->dry_run = 1;
+            break;
+        case OPT_GC:
+            // Collection works on home_local of the original home directory like an update
+            arguments->update = 1;
+            arguments->gc = strtol(arg, NULL, 10);
+            if (arguments->gc < 1) {
+                argp_error(state, "invalid number of days: %s", arg);
+            }
+            break;
+        case OPT_IO_IDLE:
+            arguments->io_idle = 1;
+            break;
+        case OPT_IOPS:
+            if (parse_size(arg, &arguments->iops) < 0) {
+                argp_error(state, "invalid operation limit: %s", arg);
+            }
+            break;
+        case OPT_LOCK_TIMEOUT:
+            arguments->lock_timeout = strtol(arg, NULL, 10);
+            if (arguments->lock_timeout < 0) {
+                argp_error(state, "invalid lock timeout: %s", arg);
+            }
+            break;
+        case OPT_MAP:
+            // Mapping reads the configuration of the original home directory like an update
+            arguments->update = 1;
+            arguments->map = 1;
+            break;
+        case OPT_METRICS:
+            if (trace_metrics(arg) < 0) {
+                argp_failure(state, 1, errno, "%s", arg);
+            }
+            break;
+        case OPT_PLAN:
+            // Planning reads the configuration of the original home directory like an update
+            arguments->update = 1;
+            arguments->plan = 1;
+            break;
+        case OPT_PROVISION:
+            // Provisioning runs from the original home directory like an update
+            arguments->update = 1;
+            arguments->provision = arg;
+            break;
+        case OPT_QUEUE_DEPTH:
+            if (copy_set_queue_depth(strtol(arg, NULL, 10)) < 0) {
+                argp_error(state, "invalid queue depth: %s", arg);
+            }
+            break;
+        case OPT_REPORT:
+            arguments->update = 1;
+            arguments->report = 1;
+            break;
+        case OPT_STORE:
+            arguments->store = 1;
+            break;
+        case OPT_SKIP_UNCHANGED_DIRS:
+            arguments->skip_unchanged_dirs = 1;
+            break;
+        case OPT_SYNC_BACK:
+            // The durable copy is found from the original home directory like an update
+            arguments->update = 1;
+            arguments->sync_back = 1;
+            break;
+        case OPT_SYNC_INTERVAL:
+            arguments->sync_interval = strtol(arg, NULL, 10);
+            if (arguments->sync_interval < 1) {
+                argp_error(state, "invalid sync interval: %s", arg);
+            }
+            break;
+        case OPT_TRACE:
+            if (trace_open(arg) < 0) {
+                argp_failure(state, 1, errno, "%s", arg);
+            }
+            break;
 #ifdef ENABLE_TESTING
         case 't':
             arguments->testing = 1;
@@ -704,6 +1534,15 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state) {
         case 'u':
             arguments->update = 1;
             break;
+        case OPT_UPDATE_ALL:
+            arguments->update = 1;
+            arguments->update_all = 1;
+            break;
+        case 'w':
+            // Watching starts from an up to date home directory
+            arguments->update = 1;
+            arguments->watch = 1;
+            break;
         case ARGP_KEY_ARG:
             if (state->arg_num > 1) {
                 argp_usage(state);
@@ -715,6 +1554,7 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state) {
     return 0;
 }
 
+#ifdef MULTIHOME_RSYNC_BIN
 /**
  * Is rsync available?
  * @return 0=not found, 1 found
@@ -725,6 +1565,7 @@ int rsync_exists() {
     }
     return 0;
 }
+#endif
 
 static struct argp argp = { options, parse_opt, args_doc, doc };
 // end of argp setup
@@ -735,29 +1576,66 @@ int main(int argc, char *argv[]) {
     struct passwd *user_info;
     struct utsname host_info;
     char *nodename;
+    int storage_fallback;
 
     // Disable line buffering via macro
     DISABLE_BUFFERING
 
     struct arguments arguments;
+    arguments.archive = NULL;
+    arguments.bwlimit = 0;
+    arguments.checksum = 0;
+    arguments.deadline = getenv("MULTIHOME_DEADLINE") ? strtol(getenv("MULTIHOME_DEADLINE"), NULL, 10) : 0;
+    arguments.debounce = WATCH_DEBOUNCE_DEFAULT;
+    arguments.dry_run = 0;
+    arguments.gc = 0;
+    arguments.io_idle = getenv("MULTIHOME_IO_IDLE") != NULL;
+    arguments.iops = 0;
+    arguments.lock_timeout = INIT_LOCK_TIMEOUT_DEFAULT;
+    arguments.map = 0;
+    arguments.plan = 0;
+    arguments.provision = NULL;
+    arguments.report = 0;
+    arguments.skip_unchanged_dirs = 0;
     arguments.script = 0;
+    arguments.store = 0;
+    arguments.sync_back = 0;
+    arguments.sync_interval = 0;
 #ifdef ENABLE_TESTING
     arguments.testing = 0;
 #endif
     arguments.update = 0;
+    arguments.update_all = 0;
     arguments.version = 0;
+    arguments.watch = 0;
+
+    // Sites throttle first logins from the environment, the init scripts pass no options
+    if (getenv("MULTIHOME_BWLIMIT") && parse_size(getenv("MULTIHOME_BWLIMIT"), &arguments.bwlimit) < 0) {
+        fprintf(stderr, "Ignoring invalid MULTIHOME_BWLIMIT: %s\n", getenv("MULTIHOME_BWLIMIT"));
+    }
+    if (getenv("MULTIHOME_IOPS") && parse_size(getenv("MULTIHOME_IOPS"), &arguments.iops) < 0) {
+        fprintf(stderr, "Ignoring invalid MULTIHOME_IOPS: %s\n", getenv("MULTIHOME_IOPS"));
+    }
+    if (getenv("MULTIHOME_METRICS_DIR") && *getenv("MULTIHOME_METRICS_DIR")) {
+        trace_metrics(getenv("MULTIHOME_METRICS_DIR"));
+    }
     argp_parse(&argp, argc, argv, 0, 0, &arguments);
+    copy_set_throttle(arguments.bwlimit, arguments.iops);
+    copy_set_idle(arguments.io_idle);
+    home_set_deadline(arguments.deadline);
 
     if (arguments.version) {
         puts(VERSION);
         exit(0);
     }
 
-    // Refuse to operate if rsync is not available
-    if (rsync_exists() != 0) {
+#ifdef MULTIHOME_RSYNC_BIN
+    // Refuse to operate if the rsync backend was requested but rsync is not available
+    if (copy_get_backend() == COPY_BACKEND_RSYNC && rsync_exists() != 0) {
         fprintf(stderr, "rsync program not found (expecting: %s)\n", MULTIHOME_RSYNC_BIN);
         return 1;
     }
+#endif
 
 #ifdef ENABLE_TESTING
     if (arguments.testing) {
@@ -766,18 +1644,15 @@ int main(int argc, char *argv[]) {
     }
 #endif
 
-    // Get effective user account information
-    uid = geteuid();
-    if ((user_info = getpwuid(uid)) == NULL) {
-        perror("getpwuid");
-        return errno;
-    }
+    size_t phase;
 
     // Get host information
+    phase = trace_begin("uname");
     if (uname(&host_info) < 0) {
         perror("uname");
         return errno;
     }
+    trace_end(phase, 0);
 
     // The short hostname is used to establish the name for the new home directory
     // Allocate enough space to fit a long user-defined name, just in case
@@ -787,6 +1662,30 @@ int main(int argc, char *argv[]) {
         return 1;
     }
     strcpy(nodename, strip_domainname(host_info.nodename));
+    trace_note("host", nodename);
+
+    // Fast path: this host was resolved before and nothing has been invalidated since
+    if (!arguments.update && !arguments.script) {
+        char *home;
+        int status;
+
+        phase = trace_begin("resolve_cache");
+        home = getenv("HOME");
+        status = home != NULL ? resolve_cache_lookup(home, nodename, multihome.path_new) : -1;
+        trace_end(phase, status);
+        if (status == 0 && !home_abandoned(multihome.path_new)) {
+            size_t len;
+            trace_note("path", "fast");
+            trace_note("home", multihome.path_new);
+            home_mark_used(multihome.path_new);
+            len = strlen(multihome.path_new);
+            multihome.path_new[len] = '\n';
+            if (write(STDOUT_FILENO, multihome.path_new, len + 1) < 0) {
+                return 1;
+            }
+            return 0;
+        }
+    }
 
     // Determine the user's home directory
     char *path_old;
@@ -799,6 +1698,14 @@ int main(int argc, char *argv[]) {
     // Handle legitimate case where HOME (or HOME_OLD) is undefined. Use the system's records instead...
     // i.e. The user wiped the environment with `env -i` prior to executing multihome
     if (path_old == NULL) {
+        // Get effective user account information
+        phase = trace_begin("getpwuid");
+        uid = geteuid();
+        if ((user_info = getpwuid(uid)) == NULL) {
+            perror("getpwuid");
+            return errno;
+        }
+        trace_end(phase, 0);
         path_old = user_info->pw_dir;
         if (path_old == NULL) {
             fprintf(stderr, "Unable to determine home directory path\n");
@@ -806,17 +1713,18 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    trace_note("path", "full");
+
     // Populate multihome struct
-    char *entry_point;
-    entry_point = find_program(argv[0]);
-    strcpy(multihome.entry_point, entry_point);
-    strcpy(multihome.path_old, path_old);
-    strcpy(multihome.path_root, MULTIHOME_ROOT);
-    strcpy(multihome.scripts_dir, MULTIHOME_SCRIPTS_DIR);
-    sprintf(multihome.config_dir, "%s/%s", multihome.path_old, MULTIHOME_CFGDIR);
-    sprintf(multihome.config_transfer, "%s/%s", multihome.config_dir, MULTIHOME_CFG_TRANSFER);
-    sprintf(multihome.config_skeleton, "%s/%s", multihome.config_dir, MULTIHOME_CFG_SKEL);
-    sprintf(multihome.config_host_group, "%s/%s", multihome.config_dir, MULTIHOME_CFG_HOST_GROUP);
+    if (multihome_init(&multihome, path_old) < 0) {
+        fprintf(stderr, "Home directory path is too long: %s\n", path_old);
+        return 1;
+    }
+
+    if (arguments.store && copy_set_store(multihome.config_objects) < 0) {
+        fprintf(stderr, "Object store path is too long: %s\n", multihome.config_objects);
+        return 1;
+    }
 
     // Refuse to operate within a controlled home directory
     char already_inside[PATH_MAX];
@@ -826,95 +1734,141 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    // Generate configuration directory
-    if (access(multihome.config_dir, F_OK) < 0) {
-        fprintf(stderr, "Creating configuration directory: %s\n", multihome.config_dir);
-        if (mkdirs(multihome.config_dir) < 0) {
-            perror(multihome.config_dir);
-            return errno;
-        }
+    // Generate configuration directory and files
+    phase = trace_begin("prepare_config");
+    if (multihome_config(&multihome) < 0) {
+        return errno;
     }
+    trace_end(phase, 0);
 
-    // Generate a blank host group configuration
-    if (access(multihome.config_host_group, F_OK) < 0) {
-        fprintf(stderr, "Creating host group configuration: %s\n", multihome.config_host_group);
-        if (touch(multihome.config_host_group) < 0) {
-            perror(multihome.config_host_group);
-            return errno;
-        }
+    // Parse host_group and transfer configuration (or reuse the compiled snapshot)
+    phase = trace_begin("snapshot");
+    if (multihome_load(&multihome) < 0) {
+        fprintf(stderr, "Unable to load configuration\n");
+        return 1;
     }
+    trace_end(phase, 0);
 
-    // When this host belongs to a host group, modify the hostname once more
-    user_host_group(&nodename);
-    sprintf(multihome.path_new, "%s/%s/%s", multihome.path_old, multihome.path_root, nodename);
-    free(nodename);
+    // Every home directory is updated from here. This host's own name does not matter.
+    if (arguments.update_all) {
+        if (copy_get_backend() == COPY_BACKEND_RSYNC) {
+            fprintf(stderr, "--update-all requires the native copy backend\n");
+            return 1;
+        }
+        free(nodename);
+        return user_update_all(arguments.checksum);
+    }
 
-    sprintf(multihome.path_topdir, "%s/%s", multihome.path_new, MULTIHOME_TOPDIR);
-    sprintf(multihome.marker, "%s/%s", multihome.path_new, MULTIHOME_MARKER);
+    // Only the mapping of other hosts is wanted
+    if (arguments.map) {
+        static char buf[1 << 16];
+        setvbuf(stdout, buf, _IOFBF, sizeof(buf));
+        free(nodename);
+        return user_map(stdin, stdout);
+    }
 
-    copy_mode = arguments.update; // 0 = normal copy, 1 = update files
+    // Only home_local itself is of interest
+    if (arguments.report) {
+        free(nodename);
+        return user_report();
+    }
+    if (arguments.gc) {
+        free(nodename);
+        return user_gc(arguments.gc, arguments.archive, arguments.dry_run, arguments.lock_timeout);
+    }
 
-    // Create new home directory
-    if (strcmp(multihome.path_new, multihome.path_old) != 0) {
-        if (access(multihome.path_new, F_OK) < 0) {
-            fprintf(stderr, "Creating home directory: %s\n", multihome.path_new);
-            if (mkdirs(multihome.path_new) < 0) {
-                perror(multihome.path_new);
-                return errno;
-            }
+    // Every listed host is initialized from here
+    if (arguments.provision) {
+        if (copy_get_backend() == COPY_BACKEND_RSYNC) {
+            fprintf(stderr, "--provision requires the native copy backend\n");
+            return 1;
         }
+        free(nodename);
+        return user_provision(arguments.provision, arguments.lock_timeout);
     }
 
-    // Generate symbolic link within the new home directory pointing back to the real account home directory
-    if (access(multihome.path_topdir, F_OK) != 0 ) {
-        fprintf(stderr, "Creating symlink to original home directory: %s\n", multihome.path_topdir);
-        if (symlink(multihome.path_old, multihome.path_topdir) < 0) {
-            perror(multihome.path_topdir);
-            return errno;
-        }
+    // When this host belongs to a host group, modify the hostname once more
+    phase = trace_begin("user_host_group");
+    trace_end(phase, multihome_resolve(&multihome, nodename) ? 0 : 1);
+    free(nodename);
+    storage_fallback = multihome_storage(&multihome) < 0;
+    trace_note("home", multihome.path_new);
+
+    // Only show what populating this host's home would do
+    if (arguments.plan) {
+        struct Plan plan;
+
+        plan_init(&plan, multihome.path_new);
+        user_transfer_exclude(&multihome, 1);
+        home_plan(&multihome, &plan, TRANSFER_ALL);
+        plan_estimate(&plan);
+        user_transfer_exclude(&multihome, 0);
+        plan_print(&plan, stdout);
+        plan_free(&plan);
+        return 0;
     }
 
-    // Generate directory for user-defined account defaults
-    // Files placed here will be copied to the new home directory.
-    if (access(multihome.config_skeleton, F_OK) < 0) {
-        fprintf(stderr, "Creating user skel directory: %s\n", multihome.config_skeleton);
-        if (mkdirs(multihome.config_skeleton) < 0) {
-            perror(multihome.config_skeleton);
-            return errno;
+    // Only the durable copy of this host's home is written
+    if (arguments.sync_back) {
+        if (copy_get_backend() == COPY_BACKEND_RSYNC) {
+            fprintf(stderr, "--sync-back requires the native copy backend\n");
+            return 1;
         }
+        return user_sync_back(arguments.sync_interval, arguments.lock_timeout, arguments.skip_unchanged_dirs);
     }
 
-    // Generate a blank transfer configuration
-    if (access(multihome.config_transfer, F_OK) < 0) {
-        fprintf(stderr, "Creating transfer configuration: %s\n", multihome.config_transfer);
-        if (touch(multihome.config_transfer) < 0) {
-            perror(multihome.config_transfer);
+    copy_mode = arguments.update; // 0 = normal copy, 1 = update files
+
+    // NOTE: update mode skips the home directory marker check
+    // (except for a node-local home that is gone, which is seeded like on a first login)
+    if (arguments.update && (strcmp(multihome.path_new, multihome.path_durable) == 0 || access(multihome.marker, F_OK) == 0)) {
+        if (home_prepare(&multihome, multihome.path_new) < 0) {
             return errno;
         }
+        home_populate(&multihome, multihome.path_new, multihome.path_new, copy_mode, arguments.checksum, arguments.skip_unchanged_dirs, TRANSFER_ALL);
+
+        // Leave our mark: "multihome was here"
+        if (access(multihome.marker, F_OK) < 0) {
+            fprintf(stderr, "Creating marker file: %s\n", multihome.marker);
+            touch(multihome.marker);
+        }
+    } else if (access(multihome.marker, F_OK) < 0) {
+        if (home_initialize(&multihome, arguments.lock_timeout, arguments.checksum, arguments.skip_unchanged_dirs) < 0) {
+            return 1;
+        }
     }
 
-    // NOTE: update mode skips the home directory marker check
-    if (arguments.update || access(multihome.marker, F_OK) < 0) {
-        // Copy system account defaults
-        fprintf(stderr, "Pulling account skeleton: %s\n", OS_SKEL_DIR);
-        copy(OS_SKEL_DIR, multihome.path_new, copy_mode);
+    // A worker finishing deferred transfers did not complete
+    home_resume(&multihome);
 
-        // Copy user-defined account defaults
-        fprintf(stderr, "Pulling user-defined account skeleton: %s\n", multihome.config_skeleton);
-        copy(multihome.config_skeleton, multihome.path_new, copy_mode);
+    // Remember where this host lives so the next login can take the fast path
+    // (not when the durable copy stands in for unavailable node-local storage)
+    home_mark_used(multihome.path_new);
+    phase = trace_begin("resolve_cache_write");
+    if (!storage_fallback && resolve_cache_write(multihome.path_old, host_info.nodename, multihome.path_new) < 0) {
+        fprintf(stderr, "Unable to write resolution cache: %s\n", strerror(errno));
+    }
+    trace_end(phase, storage_fallback);
 
-        // Transfer or link user-defined files into the new home
-        user_transfer(copy_mode);
+    // Bake this host into previously generated init scripts
+    if (!arguments.script) {
+        phase = trace_begin("refresh_init_script");
+        refresh_init_script(argv[0]);
+        trace_end(phase, 0);
     }
 
-    // Leave our mark: "multihome was here"
-    if (access(multihome.marker, F_OK) < 0) {
-        fprintf(stderr, "Creating marker file: %s\n", multihome.marker);
-        touch(multihome.marker);
+    if (arguments.watch) {
+        return user_watch(arguments.debounce, arguments.checksum);
     }
 
     if (arguments.script) {
-        write_init_script();
+        if (find_program(argv[0], multihome.entry_point) == NULL) {
+            fprintf(stderr, "Unable to determine location of %s\n", argv[0]);
+            return 1;
+        }
+        if (write_init_script() < 0) {
+            return 1;
+        }
     } else {
         printf("%s\n", multihome.path_new);
     }
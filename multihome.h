@@ -5,7 +5,10 @@
 #include <assert.h>
 #endif
 
+#include <ctype.h>
 #include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -14,13 +17,17 @@
 #include <pwd.h>
 #include <sys/utsname.h>
 #include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <libgen.h>
 #include <wait.h>
 #include <argp.h>
 #include <time.h>
+#include <signal.h>
 #include <dirent.h>
 #include <regex.h>
+#include <pthread.h>
 #include "config.h"
 
 #define VERSION "0.0.1"
@@ -29,28 +36,399 @@
 #define MULTIHOME_CFGDIR ".multihome"
 #define MULTIHOME_CFG_TRANSFER "transfer"
 #define MULTIHOME_CFG_HOST_GROUP "host_group"
+#define MULTIHOME_CFG_SNAPSHOT "snapshot"
+#define MULTIHOME_CFG_RESOLVE "resolve"
+#define MULTIHOME_CFG_OBJECTS "objects"
+#define MULTIHOME_CFG_STORAGE "storage"
 #define MULTIHOME_CFG_SKEL "skel/"  // NOTE: Trailing slash is required
 #define MULTIHOME_MARKER ".multihome_controlled"
+#define MULTIHOME_MANIFEST ".multihome_manifest"
+#define MULTIHOME_USED ".multihome_used"
+#define MULTIHOME_SYNC_MANIFEST ".multihome_syncback"
+#define MULTIHOME_PENDING ".multihome_pending"     // deferred transfers have not finished
+#define MULTIHOME_DEFER_LOG ".multihome_transfer.log"
 #define OS_SKEL_DIR "/etc/skel/"    // NOTE: Trailing slash is required
 #define RSYNC_ARGS "-aq"
 #define COPY_NORMAL 0
 #define COPY_UPDATE 1
+#define TRANSFER_ALL 0
+#define TRANSFER_LOGIN 1            // L, H and required (T!) entries
+#define TRANSFER_DEFERRED 2         // T entries left to the background worker
+#define PLAN_JOBS 4                 // operations run at once (directory copies bring their own threads)
+#define COPY_BACKEND_NATIVE 0
+#define COPY_BACKEND_RSYNC 1
+#define COPY_BACKEND_URING 2        // native, with small files batched through io_uring
+#define COPY_JOBS_DEFAULT 8         // Directory copies are bound by NFS round trips, not CPU
+#define COPY_JOBS_MAX 256
+#define TRACE_NOTES_MAX 16
+#define COPY_CLONE_CACHE 16         // filesystem pairs remembered by the reflink probe
+#define COPY_QUEUE_DEPTH_DEFAULT 64 // io_uring operations in flight per thread
+#define COPY_QUEUE_DEPTH_MAX 4096
+#define COPY_URING_CHUNK 65536      // io_uring read/write size
+#define COPY_URING_SMALL 1048576    // larger files take the synchronous path (copy_file_range, reflinks)
+#define COPY_THROTTLE_CHUNK 1048576 // largest data step between rate checks when throttled
 
 #define DISABLE_BUFFERING \
     setvbuf(stdout, NULL, _IONBF, 0); \
     setvbuf(stderr, NULL, _IONBF, 0);
 
+#define SNAPSHOT_MAGIC "MHSNAP\0\0"
+#define SNAPSHOT_VERSION 3
+#define SNAPSHOT_MATCH_LITERAL 0
+#define SNAPSHOT_MATCH_REGEX 1
+#define SNAPSHOT_TRANSFER_REQUIRED 0x01    // T! entry, copied before the login returns
+#define MANIFEST_MAGIC "MHMANIF\0"
+#define MANIFEST_VERSION 1
+#define MANIFEST_HASH_INIT 0xcbf29ce484222325ULL
+#define RESOLVE_MAGIC "MHRESOLV"
+#define RESOLVE_VERSION 2
+#define WATCH_DEBOUNCE_DEFAULT 200  // milliseconds
+#define INIT_LOCK_TIMEOUT_DEFAULT 120  // seconds
+#define INIT_LOCK_POLL_MS 50
+#define HOSTLIST_MAX 1048576           // hosts accepted by --provision
+#define HOSTLIST_NAME_MAX 256
+#define SNAPSHOT_MATCHER_MIN 16      // rules needed before the combined matcher pays off
+#define HOME_USED_INTERVAL 3600      // seconds between last-used stamps of a home
+#define COPY_STORE_GRACE 3600        // seconds an unreferenced store object is kept (it may be about to be linked)
+#define COPY_STORE_RECORD ".meta"     // suffix of the record next to each store object (see copy_store_valid())
+#define STORAGE_PWBUF 16384          // getpwuid_r() buffer for node-local storage paths
+#define WATCH_KIND_CONFIG 0
+#define WATCH_KIND_SKEL 1
+#define WATCH_KIND_TRANSFER 2
+
+struct SnapshotSource {
+    int64_t size;               // -1 when the file does not exist
+    uint64_t ino;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+};
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t rule_count;
+    uint32_t transfer_count;
+    uint32_t strings_size;
+    struct SnapshotSource host_group;
+    struct SnapshotSource transfer;
+};
+
+struct SnapshotRule {
+    uint32_t pattern;           // string table offset
+    uint32_t home;              // string table offset
+    uint32_t lineno;
+    uint32_t kind;              // SNAPSHOT_MATCH_*
+};
+
+struct SnapshotTransfer {
+    uint32_t where;             // string table offset
+    uint32_t lineno;
+    char type;                  // L, H, T or X
+    char flags;                 // SNAPSHOT_TRANSFER_*
+    char reserved[2];
+};
+
+struct Uring;
+
+struct PlanOp {
+    char type;                  // '\0' (skeleton), T, L or H
+    char *source;
+    char *dest;
+    char *where;                // transfer record or skeleton phase name
+    char **names;               // top level entries of the home directory written
+    size_t names_count;
+    size_t *deps;               // operations that must finish first
+    size_t deps_count;
+    size_t waiting;             // unfinished dependencies (plan_run())
+    int state;
+    int status;
+    uint64_t files;             // estimate (plan_estimate())
+    uint64_t bytes;
+};
+
+struct Plan {
+    char *home;
+    struct PlanOp *ops;
+    size_t count;
+    size_t alloc;
+};
+
+struct Matcher {
+    size_t rules;
+    char **needles;             // per rule, NULL when the rule is in always
+    unsigned char classes[256]; // input byte -> class (0 = in no needle)
+    size_t classes_count;
+    int32_t *next;              // transitions: state * classes_count + class
+    int32_t *dict;              // nearest suffix state completing a needle, or -1
+    int32_t *out_head;          // first output of a state, or -1
+    int32_t *out_rule;          // outputs: rule index
+    int32_t *out_link;          // outputs: next output of the same state, or -1
+    size_t states_count;
+    size_t out_count;
+    size_t words;
+    uint64_t *always;           // rules that are candidates for every hostname
+    uint64_t *candidates;       // scratch returned by matcher_scan()
+};
+
+struct Snapshot {
+    void *data;
+    size_t size;
+    int mapped;
+    struct SnapshotHeader *header;
+    struct SnapshotRule *rules;
+    struct SnapshotTransfer *transfers;
+    char *strings;
+    regex_t **compiled;         // regular expressions compiled on demand
+    struct Matcher *matcher;    // combined matcher (large rule sets, see snapshot_matcher())
+};
+
+struct StorageRule {
+    regex_t compiled;           // pattern matched against the name of the home directory
+    char *root;                 // node-local storage directory
+};
+
+struct Storage {
+    struct StorageRule *rules;
+    size_t count;
+    size_t alloc;
+};
+
+struct Multihome {
+    char path_new[PATH_MAX];
+    char path_durable[PATH_MAX];    // home in home_local (same as path_new unless the home is node-local)
+    char path_old[PATH_MAX];
+    char path_topdir[PATH_MAX];
+    char path_root[PATH_MAX];
+    char marker[PATH_MAX];
+    char manifest[PATH_MAX];
+    char entry_point[PATH_MAX];
+    char config_dir[PATH_MAX];
+    char config_host_group[PATH_MAX];
+    char config_transfer[PATH_MAX];
+    char config_skeleton[PATH_MAX];
+    char scripts_dir[PATH_MAX];
+    char config_snapshot[PATH_MAX];
+    char config_objects[PATH_MAX];
+    char config_storage[PATH_MAX];
+    struct Snapshot snapshot;   // compiled host_group and transfer configuration
+    struct Storage storage;     // node-local storage rules
+};
+
+struct CopyStats {
+    uint64_t files;
+    uint64_t dirs;
+    uint64_t links;
+    uint64_t bytes;
+    uint64_t skipped;
+    uint64_t errors;
+    uint64_t cloned;            // files that share their data with the source (reflink)
+};
+
+struct UsageStats {
+    uint64_t bytes;             // allocated on disk
+    uint64_t apparent;          // sum of file sizes
+    uint64_t files;
+    uint64_t dirs;
+    uint64_t errors;
+};
+
+struct CopyListEntry {
+    char *path;                 // relative to CopyList.source ("" for the source itself)
+    struct stat st;
+};
+
+struct CopyList {
+    char *source;
+    int contents;               // source had a trailing slash
+    struct CopyListEntry *entries;
+    size_t count;
+    size_t alloc;
+};
+
+struct ManifestRecord {
+    char *path;                 // destination path
+    uint32_t mode;              // source metadata
+    int64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t ino;
+    uint64_t hash;              // content hash (0 if not computed)
+    uint32_t generation;        // records not seen during this run are dropped on save
+};
+
+struct Manifest {
+    pthread_mutex_t lock;
+    struct ManifestRecord *table;
+    size_t alloc;
+    size_t count;
+    uint32_t generation;
+    char **index;               // sorted paths of unseen records (see manifest_keep())
+    size_t index_count;
+};
+
+struct HostList {
+    char **hosts;
+    size_t count;
+    size_t alloc;
+};
+
+struct ResolveHost {
+    char *nodename;
+    char *path_new;
+};
+
+struct WatchEntry {
+    int wd;                     // -1 once the kernel dropped the watch
+    int kind;
+    char *dir;
+    char *name;                 // NULL for tree watches
+    char *source;
+    char *dest;
+};
+
+struct Watch {
+    int fd;
+    int overflow;               // events were lost since the last batch
+    struct WatchEntry *entries;
+    size_t count;
+    size_t alloc;
+};
+
+struct WatchChange {
+    int kind;
+    int exact;                  // source/dest are exactly as passed to watch_add()
+    char *source;
+    char *dest;
+};
+
 void free_array(void **arr, size_t nelem);
 ssize_t count_substrings(const char *s, char *sub);
 char **split(const char *sptr, char *delim, size_t *num_alloc);
-char *find_program(const char *_name);
+char *find_program(const char *_name, char *buf);
 int shell(char *args[]);
 int mkdirs(char *path);
 int copy(char *source, char *dest, int mode);
+int copy_set_backend(const char *name);
+int copy_get_backend();
+int copy_set_jobs(long jobs);
+size_t copy_get_jobs();
+int copy_set_queue_depth(long depth);
+void copy_set_throttle(uint64_t bytes_per_sec, uint64_t ops_per_sec);
+void copy_set_idle(int enable);
+void copy_get_stats(struct CopyStats *stats);
+void copy_stats_track(struct CopyStats *stats);
+void copy_set_manifest(struct Manifest *manifest, int checksum, int skip_dirs);
+int copy_set_store(const char *path);
+int copy_set_exclude(const char *root, const char **patterns, size_t count);
+int copy_excluded(const char *path, mode_t mode);
+void copy_exclude_lift(int lifted);
+int copy_store_prune(const char *path, int dry_run, uint64_t *objects, uint64_t *bytes);
+int copy_list_scan(struct CopyList *list, const char *source);
+int copy_list_apply(struct CopyList *list, const char *dest, int mode, struct Manifest *manifest, struct CopyStats *stats);
+void copy_list_free(struct CopyList *list);
+uint64_t hash_fnv1a(uint64_t hash, const void *data, size_t len);
+int hash_file(const char *path, uint64_t *hash);
+void manifest_init(struct Manifest *m);
+size_t manifest_load(struct Manifest *m, const char *filename);
+int manifest_save(struct Manifest *m, const char *filename);
+void manifest_free(struct Manifest *m);
+int manifest_match(struct Manifest *m, const char *dest, struct stat *st, uint64_t *hash);
+void manifest_update(struct Manifest *m, const char *dest, struct stat *st, uint64_t hash);
+void manifest_keep(struct Manifest *m, const char *dest);
+void manifest_rebase(struct Manifest *m, const char *from, const char *to);
+char **manifest_stale(struct Manifest *m, size_t *count);
+int watch_init(struct Watch *w);
+void watch_free(struct Watch *w);
+int watch_add(struct Watch *w, int kind, const char *dir, const char *name, const char *source, const char *dest);
+void watch_remove(struct Watch *w, int kind);
+ssize_t watch_wait(struct Watch *w, long debounce_ms, struct WatchChange **changes);
+void watch_changes_free(struct WatchChange *changes, size_t count);
 int touch(char *filename);
-char *get_timestamp();
-void write_init_script();
-void user_transfer(int copy_mode);
+char *get_timestamp(char *result, size_t size);
+char *human_size(uint64_t bytes, char *result, size_t size);
+int parse_size(const char *str, uint64_t *result);
+int write_init_script();
+int render_template(FILE *fp_input, FILE *fp_output, const char *path_output, struct ResolveHost *hosts, size_t hosts_count);
+void refresh_init_script(const char *argv0);
+int multihome_init(struct Multihome *mh, const char *path_old);
+int multihome_config(struct Multihome *mh);
+int multihome_load(struct Multihome *mh);
+int multihome_resolve(struct Multihome *mh, const char *nodename);
+int multihome_storage(struct Multihome *mh);
+const char *multihome_map(struct Multihome *mh, const char *hostname);
+void multihome_free(struct Multihome *mh);
+int multihome_login(const char *path_old, const char *nodename, long timeout, char *path_new);
+char **user_transfer_sources(struct Multihome *mh, struct SnapshotTransfer *record, size_t *count);
+void user_transfer_exclude(struct Multihome *mh, int enable);
+void user_transfer(struct Multihome *mh, const char *home, int copy_mode, int select);
+int home_prepare(struct Multihome *mh, const char *home);
+void home_plan(struct Multihome *mh, struct Plan *plan, int select);
+void home_populate(struct Multihome *mh, const char *home, const char *home_final, int copy_mode, int checksum, int skip_dirs, int select);
+int home_build(const char *home, long timeout, int (*populate)(const char *, const char *, void *), void *arg);
+int home_initialize(struct Multihome *mh, long timeout, int checksum, int skip_dirs);
+void home_set_deadline(long seconds);
+int home_abandoned(const char *home);
+int home_resume(struct Multihome *mh);
+int home_mark_used(const char *home);
+time_t home_last_used(const char *home);
+int home_retire(const char *home, time_t cutoff, const char *archive, long timeout);
+int home_sync_back(struct Multihome *mh, long timeout, int skip_dirs, struct CopyStats *stats, uint64_t *removed);
+int usage_scan(char **paths, size_t count, struct UsageStats *stats, size_t jobs);
+int user_watch(long debounce_ms, int checksum);
+int user_update_all(int checksum);
+int user_provision(const char *hostlist, long timeout);
+int user_map(FILE *in, FILE *out);
+int user_report();
+int user_gc(long days, const char *archive, int dry_run, long timeout);
+int user_sync_back(long interval, long timeout, int skip_dirs);
 char *strip_domainname(char *hostname);
+void plan_init(struct Plan *plan, const char *home);
+size_t plan_add(struct Plan *plan, char type, const char *source, const char *dest, const char *where);
+void plan_estimate(struct Plan *plan);
+void plan_print(struct Plan *plan, FILE *fp);
+int plan_link(char type, const char *source, const char *dest);
+int plan_run(struct Plan *plan, int mode);
+void plan_free(struct Plan *plan);
+int trace_open(const char *filename);
+int trace_metrics(const char *dir);
+void trace_finish();
+int trace_enabled();
+void trace_note(const char *key, const char *value);
+size_t trace_begin(const char *name);
+size_t trace_begin_transfer(char type, const char *where);
+void trace_end(size_t id, int status);
+int snapshot_load(struct Snapshot *snap, const char *filename, const char *host_group, const char *transfer);
+void snapshot_free(struct Snapshot *snap);
+const char *snapshot_string(struct Snapshot *snap, uint32_t offset);
+ssize_t snapshot_match(struct Snapshot *snap, const char *hostname);
+void snapshot_matcher(struct Snapshot *snap);
+void snapshot_source(const char *filename, struct SnapshotSource *source);
+int resolve_cache_lookup(const char *home, const char *nodename, char *path_new);
+int resolve_cache_write(const char *home, const char *nodename, const char *path_new);
+struct ResolveHost *resolve_cache_list(const char *home, size_t *count);
+void resolve_cache_list_free(struct ResolveHost *hosts, size_t count);
+int hostlist_add(struct HostList *list, const char *expr);
+int hostlist_read(struct HostList *list, FILE *fp);
+void hostlist_free(struct HostList *list);
+int storage_load(struct Storage *storage, const char *filename);
+const char *storage_match(struct Storage *storage, const char *name);
+int storage_prepare(const char *dir);
+void storage_free(struct Storage *storage);
+struct Uring *uring_open(unsigned entries);
+void uring_close(struct Uring *ring);
+unsigned uring_entries(struct Uring *ring);
+int uring_prep_openat(struct Uring *ring, int dirfd, const char *path, int flags, mode_t mode, uint64_t data);
+int uring_prep_statx(struct Uring *ring, int dirfd, const char *path, int flags, unsigned mask, void *statxbuf, uint64_t data);
+int uring_prep_read(struct Uring *ring, int fd, void *buf, unsigned len, uint64_t offset, uint64_t data);
+int uring_prep_write(struct Uring *ring, int fd, const void *buf, unsigned len, uint64_t offset, uint64_t data);
+int uring_prep_close(struct Uring *ring, int fd, uint64_t data);
+int uring_prep_renameat(struct Uring *ring, int olddirfd, const char *oldpath, int newdirfd, const char *newpath, uint64_t data);
+int uring_wait(struct Uring *ring, uint64_t *data, int *res);
+void matcher_init(struct Matcher *m, size_t rules);
+void matcher_add(struct Matcher *m, size_t rule, const char *needle);
+void matcher_build(struct Matcher *m);
+const uint64_t *matcher_scan(struct Matcher *m, const char *text);
+void matcher_needle(const char *pattern, char *buf, size_t size);
+void matcher_free(struct Matcher *m);
 
 #endif //MULTIHOME_MULTIHOME_H
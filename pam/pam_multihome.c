@@ -0,0 +1,219 @@
+/**
+ * pam_multihome: set HOME to the per-host home directory at session open
+ *
+ * Shell profiles only run for interactive logins, so "ssh host command", scp and
+ * sftp never see the managed home directory. This session module resolves it
+ * inside the PAM stack instead and exports HOME (and HOME_OLD) through the PAM
+ * environment, which the service copies into the user's process.
+ *
+ * Accounts without ~/.multihome are left alone. Resolution and initialization run
+ * in a child process with the user's credentials (home directories on NFS are
+ * often not accessible to root). A failure never blocks the login, the session
+ * simply keeps the original home directory.
+ *
+ * Example (/etc/pam.d/sshd):
+ *     session optional pam_multihome.so timeout=30
+ *
+ * ARGUMENTS:
+ *     timeout=SEC  wait up to SEC seconds for another login initializing the same home
+ *     deadline=SEC finish T entries in the background after SEC seconds of a first login
+ *     bwlimit=RATE copy at most RATE bytes per second (K, M, G suffixes)
+ *     iops=N       create or examine at most N entries per second while copying
+ *     idle         copy in the idle I/O scheduling class
+ *     metrics=DIR  add the metrics of each login to DIR/multihome_USER.prom
+ *     debug        log every resolution
+ */
+#define PAM_SM_SESSION
+#include "multihome.h"
+#include <grp.h>
+#include <syslog.h>
+#include <security/pam_modules.h>
+
+#define PAM_MULTIHOME_PWBUF 16384
+#define PAM_MULTIHOME_DISABLED 2    // exit status of the child for accounts without ~/.multihome
+
+/**
+ * Resolve the home directory as the user
+ * @param pw account
+ * @param nodename short hostname
+ * @param timeout lock timeout passed to multihome_login()
+ * @param fd write end of the result pipe
+ */
+static void pam_multihome_child(struct passwd *pw, const char *nodename, long timeout, int fd) {
+    char config_dir[PATH_MAX];
+    char path_new[PATH_MAX];
+    int null;
+
+    // Nothing may reach the client's terminal
+    null = open("/dev/null", O_RDWR);
+    if (null >= 0) {
+        dup2(null, STDIN_FILENO);
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        if (null > STDERR_FILENO) {
+            close(null);
+        }
+    }
+
+    if (geteuid() == 0) {
+        if (setgid(pw->pw_gid) < 0 || initgroups(pw->pw_name, pw->pw_gid) < 0 || setuid(pw->pw_uid) < 0) {
+            _exit(1);
+        }
+    } else if (geteuid() != pw->pw_uid) {
+        _exit(1);
+    }
+    umask(022);
+
+    snprintf(config_dir, sizeof(config_dir), "%s/%s", pw->pw_dir, MULTIHOME_CFGDIR);
+    if (access(config_dir, F_OK) < 0) {
+        _exit(PAM_MULTIHOME_DISABLED);
+    }
+
+    if (multihome_login(pw->pw_dir, nodename, timeout, path_new) < 0) {
+        trace_finish();
+        _exit(1);
+    }
+    if (write(fd, path_new, strlen(path_new)) < 0) {
+        _exit(1);
+    }
+    trace_finish();
+    _exit(0);
+}
+
+int pam_sm_open_session(pam_handle_t *pamh, int flags, int argc, const char **argv) {
+    struct sigaction sa_default;
+    struct sigaction sa_saved;
+    struct passwd pw;
+    struct passwd *result;
+    struct utsname host_info;
+    char pwbuf[PAM_MULTIHOME_PWBUF];
+    char path_new[PATH_MAX];
+    char env[PATH_MAX + 16];
+    const char *metrics;
+    const char *user;
+    uint64_t bwlimit;
+    uint64_t iops;
+    long deadline;
+    long timeout;
+    ssize_t len;
+    size_t total;
+    pid_t pid;
+    int debug;
+    int idle;
+    int status;
+    int fds[2];
+
+    (void) flags;
+    timeout = INIT_LOCK_TIMEOUT_DEFAULT;
+    deadline = 0;
+    metrics = NULL;
+    bwlimit = 0;
+    iops = 0;
+    debug = 0;
+    idle = 0;
+    for (int i = 0; i < argc; i++) {
+        if (strncmp(argv[i], "timeout=", 8) == 0) {
+            timeout = strtol(argv[i] + 8, NULL, 10);
+        } else if (strncmp(argv[i], "deadline=", 9) == 0) {
+            deadline = strtol(argv[i] + 9, NULL, 10);
+        } else if (strncmp(argv[i], "bwlimit=", 8) == 0 && parse_size(argv[i] + 8, &bwlimit) == 0) {
+            continue;
+        } else if (strncmp(argv[i], "iops=", 5) == 0 && parse_size(argv[i] + 5, &iops) == 0) {
+            continue;
+        } else if (strncmp(argv[i], "metrics=", 8) == 0) {
+            metrics = argv[i] + 8;
+        } else if (strcmp(argv[i], "idle") == 0) {
+            idle = 1;
+        } else if (strcmp(argv[i], "debug") == 0) {
+            debug = 1;
+        } else {
+            syslog(LOG_AUTHPRIV | LOG_ERR, "pam_multihome: unknown option: %s", argv[i]);
+        }
+    }
+
+    if (pam_get_user(pamh, &user, NULL) != PAM_SUCCESS || user == NULL) {
+        return PAM_USER_UNKNOWN;
+    }
+    if (getpwnam_r(user, &pw, pwbuf, sizeof(pwbuf), &result) != 0 || result == NULL) {
+        return PAM_USER_UNKNOWN;
+    }
+    if (uname(&host_info) < 0) {
+        return PAM_IGNORE;
+    }
+    strip_domainname(host_info.nodename);
+
+    if (pipe(fds) < 0) {
+        return PAM_IGNORE;
+    }
+
+    // The service may reap children on its own. Keep our child to ourselves.
+    memset(&sa_default, 0, sizeof(sa_default));
+    sa_default.sa_handler = SIG_DFL;
+    sigemptyset(&sa_default.sa_mask);
+    sigaction(SIGCHLD, &sa_default, &sa_saved);
+
+    pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        copy_set_throttle(bwlimit, iops);
+        copy_set_idle(idle);
+        home_set_deadline(deadline);
+        if (metrics != NULL) {
+            trace_metrics(metrics);
+        }
+        pam_multihome_child(&pw, host_info.nodename, timeout, fds[1]);
+    }
+    close(fds[1]);
+
+    total = 0;
+    if (pid > 0) {
+        while (total < sizeof(path_new) - 1 && (len = read(fds[0], path_new + total, sizeof(path_new) - 1 - total)) != 0) {
+            if (len < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+            total += len;
+        }
+    }
+    path_new[total] = '\0';
+    close(fds[0]);
+
+    status = -1;
+    if (pid > 0) {
+        while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+            continue;
+        }
+    }
+    sigaction(SIGCHLD, &sa_saved, NULL);
+
+    if (pid < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0 || total == 0) {
+        if (pid > 0 && WIFEXITED(status) && WEXITSTATUS(status) == PAM_MULTIHOME_DISABLED) {
+            return PAM_IGNORE;
+        }
+        syslog(LOG_AUTHPRIV | LOG_WARNING, "pam_multihome: unable to resolve the home directory of %s on %s", user, host_info.nodename);
+        return PAM_IGNORE;
+    }
+
+    snprintf(env, sizeof(env), "HOME_OLD=%s", pw.pw_dir);
+    if (pam_putenv(pamh, env) != PAM_SUCCESS) {
+        return PAM_IGNORE;
+    }
+    snprintf(env, sizeof(env), "HOME=%s", path_new);
+    if (pam_putenv(pamh, env) != PAM_SUCCESS) {
+        return PAM_IGNORE;
+    }
+    if (debug) {
+        syslog(LOG_AUTHPRIV | LOG_DEBUG, "pam_multihome: %s on %s: HOME=%s", user, host_info.nodename, path_new);
+    }
+    return PAM_SUCCESS;
+}
+
+int pam_sm_close_session(pam_handle_t *pamh, int flags, int argc, const char **argv) {
+    (void) pamh;
+    (void) flags;
+    (void) argc;
+    (void) argv;
+    return PAM_SUCCESS;
+}
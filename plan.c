@@ -0,0 +1,421 @@
+#include "multihome.h"
+
+/**
+ * Plan and execute the population of a home directory
+ *
+ * The skeletons and the transfer configuration are first turned into a list of
+ * operations: one copy per skeleton, one copy, symlink or hardlink per transfer
+ * source. Every operation writes a known set of names at the top of the home
+ * directory. An operation depends on the last earlier operation that writes one
+ * of the same names, so wherever two of them overlap they run in the order of
+ * the old sequential code: the user skeleton after the system skeleton, T, L and
+ * H entries after the skeletons they override, and transfer entries in file
+ * order. Operations that share no name run concurrently (see plan_run()).
+ *
+ * EXAMPLE:
+ *     #1 copy     /etc/skel/ -> .
+ *     #2 copy     ~/.multihome/skel/ -> .       after #1 (.bashrc)
+ *     #3 symlink  ~/.ssh -> .ssh
+ *     #4 copy     ~/.config/ -> .config         after #2 (.config)
+ */
+
+#define PLAN_WAITING 0
+#define PLAN_READY 1
+#define PLAN_RUNNING 2
+#define PLAN_DONE 3
+
+/**
+ * Prepare an empty plan
+ * @param plan plan
+ * @param home destination home directory
+ */
+void plan_init(struct Plan *plan, const char *home) {
+    memset(plan, 0, sizeof(*plan));
+    plan->home = strdup(home);
+    if (plan->home == NULL) {
+        perror("plan");
+        exit(1);
+    }
+}
+
+/**
+ * Append a string to an array
+ */
+static void plan_push_name(struct PlanOp *op, const char *name) {
+    char **tmp;
+
+    tmp = realloc(op->names, (op->names_count + 1) * sizeof(*tmp));
+    if (tmp == NULL || (tmp[op->names_count] = strdup(name)) == NULL) {
+        perror("plan");
+        exit(1);
+    }
+    op->names = tmp;
+    op->names_count++;
+}
+
+/**
+ * Find the names a copy writes at the top of the home directory
+ * @param op operation (source and dest set)
+ * @param home home directory
+ */
+static void plan_names(struct PlanOp *op, const char *home) {
+    struct dirent *rec;
+    DIR *d;
+
+    if (strcmp(op->dest, home) != 0) {
+        plan_push_name(op, op->dest + strlen(home) + 1);
+        return;
+    }
+
+    // A skeleton spreads its contents over the home directory
+    d = opendir(op->source);
+    if (d == NULL) {
+        return;
+    }
+    while ((rec = readdir(d)) != NULL) {
+        if (strcmp(rec->d_name, ".") != 0 && strcmp(rec->d_name, "..") != 0) {
+            plan_push_name(op, rec->d_name);
+        }
+    }
+    closedir(d);
+}
+
+/**
+ * Add an operation
+ *
+ * @param plan plan
+ * @param type '\0' = copy the contents of a skeleton directory into the home
+ *        directory, T = copy source to dest, L = symbolic link, H = hard link
+ * @param source source path
+ * @param dest destination path (the home directory itself for skeletons)
+ * @param where transfer record, or phase name of a skeleton (reported by trace)
+ * @return index of the operation
+ */
+size_t plan_add(struct Plan *plan, char type, const char *source, const char *dest, const char *where) {
+    struct PlanOp *op;
+
+    if (plan->count == plan->alloc) {
+        struct PlanOp *tmp;
+        size_t alloc = plan->alloc ? plan->alloc * 2 : 16;
+        tmp = realloc(plan->ops, alloc * sizeof(*tmp));
+        if (tmp == NULL) {
+            perror("plan");
+            exit(1);
+        }
+        plan->ops = tmp;
+        plan->alloc = alloc;
+    }
+    op = &plan->ops[plan->count];
+    memset(op, 0, sizeof(*op));
+    op->type = type;
+    op->source = strdup(source);
+    op->dest = strdup(dest);
+    op->where = strdup(where);
+    if (op->source == NULL || op->dest == NULL || op->where == NULL) {
+        perror("plan");
+        exit(1);
+    }
+    plan_names(op, plan->home);
+
+    // Wait for the last earlier writer of each name
+    for (size_t n = 0; n < op->names_count; n++) {
+        for (size_t i = plan->count; i-- > 0;) {
+            struct PlanOp *prev = &plan->ops[i];
+            size_t k;
+
+            for (k = 0; k < prev->names_count && strcmp(prev->names[k], op->names[n]) != 0; k++) {
+                continue;
+            }
+            if (k == prev->names_count) {
+                continue;
+            }
+            for (k = 0; k < op->deps_count && op->deps[k] != i; k++) {
+                continue;
+            }
+            if (k == op->deps_count) {
+                size_t *tmp = realloc(op->deps, (op->deps_count + 1) * sizeof(*tmp));
+                if (tmp == NULL) {
+                    perror("plan");
+                    exit(1);
+                }
+                op->deps = tmp;
+                op->deps[op->deps_count++] = i;
+            }
+            break;
+        }
+    }
+    return plan->count++;
+}
+
+/**
+ * Estimate what each copy will write
+ *
+ * The estimate is the size of the source. Entries the manifest shows unchanged
+ * are skipped by the copy, so it is an upper bound.
+ *
+ * @param plan plan
+ */
+void plan_estimate(struct Plan *plan) {
+    for (size_t i = 0; i < plan->count; i++) {
+        struct PlanOp *op = &plan->ops[i];
+        struct CopyList list;
+
+        if (op->type != '\0' && op->type != 'T') {
+            continue;
+        }
+        copy_exclude_lift(op->type == '\0');
+        if (copy_list_scan(&list, op->source) == 0) {
+            for (size_t j = 0; j < list.count; j++) {
+                if (S_ISREG(list.entries[j].st.st_mode)) {
+                    op->files++;
+                    op->bytes += list.entries[j].st.st_size;
+                }
+            }
+        }
+        copy_list_free(&list);
+        copy_exclude_lift(0);
+    }
+}
+
+/**
+ * Print a plan
+ * @param plan plan (see plan_estimate())
+ * @param fp output
+ */
+void plan_print(struct Plan *plan, FILE *fp) {
+    char size[32];
+    uint64_t bytes;
+    uint64_t files;
+    size_t home_len;
+
+    fprintf(fp, "Plan for %s\n", plan->home);
+    home_len = strlen(plan->home);
+    bytes = files = 0;
+    for (size_t i = 0; i < plan->count; i++) {
+        struct PlanOp *op = &plan->ops[i];
+        const char *dest;
+        const char *action;
+
+        dest = strncmp(op->dest, plan->home, home_len) == 0 && op->dest[home_len] == '/' ? op->dest + home_len + 1 : ".";
+        action = op->type == 'L' ? "symlink" : op->type == 'H' ? "hardlink" : "copy";
+        fprintf(fp, "  #%-3zu %-8s %s -> %s", i + 1, action, op->source, dest);
+        if (op->type == '\0' || op->type == 'T') {
+            fprintf(fp, "  (%llu files, %s)", (unsigned long long) op->files, human_size(op->bytes, size, sizeof(size)));
+        }
+        for (size_t j = 0; j < op->deps_count; j++) {
+            fprintf(fp, "%s#%zu", j ? ", " : "  after ", op->deps[j] + 1);
+        }
+        fputc('\n', fp);
+        bytes += op->bytes;
+        files += op->files;
+    }
+    fprintf(fp, "%zu operations, %llu files, %s at most\n", plan->count, (unsigned long long) files, human_size(bytes, size, sizeof(size)));
+}
+
+/**
+ * Create a link, replacing what a skeleton put in its place
+ *
+ * A link that is already in place is left alone. Directories are never replaced.
+ * Every path that populates a home directory (login, --update, --update-all,
+ * --provision) links through here, so they all build the same home.
+ *
+ * @param type L (symbolic link) or H (hardlink)
+ * @param source link target
+ * @param dest path of the link
+ * @return 0=success, -1=error (errno set)
+ */
+int plan_link(char type, const char *source, const char *dest) {
+    struct stat st;
+    struct stat src_st;
+
+    if (lstat(dest, &st) == 0) {
+        if (type == 'L' && S_ISLNK(st.st_mode)) {
+            char target[PATH_MAX];
+            ssize_t len = readlink(dest, target, sizeof(target) - 1);
+            if (len >= 0 && (target[len] = '\0', strcmp(target, source) == 0)) {
+                return 0;
+            }
+        } else if (type == 'H' && lstat(source, &src_st) == 0
+                   && st.st_dev == src_st.st_dev && st.st_ino == src_st.st_ino) {
+            return 0;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            errno = EEXIST;
+            return -1;
+        }
+        if (unlink(dest) < 0) {
+            return -1;
+        }
+    }
+    return type == 'L' ? symlink(source, dest) : link(source, dest);
+}
+
+/**
+ * Perform one operation
+ * @param op operation
+ * @param mode COPY_NORMAL or COPY_UPDATE
+ * @return 0=success, -1=error
+ */
+static int plan_execute(struct PlanOp *op, int mode) {
+    int status;
+
+    switch (op->type) {
+        case 'L':
+            if (plan_link(op->type, op->source, op->dest) < 0) {
+                fprintf(stderr, "symlink: %s: %s -> %s\n", strerror(errno), op->source, op->dest);
+                return -1;
+            }
+            return 0;
+        case 'H':
+            if (plan_link(op->type, op->source, op->dest) < 0) {
+                fprintf(stderr, "hardlink: %s: %s -> %s\n", strerror(errno), op->source, op->dest);
+                return -1;
+            }
+            return 0;
+        case 'T':
+            if (copy(op->source, op->dest, mode) != 0) {
+                fprintf(stderr, "transfer: %s: %s -> %s\n", strerror(errno), op->source, op->dest);
+                return -1;
+            }
+            return 0;
+        default:
+            // Skeletons are never pruned by X entries
+            copy_exclude_lift(1);
+            status = copy(op->source, op->dest, mode);
+            copy_exclude_lift(0);
+            return status != 0 ? -1 : 0;
+    }
+}
+
+struct PlanRun {
+    struct Plan *plan;
+    int mode;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    size_t done;
+    int status;
+};
+
+static void *plan_worker(void *arg) {
+    struct PlanRun *run = arg;
+    struct Plan *plan = run->plan;
+
+    pthread_mutex_lock(&run->lock);
+    while (run->done < plan->count) {
+        struct CopyStats stats;
+        struct PlanOp *op;
+        size_t event;
+        size_t i;
+        int status;
+
+        // Lowest ready operation first, which is the sequential order when nothing overlaps
+        for (i = 0; i < plan->count && plan->ops[i].state != PLAN_READY; i++) {
+            continue;
+        }
+        if (i == plan->count) {
+            pthread_cond_wait(&run->wake, &run->lock);
+            continue;
+        }
+        op = &plan->ops[i];
+        op->state = PLAN_RUNNING;
+        // Other operations copy at the same time. Count this one on its own.
+        memset(&stats, 0, sizeof(stats));
+        copy_stats_track(&stats);
+        event = trace_begin_transfer(op->type, op->where);
+        pthread_mutex_unlock(&run->lock);
+
+        status = plan_execute(op, run->mode);
+
+        pthread_mutex_lock(&run->lock);
+        trace_end(event, status);
+        copy_stats_track(NULL);
+        op->status = status;
+        op->state = PLAN_DONE;
+        if (status < 0) {
+            run->status = -1;
+        }
+        run->done++;
+        for (size_t j = i + 1; j < plan->count; j++) {
+            for (size_t k = 0; k < plan->ops[j].deps_count; k++) {
+                if (plan->ops[j].deps[k] == i && --plan->ops[j].waiting == 0) {
+                    plan->ops[j].state = PLAN_READY;
+                }
+            }
+        }
+        pthread_cond_broadcast(&run->wake);
+    }
+    pthread_mutex_unlock(&run->lock);
+    return NULL;
+}
+
+/**
+ * Execute a plan
+ *
+ * Up to PLAN_JOBS operations run at once, each directory copy with its own pool of
+ * copy threads (see copy_set_jobs()). A failed operation is reported and does not
+ * hold back the ones that depend on it, as in the sequential code. X entries must
+ * be in effect (see user_transfer_exclude()), skeleton copies lift them for
+ * themselves.
+ *
+ * @param plan plan
+ * @param mode COPY_NORMAL or COPY_UPDATE
+ * @return 0=success, -1=one or more operations failed
+ */
+int plan_run(struct Plan *plan, int mode) {
+    struct PlanRun run;
+    pthread_t threads[PLAN_JOBS];
+    size_t workers;
+    size_t started;
+
+    for (size_t i = 0; i < plan->count; i++) {
+        plan->ops[i].waiting = plan->ops[i].deps_count;
+        plan->ops[i].state = plan->ops[i].waiting ? PLAN_WAITING : PLAN_READY;
+        plan->ops[i].status = 0;
+    }
+
+    memset(&run, 0, sizeof(run));
+    run.plan = plan;
+    run.mode = mode;
+    pthread_mutex_init(&run.lock, NULL);
+    pthread_cond_init(&run.wake, NULL);
+
+    workers = plan->count < PLAN_JOBS ? plan->count : PLAN_JOBS;
+    started = 0;
+    for (size_t i = 0; workers > 1 && i < workers; i++) {
+        if (pthread_create(&threads[i], NULL, plan_worker, &run) != 0) {
+            break;
+        }
+        started++;
+    }
+    if (started == 0) {
+        plan_worker(&run);
+    }
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    pthread_mutex_destroy(&run.lock);
+    pthread_cond_destroy(&run.wake);
+    return run.status;
+}
+
+/**
+ * Release a plan
+ * @param plan plan
+ */
+void plan_free(struct Plan *plan) {
+    for (size_t i = 0; i < plan->count; i++) {
+        struct PlanOp *op = &plan->ops[i];
+        for (size_t j = 0; j < op->names_count; j++) {
+            free(op->names[j]);
+        }
+        free(op->names);
+        free(op->deps);
+        free(op->source);
+        free(op->dest);
+        free(op->where);
+    }
+    free(plan->ops);
+    free(plan->home);
+    memset(plan, 0, sizeof(*plan));
+}
@@ -0,0 +1,234 @@
+#include "multihome.h"
+
+/**
+ * Per-host resolution cache
+ *
+ * Each host that has been resolved once gets a small record under
+ * ~/.multihome/resolve/ holding the home directory it maps to. The record is
+ * trusted only while host_group and storage are unchanged and the target home
+ * still carries the multihome marker, so a login can be answered without NSS
+ * lookups, PATH searches or parsing any configuration.
+ */
+
+struct ResolveRecord {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    struct SnapshotSource host_group;
+    struct SnapshotSource storage;
+    char path_old[PATH_MAX];
+    char path_new[PATH_MAX];
+};
+
+/**
+ * Construct the path to a host's resolution record
+ * @param home original home directory
+ * @param nodename short hostname
+ * @param buf output buffer (PATH_MAX)
+ * @return 0=success, -1=path too long
+ */
+static int resolve_cache_path(const char *home, const char *nodename, char *buf) {
+    int len;
+    len = snprintf(buf, PATH_MAX, "%s/%s/%s/%s", home, MULTIHOME_CFGDIR, MULTIHOME_CFG_RESOLVE, nodename);
+    if (len < 0 || len >= PATH_MAX) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Look up the home directory previously resolved for a host
+ * @param home original home directory
+ * @param nodename short hostname
+ * @param path_new output buffer (PATH_MAX)
+ * @return 0=hit, -1=miss or invalidated
+ */
+int resolve_cache_lookup(const char *home, const char *nodename, char *path_new) {
+    struct ResolveRecord rec;
+    struct SnapshotSource source;
+    char path[PATH_MAX];
+    ssize_t len;
+    int fd;
+
+    if (resolve_cache_path(home, nodename, path) < 0) {
+        return -1;
+    }
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    len = read(fd, &rec, sizeof(rec));
+    close(fd);
+
+    if (len != sizeof(rec)
+            || memcmp(rec.magic, RESOLVE_MAGIC, sizeof(rec.magic)) != 0
+            || rec.version != RESOLVE_VERSION) {
+        return -1;
+    }
+    rec.path_old[PATH_MAX - 1] = '\0';
+    rec.path_new[PATH_MAX - 1] = '\0';
+
+    if (strcmp(rec.path_old, home) != 0) {
+        return -1;
+    }
+
+    // A host_group edit may map this host somewhere else
+    snprintf(path, sizeof(path), "%s/%s/%s", home, MULTIHOME_CFGDIR, MULTIHOME_CFG_HOST_GROUP);
+    snapshot_source(path, &source);
+    if (memcmp(&source, &rec.host_group, sizeof(source)) != 0) {
+        return -1;
+    }
+
+    // A storage edit may move the home onto (or off) node-local storage
+    snprintf(path, sizeof(path), "%s/%s/%s", home, MULTIHOME_CFGDIR, MULTIHOME_CFG_STORAGE);
+    snapshot_source(path, &source);
+    if (memcmp(&source, &rec.storage, sizeof(source)) != 0) {
+        return -1;
+    }
+
+    // The home directory must still be initialized
+    if (snprintf(path, sizeof(path), "%s/%s", rec.path_new, MULTIHOME_MARKER) >= PATH_MAX
+            || access(path, F_OK) < 0) {
+        return -1;
+    }
+
+    strcpy(path_new, rec.path_new);
+    return 0;
+}
+
+/**
+ * Record the home directory resolved for a host
+ *
+ * Only record a home the configuration actually maps the host to, never the
+ * durable copy used while node-local storage is unavailable (see
+ * multihome_storage()), or the host would stay on it for good.
+ *
+ * @param home original home directory
+ * @param nodename short hostname
+ * @param path_new resolved home directory
+ * @return 0=success, -1=error (errno set)
+ */
+int resolve_cache_write(const char *home, const char *nodename, const char *path_new) {
+    struct ResolveRecord rec;
+    char path[PATH_MAX];
+    char tmp[PATH_MAX];
+    int fd;
+
+    memset(&rec, 0, sizeof(rec));
+    memcpy(rec.magic, RESOLVE_MAGIC, sizeof(rec.magic));
+    rec.version = RESOLVE_VERSION;
+    strncpy(rec.path_old, home, PATH_MAX - 1);
+    strncpy(rec.path_new, path_new, PATH_MAX - 1);
+
+    snprintf(path, sizeof(path), "%s/%s/%s", home, MULTIHOME_CFGDIR, MULTIHOME_CFG_HOST_GROUP);
+    snapshot_source(path, &rec.host_group);
+    snprintf(path, sizeof(path), "%s/%s/%s", home, MULTIHOME_CFGDIR, MULTIHOME_CFG_STORAGE);
+    snapshot_source(path, &rec.storage);
+
+    snprintf(path, sizeof(path), "%s/%s/%s", home, MULTIHOME_CFGDIR, MULTIHOME_CFG_RESOLVE);
+    if (access(path, F_OK) < 0 && mkdirs(path) < 0) {
+        return -1;
+    }
+
+    if (resolve_cache_path(home, nodename, path) < 0) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+    fd = mkstemp(tmp);
+    if (fd < 0) {
+        return -1;
+    }
+    if (write(fd, &rec, sizeof(rec)) != sizeof(rec)) {
+        int err = errno;
+        close(fd);
+        unlink(tmp);
+        errno = err;
+        return -1;
+    }
+    if (close(fd) < 0 || rename(tmp, path) < 0) {
+        int err = errno;
+        unlink(tmp);
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+static int resolve_host_cmp(const void *a, const void *b) {
+    return strcmp(((const struct ResolveHost *) a)->nodename, ((const struct ResolveHost *) b)->nodename);
+}
+
+/**
+ * List every host whose resolution record is still valid
+ * @param home original home directory
+ * @param count output: number of hosts
+ * @return array of hosts sorted by name (release with resolve_cache_list_free()), or NULL
+ */
+struct ResolveHost *resolve_cache_list(const char *home, size_t *count) {
+    struct ResolveHost *hosts;
+    struct dirent *rec;
+    char path[PATH_MAX];
+    size_t alloc;
+    DIR *d;
+
+    *count = 0;
+    alloc = 16;
+    hosts = calloc(alloc, sizeof(*hosts));
+    if (hosts == NULL) {
+        perror("resolve cache");
+        exit(1);
+    }
+
+    snprintf(path, sizeof(path), "%s/%s/%s", home, MULTIHOME_CFGDIR, MULTIHOME_CFG_RESOLVE);
+    d = opendir(path);
+    if (d == NULL) {
+        return hosts;
+    }
+    while ((rec = readdir(d)) != NULL) {
+        char path_new[PATH_MAX];
+
+        // Skip dot files and interrupted writes (nodename.XXXXXX)
+        if (rec->d_name[0] == '.' || strchr(rec->d_name, '.') != NULL) {
+            continue;
+        }
+        if (resolve_cache_lookup(home, rec->d_name, path_new) < 0) {
+            continue;
+        }
+        if (*count == alloc) {
+            struct ResolveHost *tmp;
+            alloc *= 2;
+            tmp = realloc(hosts, alloc * sizeof(*tmp));
+            if (tmp == NULL) {
+                perror("resolve cache");
+                exit(1);
+            }
+            hosts = tmp;
+        }
+        hosts[*count].nodename = strdup(rec->d_name);
+        hosts[*count].path_new = strdup(path_new);
+        if (hosts[*count].nodename == NULL || hosts[*count].path_new == NULL) {
+            perror("resolve cache");
+            exit(1);
+        }
+        (*count)++;
+    }
+    closedir(d);
+
+    qsort(hosts, *count, sizeof(*hosts), resolve_host_cmp);
+    return hosts;
+}
+
+/**
+ * Release a list returned by resolve_cache_list()
+ * @param hosts array of hosts
+ * @param count number of hosts
+ */
+void resolve_cache_list_free(struct ResolveHost *hosts, size_t count) {
+    for (size_t i = 0; hosts && i < count; i++) {
+        free(hosts[i].nodename);
+        free(hosts[i].path_new);
+    }
+    free(hosts);
+}
@@ -0,0 +1,739 @@
+#include "multihome.h"
+#include <sys/mman.h>
+
+/**
+ * Compiled configuration snapshot
+ *
+ * host_group and transfer are parsed and validated once, then stored in a single
+ * file under the configuration directory. The snapshot is keyed by the size, mtime
+ * and inode of both source files and is rebuilt whenever either one changes.
+ *
+ * LAYOUT:
+ *     struct SnapshotHeader
+ *     struct SnapshotRule[rule_count]
+ *     struct SnapshotTransfer[transfer_count]
+ *     char strings[strings_size]   (NUL terminated strings, referenced by offset)
+ */
+
+struct SnapshotBuilder {
+    struct SnapshotRule *rules;
+    size_t rules_count;
+    size_t rules_alloc;
+    struct SnapshotTransfer *transfers;
+    size_t transfers_count;
+    size_t transfers_alloc;
+    char *strings;
+    size_t strings_size;
+    size_t strings_alloc;
+};
+
+/**
+ * Grow an array held by the builder
+ */
+static void *builder_grow(void *ptr, size_t *alloc, size_t count, size_t elem_size) {
+    if (count < *alloc) {
+        return ptr;
+    }
+    *alloc = *alloc ? *alloc * 2 : 32;
+    ptr = realloc(ptr, *alloc * elem_size);
+    if (ptr == NULL) {
+        perror("snapshot");
+        exit(1);
+    }
+    return ptr;
+}
+
+/**
+ * Append a string to the builder's string table
+ * @return offset of the string
+ */
+static uint32_t builder_string(struct SnapshotBuilder *b, const char *str) {
+    size_t len;
+    uint32_t offset;
+
+    len = strlen(str) + 1;
+    while (b->strings_size + len > b->strings_alloc) {
+        b->strings_alloc = b->strings_alloc ? b->strings_alloc * 2 : BUFSIZ;
+        b->strings = realloc(b->strings, b->strings_alloc);
+        if (b->strings == NULL) {
+            perror("snapshot");
+            exit(1);
+        }
+    }
+    offset = b->strings_size;
+    memcpy(&b->strings[offset], str, len);
+    b->strings_size += len;
+    return offset;
+}
+
+/**
+ * End string on first occurrence of LF or whitespace
+ * @param str
+ * @return non-zero if LF not found
+ */
+static int strip(char **str) {
+    char *orig;
+    char *tmp;
+    char *result;
+
+    orig = (*str);
+    tmp = NULL;
+    result = strchr((*str), '\n');
+    if (result) {
+        *result = '\0';
+    }
+
+    tmp = (*str);
+    while(tmp) {
+        if (isblank(*tmp)) {
+            tmp++;
+            continue;
+        }
+        break;
+    }
+    size_t size;
+    size_t len;
+    size = tmp - (*str);
+    len = strlen(tmp);
+
+    memmove(orig, tmp, len);
+    len = strlen(orig) - size;
+    *((*str) + len) = '\0';
+
+    result = strrchr((*str), ' ');
+    if (result) {
+        *result = '\0';
+    }
+
+    return 0;
+}
+
+/**
+ * Determine whether a pattern can be matched without the regex engine
+ *
+ * Patterns free of basic regular expression operators match wherever the text
+ * occurs in the hostname, so strstr() gives the same answer as regexec().
+ *
+ * @param pattern regular expression
+ * @return 1=literal, 0=regular expression
+ */
+static int pattern_is_literal(const char *pattern) {
+    return strpbrk(pattern, ".[]*^$\\") == NULL;
+}
+
+/**
+ * Parse and validate the host_group configuration file
+ *
+ * FORMAT:
+ *     # Comment
+ *     HOST_PATTERN = COMMON_HOME
+ *     HOST_PATTERN=COMMON_HOME  # Inline comment
+ *
+ * @param b builder receiving the rules
+ * @param filename path to host_group configuration
+ */
+static void compile_host_group(struct SnapshotBuilder *b, const char *filename) {
+    FILE *fp;
+    char *recptr;
+    char rec[PATH_MAX];
+
+    fp = fopen(filename, "r");
+    if (!fp) {
+        return;
+    }
+
+    for (size_t i = 0; fgets(rec, PATH_MAX - 1, fp) != NULL; i++) {
+        size_t alloc;
+        regex_t compiled;
+        char **data;
+        char *comment;
+        struct SnapshotRule *rule;
+
+        recptr = rec;
+
+        // Ignore empty lines
+        if (strlen(recptr) == 0 || *recptr == '\n') {
+            continue;
+        }
+
+        // Ignore comments and inline comments
+        if (*recptr == '#') {
+            continue;
+        } else if ((comment = strstr(recptr, "#")) != NULL) {
+            comment--;
+            for (; comment != NULL && isblank(*comment) && comment > recptr; comment--) {
+                *comment = '\0';
+            }
+        }
+
+        // Report and skip invalid records
+        if (strchr(recptr, '=') == NULL) {
+            fprintf(stderr, "%s:%zu:syntax error, missing '=' operator\n", filename, i);
+            continue;
+        }
+
+        data = split(recptr, "=", &alloc);
+        if (data == NULL) {
+            continue;
+        }
+
+        // Strip blank characters from data
+        for (size_t item = 0; alloc > 1 && item < alloc - 1; item++) {
+            strip(&data[item]);
+        }
+
+        // Validate regex pattern
+        if (regcomp(&compiled, data[0], 0) != 0) {
+            fprintf(stderr, "%s:%zu:unable to compile regex pattern '%s'\n", filename, i, data[0]);
+            free_array((void **) data, alloc);
+            continue;
+        }
+        regfree(&compiled);
+
+        b->rules = builder_grow(b->rules, &b->rules_alloc, b->rules_count, sizeof(*b->rules));
+        rule = &b->rules[b->rules_count++];
+        memset(rule, 0, sizeof(*rule));
+        rule->pattern = builder_string(b, data[0]);
+        rule->home = builder_string(b, data[1]);
+        rule->lineno = i;
+        rule->kind = pattern_is_literal(data[0]) ? SNAPSHOT_MATCH_LITERAL : SNAPSHOT_MATCH_REGEX;
+
+        free_array((void **)data, alloc);
+    }
+    fclose(fp);
+}
+
+/**
+ * Parse and validate the transfer configuration file
+ *
+ * FORMAT:
+ *     TYPE WHERE
+ *
+ * TYPE:
+ *     L = SYMBOLIC LINK
+ *     H = HARD LINK
+ *     T = TRANSFER (file, directory, etc)
+ *     T! = REQUIRED TRANSFER (never deferred past the login deadline)
+ *     X = EXCLUDE (pattern pruned from T copies, see copy_set_exclude())
+ *
+ * @param b builder receiving the records
+ * @param filename path to transfer configuration
+ */
+static void compile_transfer(struct SnapshotBuilder *b, const char *filename) {
+    FILE *fp;
+    char rec[PATH_MAX];
+    size_t lineno;
+
+    memset(rec, '\0', PATH_MAX);
+
+    fp = fopen(filename, "r");
+    if (fp == NULL) {
+        // doesn't exist or isn't readable. non-fatal.
+        return;
+    }
+
+    lineno = 0;
+    while (fgets(rec, PATH_MAX - 1, fp) != NULL) {
+        char *recptr;
+        char *field_type;
+        char *field_where;
+        char flags;
+        struct SnapshotTransfer *record;
+
+        lineno++;
+
+        // Set pointer to string
+        recptr = rec;
+
+        // Set pointer to TYPE field (beginning of string)
+        field_type = recptr;
+
+        // Ignore empty lines
+        if (strlen(recptr) == 0 || *recptr == '\n') {
+            continue;
+        }
+
+        // Ignore: comments and inline comments
+        char *comment;
+        if (*recptr == '#') {
+            continue;
+        } else if ((comment = strstr(recptr, "#")) != NULL) {
+            comment--;
+            for (; comment != NULL && isblank(*comment) && comment > recptr; comment--) {
+                *comment = '\0';
+            }
+        }
+
+        // Ignore: bad lines without enough information
+        if (strlen(rec) < 3) {
+            fprintf(stderr, "%s:%zu: Invalid format: %s\n", filename, lineno, rec);
+            continue;
+        }
+
+        // Ignore: unknown types
+        if (strchr("LHTX", *field_type) == NULL) {
+            fprintf(stderr, "%s:%zu: Invalid type: '%c'\n", filename, lineno, *field_type);
+            continue;
+        }
+
+        // T! marks a transfer the login cannot do without (see home_set_deadline())
+        flags = 0;
+        field_where = &rec[2];
+        if (field_type[1] == '!') {
+            if (*field_type != 'T' || strlen(rec) < 4) {
+                fprintf(stderr, "%s:%zu: Invalid format: %s\n", filename, lineno, rec);
+                continue;
+            }
+            flags |= SNAPSHOT_TRANSFER_REQUIRED;
+            field_where = &rec[3];
+        }
+
+        // A leading '/' anchors an exclude pattern at the home directory
+        if (*field_where == '/' && *field_type != 'X') {
+            fprintf(stderr, "%s:%zu: Removing leading '/' from: %s\n", filename, lineno, field_where);
+            memmove(field_where, field_where + 1, strlen(field_where) + 1);
+        }
+
+        if (field_where[strlen(field_where) - 1] == '\n') {
+            field_where[strlen(field_where) - 1] = '\0';
+        }
+
+        b->transfers = builder_grow(b->transfers, &b->transfers_alloc, b->transfers_count, sizeof(*b->transfers));
+        record = &b->transfers[b->transfers_count++];
+        memset(record, 0, sizeof(*record));
+        record->type = *field_type;
+        record->flags = flags;
+        record->where = builder_string(b, field_where);
+        record->lineno = lineno;
+    }
+    fclose(fp);
+}
+
+/**
+ * Describe a configuration file for snapshot validation
+ * @param filename path to file
+ * @param source output
+ */
+void snapshot_source(const char *filename, struct SnapshotSource *source) {
+    struct stat st;
+
+    memset(source, 0, sizeof(*source));
+    if (stat(filename, &st) < 0) {
+        source->size = -1;
+        return;
+    }
+    source->size = st.st_size;
+    source->ino = st.st_ino;
+    source->mtime_sec = st.st_mtim.tv_sec;
+    source->mtime_nsec = st.st_mtim.tv_nsec;
+}
+
+/**
+ * Point the snapshot's accessors into its data block
+ *
+ * Every string offset must fall inside the string table, and the table must end
+ * with a NUL, so snapshot_string() never reads past the data block.
+ *
+ * @return 0=success, -1=data block is not a valid snapshot
+ */
+static int snapshot_index(struct Snapshot *snap) {
+    struct SnapshotHeader *header;
+    size_t expected;
+
+    if (snap->size < sizeof(*header)) {
+        return -1;
+    }
+    header = snap->data;
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0
+            || header->version != SNAPSHOT_VERSION) {
+        return -1;
+    }
+
+    expected = sizeof(*header)
+            + header->rule_count * sizeof(struct SnapshotRule)
+            + header->transfer_count * sizeof(struct SnapshotTransfer)
+            + header->strings_size;
+    if (expected != snap->size) {
+        return -1;
+    }
+
+    snap->header = header;
+    snap->rules = (struct SnapshotRule *) (header + 1);
+    snap->transfers = (struct SnapshotTransfer *) (snap->rules + header->rule_count);
+    snap->strings = (char *) (snap->transfers + header->transfer_count);
+
+    if (header->strings_size && snap->strings[header->strings_size - 1] != '\0') {
+        return -1;
+    }
+    for (size_t i = 0; i < header->rule_count; i++) {
+        if (snap->rules[i].pattern >= header->strings_size || snap->rules[i].home >= header->strings_size) {
+            return -1;
+        }
+    }
+    for (size_t i = 0; i < header->transfer_count; i++) {
+        if (snap->transfers[i].where >= header->strings_size) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Parse the configuration files into a new snapshot
+ * @param snap output
+ * @param host_group path to host_group configuration
+ * @param transfer path to transfer configuration
+ * @return 0=success, -1=error
+ */
+static int snapshot_compile(struct Snapshot *snap, const char *host_group, const char *transfer) {
+    struct SnapshotBuilder b;
+    struct SnapshotHeader header;
+    char *ptr;
+
+    memset(&b, 0, sizeof(b));
+    memset(&header, 0, sizeof(header));
+
+    // Record source metadata first. An edit made while compiling invalidates the result.
+    snapshot_source(host_group, &header.host_group);
+    snapshot_source(transfer, &header.transfer);
+    compile_host_group(&b, host_group);
+    compile_transfer(&b, transfer);
+
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.rule_count = b.rules_count;
+    header.transfer_count = b.transfers_count;
+    header.strings_size = b.strings_size;
+
+    snap->size = sizeof(header)
+            + b.rules_count * sizeof(*b.rules)
+            + b.transfers_count * sizeof(*b.transfers)
+            + b.strings_size;
+    snap->data = malloc(snap->size);
+    if (snap->data == NULL) {
+        perror("snapshot");
+        exit(1);
+    }
+    snap->mapped = 0;
+
+    ptr = snap->data;
+    memcpy(ptr, &header, sizeof(header));
+    ptr += sizeof(header);
+    if (b.rules_count) {
+        memcpy(ptr, b.rules, b.rules_count * sizeof(*b.rules));
+        ptr += b.rules_count * sizeof(*b.rules);
+    }
+    if (b.transfers_count) {
+        memcpy(ptr, b.transfers, b.transfers_count * sizeof(*b.transfers));
+        ptr += b.transfers_count * sizeof(*b.transfers);
+    }
+    if (b.strings_size) {
+        memcpy(ptr, b.strings, b.strings_size);
+    }
+
+    free(b.rules);
+    free(b.transfers);
+    free(b.strings);
+    return snapshot_index(snap);
+}
+
+/**
+ * Write a snapshot to disk atomically
+ * @param snap snapshot
+ * @param filename destination
+ * @return 0=success, -1=error (errno set)
+ */
+static int snapshot_write(struct Snapshot *snap, const char *filename) {
+    char tmp[PATH_MAX];
+    int fd;
+    char *ptr;
+    size_t remain;
+
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", filename);
+    fd = mkstemp(tmp);
+    if (fd < 0) {
+        return -1;
+    }
+
+    ptr = snap->data;
+    remain = snap->size;
+    while (remain > 0) {
+        ssize_t n;
+        n = write(fd, ptr, remain);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            goto snapshot_write_failed;
+        }
+        ptr += n;
+        remain -= n;
+    }
+
+    if (close(fd) < 0) {
+        fd = -1;
+        goto snapshot_write_failed;
+    }
+    if (rename(tmp, filename) < 0) {
+        fd = -1;
+        goto snapshot_write_failed;
+    }
+    return 0;
+
+snapshot_write_failed:
+    {
+        int err = errno;
+        if (fd >= 0) {
+            close(fd);
+        }
+        unlink(tmp);
+        errno = err;
+    }
+    return -1;
+}
+
+/**
+ * Map an existing snapshot file
+ * @param snap output
+ * @param filename path to snapshot
+ * @return 0=success, -1=missing or invalid
+ */
+static int snapshot_map(struct Snapshot *snap, const char *filename) {
+    struct stat st;
+    int fd;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        close(fd);
+        return -1;
+    }
+
+    snap->size = st.st_size;
+    snap->data = mmap(NULL, snap->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (snap->data == MAP_FAILED) {
+        snap->data = NULL;
+        return -1;
+    }
+    snap->mapped = 1;
+
+    if (snapshot_index(snap) < 0) {
+        munmap(snap->data, snap->size);
+        snap->data = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Load the configuration snapshot, rebuilding it when the sources have changed
+ *
+ * Syntax errors are reported only when the snapshot is rebuilt.
+ *
+ * @param snap output (release with snapshot_free())
+ * @param filename path to snapshot
+ * @param host_group path to host_group configuration
+ * @param transfer path to transfer configuration
+ * @return 0=success, -1=error
+ */
+int snapshot_load(struct Snapshot *snap, const char *filename, const char *host_group, const char *transfer) {
+    struct SnapshotSource current;
+
+    memset(snap, 0, sizeof(*snap));
+    if (snapshot_map(snap, filename) == 0) {
+        snapshot_source(host_group, &current);
+        if (memcmp(&current, &snap->header->host_group, sizeof(current)) == 0) {
+            snapshot_source(transfer, &current);
+            if (memcmp(&current, &snap->header->transfer, sizeof(current)) == 0) {
+                goto snapshot_load_ready;
+            }
+        }
+        snapshot_free(snap);
+    }
+
+    if (snapshot_compile(snap, host_group, transfer) < 0) {
+        snapshot_free(snap);
+        return -1;
+    }
+
+    // Not fatal. The compiled snapshot is still usable from memory.
+    if (snapshot_write(snap, filename) < 0) {
+        fprintf(stderr, "Unable to write configuration snapshot: %s: %s\n", filename, strerror(errno));
+    }
+
+snapshot_load_ready:
+    snap->compiled = calloc(snap->header->rule_count + 1, sizeof(*snap->compiled));
+    if (snap->compiled == NULL) {
+        perror("snapshot");
+        exit(1);
+    }
+    return 0;
+}
+
+/**
+ * Release resources held by a snapshot
+ * @param snap snapshot
+ */
+void snapshot_free(struct Snapshot *snap) {
+    if (snap->matcher) {
+        matcher_free(snap->matcher);
+        free(snap->matcher);
+    }
+    if (snap->compiled) {
+        for (size_t i = 0; snap->header && i < snap->header->rule_count; i++) {
+            if (snap->compiled[i]) {
+                regfree(snap->compiled[i]);
+                free(snap->compiled[i]);
+            }
+        }
+        free(snap->compiled);
+    }
+    if (snap->data) {
+        if (snap->mapped) {
+            munmap(snap->data, snap->size);
+        } else {
+            free(snap->data);
+        }
+    }
+    memset(snap, 0, sizeof(*snap));
+}
+
+/**
+ * Return a string stored in the snapshot
+ * @param snap snapshot
+ * @param offset string table offset
+ * @return pointer into the snapshot (do not free())
+ */
+const char *snapshot_string(struct Snapshot *snap, uint32_t offset) {
+    return &snap->strings[offset];
+}
+
+/**
+ * Test a regular expression rule against a hostname
+ *
+ * The expression is compiled on first use.
+ *
+ * @param snap snapshot
+ * @param i rule index
+ * @param hostname short hostname
+ * @return 1=match, 0=no match or invalid expression
+ */
+static int snapshot_match_regex(struct Snapshot *snap, size_t i, const char *hostname) {
+    struct SnapshotRule *rule;
+    const char *pattern;
+    regmatch_t match[100];
+    int num_matches;
+    int status;
+
+    rule = &snap->rules[i];
+    pattern = snapshot_string(snap, rule->pattern);
+
+    if (snap->compiled[i] == NULL) {
+        snap->compiled[i] = malloc(sizeof(regex_t));
+        if (snap->compiled[i] == NULL || regcomp(snap->compiled[i], pattern, 0) != 0) {
+            fprintf(stderr, "%s:%u:unable to compile regex pattern '%s'\n", MULTIHOME_CFG_HOST_GROUP, rule->lineno, pattern);
+            free(snap->compiled[i]);
+            snap->compiled[i] = NULL;
+            return 0;
+        }
+    }
+
+    // Check whether the regex pattern matches
+    num_matches = sizeof(match) / sizeof(regmatch_t);
+    status = regexec(snap->compiled[i], hostname, num_matches, match, REG_EXTENDED);
+    if (status == REG_NOMATCH) {
+        // Ignore unmatched records
+    } else if (status > 0) {
+        // handle fatal error
+        char errbuf[BUFSIZ];
+        regerror(status, snap->compiled[i], errbuf, BUFSIZ);
+        fprintf(stderr, "%s:%u:regex %s\n", MULTIHOME_CFG_HOST_GROUP, rule->lineno, errbuf);
+    } else {
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Compile every host_group rule into one combined matcher
+ *
+ * snapshot_match() uses it from then on. It is built automatically for large rule
+ * sets; callers matching many hostnames may build it up front.
+ *
+ * @param snap snapshot
+ */
+void snapshot_matcher(struct Snapshot *snap) {
+    if (snap->matcher) {
+        return;
+    }
+    snap->matcher = malloc(sizeof(*snap->matcher));
+    if (snap->matcher == NULL) {
+        perror("snapshot");
+        exit(1);
+    }
+    matcher_init(snap->matcher, snap->header->rule_count);
+    for (size_t i = 0; i < snap->header->rule_count; i++) {
+        const char *pattern;
+        char needle[PATH_MAX];
+
+        pattern = snapshot_string(snap, snap->rules[i].pattern);
+        if (snap->rules[i].kind == SNAPSHOT_MATCH_LITERAL) {
+            matcher_add(snap->matcher, i, pattern);
+        } else {
+            matcher_needle(pattern, needle, sizeof(needle));
+            matcher_add(snap->matcher, i, needle);
+        }
+    }
+    matcher_build(snap->matcher);
+}
+
+/**
+ * Find the first host_group rule matching a hostname
+ *
+ * Literal patterns are matched directly. Regular expressions are compiled on first use.
+ * With the combined matcher only rules whose needle occurs in the hostname are tested.
+ *
+ * @param snap snapshot
+ * @param hostname short hostname
+ * @return rule index, or -1 if no rule matches
+ */
+ssize_t snapshot_match(struct Snapshot *snap, const char *hostname) {
+    if (snap->matcher == NULL && snap->header->rule_count >= SNAPSHOT_MATCHER_MIN) {
+        snapshot_matcher(snap);
+    }
+
+    if (snap->matcher) {
+        const uint64_t *candidates = matcher_scan(snap->matcher, hostname);
+        for (size_t w = 0; w < snap->matcher->words; w++) {
+            uint64_t bits = candidates[w];
+            while (bits) {
+                size_t i = w * 64 + __builtin_ctzll(bits);
+                bits &= bits - 1;
+                // A literal candidate occurs in the hostname by construction
+                if (snap->rules[i].kind == SNAPSHOT_MATCH_LITERAL || snapshot_match_regex(snap, i, hostname)) {
+                    return i;
+                }
+            }
+        }
+        return -1;
+    }
+
+    for (size_t i = 0; i < snap->header->rule_count; i++) {
+        struct SnapshotRule *rule;
+
+        rule = &snap->rules[i];
+        if (rule->kind == SNAPSHOT_MATCH_LITERAL) {
+            if (strstr(hostname, snapshot_string(snap, rule->pattern)) != NULL) {
+                return i;
+            }
+            continue;
+        }
+        if (snapshot_match_regex(snap, i, hostname)) {
+            return i;
+        }
+    }
+    return -1;
+}
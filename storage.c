@@ -0,0 +1,167 @@
+#include "multihome.h"
+
+/**
+ * Node-local storage
+ *
+ * ~/.multihome/storage moves the home directories of selected host groups off
+ * NFS onto a disk of the node (/tmp, /scratch, /local, ...). The directory in
+ * home_local remains the durable copy. A local home is seeded from it, or built
+ * from the account skeleton when there is none yet.
+ *
+ * FORMAT:
+ *     # Comment
+ *     HOME_PATTERN = DIRECTORY
+ *     HOME_PATTERN=DIRECTORY  # Inline comment
+ *
+ * HOME_PATTERN is a regular expression matched, like a host_group pattern,
+ * against the name of the home directory: the host group a host_group rule
+ * mapped the host to, otherwise the hostname. The first matching line wins. The
+ * home then lives in DIRECTORY/USER/NAME.
+ *
+ * EXAMPLE:
+ *     gpu = /scratch
+ *     login[0-9]* = /tmp
+ */
+
+/**
+ * Trim blank characters from both ends of a string
+ * @param str string (modified)
+ * @return str
+ */
+static char *storage_trim(char *str) {
+    char *end;
+
+    while (isblank((unsigned char) *str)) {
+        str++;
+    }
+    end = str + strlen(str);
+    while (end > str && isspace((unsigned char) end[-1])) {
+        *--end = '\0';
+    }
+    return str;
+}
+
+/**
+ * Parse the storage configuration
+ *
+ * Invalid lines are reported and skipped. A missing file yields no rules.
+ *
+ * @param storage output (release with storage_free())
+ * @param filename path to storage configuration
+ * @return 0=success, -1=read error (errno set)
+ */
+int storage_load(struct Storage *storage, const char *filename) {
+    char rec[PATH_MAX];
+    FILE *fp;
+
+    memset(storage, 0, sizeof(*storage));
+    fp = fopen(filename, "r");
+    if (fp == NULL) {
+        return errno == ENOENT ? 0 : -1;
+    }
+
+    for (size_t i = 1; fgets(rec, sizeof(rec), fp) != NULL; i++) {
+        struct StorageRule *rule;
+        char *pattern;
+        char *root;
+        char *sep;
+
+        rec[strcspn(rec, "#\n")] = '\0';
+        pattern = storage_trim(rec);
+        if (*pattern == '\0') {
+            continue;
+        }
+
+        sep = strchr(pattern, '=');
+        if (sep == NULL) {
+            fprintf(stderr, "%s:%zu:syntax error, missing '=' operator\n", filename, i);
+            continue;
+        }
+        *sep = '\0';
+        pattern = storage_trim(pattern);
+        root = storage_trim(sep + 1);
+        if (*root != '/') {
+            fprintf(stderr, "%s:%zu:storage directory must be an absolute path '%s'\n", filename, i, root);
+            continue;
+        }
+
+        if (storage->count == storage->alloc) {
+            struct StorageRule *tmp;
+            size_t alloc = storage->alloc ? storage->alloc * 2 : 8;
+            tmp = realloc(storage->rules, alloc * sizeof(*tmp));
+            if (tmp == NULL) {
+                perror("storage");
+                exit(1);
+            }
+            storage->rules = tmp;
+            storage->alloc = alloc;
+        }
+        rule = &storage->rules[storage->count];
+        if (regcomp(&rule->compiled, pattern, 0) != 0) {
+            fprintf(stderr, "%s:%zu:unable to compile regex pattern '%s'\n", filename, i, pattern);
+            continue;
+        }
+        rule->root = strdup(root);
+        if (rule->root == NULL) {
+            perror("storage");
+            exit(1);
+        }
+        storage->count++;
+    }
+    fclose(fp);
+    return 0;
+}
+
+/**
+ * Find the node-local storage of a home directory
+ * @param storage rules from storage_load()
+ * @param name name of the home directory (host group or hostname)
+ * @return storage directory, NULL=the home stays in home_local
+ */
+const char *storage_match(struct Storage *storage, const char *name) {
+    for (size_t i = 0; i < storage->count; i++) {
+        if (regexec(&storage->rules[i].compiled, name, 0, NULL, 0) == 0) {
+            return storage->rules[i].root;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Create the calling user's directory in a storage directory
+ *
+ * Storage such as /tmp is shared with every other account, so an existing
+ * directory is only used when it is a real directory owned by the user that
+ * nobody else can write to.
+ *
+ * @param dir DIRECTORY/USER
+ * @return 0=usable, -1=missing storage or unsafe directory (errno set)
+ */
+int storage_prepare(const char *dir) {
+    struct stat st;
+
+    if (mkdir(dir, S_IRWXU) < 0 && errno != EEXIST) {
+        return -1;
+    }
+    if (lstat(dir, &st) < 0) {
+        return -1;
+    }
+    if (!S_ISDIR(st.st_mode) || st.st_uid != geteuid() || (st.st_mode & (S_IWGRP | S_IWOTH))) {
+        errno = EPERM;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Release storage rules
+ * @param storage rules from storage_load()
+ */
+void storage_free(struct Storage *storage) {
+    for (size_t i = 0; i < storage->count; i++) {
+        regfree(&storage->rules[i].compiled);
+        free(storage->rules[i].root);
+    }
+    free(storage->rules);
+    memset(storage, 0, sizeof(*storage));
+}
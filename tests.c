@@ -25,10 +25,14 @@ void test_mkdirs() {
     char *input = "this/is/a/test";
 
     if (access(input, F_OK) == 0) {
-        assert(remove("this/is/a/test") == 0);
-        assert(remove("this/is/a") == 0);
-        assert(remove("this/is") == 0);
-        assert(remove("this") == 0);
+        result = remove("this/is/a/test");
+        assert(result == 0);
+        result = remove("this/is/a");
+        assert(result == 0);
+        result = remove("this/is");
+        assert(result == 0);
+        result = remove("this");
+        assert(result == 0);
     }
 
     result = mkdirs(input);
@@ -38,23 +42,1653 @@ void test_mkdirs() {
 
 void test_shell() {
     puts("shell()");
-    assert(shell((char *[]){"/bin/echo", "testing", NULL}) == 0);
-    assert(shell((char *[]){"/bin/date", NULL}) == 0);
-    assert(shell((char *[]){"/bin/unlikelyToExistAnywhere", NULL}) != 0);
+    int result;
+
+    result = shell((char *[]){"/bin/echo", "testing", NULL});
+    assert(result == 0);
+    result = shell((char *[]){"/bin/date", NULL});
+    assert(result == 0);
+    result = shell((char *[]){"/bin/unlikelyToExistAnywhere", NULL});
+    assert(result != 0);
 }
 
 void test_touch() {
     puts("touch()");
     char *input = "touched_file.txt";
+    int result;
 
     if (access(input, F_OK) == 0) {
         remove(input);
     }
 
-    assert(touch(input) == 0);
+    result = touch(input);
+    assert(result == 0);
     assert(access(input, F_OK) == 0);
 }
 
+void test_copy() {
+    puts("copy()");
+    struct stat st;
+    char target[PATH_MAX];
+    ssize_t len;
+    int result;
+
+    if (access("copy_source", F_OK) == 0) {
+        result = shell((char *[]){"/bin/rm", "-rf", "copy_source", "copy_dest", NULL});
+        assert(result == 0);
+    }
+    result = mkdirs("copy_source/sub");
+    assert(result == 0);
+    result = touch("copy_source/sub/file");
+    assert(result == 0);
+    result = chmod("copy_source/sub/file", 0600);
+    assert(result == 0);
+    result = symlink("sub/file", "copy_source/link");
+    assert(result == 0);
+
+    // Trailing slash copies the contents of the directory
+    result = copy("copy_source/", "copy_dest", COPY_NORMAL);
+    assert(result == 0);
+    assert(stat("copy_dest/sub/file", &st) == 0 && (st.st_mode & 0777) == 0600);
+    len = readlink("copy_dest/link", target, sizeof(target) - 1);
+    assert(len > 0);
+    target[len] = '\0';
+    assert(strcmp(target, "sub/file") == 0);
+
+    // No trailing slash copies the directory itself
+    result = copy("copy_source", "copy_dest", COPY_NORMAL);
+    assert(result == 0);
+    assert(access("copy_dest/copy_source/sub/file", F_OK) == 0);
+
+    // Update mode never replaces a newer destination
+    FILE *fp;
+    fp = fopen("copy_dest/sub/file", "w");
+    fputs("newer", fp);
+    fclose(fp);
+    result = utimensat(AT_FDCWD, "copy_source/sub/file", (struct timespec[]){{0, 0}, {0, 0}}, 0);
+    assert(result == 0);
+    result = copy("copy_source/", "copy_dest", COPY_UPDATE);
+    assert(result == 0);
+    assert(stat("copy_dest/sub/file", &st) == 0 && st.st_size == 5);
+    result = copy("copy_source/", "copy_dest", COPY_NORMAL);
+    assert(result == 0);
+    assert(stat("copy_dest/sub/file", &st) == 0 && st.st_size == 0);
+
+    // Empty paths are errors
+    result = copy("", "copy_dest", COPY_NORMAL);
+    assert(result < 0);
+    result = copy("copy_source/sub/file", "", COPY_NORMAL);
+    assert(result < 0);
+}
+
+void test_copy_readonly() {
+    puts("copy() [read-only directories]");
+    pid_t pid;
+    int status;
+    int result;
+
+    shell((char *[]){"/bin/rm", "-rf", "copy_readonly", NULL});
+    result = mkdir("copy_readonly", 0777);
+    assert(result == 0);
+    result = chmod("copy_readonly", 0777);
+    assert(result == 0);
+
+    // Permissions do not apply to root. Copy as an ordinary user.
+    pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        if (chdir("copy_readonly") < 0 || (geteuid() == 0 && (setgid(65534) < 0 || setuid(65534) < 0))) {
+            _exit(2);
+        }
+        if (shell((char *[]){"/bin/sh", "-c", "mkdir -p src/ro/sub && echo a > src/ro/f && echo b > src/ro/sub/g && chmod 555 src/ro/sub src/ro", NULL}) != 0
+                || copy("src/", "dest", COPY_NORMAL) < 0) {
+            _exit(3);
+        }
+        // Later updates write into the read-only copies
+        if (shell((char *[]){"/bin/sh", "-c", "chmod u+w src/ro && echo changed > src/ro/f && echo c > src/ro/new && chmod 555 src/ro", NULL}) != 0
+                || copy("src/", "dest", COPY_UPDATE) < 0
+                || shell((char *[]){"/bin/grep", "-qx", "changed", "dest/ro/f", NULL}) != 0
+                || access("dest/ro/new", F_OK) < 0) {
+            _exit(4);
+        }
+        _exit(0);
+    }
+    result = waitpid(pid, &status, 0);
+    assert(result == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    shell((char *[]){"/bin/chmod", "-R", "u+w", "copy_readonly", NULL});
+}
+
+void test_copy_parallel() {
+    puts("copy() [parallel]");
+    char path[PATH_MAX];
+    struct stat st;
+    int result;
+
+    if (access("copy_tree", F_OK) == 0) {
+        result = shell((char *[]){"/bin/rm", "-rf", "copy_tree", "copy_tree_dest", NULL});
+        assert(result == 0);
+    }
+    for (int i = 0; i < 16; i++) {
+        sprintf(path, "copy_tree/d%d/e%d", i, i);
+        result = mkdirs(path);
+        assert(result == 0);
+        strcat(path, "/file");
+        result = touch(path);
+        assert(result == 0);
+    }
+    result = chmod("copy_tree/d3", 0700);
+    assert(result == 0);
+
+    result = copy_set_jobs(0);
+    assert(result < 0);
+    result = copy_set_jobs(4);
+    assert(result == 0);
+    result = copy("copy_tree/", "copy_tree_dest", COPY_NORMAL);
+    assert(result == 0);
+    for (int i = 0; i < 16; i++) {
+        sprintf(path, "copy_tree_dest/d%d/e%d/file", i, i);
+        assert(access(path, F_OK) == 0);
+    }
+    assert(stat("copy_tree_dest/d3", &st) == 0 && (st.st_mode & 0777) == 0700);
+    result = copy_set_jobs(COPY_JOBS_DEFAULT);
+    assert(result == 0);
+}
+
+void test_copy_throttle() {
+    puts("copy() [throttled]");
+    struct timespec start;
+    struct timespec end;
+    char path[PATH_MAX];
+    uint64_t value;
+    double elapsed;
+    FILE *fp;
+    int result;
+
+    result = parse_size("512", &value);
+    assert(result == 0 && value == 512);
+    result = parse_size("64k", &value);
+    assert(result == 0 && value == 65536);
+    result = parse_size("1.5M", &value);
+    assert(result == 0 && value == 1572864);
+    result = parse_size("10X", &value);
+    assert(result < 0);
+    result = parse_size("", &value);
+    assert(result < 0);
+    result = parse_size("-1", &value);
+    assert(result < 0);
+
+    memset(path, 'x', sizeof(path));
+    shell((char *[]){"/bin/rm", "-rf", "throttle_src", "throttle_dest", NULL});
+    result = mkdirs("throttle_src");
+    assert(result == 0);
+    fp = fopen("throttle_src/data", "w");
+    assert(fp != NULL);
+    for (int i = 0; i < 3 * 1024; i++) {
+        fwrite(path, 1, 1024, fp);
+    }
+    fclose(fp);
+    for (int i = 0; i < 30; i++) {
+        sprintf(path, "throttle_src/f%d", i);
+        result = touch(path);
+        assert(result == 0);
+    }
+
+    // The buckets start full (one second worth): 3 MiB at 2 MiB/s waits ~0.5s,
+    // and 30 files plus a directory at 20 per second wait ~0.5s
+    copy_set_throttle(2 * 1024 * 1024, 20);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    result = copy("throttle_src/", "throttle_dest", COPY_NORMAL);
+    assert(result == 0);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    copy_set_throttle(0, 0);
+    elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    assert(elapsed >= 0.4);
+    assert(access("throttle_dest/data", F_OK) == 0 && access("throttle_dest/f29", F_OK) == 0);
+
+    // Idle I/O priority is best effort and never fails a copy
+    copy_set_idle(1);
+    result = copy("throttle_src/", "throttle_dest", COPY_UPDATE);
+    assert(result == 0);
+    copy_set_idle(0);
+}
+
+void test_copy_list() {
+    puts("copy_list_apply()");
+    struct CopyList list;
+    struct CopyStats stats;
+    struct Manifest manifest;
+    struct stat st;
+    int result;
+
+    shell((char *[]){"/bin/rm", "-rf", "copy_list_src", "copy_list_a", "copy_list_b", NULL});
+    result = mkdirs("copy_list_src/dir/sub");
+    assert(result == 0);
+    result = touch("copy_list_src/dir/sub/file");
+    assert(result == 0);
+    result = symlink("dir/sub/file", "copy_list_src/link");
+    assert(result == 0);
+    result = chmod("copy_list_src/dir", 0700);
+    assert(result == 0);
+
+    result = copy_list_scan(&list, "copy_list_src/");
+    assert(result == 0);
+    assert(list.count == 5 && list.contents == 1);
+
+    // One listing, many destinations
+    memset(&stats, 0, sizeof(stats));
+    result = copy_list_apply(&list, "copy_list_a", COPY_NORMAL, NULL, &stats);
+    assert(result == 0);
+    result = copy_list_apply(&list, "copy_list_b", COPY_NORMAL, NULL, &stats);
+    assert(result == 0);
+    assert(stats.files == 2 && stats.links == 2);
+    assert(access("copy_list_b/dir/sub/file", F_OK) == 0);
+    assert(lstat("copy_list_a/link", &st) == 0 && S_ISLNK(st.st_mode));
+    assert(stat("copy_list_a/dir", &st) == 0 && (st.st_mode & 0777) == 0700);
+
+    // Unchanged sources are skipped through the manifest
+    manifest_init(&manifest);
+    memset(&stats, 0, sizeof(stats));
+    result = copy_list_apply(&list, "copy_list_a", COPY_UPDATE, &manifest, &stats);
+    assert(result == 0);
+    assert(stats.files == 0 && stats.errors == 0);
+    memset(&stats, 0, sizeof(stats));
+    result = copy_list_apply(&list, "copy_list_a", COPY_UPDATE, &manifest, &stats);
+    assert(result == 0);
+    assert(stats.skipped == 2 && stats.links == 0);
+    manifest_free(&manifest);
+    copy_list_free(&list);
+}
+
+void test_copy_uring() {
+    puts("copy() [uring]");
+    struct CopyList list;
+    struct CopyStats stats;
+    struct stat st_src;
+    struct stat st;
+    char path[PATH_MAX];
+    FILE *fp;
+    int result;
+
+    shell((char *[]){"/bin/rm", "-rf", "copy_uring_src", "copy_uring_dest", "copy_uring_list", NULL});
+    result = mkdirs("copy_uring_src/sub");
+    assert(result == 0);
+    result = touch("copy_uring_src/empty");
+    assert(result == 0);
+    result = symlink("sub/f0", "copy_uring_src/link");
+    assert(result == 0);
+    // Several read/write rounds, and one file past COPY_URING_SMALL (synchronous path)
+    for (int i = 0; i < 8; i++) {
+        sprintf(path, "copy_uring_src/sub/f%d", i);
+        fp = fopen(path, "w");
+        assert(fp != NULL);
+        for (long n = 0; n < (i == 7 ? COPY_URING_SMALL + 1 : i * 30000L); n++) {
+            fputc('a' + (n + i) % 26, fp);
+        }
+        fclose(fp);
+    }
+    result = chmod("copy_uring_src/sub/f1", 0600);
+    assert(result == 0);
+    result = chmod("copy_uring_src/sub/f2", 0777);
+    assert(result == 0);
+
+    result = copy_set_queue_depth(1);
+    assert(result < 0);
+    result = copy_set_queue_depth(8);
+    assert(result == 0);
+    result = copy_set_backend("uring");
+    assert(result == 0);
+    result = copy("copy_uring_src/", "copy_uring_dest", COPY_NORMAL);
+    assert(result == 0);
+    result = shell((char *[]){"/usr/bin/diff", "-r", "copy_uring_src", "copy_uring_dest", NULL});
+    assert(result == 0);
+    for (int i = 0; i < 8; i++) {
+        sprintf(path, "copy_uring_src/sub/f%d", i);
+        result = stat(path, &st_src);
+        assert(result == 0);
+        sprintf(path, "copy_uring_dest/sub/f%d", i);
+        result = stat(path, &st);
+        assert(result == 0);
+        assert(st.st_mode == st_src.st_mode && st.st_size == st_src.st_size);
+        assert(st.st_mtim.tv_sec == st_src.st_mtim.tv_sec && st.st_mtim.tv_nsec == st_src.st_mtim.tv_nsec);
+    }
+    assert(lstat("copy_uring_dest/link", &st) == 0 && S_ISLNK(st.st_mode));
+
+    // Changed files replace their destination, unchanged ones are left alone
+    fp = fopen("copy_uring_src/sub/f3", "w");
+    assert(fp != NULL);
+    fputs("changed", fp);
+    fclose(fp);
+    result = stat("copy_uring_dest/sub/f4", &st_src);
+    assert(result == 0);
+    result = copy("copy_uring_src/", "copy_uring_dest", COPY_NORMAL);
+    assert(result == 0);
+    assert(stat("copy_uring_dest/sub/f3", &st) == 0 && st.st_size == 7);
+    assert(stat("copy_uring_dest/sub/f4", &st) == 0 && st.st_ino == st_src.st_ino);
+
+    // A directory in the way of a file is an error
+    result = unlink("copy_uring_dest/empty");
+    assert(result == 0);
+    result = mkdir("copy_uring_dest/empty", 0755);
+    assert(result == 0);
+    result = copy("copy_uring_src/", "copy_uring_dest", COPY_NORMAL);
+    assert(result < 0);
+
+    // Listings batch their small files as well
+    result = copy_list_scan(&list, "copy_uring_src/");
+    assert(result == 0);
+    memset(&stats, 0, sizeof(stats));
+    result = copy_list_apply(&list, "copy_uring_list", COPY_NORMAL, NULL, &stats);
+    assert(result == 0);
+    assert(stats.files == 9 && stats.links == 1 && stats.errors == 0);
+    result = shell((char *[]){"/usr/bin/diff", "-r", "copy_uring_src", "copy_uring_list", NULL});
+    assert(result == 0);
+    copy_list_free(&list);
+
+    result = copy_set_backend("native");
+    assert(result == 0);
+    result = copy_set_queue_depth(COPY_QUEUE_DEPTH_DEFAULT);
+    assert(result == 0);
+}
+
+void test_copy_clone() {
+    puts("copy() [clone]");
+    struct CopyStats stats;
+    struct stat st_src;
+    struct stat st;
+    char dest[PATH_MAX];
+    uint64_t cloned;
+    FILE *fp;
+    int result;
+
+    shell((char *[]){"/bin/rm", "-rf", "copy_clone_src", "copy_clone_dest", NULL});
+    result = mkdirs("copy_clone_src");
+    assert(result == 0);
+    fp = fopen("copy_clone_src/data", "w");
+    assert(fp != NULL);
+    for (long n = 0; n < 100000; n++) {
+        fputc('a' + n % 26, fp);
+    }
+    fclose(fp);
+
+    // Same filesystem: cloned where reflinks are supported, copied otherwise (EOPNOTSUPP)
+    memset(&stats, 0, sizeof(stats));
+    copy_stats_track(&stats);
+    result = copy("copy_clone_src/", "copy_clone_dest", COPY_NORMAL);
+    copy_stats_track(NULL);
+    assert(result == 0);
+    assert(stats.files == 1 && stats.cloned <= 1 && stats.errors == 0);
+    result = shell((char *[]){"/usr/bin/diff", "-r", "copy_clone_src", "copy_clone_dest", NULL});
+    assert(result == 0);
+
+    // The probed support of the pair is reused, and so is the fallback
+    fp = fopen("copy_clone_src/data", "a");
+    assert(fp != NULL);
+    fputs("changed", fp);
+    fclose(fp);
+    cloned = stats.cloned;
+    memset(&stats, 0, sizeof(stats));
+    copy_stats_track(&stats);
+    result = copy("copy_clone_src/", "copy_clone_dest", COPY_NORMAL);
+    copy_stats_track(NULL);
+    assert(result == 0);
+    assert(stats.files == 1 && stats.cloned == cloned && stats.errors == 0);
+    result = shell((char *[]){"/usr/bin/diff", "-r", "copy_clone_src", "copy_clone_dest", NULL});
+    assert(result == 0);
+
+    // Another filesystem: FICLONE fails with EXDEV and the data is copied
+    // (only where /dev/shm is a separate, writable filesystem)
+    result = stat(".", &st_src);
+    assert(result == 0);
+    if (stat("/dev/shm", &st) < 0 || st.st_dev == st_src.st_dev || access("/dev/shm", W_OK) < 0) {
+        return;
+    }
+    sprintf(dest, "/dev/shm/multihome_clone_%d", (int) getpid());
+    shell((char *[]){"/bin/rm", "-rf", dest, NULL});
+    memset(&stats, 0, sizeof(stats));
+    copy_stats_track(&stats);
+    result = copy("copy_clone_src/", dest, COPY_NORMAL);
+    copy_stats_track(NULL);
+    assert(result == 0);
+    assert(stats.files == 1 && stats.cloned == 0 && stats.errors == 0);
+    result = shell((char *[]){"/usr/bin/diff", "-r", "copy_clone_src", dest, NULL});
+    shell((char *[]){"/bin/rm", "-rf", dest, NULL});
+    assert(result == 0);
+}
+
+void test_manifest() {
+    puts("manifest_load()");
+    struct Manifest manifest;
+    struct stat st;
+    struct stat st_changed;
+    uint64_t hash;
+    size_t count;
+    size_t loaded;
+    char **stale;
+    FILE *fp;
+    int result;
+
+    memset(&st, 0, sizeof(st));
+    st.st_mode = S_IFREG | 0644;
+    st.st_size = 3;
+    st.st_mtim.tv_sec = 1000;
+    st.st_mtim.tv_nsec = 5;
+    st.st_ino = 7;
+    manifest_init(&manifest);
+    manifest_update(&manifest, "home/a", &st, 42);
+    manifest_update(&manifest, "home/dir/b", &st, 0);
+    manifest_update(&manifest, "home/dir/c", &st, 0);
+    manifest_update(&manifest, "home/gone", &st, 0);
+    unlink("manifest_test");
+    result = manifest_save(&manifest, "manifest_test");
+    assert(result == 0);
+    manifest_free(&manifest);
+
+    // Round trip
+    loaded = manifest_load(&manifest, "manifest_test");
+    assert(loaded == 4);
+    result = manifest_match(&manifest, "home/a", &st, &hash);
+    assert(result == 1 && hash == 42);
+
+    // Any metadata change is a miss, the recorded hash is still reported
+    st_changed = st;
+    st_changed.st_mtim.tv_nsec++;
+    result = manifest_match(&manifest, "home/dir/b", &st_changed, &hash);
+    assert(result == 0 && hash == 0);
+    st_changed = st;
+    st_changed.st_ino++;
+    result = manifest_match(&manifest, "home/a", &st_changed, &hash);
+    assert(result == 0 && hash == 42);
+    result = manifest_match(&manifest, "home/unknown", &st, &hash);
+    assert(result == 0 && hash == 0);
+
+    // Records below a skipped directory are kept, the rest are stale
+    manifest_keep(&manifest, "home/dir");
+    stale = manifest_stale(&manifest, &count);
+    assert(count == 1 && strcmp(stale[0], "home/gone") == 0);
+    free_array((void **) stale, count);
+    result = manifest_save(&manifest, "manifest_test");
+    assert(result == 0);
+    manifest_free(&manifest);
+    loaded = manifest_load(&manifest, "manifest_test");
+    assert(loaded == 3);
+    result = manifest_match(&manifest, "home/gone", &st, NULL);
+    assert(result == 0);
+    result = manifest_match(&manifest, "home/dir/c", &st, NULL);
+    assert(result == 1);
+    manifest_free(&manifest);
+
+    // A damaged manifest loads empty
+    fp = fopen("manifest_test", "r+b");
+    assert(fp != NULL);
+    fputs("garbage", fp);
+    fclose(fp);
+    loaded = manifest_load(&manifest, "manifest_test");
+    assert(loaded == 0);
+    manifest_free(&manifest);
+    loaded = manifest_load(&manifest, "manifest_test_missing");
+    assert(loaded == 0);
+    manifest_free(&manifest);
+}
+
+void test_manifest_rebase() {
+    puts("manifest_rebase()");
+    struct Manifest manifest;
+    struct stat st;
+    int result;
+
+    memset(&st, 0, sizeof(st));
+    st.st_mode = S_IFREG | 0644;
+    st.st_size = 1;
+    manifest_init(&manifest);
+    manifest_update(&manifest, "staging/file", &st, 0);
+    manifest_update(&manifest, "staging2/file", &st, 0);
+
+    // Only records below the staging directory move
+    manifest_rebase(&manifest, "staging", "home");
+    result = manifest_match(&manifest, "home/file", &st, NULL);
+    assert(result == 1);
+    result = manifest_match(&manifest, "staging/file", &st, NULL);
+    assert(result == 0);
+    result = manifest_match(&manifest, "staging2/file", &st, NULL);
+    assert(result == 1);
+    manifest_free(&manifest);
+}
+
+void test_copy_manifest() {
+    puts("copy() [manifest]");
+    struct Manifest manifest;
+    struct CopyStats stats;
+    struct timespec times[2];
+    int result;
+
+    shell((char *[]){"/bin/rm", "-rf", "copy_manifest_src", "copy_manifest_dest", NULL});
+    result = mkdirs("copy_manifest_src/sub");
+    assert(result == 0);
+    result = shell((char *[]){"/bin/sh", "-c", "echo rc > copy_manifest_src/.vimrc && echo f > copy_manifest_src/sub/f", NULL});
+    assert(result == 0);
+
+    manifest_init(&manifest);
+    copy_set_manifest(&manifest, 0, 1);
+    result = copy("copy_manifest_src/", "copy_manifest_dest", COPY_UPDATE);
+    assert(result == 0);
+    memset(&stats, 0, sizeof(stats));
+    copy_stats_track(&stats);
+    result = copy("copy_manifest_src/", "copy_manifest_dest", COPY_UPDATE);
+    copy_stats_track(NULL);
+    assert(result == 0);
+    assert(stats.files == 0 && stats.skipped > 0);
+
+    // Destinations deleted since the last copy are restored despite the manifest hit
+    result = unlink("copy_manifest_dest/.vimrc");
+    assert(result == 0);
+    result = unlink("copy_manifest_dest/sub/f");
+    assert(result == 0);
+    result = copy("copy_manifest_src/", "copy_manifest_dest", COPY_UPDATE);
+    assert(result == 0);
+    assert(access("copy_manifest_dest/.vimrc", F_OK) == 0 && access("copy_manifest_dest/sub/f", F_OK) == 0);
+
+    // --checksum: a touched source whose destination was edited (same size) is copied again
+    copy_set_manifest(&manifest, 1, 0);
+    times[0].tv_sec = times[1].tv_sec = 1000;
+    times[0].tv_nsec = times[1].tv_nsec = 0;
+    result = utimensat(AT_FDCWD, "copy_manifest_src/.vimrc", times, 0);
+    assert(result == 0);
+    result = copy("copy_manifest_src/", "copy_manifest_dest", COPY_NORMAL);
+    assert(result == 0);
+    result = shell((char *[]){"/bin/sh", "-c", "echo RC > copy_manifest_dest/.vimrc", NULL});
+    assert(result == 0);
+    times[0].tv_sec = times[1].tv_sec = 2000;
+    result = utimensat(AT_FDCWD, "copy_manifest_src/.vimrc", times, 0);
+    assert(result == 0);
+    result = copy("copy_manifest_src/", "copy_manifest_dest", COPY_NORMAL);
+    assert(result == 0);
+    result = shell((char *[]){"/bin/grep", "-qx", "rc", "copy_manifest_dest/.vimrc", NULL});
+    assert(result == 0);
+
+    copy_set_manifest(NULL, 0, 0);
+    manifest_free(&manifest);
+}
+
+void test_copy_store() {
+    puts("copy() [store]");
+    struct stat st_src;
+    struct stat st_a;
+    struct stat st_b;
+    int result;
+
+    shell((char *[]){"/bin/rm", "-rf", "store_src", "store_a", "store_b", "store_c", "store_d", "store_objects", NULL});
+    result = mkdirs("store_src");
+    assert(result == 0);
+    result = shell((char *[]){"/bin/sh", "-c", "echo same > store_src/file", NULL});
+    assert(result == 0);
+
+    result = copy_set_store("store_objects");
+    assert(result == 0);
+    result = copy("store_src/", "store_a", COPY_NORMAL);
+    assert(result == 0);
+    result = copy("store_src/", "store_b", COPY_NORMAL);
+    assert(result == 0);
+    assert(stat("store_a/file", &st_a) == 0 && stat("store_b/file", &st_b) == 0);
+    assert(st_a.st_ino == st_b.st_ino && st_a.st_nlink == 3);
+    assert(stat("store_src/file", &st_src) == 0 && st_a.st_mode == st_src.st_mode);
+    result = shell((char *[]){"/bin/sh", "-c", "test -f store_objects/*/*" COPY_STORE_RECORD, NULL});
+    assert(result == 0);
+
+    // Changed content gets a new object, the old links are left alone
+    result = shell((char *[]){"/bin/sh", "-c", "echo different > store_src/file", NULL});
+    assert(result == 0);
+    result = copy("store_src/", "store_a", COPY_UPDATE);
+    assert(result == 0);
+    assert(stat("store_a/file", &st_a) == 0 && stat("store_b/file", &st_b) == 0);
+    assert(st_a.st_ino != st_b.st_ino && st_a.st_size != st_b.st_size);
+
+    // An object edited in place through one home is replaced, not linked again
+    result = shell((char *[]){"/bin/sh", "-c", "echo SAME > store_b/file", NULL});
+    assert(result == 0);
+    result = shell((char *[]){"/bin/sh", "-c", "echo same > store_src/file", NULL});
+    assert(result == 0);
+    result = copy("store_src/", "store_c", COPY_NORMAL);
+    assert(result == 0);
+    assert(stat("store_c/file", &st_a) == 0 && stat("store_b/file", &st_b) == 0);
+    assert(st_a.st_ino != st_b.st_ino && (st_a.st_mode & S_IWUSR));
+    result = shell((char *[]){"/bin/grep", "-qx", "same", "store_c/file", NULL});
+    assert(result == 0);
+
+    // The home that edited a shared file keeps its edit in a private copy
+    result = copy("store_src/", "store_d", COPY_NORMAL);
+    assert(result == 0);
+    result = shell((char *[]){"/bin/sh", "-c", "echo edit > store_d/file", NULL});
+    assert(result == 0);
+    result = copy("store_src/", "store_d", COPY_UPDATE);
+    assert(result == 0);
+    assert(stat("store_d/file", &st_a) == 0 && st_a.st_nlink == 1 && (st_a.st_mode & S_IWUSR));
+    result = shell((char *[]){"/bin/grep", "-qx", "edit", "store_d/file", NULL});
+    assert(result == 0);
+    result = copy_set_store(NULL);
+    assert(result == 0);
+}
+
+void test_snapshot() {
+    puts("snapshot_load()");
+    struct Snapshot snap;
+    FILE *fp;
+    uint32_t offset;
+    ssize_t match;
+    size_t count;
+    int result;
+
+    unlink("snapshot_test");
+    fp = fopen("snapshot_test_host_group", "w");
+    fprintf(fp, "# comment\n");
+    fprintf(fp, "missing operator\n");
+    fprintf(fp, "special[12] = special_boxes  # inline\n");
+    fprintf(fp, "example = example\n");
+    fclose(fp);
+    fp = fopen("snapshot_test_transfer", "w");
+    fprintf(fp, "L .ssh\n");
+    fprintf(fp, "T /special_dotfiles/\n");
+    fprintf(fp, "X /.cache/\n");
+    fprintf(fp, "T! .gnupg/\n");
+    fprintf(fp, "L! invalid\n");
+    fprintf(fp, "Z invalid\n");
+    fclose(fp);
+
+    // Compiled from source
+    result = snapshot_load(&snap, "snapshot_test", "snapshot_test_host_group", "snapshot_test_transfer");
+    assert(result == 0);
+    assert(snap.mapped == 0);
+    assert(snap.header->rule_count == 2);
+    assert(snap.rules[0].kind == SNAPSHOT_MATCH_REGEX && snap.rules[1].kind == SNAPSHOT_MATCH_LITERAL);
+    match = snapshot_match(&snap, "special2");
+    assert(match == 0);
+    match = snapshot_match(&snap, "example1");
+    assert(match == 1);
+    match = snapshot_match(&snap, "other");
+    assert(match < 0);
+    assert(strcmp(snapshot_string(&snap, snap.rules[0].home), "special_boxes") == 0);
+    assert(snap.header->transfer_count == 4);
+    assert(snap.transfers[1].type == 'T' && snap.transfers[1].flags == 0);
+    assert(strcmp(snapshot_string(&snap, snap.transfers[1].where), "special_dotfiles/") == 0);
+    assert(snap.transfers[2].type == 'X');
+    assert(strcmp(snapshot_string(&snap, snap.transfers[2].where), "/.cache/") == 0);
+    assert(snap.transfers[3].type == 'T' && snap.transfers[3].flags == SNAPSHOT_TRANSFER_REQUIRED);
+    assert(strcmp(snapshot_string(&snap, snap.transfers[3].where), ".gnupg/") == 0);
+    snapshot_free(&snap);
+
+    // Reused from disk
+    result = snapshot_load(&snap, "snapshot_test", "snapshot_test_host_group", "snapshot_test_transfer");
+    assert(result == 0);
+    assert(snap.mapped == 1);
+    match = snapshot_match(&snap, "special1");
+    assert(match == 0);
+    snapshot_free(&snap);
+
+    // Rebuilt after the source changes
+    fp = fopen("snapshot_test_host_group", "a");
+    fprintf(fp, "^other = other\n");
+    fclose(fp);
+    result = snapshot_load(&snap, "snapshot_test", "snapshot_test_host_group", "snapshot_test_transfer");
+    assert(result == 0);
+    assert(snap.mapped == 0);
+    assert(snap.header->rule_count == 3);
+    snapshot_free(&snap);
+
+    // Rebuilt when a string offset points outside the string table
+    offset = UINT32_MAX;
+    fp = fopen("snapshot_test", "r+");
+    assert(fp != NULL);
+    result = fseek(fp, sizeof(struct SnapshotHeader) + offsetof(struct SnapshotRule, home), SEEK_SET);
+    assert(result == 0);
+    count = fwrite(&offset, sizeof(offset), 1, fp);
+    assert(count == 1);
+    fclose(fp);
+    result = snapshot_load(&snap, "snapshot_test", "snapshot_test_host_group", "snapshot_test_transfer");
+    assert(result == 0);
+    assert(snap.mapped == 0);
+    assert(strcmp(snapshot_string(&snap, snap.rules[0].home), "special_boxes") == 0);
+    snapshot_free(&snap);
+
+    // Rebuilt when the string table is not NUL terminated
+    fp = fopen("snapshot_test", "r+");
+    assert(fp != NULL);
+    result = fseek(fp, -1, SEEK_END);
+    assert(result == 0);
+    result = fputc('x', fp);
+    assert(result == 'x');
+    fclose(fp);
+    result = snapshot_load(&snap, "snapshot_test", "snapshot_test_host_group", "snapshot_test_transfer");
+    assert(result == 0);
+    assert(snap.mapped == 0);
+    snapshot_free(&snap);
+    result = snapshot_load(&snap, "snapshot_test", "snapshot_test_host_group", "snapshot_test_transfer");
+    assert(result == 0);
+    assert(snap.mapped == 1);
+    snapshot_free(&snap);
+}
+
+void test_snapshot_matcher() {
+    puts("snapshot_match() [combined]");
+    struct Snapshot snap;
+    char needle[PATH_MAX];
+    ssize_t match;
+    int result;
+    const char *patterns[] = {
+        "gpu", "login[0-9]", "c[0-9]*n", "^node00", "rack\\(1\\|2\\)", "a*bcd",
+        "x\\.y", "dev", "test\\{2\\}", "[[:digit:]]$", "node01", "cpu", "ab\\?cpu",
+        "mem.*big", "stor", "\\(ab\\)*io", "batch", "viz", "node0", "n",
+    };
+    const char *hosts[] = {
+        "gpu01", "login3", "c12n4", "node001", "rack2a", "bcd", "x.y", "devtest",
+        "testt", "host9", "node01", "acpu", "memxbig", "storage", "io", "viz1",
+        "node02", "zzz", "", "abcpu",
+    };
+    size_t count = sizeof(patterns) / sizeof(*patterns);
+    FILE *fp;
+
+    matcher_needle("^node[0-9]*-gpu\\.x", needle, sizeof(needle));
+    assert(strcmp(needle, "-gpu.x") == 0);
+    matcher_needle("abc*d", needle, sizeof(needle));
+    assert(strcmp(needle, "ab") == 0);
+    matcher_needle("a\\(bcdef\\)*g", needle, sizeof(needle));
+    assert(strcmp(needle, "a") == 0);
+    matcher_needle("one\\|two", needle, sizeof(needle));
+    assert(strcmp(needle, "") == 0);
+    matcher_needle("gpu\\(a\\|b\\)", needle, sizeof(needle));
+    assert(strcmp(needle, "gpu") == 0);
+    matcher_needle("[[:alpha:]]xy[]a]z", needle, sizeof(needle));
+    assert(strcmp(needle, "xy") == 0);
+
+    unlink("snapshot_matcher_test");
+    fp = fopen("snapshot_matcher_test_host_group", "w");
+    for (size_t i = 0; i < count; i++) {
+        fprintf(fp, "%s = home%zu\n", patterns[i], i);
+    }
+    fclose(fp);
+    result = snapshot_load(&snap, "snapshot_matcher_test", "snapshot_matcher_test_host_group", "snapshot_matcher_test_transfer");
+    assert(result == 0);
+    assert(snap.header->rule_count == count);
+
+    // Same answers as testing each rule in order
+    for (size_t h = 0; h < sizeof(hosts) / sizeof(*hosts); h++) {
+        ssize_t expect = -1;
+        for (size_t i = 0; i < count && expect < 0; i++) {
+            regex_t re;
+            if (snap.rules[i].kind == SNAPSHOT_MATCH_LITERAL) {
+                expect = strstr(hosts[h], patterns[i]) ? (ssize_t) i : -1;
+                continue;
+            }
+            result = regcomp(&re, patterns[i], 0);
+            assert(result == 0);
+            expect = regexec(&re, hosts[h], 0, NULL, REG_EXTENDED) == 0 ? (ssize_t) i : -1;
+            regfree(&re);
+        }
+        match = snapshot_match(&snap, hosts[h]);
+        assert(match == expect);
+    }
+    assert(snap.matcher != NULL);
+    snapshot_free(&snap);
+}
+
+void test_resolve_cache() {
+    puts("resolve_cache_lookup()");
+    char home[PATH_MAX];
+    char result[PATH_MAX];
+    FILE *fp;
+    char *resolved;
+    int status;
+
+    resolved = realpath(".", home);
+    assert(resolved != NULL);
+    strcat(home, "/resolve_home");
+    status = mkdirs("resolve_home/.multihome");
+    assert(status == 0);
+    status = mkdirs("resolve_home/home_local/node");
+    assert(status == 0);
+    status = touch("resolve_home/.multihome/host_group");
+    assert(status == 0);
+    status = touch("resolve_home/home_local/node/" MULTIHOME_MARKER);
+    assert(status == 0);
+    unlink("resolve_home/.multihome/resolve/node");
+
+    status = resolve_cache_lookup(home, "node", result);
+    assert(status < 0);
+    status = resolve_cache_write(home, "node", "resolve_home/home_local/node");
+    assert(status == 0);
+    status = resolve_cache_lookup(home, "node", result);
+    assert(status == 0);
+    assert(strcmp(result, "resolve_home/home_local/node") == 0);
+    status = resolve_cache_lookup("/elsewhere", "node", result);
+    assert(status < 0);
+
+    // Editing host_group invalidates the record
+    fp = fopen("resolve_home/.multihome/host_group", "w");
+    fprintf(fp, "node = group\n");
+    fclose(fp);
+    status = resolve_cache_lookup(home, "node", result);
+    assert(status < 0);
+
+    // So does editing storage
+    status = resolve_cache_write(home, "node", "resolve_home/home_local/node");
+    assert(status == 0);
+    status = resolve_cache_lookup(home, "node", result);
+    assert(status == 0);
+    fp = fopen("resolve_home/.multihome/storage", "w");
+    fprintf(fp, ".* = /tmp\n");
+    fclose(fp);
+    status = resolve_cache_lookup(home, "node", result);
+    assert(status < 0);
+    unlink("resolve_home/.multihome/storage");
+}
+
+void test_render_template() {
+    puts("render_template()");
+    struct ResolveHost hosts[] = {{"a", "/h/a"}, {"b", "/h/b"}};
+    const char *expect = "# " MULTIHOME_MARKER "\ncase a in\n  /h/a;;\ncase b in\n  /h/b;;\nesac 100%\n%q %1\na=/h/a\nb=/h/b\n";
+    char buf[BUFSIZ];
+    size_t count;
+    FILE *fp_input;
+    FILE *fp_output;
+    int result;
+
+    fp_input = tmpfile();
+    fp_output = tmpfile();
+    assert(fp_input != NULL && fp_output != NULL);
+    // Each run of "%@" lines repeats per host, host directives outside a run stay as they are
+    fputs("# %m\n%@case %1 in\n%@  %2;;\nesac 100%%\n%q %1\n%@%1=%2\n", fp_input);
+    rewind(fp_input);
+    result = render_template(fp_input, fp_output, "init.sh", hosts, 2);
+    assert(result == 0);
+    rewind(fp_output);
+    count = fread(buf, 1, sizeof(buf) - 1, fp_output);
+    buf[count] = '\0';
+    assert(strcmp(buf, expect) == 0);
+    fclose(fp_input);
+    fclose(fp_output);
+
+    // No hosts: the table disappears
+    fp_input = tmpfile();
+    fp_output = tmpfile();
+    assert(fp_input != NULL && fp_output != NULL);
+    fputs("start\n%@%1\nend\n", fp_input);
+    rewind(fp_input);
+    result = render_template(fp_input, fp_output, "init.sh", NULL, 0);
+    assert(result == 0);
+    rewind(fp_output);
+    count = fread(buf, 1, sizeof(buf) - 1, fp_output);
+    buf[count] = '\0';
+    assert(strcmp(buf, "start\nend\n") == 0);
+    fclose(fp_input);
+    fclose(fp_output);
+}
+
+void test_watch() {
+    puts("watch_wait()");
+    struct Watch w;
+    struct WatchChange *changes;
+    ssize_t count;
+    int result;
+
+    shell((char *[]){"/bin/rm", "-rf", "watch_src", NULL});
+    result = mkdirs("watch_src/sub");
+    assert(result == 0);
+    result = watch_init(&w);
+    assert(result == 0);
+    result = watch_add(&w, WATCH_KIND_SKEL, "watch_src", NULL, NULL, "watch_dest");
+    assert(result == 0);
+    result = watch_add(&w, WATCH_KIND_TRANSFER, "watch_src", "single", "watch_src/single", "watch_dest/other");
+    assert(result == 0);
+
+    // Repeated events for one file and everything below a new directory collapse
+    result = touch("watch_src/sub/file");
+    assert(result == 0);
+    result = touch("watch_src/sub/file");
+    assert(result == 0);
+    result = mkdirs("watch_src/new/deeper");
+    assert(result == 0);
+    result = touch("watch_src/single");
+    assert(result == 0);
+    count = watch_wait(&w, 50, &changes);
+    assert(count == 4);
+    assert(strcmp(changes[0].source, "watch_src/new") == 0);
+    assert(strcmp(changes[0].dest, "watch_dest/new") == 0);
+    assert(changes[1].exact == 1 && strcmp(changes[1].dest, "watch_dest/other") == 0);
+    assert(changes[2].exact == 0 && strcmp(changes[2].dest, "watch_dest/single") == 0);
+    assert(strcmp(changes[3].dest, "watch_dest/sub/file") == 0);
+    watch_changes_free(changes, count);
+
+    // New directories are followed
+    result = touch("watch_src/new/deeper/file");
+    assert(result == 0);
+    count = watch_wait(&w, 50, &changes);
+    assert(count == 1);
+    assert(strcmp(changes[0].dest, "watch_dest/new/deeper/file") == 0);
+    watch_changes_free(changes, count);
+
+    watch_remove(&w, WATCH_KIND_TRANSFER);
+    assert(w.count > 0);
+    watch_free(&w);
+}
+
+void test_hostlist() {
+    puts("hostlist_add()");
+    struct HostList list;
+    int result;
+    const char *truth[] = {
+        "node008", "node009", "node010", "node020",
+        "r1-g1", "r1-g2", "r2-g1", "r2-g2",
+        "login", "login2.example.com",
+    };
+
+    memset(&list, 0, sizeof(list));
+    result = hostlist_add(&list, "node[008-010,020] r[1-2]-g[1-2],login");
+    assert(result == 0);
+    result = hostlist_add(&list, "login2.example.com");
+    assert(result == 0);
+    assert(list.count == sizeof(truth) / sizeof(*truth));
+    for (size_t i = 0; i < list.count; i++) {
+        assert(strcmp(list.hosts[i], truth[i]) == 0);
+    }
+
+    // Malformed ranges are rejected
+    result = hostlist_add(&list, "node[1-");
+    assert(result < 0);
+    result = hostlist_add(&list, "node[3-1]");
+    assert(result < 0);
+    result = hostlist_add(&list, "node[x]");
+    assert(result < 0);
+    result = hostlist_add(&list, "node[[1]]");
+    assert(result < 0);
+    hostlist_free(&list);
+}
+
+void test_transfer_filter() {
+    puts("user_transfer() [glob, exclude]");
+    struct Multihome mh;
+    char path_old[PATH_MAX];
+    char dest[PATH_MAX];
+    char path[PATH_MAX];
+    char **sources;
+    size_t count;
+    FILE *fp;
+    char *resolved;
+    int result;
+
+    shell((char *[]){"/bin/rm", "-rf", "transfer_test", "transfer_dest", NULL});
+    result = mkdirs("transfer_test/.multihome");
+    assert(result == 0);
+    result = mkdirs("transfer_test/.config/app/Cache");
+    assert(result == 0);
+    result = touch("transfer_test/.config/app/Cache/blob");
+    assert(result == 0);
+    result = touch("transfer_test/.config/app/settings");
+    assert(result == 0);
+    result = mkdirs("transfer_test/.config/browser/profile");
+    assert(result == 0);
+    result = touch("transfer_test/.config/browser/profile/data");
+    assert(result == 0);
+    result = mkdirs("transfer_test/src/__pycache__");
+    assert(result == 0);
+    result = touch("transfer_test/src/__pycache__/main.pyc");
+    assert(result == 0);
+    result = touch("transfer_test/src/main.py");
+    assert(result == 0);
+    result = touch("transfer_test/src/main.o");
+    assert(result == 0);
+    result = touch("transfer_test/notes_a.txt");
+    assert(result == 0);
+    result = touch("transfer_test/notes_b.txt");
+    assert(result == 0);
+    result = touch("transfer_test/other.md");
+    assert(result == 0);
+    fp = fopen("transfer_test/.multihome/transfer", "w");
+    assert(fp != NULL);
+    fprintf(fp, "T .config/\nT notes_*.txt\nT src/\nT missing_*\n");
+    fprintf(fp, "X Cache/\nX .config/browser\nX *.o\nX __pycache__/\n");
+    fclose(fp);
+    result = mkdirs("transfer_dest");
+    assert(result == 0);
+    resolved = realpath("transfer_test", path_old);
+    assert(resolved != NULL);
+    resolved = realpath("transfer_dest", dest);
+    assert(resolved != NULL);
+
+    result = multihome_init(&mh, path_old);
+    assert(result == 0);
+    result = multihome_load(&mh);
+    assert(result == 0);
+
+    // Wildcards expand below the original home, no match is not an error
+    sources = user_transfer_sources(&mh, &mh.snapshot.transfers[1], &count);
+    assert(count == 2 && strstr(sources[0], "/notes_a.txt") != NULL);
+    free_array((void **) sources, 0);
+    sources = user_transfer_sources(&mh, &mh.snapshot.transfers[3], &count);
+    assert(count == 0 && sources[0] == NULL);
+    free_array((void **) sources, 0);
+
+    // Exclusion covers everything below an excluded directory
+    user_transfer_exclude(&mh, 1);
+    snprintf(path, sizeof(path), "%s/.config/app/Cache/blob", path_old);
+    assert(copy_excluded(path, S_IFREG) == 1);
+    snprintf(path, sizeof(path), "%s/.config/app/settings", path_old);
+    assert(copy_excluded(path, S_IFREG) == 0);
+    user_transfer_exclude(&mh, 0);
+    snprintf(path, sizeof(path), "%s/.config/app/Cache/blob", path_old);
+    assert(copy_excluded(path, S_IFREG) == 0);
+
+    user_transfer(&mh, dest, COPY_NORMAL, TRANSFER_ALL);
+    assert(access("transfer_dest/.config/app/settings", F_OK) == 0);
+    assert(access("transfer_dest/.config/app/Cache", F_OK) < 0);
+    assert(access("transfer_dest/.config/browser", F_OK) < 0);
+    assert(access("transfer_dest/notes_a.txt", F_OK) == 0);
+    assert(access("transfer_dest/notes_b.txt", F_OK) == 0);
+    assert(access("transfer_dest/other.md", F_OK) < 0);
+    assert(access("transfer_dest/src/main.py", F_OK) == 0);
+    assert(access("transfer_dest/src/main.o", F_OK) < 0);
+    assert(access("transfer_dest/src/__pycache__", F_OK) < 0);
+    multihome_free(&mh);
+}
+
+void test_plan() {
+    puts("plan_run()");
+    struct Plan plan;
+    struct stat st;
+    char root[PATH_MAX];
+    char home[PATH_MAX];
+    char source[PATH_MAX];
+    char dest[PATH_MAX];
+    struct CopyStats stats;
+    struct CopyStats total;
+    char buf[4096];
+    size_t len;
+    FILE *fp;
+    size_t id;
+    char *resolved;
+    int result;
+
+    shell((char *[]){"/bin/rm", "-rf", "plan_test", NULL});
+    result = mkdirs("plan_test/skel");
+    assert(result == 0);
+    result = mkdirs("plan_test/home");
+    assert(result == 0);
+    result = mkdirs("plan_test/data/sub");
+    assert(result == 0);
+    result = touch("plan_test/skel/.profile");
+    assert(result == 0);
+    result = touch("plan_test/skel/.vimrc");
+    assert(result == 0);
+    result = touch("plan_test/data/sub/file");
+    assert(result == 0);
+    result = touch("plan_test/.vimrc");
+    assert(result == 0);
+    result = mkdirs("plan_test/more/data");
+    assert(result == 0);
+    result = touch("plan_test/more/data/extra");
+    assert(result == 0);
+    resolved = realpath("plan_test", root);
+    assert(resolved != NULL);
+    snprintf(home, sizeof(home), "%s/home", root);
+
+    plan_init(&plan, home);
+    snprintf(source, sizeof(source), "%s/skel/", root);
+    id = plan_add(&plan, '\0', source, home, "skel_system");
+    assert(id == 0);
+    snprintf(source, sizeof(source), "%s/data/", root);
+    snprintf(dest, sizeof(dest), "%s/data", home);
+    id = plan_add(&plan, 'T', source, dest, "data/");
+    assert(id == 1);
+    snprintf(source, sizeof(source), "%s/.vimrc", root);
+    snprintf(dest, sizeof(dest), "%s/.vimrc", home);
+    id = plan_add(&plan, 'L', source, dest, ".vimrc");
+    assert(id == 2);
+    snprintf(source, sizeof(source), "%s/more/data/", root);
+    snprintf(dest, sizeof(dest), "%s/data", home);
+    id = plan_add(&plan, 'T', source, dest, "more/data/");
+    assert(id == 3);
+
+    // Only writers of the same name wait for each other
+    assert(plan.ops[0].deps_count == 0 && plan.ops[1].deps_count == 0);
+    assert(plan.ops[2].deps_count == 1 && plan.ops[2].deps[0] == 0);
+    assert(plan.ops[3].deps_count == 1 && plan.ops[3].deps[0] == 1);
+
+    plan_estimate(&plan);
+    assert(plan.ops[0].files == 2 && plan.ops[1].files == 1 && plan.ops[2].files == 0);
+    fp = tmpfile();
+    assert(fp != NULL);
+    plan_print(&plan, fp);
+    rewind(fp);
+    len = fread(buf, 1, sizeof(buf) - 1, fp);
+    buf[len] = '\0';
+    fclose(fp);
+    assert(strstr(buf, "symlink") != NULL && strstr(buf, "after #1") != NULL && strstr(buf, "4 operations") != NULL);
+
+    // The link replaces the skeleton's file, and is left alone the second time
+    result = plan_run(&plan, COPY_NORMAL);
+    assert(result == 0);
+    assert(lstat("plan_test/home/.vimrc", &st) == 0 && S_ISLNK(st.st_mode));
+    assert(access("plan_test/home/.profile", F_OK) == 0);
+    assert(access("plan_test/home/data/sub/file", F_OK) == 0);
+    assert(access("plan_test/home/data/extra", F_OK) == 0);
+    result = plan_run(&plan, COPY_UPDATE);
+    assert(result == 0);
+    plan_free(&plan);
+
+    // Every populate path links through plan_link(): files are replaced, directories are not
+    result = plan_link('H', "plan_test/.vimrc", "plan_test/home/.profile");
+    assert(result == 0);
+    assert(stat("plan_test/home/.profile", &st) == 0 && st.st_nlink == 2);
+    result = plan_link('H', "plan_test/.vimrc", "plan_test/home/.profile");
+    assert(result == 0);
+    result = plan_link('L', "plan_test/.vimrc", "plan_test/home/data");
+    assert(result < 0 && errno == EEXIST);
+
+    // Each operation counts its own copies, including those of its copy threads
+    memset(&stats, 0, sizeof(stats));
+    copy_stats_track(&stats);
+    result = copy("plan_test/data/", "plan_test/counted", COPY_NORMAL);
+    copy_stats_track(NULL);
+    assert(result == 0);
+    assert(stats.files == 1 && stats.dirs == 2);
+    copy_get_stats(&total);
+    assert(total.files > stats.files);
+}
+
+void test_multihome_login() {
+    puts("multihome_login()");
+    char path_old[PATH_MAX];
+    char path_new[PATH_MAX];
+    char expect[PATH_MAX];
+    char marker[PATH_MAX];
+    char *resolved;
+    int result;
+
+    shell((char *[]){"/bin/rm", "-rf", "login_test", NULL});
+    result = mkdirs("login_test");
+    assert(result == 0);
+    resolved = realpath("login_test", path_old);
+    assert(resolved != NULL);
+
+    // First call initializes the home, the second one is answered from the cache
+    result = multihome_login(path_old, "login_host", 5, path_new);
+    assert(result == 0);
+    snprintf(expect, sizeof(expect), "%s/%s/login_host", path_old, MULTIHOME_ROOT);
+    assert(strcmp(path_new, expect) == 0);
+    snprintf(marker, sizeof(marker), "%s/%s", path_new, MULTIHOME_MARKER);
+    assert(access(marker, F_OK) == 0);
+    memset(path_new, 0, sizeof(path_new));
+    result = resolve_cache_lookup(path_old, "login_host", path_new);
+    assert(result == 0);
+    result = multihome_login(path_old, "login_host", 5, path_new);
+    assert(result == 0);
+    assert(strcmp(path_new, expect) == 0);
+}
+
+void test_login_deadline() {
+    puts("multihome_login() [deadline]");
+    char path_old[PATH_MAX];
+    char path_new[PATH_MAX];
+    char path[PATH_MAX];
+    char buf[1024];
+    int fd;
+    FILE *fp;
+    size_t count;
+    char *resolved;
+    int result;
+
+    shell((char *[]){"/bin/rm", "-rf", "deadline_test", NULL});
+    result = mkdirs("deadline_test/.multihome");
+    assert(result == 0);
+    result = mkdirs("deadline_test/keys");
+    assert(result == 0);
+    result = touch("deadline_test/keys/id");
+    assert(result == 0);
+    result = mkdirs("deadline_test/data");
+    assert(result == 0);
+    memset(buf, 'x', sizeof(buf));
+    fp = fopen("deadline_test/data/blob", "w");
+    assert(fp != NULL);
+    for (int i = 0; i < 3 * 1024; i++) {
+        fwrite(buf, 1, sizeof(buf), fp);
+    }
+    fclose(fp);
+    fp = fopen("deadline_test/.multihome/transfer", "w");
+    assert(fp != NULL);
+    fprintf(fp, "T! keys/\nT data/\n");
+    fclose(fp);
+    resolved = realpath("deadline_test", path_old);
+    assert(resolved != NULL);
+
+    // 3 MiB at 1 MiB/s outlasts a one second deadline, required entries are already there
+    home_set_deadline(1);
+    copy_set_throttle(1024 * 1024, 0);
+    result = multihome_login(path_old, "deadline_host", 5, path_new);
+    assert(result == 0);
+    copy_set_throttle(0, 0);
+    snprintf(path, sizeof(path), "%s/keys/id", path_new);
+    assert(access(path, F_OK) == 0);
+    snprintf(path, sizeof(path), "%s/%s", path_new, MULTIHOME_PENDING);
+    assert(access(path, F_OK) == 0);
+    assert(home_abandoned(path_new) == 0);
+
+    // The worker removes the marker when done
+    for (int i = 0; i < 100 && access(path, F_OK) == 0; i++) {
+        usleep(100000);
+    }
+    assert(access(path, F_OK) < 0);
+    snprintf(path, sizeof(path), "%s/data/blob", path_new);
+    assert(access(path, F_OK) == 0);
+    snprintf(path, sizeof(path), "%s/%s", path_new, MULTIHOME_DEFER_LOG);
+    fp = fopen(path, "r");
+    assert(fp != NULL);
+    count = fread(buf, 1, sizeof(buf) - 1, fp);
+    assert(count > 0);
+    fclose(fp);
+
+    // A marker nobody holds a lock on is resumed by the next login
+    result = touch("deadline_test/data/more");
+    assert(result == 0);
+    snprintf(path, sizeof(path), "%s/%s", path_new, MULTIHOME_PENDING);
+    result = touch(path);
+    assert(result == 0);
+    assert(home_abandoned(path_new) == 1);
+    fd = open(path, O_RDONLY);
+    assert(fd >= 0);
+    result = flock(fd, LOCK_EX);
+    assert(result == 0);
+    assert(home_abandoned(path_new) == 0);
+    close(fd);
+    home_set_deadline(0);
+    result = multihome_login(path_old, "deadline_host", 5, path_new);
+    assert(result == 0);
+    assert(access(path, F_OK) < 0);
+    snprintf(path, sizeof(path), "%s/data/more", path_new);
+    assert(access(path, F_OK) == 0);
+}
+
+void test_storage() {
+    puts("multihome_storage()");
+    struct passwd *pw;
+    char path_old[PATH_MAX];
+    char path_new[PATH_MAX];
+    char root[PATH_MAX];
+    char expect[PATH_MAX];
+    char path[PATH_MAX];
+    FILE *fp;
+    char *resolved;
+    int result;
+
+    shell((char *[]){"/bin/rm", "-rf", "storage_test", "storage_root", NULL});
+    result = mkdirs("storage_test/.multihome");
+    assert(result == 0);
+    result = mkdirs("storage_root");
+    assert(result == 0);
+    resolved = realpath("storage_test", path_old);
+    assert(resolved != NULL);
+    resolved = realpath("storage_root", root);
+    assert(resolved != NULL);
+    pw = getpwuid(geteuid());
+    assert(pw != NULL);
+    snprintf(path, sizeof(path), "%s/.multihome/storage", path_old);
+    fp = fopen(path, "w");
+    assert(fp != NULL);
+    fprintf(fp, "# node-local homes\nnomatch = /nowhere\nlocal_host = %s  # scratch\n", root);
+    fclose(fp);
+
+    // No durable copy yet: built from the skeletons on local storage
+    result = multihome_login(path_old, "local_host", 5, path_new);
+    assert(result == 0);
+    snprintf(expect, sizeof(expect), "%s/%s/local_host", root, pw->pw_name);
+    assert(strcmp(path_new, expect) == 0);
+    snprintf(path, sizeof(path), "%s/%s", path_new, MULTIHOME_MARKER);
+    assert(access(path, F_OK) == 0);
+
+    // Other hosts keep their home in home_local
+    result = multihome_login(path_old, "other_host", 5, path_new);
+    assert(result == 0);
+    snprintf(expect, sizeof(expect), "%s/%s/other_host", path_old, MULTIHOME_ROOT);
+    assert(strcmp(path_new, expect) == 0);
+
+    // A wiped node is seeded from the durable copy
+    snprintf(path, sizeof(path), "%s/%s/local_host", path_old, MULTIHOME_ROOT);
+    result = mkdirs(path);
+    assert(result == 0);
+    strcat(path, "/" MULTIHOME_MARKER);
+    result = touch(path);
+    assert(result == 0);
+    snprintf(path, sizeof(path), "%s/%s/local_host/data", path_old, MULTIHOME_ROOT);
+    result = touch(path);
+    assert(result == 0);
+    snprintf(path, sizeof(path), "%s/%s/local_host/%s", path_old, MULTIHOME_ROOT, MULTIHOME_PENDING);
+    result = touch(path);
+    assert(result == 0);
+    snprintf(path, sizeof(path), "%s/%s", root, pw->pw_name);
+    shell((char *[]){"/bin/rm", "-rf", path, NULL});
+    result = multihome_login(path_old, "local_host", 5, path_new);
+    assert(result == 0);
+    snprintf(path, sizeof(path), "%s/data", path_new);
+    assert(access(path, F_OK) == 0);
+    assert(strncmp(path_new, root, strlen(root)) == 0);
+    // Deferred transfer state stays with the copy it belongs to, no worker resumes it
+    snprintf(path, sizeof(path), "%s/%s", path_new, MULTIHOME_PENDING);
+    assert(access(path, F_OK) < 0);
+    snprintf(path, sizeof(path), "%s/%s", path_new, MULTIHOME_DEFER_LOG);
+    assert(access(path, F_OK) < 0);
+
+    // Someone else's (or a writable) directory on shared storage is never used
+    snprintf(path, sizeof(path), "%s/%s", root, pw->pw_name);
+    shell((char *[]){"/bin/rm", "-rf", path, NULL});
+    result = mkdir(path, 0777);
+    assert(result == 0);
+    result = chmod(path, 0777);
+    assert(result == 0);
+    result = multihome_login(path_old, "local_host", 5, path_new);
+    assert(result == 0);
+    snprintf(expect, sizeof(expect), "%s/%s/local_host", path_old, MULTIHOME_ROOT);
+    assert(strcmp(path_new, expect) == 0);
+    // ... and the fallback is not cached, the next login tries node-local storage again
+    result = resolve_cache_lookup(path_old, "local_host", path);
+    assert(result < 0);
+    snprintf(path, sizeof(path), "%s/%s", root, pw->pw_name);
+    result = chmod(path, 0700);
+    assert(result == 0);
+    result = multihome_login(path_old, "local_host", 5, path_new);
+    assert(result == 0);
+    assert(strncmp(path_new, root, strlen(root)) == 0);
+}
+
+void test_sync_back() {
+    puts("home_sync_back()");
+    struct Multihome mh;
+    struct CopyStats stats;
+    uint64_t removed;
+    char path_old[PATH_MAX];
+    char path_new[PATH_MAX];
+    char root[PATH_MAX];
+    char path[PATH_MAX];
+    FILE *fp;
+    char *resolved;
+    int result;
+
+    shell((char *[]){"/bin/rm", "-rf", "sync_test", "sync_root", NULL});
+    result = mkdirs("sync_test/.multihome");
+    assert(result == 0);
+    result = mkdirs("sync_root");
+    assert(result == 0);
+    resolved = realpath("sync_test", path_old);
+    assert(resolved != NULL);
+    resolved = realpath("sync_root", root);
+    assert(resolved != NULL);
+    snprintf(path, sizeof(path), "%s/.multihome/storage", path_old);
+    fp = fopen(path, "w");
+    assert(fp != NULL);
+    fprintf(fp, "sync_host = %s\n", root);
+    fclose(fp);
+    result = multihome_login(path_old, "sync_host", 5, path_new);
+    assert(result == 0);
+
+    result = multihome_init(&mh, path_old);
+    assert(result == 0);
+    result = multihome_load(&mh);
+    assert(result == 0);
+    multihome_resolve(&mh, "sync_host");
+    result = multihome_storage(&mh);
+    assert(result == 1);
+    assert(strcmp(mh.path_new, path_new) == 0);
+
+    snprintf(path, sizeof(path), "%s/dir", path_new);
+    result = mkdirs(path);
+    assert(result == 0);
+    strcat(path, "/b");
+    result = touch(path);
+    assert(result == 0);
+    snprintf(path, sizeof(path), "%s/a", path_new);
+    result = touch(path);
+    assert(result == 0);
+    snprintf(path, sizeof(path), "%s/%s", path_new, MULTIHOME_PENDING);
+    result = touch(path);
+    assert(result == 0);
+    snprintf(path, sizeof(path), "%s/%s", path_new, MULTIHOME_DEFER_LOG);
+    result = touch(path);
+    assert(result == 0);
+
+    // The first pass creates the durable copy, without the local bookkeeping
+    result = home_sync_back(&mh, 5, 0, &stats, &removed);
+    assert(result == 0);
+    assert(stats.errors == 0 && stats.files >= 2 && removed == 0);
+    snprintf(path, sizeof(path), "%s/dir/b", mh.path_durable);
+    assert(access(path, F_OK) == 0);
+    snprintf(path, sizeof(path), "%s/%s", mh.path_durable, MULTIHOME_MARKER);
+    assert(access(path, F_OK) == 0);
+    snprintf(path, sizeof(path), "%s/%s", mh.path_durable, MULTIHOME_MANIFEST);
+    assert(access(path, F_OK) < 0);
+    snprintf(path, sizeof(path), "%s/%s", mh.path_durable, MULTIHOME_PENDING);
+    assert(access(path, F_OK) < 0);
+    snprintf(path, sizeof(path), "%s/%s", mh.path_durable, MULTIHOME_DEFER_LOG);
+    assert(access(path, F_OK) < 0);
+    snprintf(path, sizeof(path), "%s/%s", path_new, MULTIHOME_PENDING);
+    unlink(path);
+
+    // Unchanged files are not copied again
+    result = home_sync_back(&mh, 5, 0, &stats, &removed);
+    assert(result == 0);
+    assert(stats.files == 0 && stats.skipped > 0);
+
+    // Changed files are, deleted ones are removed, foreign ones are left alone
+    snprintf(path, sizeof(path), "%s/a", path_new);
+    fp = fopen(path, "w");
+    assert(fp != NULL);
+    fputs("changed", fp);
+    fclose(fp);
+    snprintf(path, sizeof(path), "%s/dir/b", path_new);
+    result = unlink(path);
+    assert(result == 0);
+    snprintf(path, sizeof(path), "%s/foreign", mh.path_durable);
+    result = touch(path);
+    assert(result == 0);
+    result = home_sync_back(&mh, 5, 0, &stats, &removed);
+    assert(result == 0);
+    assert(stats.files == 1 && removed == 1);
+    snprintf(path, sizeof(path), "%s/dir/b", mh.path_durable);
+    assert(access(path, F_OK) < 0);
+    snprintf(path, sizeof(path), "%s/foreign", mh.path_durable);
+    assert(access(path, F_OK) == 0);
+    multihome_free(&mh);
+}
+
+void test_usage_scan() {
+    puts("usage_scan()");
+    struct UsageStats stats[2];
+    char *paths[] = {"usage_a", "usage_b"};
+    char *entries[] = {"usage_a", "usage_a/one", "usage_a/one/two", "usage_a/one/two/file", "usage_a/one/empty", "usage_a/link"};
+    char data[10000];
+    uint64_t apparent;
+    struct stat st;
+    FILE *fp;
+    size_t count;
+    int result;
+
+    shell((char *[]){"/bin/rm", "-rf", "usage_a", "usage_b", NULL});
+    result = mkdirs("usage_a/one/two");
+    assert(result == 0);
+    result = mkdirs("usage_b");
+    assert(result == 0);
+    memset(data, 'x', sizeof(data));
+    fp = fopen("usage_a/one/two/file", "w");
+    assert(fp != NULL);
+    count = fwrite(data, 1, sizeof(data), fp);
+    assert(count == sizeof(data));
+    fclose(fp);
+    result = touch("usage_a/one/empty");
+    assert(result == 0);
+    result = symlink("one", "usage_a/link");
+    assert(result == 0);
+
+    // A second link to the same file is not counted twice
+    result = link("usage_a/one/two/file", "usage_a/one/two/again");
+    assert(result == 0);
+
+    apparent = 0;
+    for (size_t i = 0; i < sizeof(entries) / sizeof(*entries); i++) {
+        result = lstat(entries[i], &st);
+        assert(result == 0);
+        apparent += st.st_size;
+    }
+
+    result = usage_scan(paths, 2, stats, 4);
+    assert(result == 0);
+    assert(stats[0].dirs == 3 && stats[0].files == 4);
+    assert(stats[0].apparent == apparent);
+    assert(stats[1].dirs == 1 && stats[1].files == 0);
+    assert(stats[0].errors == 0 && stats[1].errors == 0);
+}
+
+void test_home_retire() {
+    puts("home_retire()");
+    char home[PATH_MAX];
+    char stamp[PATH_MAX];
+    struct timespec times[2];
+    time_t used;
+    char *resolved;
+    int result;
+
+    shell((char *[]){"/bin/rm", "-rf", "retire_test", NULL});
+    result = mkdirs("retire_test/home_local/node");
+    assert(result == 0);
+    resolved = realpath("retire_test/home_local/node", home);
+    assert(resolved != NULL);
+    snprintf(stamp, sizeof(stamp), "%s/%s", home, MULTIHOME_USED);
+
+    // A home in use is kept
+    result = home_mark_used(home);
+    assert(result == 0);
+    used = home_last_used(home);
+    assert(used > 0);
+    result = home_retire(home, used, NULL, 5);
+    assert(result == 1);
+    assert(access(home, F_OK) == 0);
+
+    // Stamps are not rewritten more than once per interval
+    times[0].tv_sec = times[1].tv_sec = used - HOME_USED_INTERVAL / 2;
+    times[0].tv_nsec = times[1].tv_nsec = 0;
+    result = utimensat(AT_FDCWD, stamp, times, 0);
+    assert(result == 0);
+    result = utimensat(AT_FDCWD, home, times, 0);
+    assert(result == 0);
+    result = home_mark_used(home);
+    assert(result == 0);
+    assert(home_last_used(home) == used - HOME_USED_INTERVAL / 2);
+
+    // An idle home is removed
+    result = home_retire(home, used, NULL, 5);
+    assert(result == 0);
+    assert(access(home, F_OK) < 0);
+}
+
+void test_trace() {
+    puts("trace_open()");
+    char path_old[PATH_MAX];
+    char path_new[PATH_MAX];
+    char buf[8192];
+    char *resolved;
+    char *event;
+    size_t len;
+    FILE *fp;
+    int result;
+
+    shell((char *[]){"/bin/rm", "-rf", "trace_test", "trace_test.json", NULL});
+    result = mkdirs("trace_test/.multihome");
+    assert(result == 0);
+    result = mkdirs("trace_test/data");
+    assert(result == 0);
+    result = touch("trace_test/data/file");
+    assert(result == 0);
+    fp = fopen("trace_test/.multihome/transfer", "w");
+    assert(fp != NULL);
+    fputs("T data/\n", fp);
+    fclose(fp);
+    resolved = realpath("trace_test", path_old);
+    assert(resolved != NULL);
+
+    result = trace_open("trace_test.json");
+    assert(result == 0 && trace_enabled());
+    result = multihome_login(path_old, "trace_host", 5, path_new);
+    assert(result == 0);
+    trace_finish();
+    assert(trace_enabled() == 0);
+
+    fp = fopen("trace_test.json", "r");
+    assert(fp != NULL);
+    len = fread(buf, 1, sizeof(buf) - 1, fp);
+    buf[len] = '\0';
+    fclose(fp);
+    assert(strncmp(buf, "{\"version\": ", 12) == 0 && strstr(buf, "\"path\": \"full\"") != NULL);
+    assert(strstr(buf, "{\"name\": \"initialize\"") != NULL);
+    assert(strstr(buf, "{\"name\": \"plan\"") != NULL);
+    assert(strstr(buf, "{\"name\": \"skel_system\"") != NULL);
+    assert(strstr(buf, "{\"name\": \"skel_user\"") != NULL);
+
+    // Each transfer reports its own copies
+    event = strstr(buf, "\"type\": \"T\", \"where\": \"data/\", \"status\": 0");
+    assert(event != NULL);
+    assert(strstr(event, "\"files\": 1,") != NULL);
+}
+
+void test_trace_metrics() {
+    puts("trace_metrics()");
+    char path[PATH_MAX];
+    char expect[PATH_MAX];
+    char buf[8192];
+    size_t event;
+    size_t len;
+    FILE *fp;
+    int result;
+
+    shell((char *[]){"/bin/rm", "-rf", "metrics_test", "metrics_src", "metrics_dest", NULL});
+    result = mkdirs("metrics_test");
+    assert(result == 0);
+    result = mkdirs("metrics_src");
+    assert(result == 0);
+    result = touch("metrics_src/a");
+    assert(result == 0);
+    result = touch("metrics_src/b");
+    assert(result == 0);
+    snprintf(path, sizeof(path), "metrics_test/multihome_%u.prom", (unsigned) geteuid());
+
+    // Counters add up across invocations, gauges hold the last value
+    for (int i = 0; i < 2; i++) {
+        result = trace_metrics("metrics_test");
+        assert(result == 0);
+        trace_note("path", "fast");
+        trace_note("host_group_rules", "7");
+        shell((char *[]){"/bin/rm", "-rf", "metrics_dest", NULL});
+        event = trace_begin("skel_user");
+        trace_end(event, copy("metrics_src/", "metrics_dest", COPY_NORMAL));
+        event = trace_begin_transfer('T', "missing/");
+        trace_end(event, -1);
+        trace_finish();
+        assert(trace_enabled() == 0);
+    }
+
+    fp = fopen(path, "r");
+    assert(fp != NULL);
+    len = fread(buf, 1, sizeof(buf) - 1, fp);
+    buf[len] = '\0';
+    fclose(fp);
+    snprintf(expect, sizeof(expect), "multihome_invocations_total{uid=\"%u\",path=\"fast\"} 2\n", (unsigned) geteuid());
+    assert(strstr(buf, expect) != NULL);
+    snprintf(expect, sizeof(expect), "multihome_resolve_duration_seconds_count{uid=\"%u\",path=\"fast\"} 2\n", (unsigned) geteuid());
+    assert(strstr(buf, expect) != NULL);
+    snprintf(expect, sizeof(expect), "multihome_phase_files_total{uid=\"%u\",phase=\"skel_user\"} 4\n", (unsigned) geteuid());
+    assert(strstr(buf, expect) != NULL);
+    snprintf(expect, sizeof(expect), "multihome_transfer_errors_total{uid=\"%u\"} 2\n", (unsigned) geteuid());
+    assert(strstr(buf, expect) != NULL);
+    snprintf(expect, sizeof(expect), "multihome_host_group_rules{uid=\"%u\"} 7\n", (unsigned) geteuid());
+    assert(strstr(buf, expect) != NULL);
+    assert(strstr(buf, "# TYPE multihome_resolve_duration_seconds histogram\n") != NULL);
+    result = trace_metrics("");
+    assert(result < 0);
+}
+
 void test_strip_domainname() {
     puts("strip_domainname()");
     char *input = strdup("subdomain.domain.tld");
@@ -71,6 +1705,33 @@ void test_main() {
     test_mkdirs();
     test_shell();
     test_touch();
+    test_copy();
+    test_copy_readonly();
+    test_copy_parallel();
+    test_copy_throttle();
+    test_copy_list();
+    test_copy_uring();
+    test_copy_clone();
+    test_manifest();
+    test_manifest_rebase();
+    test_copy_manifest();
+    test_copy_store();
+    test_snapshot();
+    test_snapshot_matcher();
+    test_resolve_cache();
+    test_render_template();
+    test_watch();
+    test_hostlist();
+    test_transfer_filter();
+    test_plan();
+    test_multihome_login();
+    test_login_deadline();
+    test_storage();
+    test_sync_back();
+    test_usage_scan();
+    test_home_retire();
+    test_trace();
+    test_trace_metrics();
     test_strip_domainname();
     exit(0);
 }
@@ -0,0 +1,564 @@
+#include "multihome.h"
+#include <stdarg.h>
+
+/**
+ * Phase timing trace
+ *
+ * When enabled, each phase of an invocation is timed with the monotonic clock and
+ * the copy totals are sampled at its boundaries. The report is written as a single
+ * JSON document when the process exits, and/or folded into the Prometheus metrics
+ * of the account (see trace_metrics()).
+ */
+
+struct TraceEvent {
+    char name[64];
+    char type;                  // transfer type (L, H, T), or '\0' for a phase
+    char *where;
+    uint64_t start;
+    uint64_t end;
+    int status;
+    struct CopyStats before;
+    struct CopyStats after;
+};
+
+struct TraceNote {
+    char key[64];
+    char *value;
+};
+
+struct TraceSample {
+    char *series;               // metric name and labels
+    double value;
+};
+
+struct TraceMetrics {
+    struct TraceSample *samples;
+    size_t count;
+    size_t alloc;
+};
+
+/**
+ * Metric families, in the order they are written
+ */
+static const struct {
+    const char *name;
+    const char *type;
+    const char *help;
+} trace_families[] = {
+    {"multihome_invocations_total", "counter", "Invocations of multihome by resolution path (fast = resolution cache hit)."},
+    {"multihome_resolve_duration_seconds", "histogram", "Time from start to exit of an invocation."},
+    {"multihome_last_resolve_duration_seconds", "gauge", "Duration of the last invocation."},
+    {"multihome_phase_duration_seconds_total", "counter", "Time spent in each phase."},
+    {"multihome_phase_bytes_total", "counter", "Bytes copied in each phase."},
+    {"multihome_phase_files_total", "counter", "Files copied in each phase."},
+    {"multihome_transfer_errors_total", "counter", "Transfer entries that failed."},
+    {"multihome_host_group_rules", "gauge", "Rules in the host_group configuration."},
+    {"multihome_last_run_timestamp_seconds", "gauge", "Time of the last invocation."},
+};
+
+static const double trace_buckets[] = {0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60, 300};
+
+static struct {
+    FILE *fp;
+    char *metrics_dir;
+    int enabled;
+    int registered;
+    uint64_t epoch;
+    struct TraceEvent *events;
+    size_t events_count;
+    size_t events_alloc;
+    struct TraceNote notes[TRACE_NOTES_MAX];
+    size_t notes_count;
+} trace;
+
+/**
+ * Read the monotonic clock
+ * @return nanoseconds
+ */
+static uint64_t trace_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Write a JSON string literal
+ */
+static void trace_json_string(FILE *fp, const char *str) {
+    fputc('"', fp);
+    for (const unsigned char *ch = (const unsigned char *) str; *ch; ch++) {
+        switch (*ch) {
+            case '"':
+                fputs("\\\"", fp);
+                break;
+            case '\\':
+                fputs("\\\\", fp);
+                break;
+            case '\n':
+                fputs("\\n", fp);
+                break;
+            case '\t':
+                fputs("\\t", fp);
+                break;
+            default:
+                if (*ch < 0x20) {
+                    fprintf(fp, "\\u%04x", *ch);
+                } else {
+                    fputc(*ch, fp);
+                }
+                break;
+        }
+    }
+    fputc('"', fp);
+}
+
+/**
+ * Write one event as a JSON object
+ */
+static void trace_json_event(FILE *fp, struct TraceEvent *event) {
+    uint64_t end;
+
+    end = event->end;
+    if (!end) {
+        // Still running (the process is exiting early)
+        end = trace_now();
+        copy_get_stats(&event->after);
+    }
+    fputs("{\"name\": ", fp);
+    trace_json_string(fp, event->name);
+    if (event->type) {
+        fprintf(fp, ", \"type\": \"%c\", \"where\": ", event->type);
+        trace_json_string(fp, event->where ? event->where : "");
+        fprintf(fp, ", \"status\": %d", event->status);
+    }
+    fprintf(fp, ", \"start_ms\": %.3f, \"duration_ms\": %.3f",
+            (event->start - trace.epoch) / 1e6, (end - event->start) / 1e6);
+    fprintf(fp, ", \"files\": %llu, \"dirs\": %llu, \"links\": %llu, \"bytes\": %llu, \"skipped\": %llu, \"errors\": %llu, \"cloned\": %llu}",
+            (unsigned long long) (event->after.files - event->before.files),
+            (unsigned long long) (event->after.dirs - event->before.dirs),
+            (unsigned long long) (event->after.links - event->before.links),
+            (unsigned long long) (event->after.bytes - event->before.bytes),
+            (unsigned long long) (event->after.skipped - event->before.skipped),
+            (unsigned long long) (event->after.errors - event->before.errors),
+            (unsigned long long) (event->after.cloned - event->before.cloned));
+}
+
+/**
+ * Emit the JSON report
+ */
+static void trace_write_json() {
+    FILE *fp;
+    int first;
+
+    fp = trace.fp;
+
+    fprintf(fp, "{\"version\": \"%s\", \"total_ms\": %.3f", VERSION, (trace_now() - trace.epoch) / 1e6);
+    for (size_t i = 0; i < trace.notes_count; i++) {
+        fputs(", ", fp);
+        trace_json_string(fp, trace.notes[i].key);
+        fputs(": ", fp);
+        trace_json_string(fp, trace.notes[i].value);
+    }
+
+    fputs(", \"phases\": [", fp);
+    first = 1;
+    for (size_t i = 0; i < trace.events_count; i++) {
+        if (trace.events[i].type) {
+            continue;
+        }
+        fputs(first ? "\n  " : ",\n  ", fp);
+        trace_json_event(fp, &trace.events[i]);
+        first = 0;
+    }
+
+    fputs("], \"transfers\": [", fp);
+    first = 1;
+    for (size_t i = 0; i < trace.events_count; i++) {
+        if (!trace.events[i].type) {
+            continue;
+        }
+        fputs(first ? "\n  " : ",\n  ", fp);
+        trace_json_event(fp, &trace.events[i]);
+        first = 0;
+    }
+    fputs("]}\n", fp);
+
+    if (fp != stderr) {
+        fclose(fp);
+    }
+}
+
+/**
+ * Find a sample, adding it with a value of zero
+ * @param m samples
+ * @param fmt printf format of the series (name and labels)
+ * @return pointer to the value
+ */
+static double *trace_metrics_sample(struct TraceMetrics *m, const char *fmt, ...) {
+    char series[PATH_MAX];
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(series, sizeof(series), fmt, ap);
+    va_end(ap);
+    for (size_t i = 0; i < m->count; i++) {
+        if (strcmp(m->samples[i].series, series) == 0) {
+            return &m->samples[i].value;
+        }
+    }
+    if (m->count == m->alloc) {
+        struct TraceSample *tmp;
+        size_t alloc = m->alloc ? m->alloc * 2 : 64;
+        tmp = realloc(m->samples, alloc * sizeof(*tmp));
+        if (tmp == NULL) {
+            perror("metrics");
+            exit(1);
+        }
+        m->samples = tmp;
+        m->alloc = alloc;
+    }
+    m->samples[m->count].series = strdup(series);
+    if (m->samples[m->count].series == NULL) {
+        perror("metrics");
+        exit(1);
+    }
+    m->samples[m->count].value = 0;
+    return &m->samples[m->count++].value;
+}
+
+/**
+ * Read the samples of a metrics file
+ *
+ * Comments are skipped. A missing file yields no samples.
+ *
+ * @param m samples (initialized by the caller)
+ * @param fp metrics file
+ */
+static void trace_metrics_read(struct TraceMetrics *m, FILE *fp) {
+    char line[PATH_MAX];
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        char *value;
+
+        line[strcspn(line, "\n")] = '\0';
+        if (*line == '#' || (value = strrchr(line, ' ')) == NULL) {
+            continue;
+        }
+        *value++ = '\0';
+        *trace_metrics_sample(m, "%s", line) = strtod(value, NULL);
+    }
+}
+
+/**
+ * Write samples grouped by family
+ *
+ * Samples of families this version does not know (from an older version) are
+ * dropped.
+ *
+ * @param m samples
+ * @param fp output
+ */
+static void trace_metrics_write(struct TraceMetrics *m, FILE *fp) {
+    for (size_t f = 0; f < sizeof(trace_families) / sizeof(*trace_families); f++) {
+        size_t len = strlen(trace_families[f].name);
+
+        fprintf(fp, "# HELP %s %s\n", trace_families[f].name, trace_families[f].help);
+        fprintf(fp, "# TYPE %s %s\n", trace_families[f].name, trace_families[f].type);
+        for (size_t i = 0; i < m->count; i++) {
+            const char *series = m->samples[i].series;
+            const char *rest = series + len;
+
+            if (strncmp(series, trace_families[f].name, len) != 0) {
+                continue;
+            }
+            if (strcmp(trace_families[f].type, "histogram") == 0
+                    && (strncmp(rest, "_bucket", 7) == 0 || strncmp(rest, "_sum", 4) == 0 || strncmp(rest, "_count", 6) == 0)) {
+                rest += strcspn(rest, "{");
+            }
+            if (*rest != '{' && *rest != '\0') {
+                continue;
+            }
+            fprintf(fp, "%s %.15g\n", series, m->samples[i].value);
+        }
+    }
+}
+
+/**
+ * Fold this invocation into the metrics file of the account
+ *
+ * The file is rewritten in place of the old one (node_exporter never reads a
+ * partial file). Concurrent invocations serialize on a lock file next to it.
+ */
+static void trace_write_metrics() {
+    struct TraceMetrics m;
+    char uid[32];
+    char path[PATH_MAX];
+    char path_lock[PATH_MAX];
+    char path_tmp[PATH_MAX];
+    const char *mode;
+    double elapsed;
+    uint64_t failed;
+    FILE *fp;
+    int fd_lock;
+    int fd;
+
+    // Numeric: a user name would cost an NSS lookup on the fast path
+    snprintf(uid, sizeof(uid), "%u", (unsigned) geteuid());
+    if (snprintf(path, sizeof(path), "%s/multihome_%s.prom", trace.metrics_dir, uid) >= PATH_MAX) {
+        return;
+    }
+    snprintf(path_lock, sizeof(path_lock), "%s/.multihome_%s.prom.lock", trace.metrics_dir, uid);
+    snprintf(path_tmp, sizeof(path_tmp), "%s/.multihome_%s.prom.XXXXXX", trace.metrics_dir, uid);
+
+    fd_lock = open(path_lock, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd_lock < 0 || flock(fd_lock, LOCK_EX) < 0) {
+        fprintf(stderr, "Unable to write metrics: %s: %s\n", path_lock, strerror(errno));
+        if (fd_lock >= 0) {
+            close(fd_lock);
+        }
+        return;
+    }
+
+    memset(&m, 0, sizeof(m));
+    fp = fopen(path, "r");
+    if (fp != NULL) {
+        trace_metrics_read(&m, fp);
+        fclose(fp);
+    }
+
+    mode = "full";
+    for (size_t i = 0; i < trace.notes_count; i++) {
+        if (strcmp(trace.notes[i].key, "path") == 0) {
+            mode = trace.notes[i].value;
+        } else if (strcmp(trace.notes[i].key, "host_group_rules") == 0) {
+            *trace_metrics_sample(&m, "multihome_host_group_rules{uid=\"%s\"}", uid) = strtod(trace.notes[i].value, NULL);
+        }
+    }
+
+    elapsed = (trace_now() - trace.epoch) / 1e9;
+    *trace_metrics_sample(&m, "multihome_invocations_total{uid=\"%s\",path=\"%s\"}", uid, mode) += 1;
+    for (size_t i = 0; i < sizeof(trace_buckets) / sizeof(*trace_buckets); i++) {
+        *trace_metrics_sample(&m, "multihome_resolve_duration_seconds_bucket{uid=\"%s\",path=\"%s\",le=\"%g\"}", uid, mode, trace_buckets[i]) += elapsed <= trace_buckets[i];
+    }
+    *trace_metrics_sample(&m, "multihome_resolve_duration_seconds_bucket{uid=\"%s\",path=\"%s\",le=\"+Inf\"}", uid, mode) += 1;
+    *trace_metrics_sample(&m, "multihome_resolve_duration_seconds_sum{uid=\"%s\",path=\"%s\"}", uid, mode) += elapsed;
+    *trace_metrics_sample(&m, "multihome_resolve_duration_seconds_count{uid=\"%s\",path=\"%s\"}", uid, mode) += 1;
+    *trace_metrics_sample(&m, "multihome_last_resolve_duration_seconds{uid=\"%s\",path=\"%s\"}", uid, mode) = elapsed;
+
+    failed = 0;
+    for (size_t i = 0; i < trace.events_count; i++) {
+        struct TraceEvent *event = &trace.events[i];
+
+        if (event->type) {
+            failed += event->status != 0;
+            continue;
+        }
+        if (!event->end) {
+            event->end = trace_now();
+            copy_get_stats(&event->after);
+        }
+        *trace_metrics_sample(&m, "multihome_phase_duration_seconds_total{uid=\"%s\",phase=\"%s\"}", uid, event->name) += (event->end - event->start) / 1e9;
+        *trace_metrics_sample(&m, "multihome_phase_bytes_total{uid=\"%s\",phase=\"%s\"}", uid, event->name) += event->after.bytes - event->before.bytes;
+        *trace_metrics_sample(&m, "multihome_phase_files_total{uid=\"%s\",phase=\"%s\"}", uid, event->name) += event->after.files - event->before.files;
+    }
+    *trace_metrics_sample(&m, "multihome_transfer_errors_total{uid=\"%s\"}", uid) += failed;
+    *trace_metrics_sample(&m, "multihome_last_run_timestamp_seconds{uid=\"%s\"}", uid) = time(NULL);
+
+    fd = mkstemp(path_tmp);
+    if (fd < 0 || fchmod(fd, 0644) < 0 || (fp = fdopen(fd, "w")) == NULL) {
+        fprintf(stderr, "Unable to write metrics: %s: %s\n", path_tmp, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+            unlink(path_tmp);
+        }
+    } else {
+        trace_metrics_write(&m, fp);
+        if (fclose(fp) != 0 || rename(path_tmp, path) < 0) {
+            fprintf(stderr, "Unable to write metrics: %s: %s\n", path, strerror(errno));
+            unlink(path_tmp);
+        }
+    }
+    close(fd_lock);
+
+    for (size_t i = 0; i < m.count; i++) {
+        free(m.samples[i].series);
+    }
+    free(m.samples);
+}
+
+/**
+ * Emit the report and the metrics (registered with atexit())
+ *
+ * Processes that leave with _exit() call it themselves.
+ */
+void trace_finish() {
+    if (!trace.enabled) {
+        return;
+    }
+    if (trace.fp != NULL) {
+        trace_write_json();
+    }
+    if (trace.metrics_dir != NULL) {
+        trace_write_metrics();
+    }
+    for (size_t i = 0; i < trace.events_count; i++) {
+        free(trace.events[i].where);
+    }
+    for (size_t i = 0; i < trace.notes_count; i++) {
+        free(trace.notes[i].value);
+    }
+    free(trace.events);
+    free(trace.metrics_dir);
+    memset(&trace, 0, sizeof(trace));
+    trace.registered = 1;
+}
+
+/**
+ * Start collecting events
+ */
+static void trace_enable() {
+    if (trace.enabled) {
+        return;
+    }
+    trace.epoch = trace_now();
+    trace.enabled = 1;
+    if (!trace.registered) {
+        atexit(trace_finish);
+        trace.registered = 1;
+    }
+}
+
+/**
+ * Enable tracing
+ * @param filename write the report here (NULL or "-" for stderr)
+ * @return 0=success, -1=error (errno set)
+ */
+int trace_open(const char *filename) {
+    if (filename == NULL || strcmp(filename, "-") == 0) {
+        trace.fp = stderr;
+    } else {
+        trace.fp = fopen(filename, "w");
+        if (trace.fp == NULL) {
+            return -1;
+        }
+    }
+    trace_enable();
+    return 0;
+}
+
+/**
+ * Export the metrics of every invocation in Prometheus text format
+ *
+ * Each account keeps cumulative counters and the latest gauges in
+ * DIR/multihome_UID.prom, which the node_exporter textfile collector picks up.
+ * The file is updated once, when the process exits.
+ *
+ * @param dir textfile collector directory
+ * @return 0=success, -1=error (errno set)
+ */
+int trace_metrics(const char *dir) {
+    if (*dir == '\0') {
+        errno = EINVAL;
+        return -1;
+    }
+    free(trace.metrics_dir);
+    trace.metrics_dir = strdup(dir);
+    if (trace.metrics_dir == NULL) {
+        perror("metrics");
+        exit(1);
+    }
+    trace_enable();
+    return 0;
+}
+
+/**
+ * Is tracing enabled?
+ * @return 0=no, 1=yes
+ */
+int trace_enabled() {
+    return trace.enabled;
+}
+
+/**
+ * Attach a key/value pair to the top level of the report
+ * @param key name
+ * @param value string value
+ */
+void trace_note(const char *key, const char *value) {
+    if (!trace.enabled) {
+        return;
+    }
+    for (size_t i = 0; i < trace.notes_count; i++) {
+        if (strcmp(trace.notes[i].key, key) == 0) {
+            free(trace.notes[i].value);
+            trace.notes[i].value = strdup(value);
+            return;
+        }
+    }
+    if (trace.notes_count < TRACE_NOTES_MAX) {
+        strncpy(trace.notes[trace.notes_count].key, key, sizeof(trace.notes[0].key) - 1);
+        trace.notes[trace.notes_count].value = strdup(value);
+        trace.notes_count++;
+    }
+}
+
+/**
+ * Start timing a transfer entry
+ * @param type transfer type (L, H, T)
+ * @param where path relative to the original home directory
+ * @return event handle for trace_end()
+ */
+size_t trace_begin_transfer(char type, const char *where) {
+    struct TraceEvent *event;
+
+    if (!trace.enabled) {
+        return 0;
+    }
+    if (trace.events_count == trace.events_alloc) {
+        struct TraceEvent *tmp;
+        size_t alloc = trace.events_alloc ? trace.events_alloc * 2 : 32;
+        tmp = realloc(trace.events, alloc * sizeof(*tmp));
+        if (tmp == NULL) {
+            return 0;
+        }
+        trace.events = tmp;
+        trace.events_alloc = alloc;
+    }
+
+    event = &trace.events[trace.events_count];
+    memset(event, 0, sizeof(*event));
+    snprintf(event->name, sizeof(event->name), "%s", type ? "transfer" : where);
+    event->type = type;
+    if (type) {
+        event->where = strdup(where);
+    }
+    copy_get_stats(&event->before);
+    event->start = trace_now();
+    return ++trace.events_count;
+}
+
+/**
+ * Start timing a phase
+ * @param name phase name
+ * @return event handle for trace_end()
+ */
+size_t trace_begin(const char *name) {
+    return trace_begin_transfer('\0', name);
+}
+
+/**
+ * Stop timing an event
+ * @param id handle returned by trace_begin() or trace_begin_transfer()
+ * @param status result of the event (0=success)
+ */
+void trace_end(size_t id, int status) {
+    struct TraceEvent *event;
+
+    if (!trace.enabled || id == 0 || id > trace.events_count) {
+        return;
+    }
+    event = &trace.events[id - 1];
+    event->end = trace_now();
+    event->status = status;
+    copy_get_stats(&event->after);
+}
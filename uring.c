@@ -0,0 +1,378 @@
+#include "multihome.h"
+#ifdef HAVE_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+/**
+ * Minimal io_uring interface
+ *
+ * Just enough of the submission and completion protocol for the copy engine,
+ * issued through the raw system calls so there is no dependency on liburing. A
+ * ring belongs to the thread that opened it. Operations are prepared with the
+ * uring_prep_*() functions and submitted in bulk by uring_wait(), which returns
+ * one completion at a time. Every pointer handed to a prepared operation must stay
+ * valid until its completion has been returned.
+ */
+
+#ifdef HAVE_IO_URING
+struct Uring {
+    int fd;
+    unsigned entries;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_array;
+    unsigned sq_mask;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr;
+    size_t sq_size;
+    void *cq_ptr;
+    size_t cq_size;
+    size_t sqes_size;
+    unsigned tail;              // next free submission slot
+    unsigned queued;            // prepared, not yet submitted
+    unsigned inflight;          // submitted, not yet completed
+};
+
+/**
+ * Check that the kernel implements every operation the copy engine uses
+ * @param fd ring descriptor
+ * @return 0=supported, -1=missing (errno set to EOPNOTSUPP)
+ */
+static int uring_probe(int fd) {
+    const int ops[] = {
+        IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ,
+        IORING_OP_WRITE, IORING_OP_CLOSE, IORING_OP_RENAMEAT,
+    };
+    struct io_uring_probe *probe;
+    size_t size;
+
+    size = sizeof(*probe) + 256 * sizeof(probe->ops[0]);
+    probe = calloc(1, size);
+    if (probe == NULL) {
+        perror("io_uring");
+        exit(1);
+    }
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) < 0) {
+        free(probe);
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+    for (size_t i = 0; i < sizeof(ops) / sizeof(*ops); i++) {
+        if (ops[i] > probe->last_op || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+            free(probe);
+            errno = EOPNOTSUPP;
+            return -1;
+        }
+    }
+    free(probe);
+    return 0;
+}
+
+/**
+ * Create a ring
+ * @param entries submission queue size (operations in flight)
+ * @return ring (release with uring_close()), NULL=unavailable (errno set)
+ */
+struct Uring *uring_open(unsigned entries) {
+    struct io_uring_params params;
+    struct Uring *ring;
+    int err;
+
+    ring = calloc(1, sizeof(*ring));
+    if (ring == NULL) {
+        perror("io_uring");
+        exit(1);
+    }
+    memset(&params, 0, sizeof(params));
+    ring->fd = (int) syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) {
+        goto uring_open_failed;
+    }
+    if (!(params.features & IORING_FEAT_NODROP) || uring_probe(ring->fd) < 0) {
+        errno = EOPNOTSUPP;
+        goto uring_open_failed;
+    }
+    ring->entries = params.sq_entries;
+
+    ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_size > ring->sq_size) {
+            ring->sq_size = ring->cq_size;
+        }
+        ring->cq_size = ring->sq_size;
+    }
+    ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED) {
+        ring->sq_ptr = NULL;
+        goto uring_open_failed;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ptr = ring->sq_ptr;
+    } else {
+        ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED) {
+            ring->cq_ptr = NULL;
+            goto uring_open_failed;
+        }
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        goto uring_open_failed;
+    }
+
+    ring->sq_head = (unsigned *) ((char *) ring->sq_ptr + params.sq_off.head);
+    ring->sq_tail = (unsigned *) ((char *) ring->sq_ptr + params.sq_off.tail);
+    ring->sq_array = (unsigned *) ((char *) ring->sq_ptr + params.sq_off.array);
+    ring->sq_mask = *(unsigned *) ((char *) ring->sq_ptr + params.sq_off.ring_mask);
+    ring->cq_head = (unsigned *) ((char *) ring->cq_ptr + params.cq_off.head);
+    ring->cq_tail = (unsigned *) ((char *) ring->cq_ptr + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *) ((char *) ring->cq_ptr + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) ((char *) ring->cq_ptr + params.cq_off.cqes);
+    ring->tail = *ring->sq_tail;
+    return ring;
+
+uring_open_failed:
+    err = errno;
+    uring_close(ring);
+    errno = err;
+    return NULL;
+}
+
+/**
+ * Release a ring
+ *
+ * Operations still in flight are abandoned, so only call this once uring_wait()
+ * has returned every completion.
+ *
+ * @param ring ring (may be NULL)
+ */
+void uring_close(struct Uring *ring) {
+    if (ring == NULL) {
+        return;
+    }
+    if (ring->sqes != NULL) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ptr != NULL && ring->cq_ptr != ring->sq_ptr) {
+        munmap(ring->cq_ptr, ring->cq_size);
+    }
+    if (ring->sq_ptr != NULL) {
+        munmap(ring->sq_ptr, ring->sq_size);
+    }
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+    free(ring);
+}
+
+/**
+ * Number of operations that may be in flight at once
+ * @param ring ring
+ * @return submission queue size
+ */
+unsigned uring_entries(struct Uring *ring) {
+    return ring->entries;
+}
+
+/**
+ * Claim a submission slot
+ * @return cleared entry, NULL when the ring is full (reap completions first)
+ */
+static struct io_uring_sqe *uring_sqe(struct Uring *ring, uint64_t data) {
+    struct io_uring_sqe *sqe;
+    unsigned index;
+
+    if (ring->queued + ring->inflight >= ring->entries) {
+        return NULL;
+    }
+    index = ring->tail & ring->sq_mask;
+    sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = data;
+    ring->sq_array[index] = index;
+    ring->tail++;
+    ring->queued++;
+    return sqe;
+}
+
+int uring_prep_openat(struct Uring *ring, int dirfd, const char *path, int flags, mode_t mode, uint64_t data) {
+    struct io_uring_sqe *sqe = uring_sqe(ring, data);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = dirfd;
+    sqe->addr = (uintptr_t) path;
+    sqe->len = mode;
+    sqe->open_flags = flags;
+    return 0;
+}
+
+int uring_prep_statx(struct Uring *ring, int dirfd, const char *path, int flags, unsigned mask, void *statxbuf, uint64_t data) {
+    struct io_uring_sqe *sqe = uring_sqe(ring, data);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_STATX;
+    sqe->fd = dirfd;
+    sqe->addr = (uintptr_t) path;
+    sqe->len = mask;
+    sqe->off = (uintptr_t) statxbuf;
+    sqe->statx_flags = flags;
+    return 0;
+}
+
+int uring_prep_read(struct Uring *ring, int fd, void *buf, unsigned len, uint64_t offset, uint64_t data) {
+    struct io_uring_sqe *sqe = uring_sqe(ring, data);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t) buf;
+    sqe->len = len;
+    sqe->off = offset;
+    return 0;
+}
+
+int uring_prep_write(struct Uring *ring, int fd, const void *buf, unsigned len, uint64_t offset, uint64_t data) {
+    struct io_uring_sqe *sqe = uring_sqe(ring, data);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t) buf;
+    sqe->len = len;
+    sqe->off = offset;
+    return 0;
+}
+
+int uring_prep_close(struct Uring *ring, int fd, uint64_t data) {
+    struct io_uring_sqe *sqe = uring_sqe(ring, data);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = fd;
+    return 0;
+}
+
+int uring_prep_renameat(struct Uring *ring, int olddirfd, const char *oldpath, int newdirfd, const char *newpath, uint64_t data) {
+    struct io_uring_sqe *sqe = uring_sqe(ring, data);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_RENAMEAT;
+    sqe->fd = olddirfd;
+    sqe->addr = (uintptr_t) oldpath;
+    sqe->len = newdirfd;
+    sqe->addr2 = (uintptr_t) newpath;
+    return 0;
+}
+
+/**
+ * Submit prepared operations and return one completion
+ * @param ring ring
+ * @param data output: user data of the completed operation
+ * @param res output: result of the operation (negative errno on failure)
+ * @return 0=success, -1=nothing in flight or the kernel refused (errno set)
+ */
+int uring_wait(struct Uring *ring, uint64_t *data, int *res) {
+    while (1) {
+        unsigned head;
+        int submitted;
+
+        head = *ring->cq_head;
+        if (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+            *data = cqe->user_data;
+            *res = cqe->res;
+            __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+            ring->inflight--;
+            return 0;
+        }
+        if (ring->queued + ring->inflight == 0) {
+            errno = EAGAIN;
+            return -1;
+        }
+
+        __atomic_store_n(ring->sq_tail, ring->tail, __ATOMIC_RELEASE);
+        submitted = (int) syscall(__NR_io_uring_enter, ring->fd, ring->queued, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (submitted < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+                continue;
+            }
+            return -1;
+        }
+        ring->queued -= submitted;
+        ring->inflight += submitted;
+    }
+}
+#else
+struct Uring *uring_open(unsigned entries) {
+    (void) entries;
+    errno = ENOSYS;
+    return NULL;
+}
+
+void uring_close(struct Uring *ring) {
+    (void) ring;
+}
+
+unsigned uring_entries(struct Uring *ring) {
+    (void) ring;
+    return 0;
+}
+
+int uring_prep_openat(struct Uring *ring, int dirfd, const char *path, int flags, mode_t mode, uint64_t data) {
+    (void) ring, (void) dirfd, (void) path, (void) flags, (void) mode, (void) data;
+    errno = ENOSYS;
+    return -1;
+}
+
+int uring_prep_statx(struct Uring *ring, int dirfd, const char *path, int flags, unsigned mask, void *statxbuf, uint64_t data) {
+    (void) ring, (void) dirfd, (void) path, (void) flags, (void) mask, (void) statxbuf, (void) data;
+    errno = ENOSYS;
+    return -1;
+}
+
+int uring_prep_read(struct Uring *ring, int fd, void *buf, unsigned len, uint64_t offset, uint64_t data) {
+    (void) ring, (void) fd, (void) buf, (void) len, (void) offset, (void) data;
+    errno = ENOSYS;
+    return -1;
+}
+
+int uring_prep_write(struct Uring *ring, int fd, const void *buf, unsigned len, uint64_t offset, uint64_t data) {
+    (void) ring, (void) fd, (void) buf, (void) len, (void) offset, (void) data;
+    errno = ENOSYS;
+    return -1;
+}
+
+int uring_prep_close(struct Uring *ring, int fd, uint64_t data) {
+    (void) ring, (void) fd, (void) data;
+    errno = ENOSYS;
+    return -1;
+}
+
+int uring_prep_renameat(struct Uring *ring, int olddirfd, const char *oldpath, int newdirfd, const char *newpath, uint64_t data) {
+    (void) ring, (void) olddirfd, (void) oldpath, (void) newdirfd, (void) newpath, (void) data;
+    errno = ENOSYS;
+    return -1;
+}
+
+int uring_wait(struct Uring *ring, uint64_t *data, int *res) {
+    (void) ring, (void) data, (void) res;
+    errno = ENOSYS;
+    return -1;
+}
+#endif
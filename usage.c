@@ -0,0 +1,413 @@
+#define _GNU_SOURCE
+#include "multihome.h"
+#include <sys/syscall.h>
+
+/**
+ * Disk usage of home directories
+ *
+ * Directories are read with getdents64 and their entries examined with statx
+ * relative to the open directory, so each entry costs one lookup instead of one
+ * per path component. A pool of threads shares a single stack of directories
+ * across every tree being measured, which keeps many NFS requests in flight at
+ * once where du would issue them one after the other.
+ */
+
+#define USAGE_DENTS_SIZE 65536
+
+struct UsageDirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+/**
+ * An open directory, kept until its queued subdirectories have been opened
+ */
+struct UsageDir {
+    int fd;
+    size_t refs;
+};
+
+struct UsageTask {
+    struct UsageDir *parent;    // NULL for a root
+    char *path;
+    const char *name;           // last component of path (opened relative to parent)
+    size_t root;
+};
+
+struct UsageAttr {
+    mode_t mode;
+    uint64_t nlink;
+    uint64_t ino;
+    uint64_t dev;
+    uint64_t size;
+    uint64_t blocks;
+};
+
+struct UsageScan {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    struct UsageTask *tasks;
+    size_t count;
+    size_t alloc;
+    size_t active;              // workers processing a directory
+    size_t roots;
+    uint64_t *devs;             // per root: the filesystem being measured
+    uint64_t *seen;             // multiply linked inodes already counted (open addressing)
+    size_t seen_count;
+    size_t seen_alloc;
+    struct UsageStats *stats;
+};
+
+/**
+ * Examine a directory entry without following symbolic links
+ * @param dirfd directory
+ * @param name entry name
+ * @param attr output
+ * @return 0=success, -1=error (errno set)
+ */
+static int usage_stat(int dirfd, const char *name, struct UsageAttr *attr) {
+#ifdef HAVE_STATX
+    struct statx stx;
+
+    // Cached attributes are good enough for a report
+    if (statx(dirfd, name, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT | AT_STATX_DONT_SYNC,
+              STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_INO | STATX_SIZE | STATX_BLOCKS, &stx) < 0) {
+        return -1;
+    }
+    attr->mode = stx.stx_mode;
+    attr->nlink = stx.stx_nlink;
+    attr->ino = stx.stx_ino;
+    attr->dev = ((uint64_t) stx.stx_dev_major << 32) | stx.stx_dev_minor;
+    attr->size = stx.stx_size;
+    attr->blocks = stx.stx_blocks;
+#else
+    struct stat st;
+
+    if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT) < 0) {
+        return -1;
+    }
+    attr->mode = st.st_mode;
+    attr->nlink = st.st_nlink;
+    attr->ino = st.st_ino;
+    attr->dev = st.st_dev;
+    attr->size = st.st_size;
+    attr->blocks = st.st_blocks;
+#endif
+    return 0;
+}
+
+static void usage_dir_release(struct UsageScan *scan, struct UsageDir *dir) {
+    size_t refs;
+
+    if (dir == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&scan->lock);
+    refs = --dir->refs;
+    pthread_mutex_unlock(&scan->lock);
+    if (refs == 0) {
+        close(dir->fd);
+        free(dir);
+    }
+}
+
+/**
+ * Queue a directory (caller holds the lock)
+ */
+static void usage_push(struct UsageScan *scan, struct UsageDir *parent, char *path, size_t name_offset, size_t root) {
+    if (scan->count == scan->alloc) {
+        struct UsageTask *tmp;
+        size_t alloc = scan->alloc ? scan->alloc * 2 : 64;
+        tmp = realloc(scan->tasks, alloc * sizeof(*tmp));
+        if (tmp == NULL) {
+            perror("usage");
+            exit(1);
+        }
+        scan->tasks = tmp;
+        scan->alloc = alloc;
+    }
+    scan->tasks[scan->count].parent = parent;
+    scan->tasks[scan->count].path = path;
+    scan->tasks[scan->count].name = path + name_offset;
+    scan->tasks[scan->count].root = root;
+    scan->count++;
+    if (parent != NULL) {
+        parent->refs++;
+    }
+    pthread_cond_signal(&scan->ready);
+}
+
+/**
+ * Has a multiply linked inode been counted for this root already?
+ * @return 1=yes, 0=no (and it is now)
+ */
+static int usage_seen(struct UsageScan *scan, size_t root, struct UsageAttr *attr) {
+    uint64_t key;
+    size_t slot;
+    int result;
+
+    key = hash_fnv1a(MANIFEST_HASH_INIT, &root, sizeof(root));
+    key = hash_fnv1a(key, &attr->dev, sizeof(attr->dev));
+    key = hash_fnv1a(key, &attr->ino, sizeof(attr->ino));
+    key |= 1;                   // 0 marks a free slot
+
+    pthread_mutex_lock(&scan->lock);
+    if ((scan->seen_count + 1) * 2 > scan->seen_alloc) {
+        uint64_t *table;
+        size_t alloc = scan->seen_alloc ? scan->seen_alloc * 2 : 1024;
+        table = calloc(alloc, sizeof(*table));
+        if (table == NULL) {
+            perror("usage");
+            exit(1);
+        }
+        for (size_t i = 0; i < scan->seen_alloc; i++) {
+            if (scan->seen[i]) {
+                for (slot = scan->seen[i] & (alloc - 1); table[slot]; slot = (slot + 1) & (alloc - 1)) {
+                    continue;
+                }
+                table[slot] = scan->seen[i];
+            }
+        }
+        free(scan->seen);
+        scan->seen = table;
+        scan->seen_alloc = alloc;
+    }
+    for (slot = key & (scan->seen_alloc - 1); scan->seen[slot] && scan->seen[slot] != key; slot = (slot + 1) & (scan->seen_alloc - 1)) {
+        continue;
+    }
+    result = scan->seen[slot] == key;
+    if (!result) {
+        scan->seen[slot] = key;
+        scan->seen_count++;
+    }
+    pthread_mutex_unlock(&scan->lock);
+    return result;
+}
+
+/**
+ * Read one directory, counting its entries and queueing its subdirectories
+ * @param scan shared state
+ * @param task directory
+ * @param stats per worker totals (one per root)
+ */
+static void usage_dir(struct UsageScan *scan, struct UsageTask *task, struct UsageStats *stats) {
+    struct UsageStats *total;
+    struct UsageDir *dir;
+    char *buf;
+    long len;
+    int fd;
+
+    total = &stats[task->root];
+    fd = openat(task->parent ? task->parent->fd : AT_FDCWD, task->parent ? task->name : task->path,
+                O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    usage_dir_release(scan, task->parent);
+    if (fd < 0) {
+        fprintf(stderr, "%s: %s\n", task->path, strerror(errno));
+        total->errors++;
+        return;
+    }
+
+    dir = malloc(sizeof(*dir));
+    buf = malloc(USAGE_DENTS_SIZE);
+    if (dir == NULL || buf == NULL) {
+        perror("usage");
+        exit(1);
+    }
+    dir->fd = fd;
+    dir->refs = 1;
+
+    while ((len = syscall(SYS_getdents64, fd, buf, USAGE_DENTS_SIZE)) > 0) {
+        for (long offset = 0; offset < len; ) {
+            struct UsageDirent64 *ent = (struct UsageDirent64 *) (buf + offset);
+            struct UsageAttr attr;
+
+            offset += ent->d_reclen;
+            if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+                continue;
+            }
+            if (usage_stat(fd, ent->d_name, &attr) < 0) {
+                if (errno != ENOENT) {
+                    fprintf(stderr, "%s/%s: %s\n", task->path, ent->d_name, strerror(errno));
+                    total->errors++;
+                }
+                continue;
+            }
+
+            if (S_ISDIR(attr.mode)) {
+                char *path;
+                size_t path_len;
+
+                total->dirs++;
+                total->bytes += attr.blocks * 512;
+                total->apparent += attr.size;
+
+                // Stay on the filesystem of the home directory (like du -x)
+                if (attr.dev != scan->devs[task->root]) {
+                    continue;
+                }
+                path_len = strlen(task->path);
+                path = malloc(path_len + strlen(ent->d_name) + 2);
+                if (path == NULL) {
+                    perror("usage");
+                    exit(1);
+                }
+                sprintf(path, "%s/%s", task->path, ent->d_name);
+                pthread_mutex_lock(&scan->lock);
+                usage_push(scan, dir, path, path_len + 1, task->root);
+                pthread_mutex_unlock(&scan->lock);
+                continue;
+            }
+
+            total->files++;
+            // Hard links (including object store links) are counted once per tree
+            if (attr.nlink > 1 && usage_seen(scan, task->root, &attr)) {
+                continue;
+            }
+            total->bytes += attr.blocks * 512;
+            total->apparent += attr.size;
+        }
+    }
+    if (len < 0) {
+        fprintf(stderr, "%s: %s\n", task->path, strerror(errno));
+        total->errors++;
+    }
+    free(buf);
+    usage_dir_release(scan, dir);
+}
+
+static void *usage_worker(void *arg) {
+    struct UsageScan *scan = arg;
+    struct UsageStats *stats;
+
+    stats = calloc(scan->roots, sizeof(*stats));
+    if (stats == NULL) {
+        perror("usage");
+        exit(1);
+    }
+    while (1) {
+        struct UsageTask task;
+
+        pthread_mutex_lock(&scan->lock);
+        while (scan->count == 0 && scan->active > 0) {
+            pthread_cond_wait(&scan->ready, &scan->lock);
+        }
+        if (scan->count == 0) {
+            pthread_cond_broadcast(&scan->ready);
+            pthread_mutex_unlock(&scan->lock);
+            break;
+        }
+        task = scan->tasks[--scan->count];
+        scan->active++;
+        pthread_mutex_unlock(&scan->lock);
+
+        usage_dir(scan, &task, stats);
+        free(task.path);
+
+        pthread_mutex_lock(&scan->lock);
+        scan->active--;
+        if (scan->count == 0 && scan->active == 0) {
+            pthread_cond_broadcast(&scan->ready);
+        }
+        pthread_mutex_unlock(&scan->lock);
+    }
+
+    pthread_mutex_lock(&scan->lock);
+    for (size_t i = 0; i < scan->roots; i++) {
+        scan->stats[i].bytes += stats[i].bytes;
+        scan->stats[i].apparent += stats[i].apparent;
+        scan->stats[i].files += stats[i].files;
+        scan->stats[i].dirs += stats[i].dirs;
+        scan->stats[i].errors += stats[i].errors;
+    }
+    pthread_mutex_unlock(&scan->lock);
+    free(stats);
+    return NULL;
+}
+
+/**
+ * Measure the disk usage of several directory trees at once
+ *
+ * Multiply linked files are counted once per tree. Mount points below a root
+ * are not descended into.
+ *
+ * @param paths directory trees
+ * @param count number of trees
+ * @param stats output: one entry per tree
+ * @param jobs number of threads
+ * @return 0=success, -1=one or more entries could not be examined
+ */
+int usage_scan(char **paths, size_t count, struct UsageStats *stats, size_t jobs) {
+    struct UsageScan scan;
+    pthread_t *threads;
+    size_t started;
+    int status;
+
+    memset(stats, 0, count * sizeof(*stats));
+    memset(&scan, 0, sizeof(scan));
+    pthread_mutex_init(&scan.lock, NULL);
+    pthread_cond_init(&scan.ready, NULL);
+    scan.roots = count;
+    scan.stats = stats;
+    scan.devs = calloc(count + 1, sizeof(*scan.devs));
+    if (scan.devs == NULL) {
+        perror("usage");
+        exit(1);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        struct UsageAttr attr;
+        char *path;
+
+        if (usage_stat(AT_FDCWD, paths[i], &attr) < 0 || !S_ISDIR(attr.mode)) {
+            fprintf(stderr, "%s: %s\n", paths[i], strerror(errno ? errno : ENOTDIR));
+            stats[i].errors++;
+            continue;
+        }
+        scan.devs[i] = attr.dev;
+        stats[i].dirs++;
+        stats[i].bytes += attr.blocks * 512;
+        stats[i].apparent += attr.size;
+        path = strdup(paths[i]);
+        if (path == NULL) {
+            perror("usage");
+            exit(1);
+        }
+        usage_push(&scan, NULL, path, 0, i);
+    }
+
+    threads = calloc(jobs ? jobs : 1, sizeof(*threads));
+    if (threads == NULL) {
+        perror("usage");
+        exit(1);
+    }
+    started = 0;
+    for (size_t i = 0; i < jobs; i++) {
+        if (pthread_create(&threads[i], NULL, usage_worker, &scan) != 0) {
+            break;
+        }
+        started++;
+    }
+    if (started == 0) {
+        usage_worker(&scan);
+    }
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    status = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (stats[i].errors) {
+            status = -1;
+        }
+    }
+    free(threads);
+    free(scan.tasks);
+    free(scan.seen);
+    free(scan.devs);
+    pthread_cond_destroy(&scan.ready);
+    pthread_mutex_destroy(&scan.lock);
+    return status;
+}
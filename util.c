@@ -0,0 +1,360 @@
+#include "multihome.h"
+
+/**
+ * Generic function to free an array of pointers
+ * @param arr an array
+ * @param nelem if nelem is 0 free until NULL. >0 free until nelem
+ */
+void free_array(void **arr, size_t nelem) {
+    if (nelem) {
+        for (size_t i = 0; i < nelem; i++) {
+            free(arr[i]);
+        }
+    } else {
+        for (size_t i = 0; arr[i] != NULL; i++) {
+            free(arr[i]);
+        }
+    }
+    free(arr);
+}
+
+/**
+ * Return the count of a substring in a string
+ * @param s Input string
+ * @param sub Input substring
+ * @return count
+ */
+ssize_t count_substrings(const char *s, char *sub) {
+    char *str;
+    char *str_orig;
+    size_t str_length;
+    size_t sub_length;
+    ssize_t result;
+
+    str = strdup(s);
+    if (str == NULL) {
+        return -1;
+    }
+
+    str_orig = str;
+    str_length = strlen(str);
+    sub_length = strlen(sub);
+    result = 0;
+
+    for (size_t i = 0; i < str_length; i++) {
+        char *ptr;
+        ptr = strstr(str, sub);
+
+        if (ptr) {
+            result++;
+        } else {
+            break;
+        }
+
+        if (i < str_length - sub_length) {
+            str = ptr + sub_length;
+        }
+    }
+
+    free(str_orig);
+    return result;
+}
+
+/**
+ * Split a string using a substring
+ * @param sptr Input string
+ * @param delim Substring to split on
+ * @param num_alloc Address to store count of allocated records
+ * @return NULL terminated array of strings
+ */
+char **split(const char *sptr, char *delim, size_t *num_alloc) {
+    char *s;
+    char *s_orig;
+    char **result;
+    char *token;
+
+    token = NULL;
+    result = NULL;
+    s = strdup(sptr);
+    s_orig = s;
+    if (s == NULL) {
+        return NULL;
+    }
+
+    *num_alloc = count_substrings(s, delim);
+    if (*num_alloc < 0) {
+        goto split_die_2;
+    }
+
+    *num_alloc += 2;
+    result = calloc(*num_alloc, sizeof(char *));
+
+    if (result == NULL) {
+        goto split_die_1;
+    }
+
+    for (size_t i = 0; (token = strsep(&s, delim)) != NULL; i++) {
+        result[i] = strdup(token);
+        if (result[i] == NULL) {
+            break;
+        }
+    }
+
+split_die_1:
+    free(s_orig);
+split_die_2:
+    return result;
+}
+
+/**
+ * Using $PATH, return the location of _name
+ *
+ * If _name starts with "./" return the absolute path to the file
+ *
+ * @param _name program name
+ * @param buf output buffer (PATH_MAX)
+ * @return buf, or NULL if not found
+ */
+char *find_program(const char *_name, char *buf) {
+    char *pathvar;
+    char **parts;
+    size_t parts_count;
+    int found;
+
+    pathvar = getenv("PATH");
+    if (pathvar == NULL) {
+        return NULL;
+    }
+
+    parts = split(pathvar, ":", &parts_count);
+    if (parts == NULL) {
+        return NULL;
+    }
+
+    memset(buf, '\0', PATH_MAX);
+    found = 0;
+
+    // Return the absolute path of _name when:
+    // 1) Path starts with "./" (absolute)
+    // 2) Path starts with "/" (absolute)
+    // 3) Path contains "/" (relative)
+    //
+    // Obviously strstr will do this job all by itself, however it's like watching slow scan TV.
+    if (strncmp(_name, "./", 2) == 0 || strncmp(_name, "/", 1) == 0 || strstr(_name, "/") != NULL) {
+        if (access(_name, F_OK) == 0) {
+            found = 1;
+            realpath(_name, buf);
+        }
+    } else {
+        for (int i = 0; parts[i] != NULL; i++) {
+            char tmp[PATH_MAX];
+            memset(tmp, '\0', sizeof(tmp));
+            strcat(tmp, parts[i]);
+            strcat(tmp, "/");
+            strcat(tmp, _name);
+            if (access(tmp, F_OK) == 0) {
+                found = 1;
+                realpath(tmp, buf);
+                break;
+            }
+        }
+    }
+
+    free_array((void**)parts, parts_count);
+    return found ? buf : NULL;
+}
+
+/**
+ * Create directories if they do not exist
+ * @param path Filesystem path
+ * @return int (0=success, -1=error (errno set))
+ */
+int mkdirs(char *path) {
+    char **parts;
+    char tmp[PATH_MAX];
+    size_t parts_length;
+    memset(tmp, '\0', sizeof(tmp));
+
+    parts = split(path, "/", &parts_length);
+
+    for (size_t i = 0; parts[i] != NULL; i++) {
+        if (i == 0 && strlen(parts[i]) == 0) {
+            strcat(tmp, "/");
+            continue;
+        }
+
+        strcat(tmp, parts[i]);
+
+        if (tmp[strlen(tmp) - 1] != '/') {
+            strcat(tmp, "/");
+        }
+
+        if (access(tmp, F_OK) == 0) {
+            continue;
+        }
+
+        if (mkdir(tmp, (mode_t) 0755) < 0) {
+            perror("mkdir");
+            return -1;
+        }
+    }
+
+    free_array((void **)parts, parts_length);
+    return 0;
+}
+
+/**
+ * Execute a shell program
+ * @param args (char *[]){"/path/to/program", "arg1", "arg2, ..., NULL};
+ * @return exit code of program
+ */
+int shell(char *args[]) {
+    pid_t pid;
+    pid_t status;
+
+    status = 0;
+    errno = 0;
+
+    pid = fork();
+    if (pid == -1) {
+        fprintf(stderr, "fork failed\n");
+        exit(1);
+    } else if (pid == 0) {
+        int retval;
+        retval = execv(args[0], &args[0]);
+        exit(retval);
+    } else {
+        if (waitpid(pid, &status, WUNTRACED) > 0) {
+            if (WIFEXITED(status) && WEXITSTATUS(status)) {
+                if (WEXITSTATUS(status) == 127) {
+                    fprintf(stderr, "execvp failed\n");
+                    exit(1);
+                }
+            } else if (WIFSIGNALED(status))  {
+                fprintf(stderr, "signal received: %d\n", WIFSIGNALED(status));
+            }
+        } else {
+            fprintf(stderr, "waitpid() failed\n");
+        }
+    }
+    return WEXITSTATUS(status);
+}
+
+/**
+ * Create or update the modified time on a file
+ * @param filename path to file
+ * @return 0=success, -1=error (errno set)
+ */
+int touch(char *filename) {
+    FILE *fp;
+    fp = fopen(filename, "w");
+    fflush(fp);
+    if (fp == NULL) {
+        return -1;
+    }
+    fclose(fp);
+    return 0;
+}
+
+/**
+ * Get date and time as a string
+ *
+ * @param result output buffer
+ * @param size size of result
+ * @return result
+ */
+char *get_timestamp(char *result, size_t size) {
+    struct tm tm;
+    time_t now;
+
+    // Get current time
+    time(&now);
+
+    // Convert current time to tm struct
+    localtime_r(&now, &tm);
+
+    // Write result to buffer
+    snprintf(result, size, "%02d-%02d-%d @ %02d:%02d:%02d",
+            tm.tm_mon + 1, tm.tm_mday, tm.tm_year + 1900,
+            tm.tm_hour, tm.tm_min, tm.tm_sec);
+
+    return result;
+}
+
+/**
+ * Format a byte count for people
+ *
+ * @param bytes number of bytes
+ * @param result output buffer
+ * @param size size of result
+ * @return result (e.g. "512", "1.5K", "20.0G")
+ */
+char *human_size(uint64_t bytes, char *result, size_t size) {
+    const char *units = "KMGTPE";
+    double value;
+    int unit;
+
+    if (bytes < 1024) {
+        snprintf(result, size, "%llu", (unsigned long long) bytes);
+        return result;
+    }
+    value = bytes / 1024.0;
+    for (unit = 0; value >= 1024 && units[unit + 1]; unit++) {
+        value /= 1024;
+    }
+    snprintf(result, size, "%.1f%c", value, units[unit]);
+    return result;
+}
+
+/**
+ * Parse a byte count written for people
+ *
+ * The inverse of human_size(): an optional K, M, G, T, P or E suffix (case
+ * insensitive) multiplies by powers of 1024.
+ *
+ * @param str input (e.g. "512", "64K", "1.5G")
+ * @param result output
+ * @return 0=success, -1=invalid or out of range
+ */
+int parse_size(const char *str, uint64_t *result) {
+    const char *units = "KMGTPE";
+    const char *unit;
+    double value;
+    char *end;
+
+    errno = 0;
+    value = strtod(str, &end);
+    if (end == str || errno || value < 0) {
+        return -1;
+    }
+    if (*end) {
+        unit = strchr(units, toupper((unsigned char) *end));
+        if (unit == NULL || end[1] != '\0') {
+            return -1;
+        }
+        for (const char *u = units; u <= unit; u++) {
+            value *= 1024;
+        }
+    }
+    if (value >= 18446744073709551616.0) {
+        return -1;
+    }
+    *result = (uint64_t) value;
+    return 0;
+}
+
+/**
+ * Retrieve hostname from FQDN
+ * @param hostname
+ * @return short hostname
+ */
+char *strip_domainname(char *hostname) {
+    char *ptr;
+
+    ptr = strchr(hostname, '.');
+    if (ptr != NULL) {
+        *ptr = '\0';
+    }
+
+    return hostname;
+}
@@ -0,0 +1,458 @@
+#include "multihome.h"
+#include <poll.h>
+#include <sys/inotify.h>
+
+/**
+ * Change notification
+ *
+ * A set of inotify watches, each mapping a source directory to its destination.
+ * Tree watches follow every subdirectory below their root and report changes
+ * relative to it. Exact watches observe a single name inside a directory, which
+ * also covers sources that are replaced by rename or do not exist yet.
+ *
+ * Events are collected until the sources have been quiet for the debounce
+ * interval, then returned as one batch with duplicates and descendants of new
+ * directories removed.
+ */
+
+#define WATCH_MASK (IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_MOVED_TO | IN_ONLYDIR | IN_EXCL_UNLINK)
+
+/**
+ * Read the monotonic clock
+ * @return milliseconds
+ */
+static long watch_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+/**
+ * Initialize a watch set
+ * @param w watch set
+ * @return 0=success, -1=error (errno set)
+ */
+int watch_init(struct Watch *w) {
+    memset(w, 0, sizeof(*w));
+    w->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (w->fd < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Release a watch set
+ * @param w watch set
+ */
+void watch_free(struct Watch *w) {
+    for (size_t i = 0; i < w->count; i++) {
+        free(w->entries[i].dir);
+        free(w->entries[i].name);
+        free(w->entries[i].source);
+        free(w->entries[i].dest);
+    }
+    free(w->entries);
+    if (w->fd >= 0) {
+        close(w->fd);
+    }
+    memset(w, 0, sizeof(*w));
+    w->fd = -1;
+}
+
+/**
+ * Duplicate a string that may be NULL
+ */
+static char *watch_strdup(const char *str) {
+    char *result;
+
+    if (str == NULL) {
+        return NULL;
+    }
+    result = strdup(str);
+    if (result == NULL) {
+        perror("watch");
+        exit(1);
+    }
+    return result;
+}
+
+/**
+ * Register one directory
+ */
+static int watch_add_entry(struct Watch *w, int kind, const char *dir, const char *name, const char *source, const char *dest) {
+    struct WatchEntry *entry;
+    int wd;
+
+    wd = inotify_add_watch(w->fd, dir, WATCH_MASK);
+    if (wd < 0) {
+        return -1;
+    }
+
+    if (w->count == w->alloc) {
+        struct WatchEntry *tmp;
+        size_t alloc = w->alloc ? w->alloc * 2 : 32;
+        tmp = realloc(w->entries, alloc * sizeof(*tmp));
+        if (tmp == NULL) {
+            perror("watch");
+            exit(1);
+        }
+        w->entries = tmp;
+        w->alloc = alloc;
+    }
+
+    entry = &w->entries[w->count++];
+    entry->wd = wd;
+    entry->kind = kind;
+    entry->dir = watch_strdup(dir);
+    entry->name = watch_strdup(name);
+    entry->source = watch_strdup(source);
+    entry->dest = watch_strdup(dest);
+    return 0;
+}
+
+/**
+ * Register a directory and every directory below it
+ */
+static int watch_add_tree(struct Watch *w, int kind, const char *dir, const char *dest) {
+    struct dirent *rec;
+    DIR *dp;
+
+    if (watch_add_entry(w, kind, dir, NULL, NULL, dest) < 0) {
+        return -1;
+    }
+
+    dp = opendir(dir);
+    if (dp == NULL) {
+        return -1;
+    }
+    while ((rec = readdir(dp)) != NULL) {
+        char path[PATH_MAX];
+        char path_dest[PATH_MAX];
+        struct stat st;
+
+        if (strcmp(rec->d_name, ".") == 0 || strcmp(rec->d_name, "..") == 0) {
+            continue;
+        }
+        if (rec->d_type != DT_DIR && rec->d_type != DT_UNKNOWN) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", dir, rec->d_name);
+        if (lstat(path, &st) < 0 || !S_ISDIR(st.st_mode)) {
+            continue;
+        }
+        if (kind == WATCH_KIND_TRANSFER && copy_excluded(path, st.st_mode)) {
+            continue;
+        }
+        snprintf(path_dest, sizeof(path_dest), "%s/%s", dest, rec->d_name);
+        if (watch_add_tree(w, kind, path, path_dest) < 0) {
+            fprintf(stderr, "watch: %s: %s\n", path, strerror(errno));
+        }
+    }
+    closedir(dp);
+    return 0;
+}
+
+/**
+ * Watch a source
+ *
+ * With name == NULL, dir is watched recursively and a change to dir/x is reported
+ * as (dir/x, dest/x). Otherwise only events for dir/name are reported, always as
+ * the pair (source, dest).
+ *
+ * @param w watch set
+ * @param kind caller-defined category (WATCH_KIND_*)
+ * @param dir directory to watch
+ * @param name file name inside dir, or NULL
+ * @param source reported source (exact watches only)
+ * @param dest destination of dir (tree) or source (exact)
+ * @return 0=success, -1=error (errno set)
+ */
+int watch_add(struct Watch *w, int kind, const char *dir, const char *name, const char *source, const char *dest) {
+    if (name == NULL) {
+        return watch_add_tree(w, kind, dir, dest);
+    }
+    return watch_add_entry(w, kind, dir, name, source, dest);
+}
+
+/**
+ * Stop watching every source of a kind
+ * @param w watch set
+ * @param kind category passed to watch_add()
+ */
+void watch_remove(struct Watch *w, int kind) {
+    size_t count;
+
+    count = 0;
+    for (size_t i = 0; i < w->count; i++) {
+        struct WatchEntry *entry = &w->entries[i];
+        if (entry->kind != kind) {
+            w->entries[count++] = *entry;
+            continue;
+        }
+
+        // Watch descriptors are shared by every entry on the same directory
+        int shared = 0;
+        for (size_t j = 0; j < w->count; j++) {
+            if (j != i && w->entries[j].wd == entry->wd && w->entries[j].kind != kind) {
+                shared = 1;
+                break;
+            }
+        }
+        if (!shared && entry->wd >= 0) {
+            inotify_rm_watch(w->fd, entry->wd);
+            for (size_t j = i + 1; j < w->count; j++) {
+                if (w->entries[j].wd == entry->wd) {
+                    w->entries[j].wd = -1;
+                }
+            }
+        }
+        free(entry->dir);
+        free(entry->name);
+        free(entry->source);
+        free(entry->dest);
+    }
+    w->count = count;
+}
+
+/**
+ * Append a change to a batch
+ */
+static void watch_push(struct WatchChange **changes, size_t *count, size_t *alloc, struct WatchChange *change) {
+    if (*count == *alloc) {
+        struct WatchChange *tmp;
+        *alloc = *alloc ? *alloc * 2 : 64;
+        tmp = realloc(*changes, *alloc * sizeof(*tmp));
+        if (tmp == NULL) {
+            perror("watch");
+            exit(1);
+        }
+        *changes = tmp;
+    }
+    (*changes)[(*count)++] = *change;
+}
+
+/**
+ * Translate pending inotify events into changes
+ * @return 0=success, -1=error (errno set)
+ */
+static int watch_read(struct Watch *w, struct WatchChange **changes, size_t *count, size_t *alloc) {
+    char buf[BUFSIZ * 4] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+
+    while ((len = read(w->fd, buf, sizeof(buf))) > 0) {
+        for (char *ptr = buf; ptr < buf + len; ) {
+            struct inotify_event *event = (struct inotify_event *) ptr;
+            ptr += sizeof(*event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                w->overflow = 1;
+                continue;
+            }
+            if (event->mask & IN_IGNORED) {
+                for (size_t i = 0; i < w->count; i++) {
+                    if (w->entries[i].wd == event->wd) {
+                        w->entries[i].wd = -1;
+                    }
+                }
+                continue;
+            }
+            // Directory metadata is not worth a rescan of its contents
+            if (!event->len || (event->mask & (IN_ISDIR | IN_ATTRIB)) == (IN_ISDIR | IN_ATTRIB)) {
+                continue;
+            }
+
+            // Snapshot entries by index. Tree growth below appends to w->entries.
+            size_t entries_count = w->count;
+            for (size_t i = 0; i < entries_count; i++) {
+                struct WatchEntry *entry = &w->entries[i];
+                struct WatchChange change;
+                char source[PATH_MAX];
+                char dest[PATH_MAX];
+
+                if (entry->wd != event->wd) {
+                    continue;
+                }
+                if (entry->name != NULL && strcmp(entry->name, event->name) != 0) {
+                    continue;
+                }
+
+                memset(&change, 0, sizeof(change));
+                change.kind = entry->kind;
+                if (entry->name != NULL) {
+                    change.exact = 1;
+                    change.source = watch_strdup(entry->source);
+                    change.dest = watch_strdup(entry->dest);
+                } else {
+                    snprintf(source, sizeof(source), "%s/%s", entry->dir, event->name);
+                    snprintf(dest, sizeof(dest), "%s/%s", entry->dest, event->name);
+                    change.source = watch_strdup(source);
+                    change.dest = watch_strdup(dest);
+
+                    // Follow new directories. Anything created inside before the
+                    // watch is in place is picked up when the directory is copied.
+                    if ((event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO))
+                            && !(entry->kind == WATCH_KIND_TRANSFER && copy_excluded(source, S_IFDIR))) {
+                        if (watch_add_tree(w, entry->kind, source, dest) < 0) {
+                            fprintf(stderr, "watch: %s: %s\n", source, strerror(errno));
+                        }
+                    }
+                }
+                watch_push(changes, count, alloc, &change);
+            }
+        }
+    }
+    if (len < 0 && errno != EAGAIN) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Order paths so that a directory is immediately followed by its descendants
+ */
+static int watch_path_rank(char ch) {
+    if (ch == '\0') {
+        return 0;
+    }
+    return ch == '/' ? 1 : (unsigned char) ch + 1;
+}
+
+static int watch_path_cmp(const char *a, const char *b) {
+    for (; *a && *a == *b; a++, b++) {
+        continue;
+    }
+    return watch_path_rank(*a) - watch_path_rank(*b);
+}
+
+static int watch_change_cmp(const void *a, const void *b) {
+    const struct WatchChange *x = a;
+    const struct WatchChange *y = b;
+    int result;
+
+    if ((result = watch_path_cmp(x->source, y->source)) != 0) {
+        return result;
+    }
+    if ((result = strcmp(x->dest ? x->dest : "", y->dest ? y->dest : "")) != 0) {
+        return result;
+    }
+    return x->exact - y->exact;
+}
+
+/**
+ * Does path lie below dir?
+ */
+static int watch_is_below(const char *path, const char *dir) {
+    size_t len = strlen(dir);
+    return strncmp(path, dir, len) == 0 && path[len] == '/';
+}
+
+/**
+ * Drop duplicate changes and changes below a directory that is copied as a whole
+ */
+static size_t watch_coalesce(struct WatchChange *changes, size_t count) {
+    struct WatchChange *ancestor;
+    size_t result;
+
+    qsort(changes, count, sizeof(*changes), watch_change_cmp);
+    ancestor = NULL;
+    result = 0;
+    for (size_t i = 0; i < count; i++) {
+        struct WatchChange *change = &changes[i];
+        struct WatchChange *prev = result ? &changes[result - 1] : NULL;
+
+        if ((prev && prev->exact == change->exact
+                && strcmp(prev->source, change->source) == 0
+                && strcmp(prev->dest ? prev->dest : "", change->dest ? change->dest : "") == 0)
+                || (ancestor && !change->exact && change->dest
+                    && watch_is_below(change->source, ancestor->source)
+                    && watch_is_below(change->dest, ancestor->dest))) {
+            free(change->source);
+            free(change->dest);
+            continue;
+        }
+        changes[result] = *change;
+        if (!changes[result].exact && changes[result].dest) {
+            ancestor = &changes[result];
+        }
+        result++;
+    }
+    return result;
+}
+
+/**
+ * Wait for the next batch of changes
+ *
+ * Blocks until an event arrives, then keeps collecting until no event has been seen
+ * for debounce_ms (or ten times that has passed in total, so a busy source cannot
+ * starve the destination).
+ *
+ * @param w watch set
+ * @param debounce_ms quiet period in milliseconds
+ * @param changes output array (release with watch_changes_free())
+ * @return number of changes, -1=error (errno set, EINTR when interrupted)
+ */
+ssize_t watch_wait(struct Watch *w, long debounce_ms, struct WatchChange **changes) {
+    struct pollfd pfd;
+    size_t count;
+    size_t alloc;
+    long deadline;
+    int timeout;
+
+    *changes = NULL;
+    count = 0;
+    alloc = 0;
+    w->overflow = 0;
+    pfd.fd = w->fd;
+    pfd.events = POLLIN;
+
+    timeout = -1;
+    deadline = 0;
+    for (;;) {
+        int ready = poll(&pfd, 1, timeout);
+        if (ready < 0) {
+            int err = errno;
+            watch_changes_free(*changes, count);
+            *changes = NULL;
+            errno = err;
+            return -1;
+        }
+        if (ready == 0) {
+            break;
+        }
+        if (watch_read(w, changes, &count, &alloc) < 0) {
+            int err = errno;
+            watch_changes_free(*changes, count);
+            *changes = NULL;
+            errno = err;
+            return -1;
+        }
+        if (!count && !w->overflow) {
+            continue;
+        }
+
+        if (!deadline) {
+            deadline = watch_now() + debounce_ms * 10;
+        }
+        long remaining = deadline - watch_now();
+        if (remaining <= 0) {
+            break;
+        }
+        timeout = (int) (remaining < debounce_ms ? remaining : debounce_ms);
+    }
+
+    return (ssize_t) watch_coalesce(*changes, count);
+}
+
+/**
+ * Release a batch returned by watch_wait()
+ * @param changes array of changes
+ * @param count number of changes
+ */
+void watch_changes_free(struct WatchChange *changes, size_t count) {
+    for (size_t i = 0; changes && i < count; i++) {
+        free(changes[i].source);
+        free(changes[i].dest);
+    }
+    free(changes);
+}